@@ -0,0 +1,82 @@
+#include <math.h>
+#include <string.h>
+
+#include "gps-adapt.h"
+
+#define EARTH_RADIUS_M 6371000.0
+#define DEG_TO_RAD (M_PI / 180.0)
+
+void gps_adapt_init(struct gps_adapt *a, int64_t min_ns, int64_t max_ns) {
+    memset(a, 0, sizeof(*a));
+    a->min_ns = min_ns;
+    a->max_ns = max_ns;
+    a->turn_rate = GPS_ADAPT_TURN_RATE;
+    a->accel = GPS_ADAPT_ACCEL;
+    a->spacing = GPS_ADAPT_SPACING;
+    a->period_ns = min_ns;
+}
+
+// Equirectangular approximation, plenty for the distance between samples
+static double distance_m(const struct gps_fix *a, const struct gps_fix *b) {
+    double lat = ((double)a->latitude + b->latitude) / 2 / GPS_FIX_DEGREE;
+    double x = (double)(b->longitude - a->longitude) / GPS_FIX_DEGREE * DEG_TO_RAD *
+               cos(lat * DEG_TO_RAD);
+    double y = (double)(b->latitude - a->latitude) / GPS_FIX_DEGREE * DEG_TO_RAD;
+
+    return sqrt(x * x + y * y) * EARTH_RADIUS_M;
+}
+
+static double course_change(double from, double to) {
+    double d = fmod(fabs(to - from), 360.0);
+
+    return d > 180.0 ? 360.0 - d : d;
+}
+
+// Take in a logged fix and return the period until the next sample
+int64_t gps_adapt_update(struct gps_adapt *a, const struct gps_sample *s) {
+    const struct gps_fix *fix = &s->fix;
+    double dt, dist, speed, turn = 0, accel;
+    int64_t next;
+
+    // Nothing to judge the motion by: keep the period
+    if ((fix->fields & GPS_FIX_POSITION) != GPS_FIX_POSITION) return a->period_ns;
+
+    a->stats.samples++;
+    if (!a->have_last) {
+        a->have_last = 1;
+        a->last = *s;
+        a->last_speed = fix->fields & GPS_FIX_SPEED ? (double)fix->speed / GPS_FIX_MPS : 0;
+        return a->period_ns;
+    }
+
+    dt = (s->time_ms - a->last.time_ms) / 1000.0;
+    if (dt <= 0) dt = a->period_ns / 1e9;
+
+    dist = distance_m(&a->last.fix, fix);
+    speed = fix->fields & GPS_FIX_SPEED ? (double)fix->speed / GPS_FIX_MPS : dist / dt;
+    accel = fabs(speed - a->last_speed) / dt;
+    if ((fix->fields & a->last.fix.fields & GPS_FIX_COURSE) &&
+        speed >= GPS_ADAPT_MOVING && a->last_speed >= GPS_ADAPT_MOVING) {
+        turn = course_change((double)a->last.fix.course / GPS_FIX_COURSE_DEGREE,
+                             (double)fix->course / GPS_FIX_COURSE_DEGREE) / dt;
+    }
+
+    if (turn >= a->turn_rate || accel >= a->accel) {
+        next = a->min_ns;
+        a->stats.manoeuvres++;
+    } else if (speed < GPS_ADAPT_MOVING && dist < a->spacing) {
+        next = a->period_ns * 2;
+        a->stats.parked++;
+    } else {
+        next = (int64_t)(a->spacing / (speed > GPS_ADAPT_MOVING ? speed : GPS_ADAPT_MOVING) * 1e9);
+        if (next > a->period_ns * 2) next = a->period_ns * 2;
+    }
+
+    if (next < a->min_ns) next = a->min_ns;
+    if (next > a->max_ns) next = a->max_ns;
+
+    a->last = *s;
+    a->last_speed = speed;
+    a->period_ns = next;
+    return next;
+}
@@ -0,0 +1,41 @@
+#ifndef GPS_ADAPT_H
+#define GPS_ADAPT_H
+
+#include <stdint.h>
+
+#include "gps-track.h"
+
+// Below this speed (m/s) the receiver is taken to be parked
+#define GPS_ADAPT_MOVING 0.5
+
+// Default thresholds for --adapt-thresholds
+#define GPS_ADAPT_TURN_RATE 5.0     // degrees per second
+#define GPS_ADAPT_ACCEL 1.0         // m/s per second
+#define GPS_ADAPT_SPACING 25.0      // metres between samples when cruising
+
+// Motion-adaptive sample period. Each logged fix is compared with the one
+// before: turning or accelerating beyond the thresholds drops straight to
+// the minimum period, cruising aims for one sample every `spacing` metres,
+// and while parked the period doubles up to the maximum. The period
+// shortens at once but at most doubles per sample, so a manoeuvre is never
+// sampled late for long.
+struct gps_adapt {
+    int64_t min_ns, max_ns;
+    double turn_rate;
+    double accel;
+    double spacing;
+    int64_t period_ns;          // current period
+    struct gps_sample last;     // last fix with a position
+    double last_speed;
+    int have_last;
+    struct {
+        unsigned long samples;
+        unsigned long manoeuvres;   // samples that dropped to the minimum
+        unsigned long parked;       // samples that backed off while parked
+    } stats;
+};
+
+void gps_adapt_init(struct gps_adapt *a, int64_t min_ns, int64_t max_ns);
+int64_t gps_adapt_update(struct gps_adapt *a, const struct gps_sample *s);
+
+#endif
@@ -0,0 +1,2289 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+
+#include "gps-adapt.h"
+#include "gps-fence.h"
+#include "gps-fix.h"
+#include "gps-index.h"
+#include "gps-kalman.h"
+#include "gps-latency.h"
+#include "gps-sched.h"
+#include "gps-simplify.h"
+#include "gps-track.h"
+#include "gps-trip.h"
+#include "gpsclient.h"
+
+// Benchmarks for the gps-monitor/gps-logger sample path. Each benchmark is
+// a subcommand; run without arguments for the list.
+
+struct bench {
+    const char *name;
+    const char *help;
+    int (*run)(int argc, char **argv);
+};
+
+static volatile double sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Build a reply shaped like the gps daemon's: strings plus an integer age
+static void build_reply(struct blob_buf *b) {
+    blob_buf_init(b, 0);
+    blobmsg_add_u32(b, "age", 1);
+    blobmsg_add_string(b, "latitude", "37.774929");
+    blobmsg_add_string(b, "longitude", "-122.419418");
+    blobmsg_add_string(b, "elevation", "10.200000");
+    blobmsg_add_string(b, "course", "180.000000");
+    blobmsg_add_string(b, "speed", "0.500000");
+}
+
+// decode: the copy-then-scan path the tools used before gps_fix_parse()
+// against the single-pass policy table decoder
+
+static unsigned long blob_allocations;
+
+// Same growth policy as libubox's default, counting every (re)allocation
+static bool counting_grow(struct blob_buf *buf, int minlen) {
+    int delta = ((minlen / 256) + 1) * 256;
+    void *new_buf = realloc(buf->buf, buf->buflen + delta);
+
+    if (!new_buf) return false;
+
+    blob_allocations++;
+    buf->buf = new_buf;
+    memset((char *)buf->buf + buf->buflen, 0, delta);
+    buf->buflen += delta;
+    return true;
+}
+
+static struct blob_buf legacy_buf;
+
+static const char *legacy_get_value(const char *key) {
+    struct blob_attr *attr;
+    int rem;
+
+    if (!legacy_buf.head) return NULL;
+
+    blobmsg_for_each_attr(attr, legacy_buf.head, rem) {
+        const char *name = blobmsg_name(attr);
+        if (name && strcmp(name, key) == 0) {
+            if (blobmsg_type(attr) == BLOBMSG_TYPE_STRING) {
+                return blobmsg_get_string(attr);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void legacy_decode(struct blob_attr *msg) {
+    static const char *keys[] = {
+        "latitude", "longitude", "speed", "elevation", "course", "age",
+    };
+    struct blob_attr *attr;
+    int rem;
+
+    // fetch_gps_data() reset the buffer before every request...
+    blob_buf_free(&legacy_buf);
+    memset(&legacy_buf, 0, sizeof(legacy_buf));
+    legacy_buf.grow = counting_grow;
+
+    // ...and gps_data_cb() deep-copied the reply into it
+    blob_buf_free(&legacy_buf);
+    blob_buf_init(&legacy_buf, 0);
+    blobmsg_for_each_attr(attr, msg, rem) {
+        const char *name = blobmsg_name(attr);
+        if (!name) continue;
+
+        enum blobmsg_type attr_type = blobmsg_type(attr);
+        if (attr_type == BLOBMSG_TYPE_STRING) {
+            blobmsg_add_string(&legacy_buf, name, blobmsg_get_string(attr));
+        } else if (attr_type == BLOBMSG_TYPE_INT32) {
+            blobmsg_add_u32(&legacy_buf, name, blobmsg_get_u32(attr));
+        } else if (attr_type == BLOBMSG_TYPE_INT64) {
+            blobmsg_add_u64(&legacy_buf, name, blobmsg_get_u64(attr));
+        } else if (attr_type == BLOBMSG_TYPE_DOUBLE) {
+            blobmsg_add_double(&legacy_buf, name, blobmsg_get_double(attr));
+        }
+    }
+
+    // Then one linear scan per field, parsed again with atof()
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        const char *val = legacy_get_value(keys[i]);
+        if (val) sink += atof(val);
+    }
+}
+
+static int bench_decode(int argc, char **argv) {
+    struct blob_buf reply = {};
+    struct gps_fix fix;
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    double start, legacy_ns, parse_ns;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Invalid iteration count: %s\n", argv[1]);
+        return 1;
+    }
+
+    build_reply(&reply);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        legacy_decode(reply.head);
+    }
+    legacy_ns = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        gps_fix_parse(&fix, reply.head);
+        sink += fix.latitude + fix.longitude + fix.speed +
+                fix.elevation + fix.course + fix.age;
+    }
+    parse_ns = (now_ns() - start) / iterations;
+
+    printf("decode: %ld samples\n", iterations);
+    printf("  copy+scan (legacy):  %8.1f ns/sample  %.2f allocs/sample\n",
+           legacy_ns, (double)blob_allocations / iterations);
+    printf("  gps_fix_parse:       %8.1f ns/sample  %.2f allocs/sample\n",
+           parse_ns, 0.0);
+    printf("  speedup:             %8.2fx\n", legacy_ns / parse_ns);
+
+    blob_buf_free(&legacy_buf);
+    blob_buf_free(&reply);
+    return 0;
+}
+
+// delta: round trip a synthetic multi-day 1 Hz track through the delta
+// stream, checking every fix against the bin format, and compare sizes
+
+static unsigned long rng_state = 1;
+
+static double rng(void) {
+    rng_state = rng_state * 6364136223846793005UL + 1442695040888963407UL;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// A vehicle alternating between parked and driving, with receiver noise,
+// timer jitter, missed samples and stretches without an elevation
+struct synth {
+    double lat, lon, elevation;
+    double speed, course;
+    int64_t t;
+    long i, phase_end;
+    int driving, no_elevation;
+};
+
+static void synth_init(struct synth *sy) {
+    memset(sy, 0, sizeof(*sy));
+    sy->lat = 37.774929;
+    sy->lon = -122.419418;
+    sy->elevation = 10.0;
+    sy->t = 1767225600000LL;        // 2026-01-01 00:00:00 UTC
+}
+
+static void synth_next(struct synth *sy, struct gps_sample *sample) {
+    struct gps_fix *fix = &sample->fix;
+
+    if (sy->i >= sy->phase_end) {
+        sy->driving = !sy->driving;
+        sy->phase_end = sy->i + 300 + rng() * 3600;
+    }
+    if (rng() < 0.0005) sy->no_elevation = !sy->no_elevation;
+
+    if (sy->driving) {
+        sy->speed += (rng() - 0.5) * 1.0;
+        if (sy->speed < 2) sy->speed = 2;
+        if (sy->speed > 30) sy->speed = 30;
+        sy->course = fmod(sy->course + (rng() - 0.5) * 6 + 360, 360);
+    } else {
+        sy->speed = 0;
+    }
+    sy->lat += sy->speed * cos(sy->course * M_PI / 180) / 111320.0;
+    sy->lon += sy->speed * sin(sy->course * M_PI / 180) / (111320.0 * cos(sy->lat * M_PI / 180));
+    sy->elevation += sy->speed * (rng() - 0.5) * 0.02;
+
+    // Missed samples now and then, otherwise a few ms of timer jitter
+    sy->t += rng() < 0.001 ? 1000 * (2 + (int)(rng() * 10)) : 1000;
+    sample->time_ms = sy->t + (int)(rng() * 7) - 3;
+
+    memset(fix, 0, sizeof(*fix));
+    fix->fields = GPS_FIX_ALL & ~(sy->no_elevation ? GPS_FIX_ELEVATION : 0);
+    fix->latitude = lround((sy->lat + (rng() - 0.5) * 4e-6) * GPS_FIX_DEGREE);
+    fix->longitude = lround((sy->lon + (rng() - 0.5) * 4e-6) * GPS_FIX_DEGREE);
+    fix->elevation = sy->no_elevation ? 0 : lround(sy->elevation * GPS_FIX_METRE);
+    fix->speed = lround(sy->speed * GPS_FIX_MPS);
+    fix->course = lround(sy->course * GPS_FIX_COURSE_DEGREE);
+    fix->age = rng() < 0.9 ? 0 : 1;
+    sy->i++;
+}
+
+static void synth_track(struct gps_sample *track, long count) {
+    struct synth sy;
+
+    synth_init(&sy);
+    for (long i = 0; i < count; i++) {
+        synth_next(&sy, &track[i]);
+    }
+}
+
+static int same_fix(const struct gps_sample *a, const struct gps_sample *b) {
+    const struct gps_fix *fa = &a->fix, *fb = &b->fix;
+
+    if (a->time_ms != b->time_ms || fa->fields != fb->fields) return 0;
+    if ((fa->fields & GPS_FIX_LATITUDE) && fa->latitude != fb->latitude) return 0;
+    if ((fa->fields & GPS_FIX_LONGITUDE) && fa->longitude != fb->longitude) return 0;
+    if ((fa->fields & GPS_FIX_ELEVATION) && fa->elevation != fb->elevation) return 0;
+    if ((fa->fields & GPS_FIX_SPEED) && fa->speed != fb->speed) return 0;
+    if ((fa->fields & GPS_FIX_COURSE) && fa->course != fb->course) return 0;
+    if ((fa->fields & GPS_FIX_AGE) && fa->age != fb->age) return 0;
+    return 1;
+}
+
+static int bench_delta(int argc, char **argv) {
+    long days = argc > 1 ? atol(argv[1]) : 3;
+    long count = days * 86400;
+    struct gps_sample *track, *expect, sample;
+    struct gps_track_delta d;
+    uint8_t *stream, rec[GPS_TRACK_BIN_RECORD_SIZE];
+    size_t csv_bytes = 0, len = 0, pos = 0;
+    char line[160];
+    double start, encode_ns, decode_ns;
+    long blocks = 0, independent = 0, errors = 0;
+    int ret;
+
+    if (days <= 0) {
+        fprintf(stderr, "Invalid day count: %s\n", argv[1]);
+        return 1;
+    }
+
+    track = calloc(count, sizeof(*track));
+    expect = calloc(count, sizeof(*expect));
+    stream = malloc((size_t)count * GPS_TRACK_DELTA_MAX);
+    if (!track || !expect || !stream) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    synth_track(track, count);
+
+    // What the bin format stores is the reference for the round trip
+    for (long i = 0; i < count; i++) {
+        gps_track_bin_encode(rec, &track[i]);
+        gps_track_bin_decode(rec, &expect[i]);
+        csv_bytes += gps_track_csv_format(line, sizeof(line), &track[i]);
+    }
+
+    gps_track_delta_reset(&d);
+    start = now_ns();
+    for (long i = 0; i < count; i++) {
+        len += gps_track_delta_encode(&d, stream + len, &track[i]);
+    }
+    encode_ns = (now_ns() - start) / count;
+
+    gps_track_delta_reset(&d);
+    start = now_ns();
+    for (long i = 0; i < count; i++) {
+        ret = gps_track_delta_decode(&d, stream + pos, len - pos, &sample);
+        if (ret <= 0) {
+            fprintf(stderr, "delta: decode failed at fix %ld\n", i);
+            return 1;
+        }
+        if (!same_fix(&sample, &expect[i]) && errors++ < 10) {
+            fprintf(stderr, "delta: fix %ld does not round trip\n", i);
+        }
+
+        // Every few blocks, decode the block start again with fresh state
+        if (stream[pos] == 0xff && blocks++ % 7 == 0) {
+            struct gps_track_delta fresh;
+            struct gps_sample alone;
+            size_t p = pos;
+            int n;
+
+            gps_track_delta_reset(&fresh);
+            for (long j = i; j < count && (j == i || stream[p] != 0xff); j++) {
+                n = gps_track_delta_decode(&fresh, stream + p, len - p, &alone);
+                if (n <= 0 || !same_fix(&alone, &expect[j])) {
+                    if (errors++ < 10)
+                        fprintf(stderr, "delta: block at fix %ld does not decode alone\n", i);
+                    break;
+                }
+                p += n;
+            }
+            independent++;
+        }
+        pos += ret;
+    }
+    decode_ns = (now_ns() - start) / count;
+
+    if (pos != len) {
+        fprintf(stderr, "delta: %zu trailing bytes\n", len - pos);
+        errors++;
+    }
+
+    printf("delta: %ld days at 1 Hz, %ld fixes, %ld blocks\n", days, count, blocks);
+    printf("  csv:    %10zu bytes  %6.2f bytes/fix\n", csv_bytes, (double)csv_bytes / count);
+    printf("  bin:    %10zu bytes  %6.2f bytes/fix  %5.1fx smaller than csv\n",
+           (size_t)gps_track_bin_offset(count), (double)gps_track_bin_offset(count) / count,
+           (double)csv_bytes / gps_track_bin_offset(count));
+    printf("  delta:  %10zu bytes  %6.2f bytes/fix  %5.1fx smaller than csv\n",
+           len, (double)len / count, (double)csv_bytes / len);
+    printf("  encode: %8.1f ns/fix, decode: %.1f ns/fix\n", encode_ns, decode_ns);
+    printf("  round trip: %s (%ld blocks also decoded on their own)\n",
+           errors ? "FAILED" : "ok", independent);
+
+    free(stream);
+    free(expect);
+    free(track);
+    return errors ? 1 : 0;
+}
+
+// adaptive: sample a synthetic 1 Hz drive the way gps-logger --adaptive
+// would, and compare the samples kept and how far the track they describe
+// strays from the full one against a fixed interval with the same count
+
+static double degrees(int32_t v) {
+    return (double)v / GPS_FIX_DEGREE;
+}
+
+static double adaptive_distance(const struct gps_fix *a, const struct gps_fix *b) {
+    double x = degrees(b->longitude - a->longitude) * M_PI / 180 *
+               cos((degrees(a->latitude) + degrees(b->latitude)) / 2 * M_PI / 180);
+    double y = degrees(b->latitude - a->latitude) * M_PI / 180;
+
+    return sqrt(x * x + y * y) * 6371000.0;
+}
+
+// Distance of every fix from the line between the kept fixes around it
+static void adaptive_error(const struct gps_sample *track, long count, const long *kept,
+                           long n, double *mean, double *max) {
+    double sum = 0;
+
+    *max = 0;
+    for (long k = 0; k + 1 < n; k++) {
+        const struct gps_sample *a = &track[kept[k]], *b = &track[kept[k + 1]];
+
+        for (long i = kept[k] + 1; i < kept[k + 1]; i++) {
+            double f = (double)(track[i].time_ms - a->time_ms) / (b->time_ms - a->time_ms);
+            struct gps_fix p = a->fix;
+            double e;
+
+            p.latitude += lround((b->fix.latitude - a->fix.latitude) * f);
+            p.longitude += lround((b->fix.longitude - a->fix.longitude) * f);
+            e = adaptive_distance(&p, &track[i].fix);
+            sum += e;
+            if (e > *max) *max = e;
+        }
+    }
+    *mean = sum / count;
+}
+
+static int bench_adaptive(int argc, char **argv) {
+    long days = argc > 1 ? atol(argv[1]) : 3;
+    long count = days * 86400;
+    double min = 1, max = 300;
+    struct gps_sample *track;
+    struct gps_adapt a;
+    long *kept, n = 0, fixed = 0;
+    int64_t due;
+    double mean, worst, step, start, update_ns;
+
+    if (days <= 0) {
+        fprintf(stderr, "Invalid day count: %s\n", argv[1]);
+        return 1;
+    }
+    if (argc > 2 && (sscanf(argv[2], "%lf:%lf", &min, &max) != 2 || min < 1 || max < min)) {
+        fprintf(stderr, "Invalid range: %s\n", argv[2]);
+        return 1;
+    }
+
+    track = calloc(count, sizeof(*track));
+    kept = calloc(count, sizeof(*kept));
+    if (!track || !kept) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    synth_track(track, count);
+
+    // The logger takes whichever fix is current when its timer fires
+    gps_adapt_init(&a, (int64_t)(min * 1e9), (int64_t)(max * 1e9));
+    due = track[0].time_ms;
+    start = now_ns();
+    for (long i = 0; i < count; i++) {
+        if (track[i].time_ms < due) continue;
+        kept[n++] = i;
+        due = track[i].time_ms + gps_adapt_update(&a, &track[i]) / 1000000;
+    }
+    update_ns = (now_ns() - start) / n;
+    if (kept[n - 1] != count - 1) kept[n++] = count - 1;
+
+    printf("adaptive: %ld days at 1 Hz, %ld fixes, range %g:%g s\n", days, count, min, max);
+    printf("  every %g s: %8ld samples\n", min, (long)(count / min));
+    adaptive_error(track, count, kept, n, &mean, &worst);
+    printf("  adaptive: %8ld samples (%5.1f%%)  error mean %6.2f m, max %7.1f m\n",
+           n, 100.0 * n / count, mean, worst);
+    printf("            %lu at the minimum for a manoeuvre, %lu backing off while parked\n",
+           a.stats.manoeuvres, a.stats.parked);
+
+    // Same number of samples, evenly spaced
+    step = (double)count / n;
+    for (double i = 0; i < count; i += step) kept[fixed++] = (long)i;
+    if (kept[fixed - 1] != count - 1) kept[fixed++] = count - 1;
+    adaptive_error(track, count, kept, fixed, &mean, &worst);
+    printf("  fixed:    %8ld samples (every %.1f s)  error mean %6.2f m, max %7.1f m\n",
+           fixed, step, mean, worst);
+    printf("  update: %.1f ns/sample\n", update_ns);
+
+    free(kept);
+    free(track);
+    return 0;
+}
+
+// simplify: run a recorded track, or the synthetic drive, through the
+// streaming simplification at several tolerances; report the fixes kept
+// and check that no dropped fix strays further than the tolerance
+
+// Load a whole track file of any format
+static struct gps_sample *simplify_load(const char *path, long *count) {
+    static struct gps_track_reader reader;
+    struct gps_sample *track = NULL, *grown;
+    long cap = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        fprintf(stderr, "Failed to open track file: %s\n", path);
+        return NULL;
+    }
+    if (gps_track_reader_open(&reader, f) != 0) {
+        fprintf(stderr, "%s is not a track file\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    *count = 0;
+    for (;;) {
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 65536;
+            grown = realloc(track, cap * sizeof(*track));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                free(track);
+                fclose(f);
+                return NULL;
+            }
+            track = grown;
+        }
+        if (!gps_track_reader_next(&reader, &track[*count])) break;
+        ++*count;
+    }
+    fclose(f);
+    return track;
+}
+
+// Distance of p from the segment a-b, in a local flat projection around a
+static double simplify_distance(const struct gps_fix *a, const struct gps_fix *b,
+                                const struct gps_fix *p) {
+    double kx = cos(degrees(a->latitude) * M_PI / 180);
+    double bx = degrees(b->longitude - a->longitude) * kx, by = degrees(b->latitude - a->latitude);
+    double px = degrees(p->longitude - a->longitude) * kx, py = degrees(p->latitude - a->latitude);
+    double len = bx * bx + by * by;
+    double t = len > 0 ? (px * bx + py * by) / len : 0;
+
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    px -= t * bx;
+    py -= t * by;
+    return sqrt(px * px + py * py) * 111194.93;
+}
+
+static int bench_simplify(int argc, char **argv) {
+    static const double tolerances[] = { 1, 2, 5, 10, 20, 50 };
+    struct gps_sample *track, *kept, out[2];
+    struct gps_simplify sp;
+    long count, n, errors = 0;
+    double start, add_ns;
+
+    if (argc > 1 && strcmp(argv[1], "-") != 0) {
+        track = simplify_load(argv[1], &count);
+        if (!track) return 1;
+        printf("simplify: %s, %ld fixes\n", argv[1], count);
+    } else {
+        count = 3 * 86400;
+        track = calloc(count, sizeof(*track));
+        if (!track) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        synth_track(track, count);
+        printf("simplify: synthetic 3 days at 1 Hz, %ld fixes\n", count);
+    }
+    if (count < 2) {
+        fprintf(stderr, "Track too short\n");
+        free(track);
+        return 1;
+    }
+
+    kept = calloc(count, sizeof(*kept));
+    if (!kept) {
+        fprintf(stderr, "Out of memory\n");
+        free(track);
+        return 1;
+    }
+
+    printf("  %9s %10s %8s %8s %11s %10s\n",
+           "tolerance", "kept", "%", "ratio", "max error", "ns/fix");
+    for (size_t t = 0; t < sizeof(tolerances) / sizeof(tolerances[0]); t++) {
+        double worst = 0;
+        long k = 0;
+
+        gps_simplify_init(&sp, tolerances[t], 60000);
+        n = 0;
+        start = now_ns();
+        for (long i = 0; i < count; i++) {
+            int m = gps_simplify_add(&sp, &track[i], out);
+
+            for (int j = 0; j < m; j++) kept[n++] = out[j];
+        }
+        n += gps_simplify_flush(&sp, &kept[n]);
+        add_ns = (now_ns() - start) / count;
+
+        // Every fix against the kept segment around it, matched by time
+        for (long i = 0; i < count; i++) {
+            const struct gps_sample *s = &track[i];
+            double e;
+
+            while (k + 1 < n && kept[k + 1].time_ms <= s->time_ms) k++;
+            if ((s->fix.fields & GPS_FIX_POSITION) != GPS_FIX_POSITION || k + 1 >= n) continue;
+            e = simplify_distance(&kept[k].fix, &kept[k + 1].fix, &s->fix);
+            if (e > worst) worst = e;
+        }
+        if (worst > tolerances[t] * 1.001) errors++;
+
+        printf("  %7g m %10ld %7.2f%% %7.1fx %9.2f m %10.1f%s\n", tolerances[t], n,
+               100.0 * n / count, (double)count / n, worst, add_ns,
+               worst > tolerances[t] * 1.001 ? "  OVER BOUND" : "");
+    }
+
+    free(kept);
+    free(track);
+    return errors ? 1 : 0;
+}
+
+// geofence: fence sets from 10 to 10,000 circles and polygons scattered over
+// a 50 km square, a receiver wandering through them; cost per fix with the
+// grid against testing every fence, and the events of both must agree
+
+static void geofence_set(struct gps_fences *fs, unsigned int n) {
+    struct gps_fence_point points[8];
+    char name[GPS_FENCE_NAME_MAX];
+
+    gps_fences_init(fs);
+    for (unsigned int i = 0; i < n; i++) {
+        double lat = 37.5 + rng() * 0.45, lon = -122.5 + rng() * 0.57;
+        double r = 50 + rng() * 250;
+
+        snprintf(name, sizeof(name), "fence%u", i);
+        if (i % 2) {
+            gps_fences_add_circle(fs, name, lat, lon, r);
+            continue;
+        }
+
+        // An irregular octagon around the centre
+        for (int k = 0; k < 8; k++) {
+            double a = k * M_PI / 4, d = r * (0.6 + rng() * 0.4) / 111195.0;
+
+            points[k].lat = lat + d * sin(a);
+            points[k].lon = lon + d * cos(a) / cos(lat * M_PI / 180);
+        }
+        gps_fences_add_polygon(fs, name, points, 8);
+    }
+    gps_fences_build(fs);
+}
+
+static unsigned long geofence_events;
+
+static void geofence_cb(const struct gps_fence *f, int enter, void *priv) {
+    (void)f;
+    (void)priv;
+    geofence_events += enter ? 1 : 1000000;
+}
+
+static int bench_geofence(int argc, char **argv) {
+    static const unsigned int sizes[] = { 10, 100, 1000, 10000 };
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+    struct gps_fence_point *walk;
+    int errors = 0;
+
+    if (count <= 0) {
+        fprintf(stderr, "Invalid fix count: %s\n", argv[1]);
+        return 1;
+    }
+
+    // A receiver at 15 m/s turning gently, bouncing off the square's edges
+    walk = malloc(count * sizeof(*walk));
+    if (!walk) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    walk[0].lat = 37.725;
+    walk[0].lon = -122.215;
+    for (long i = 1, course = 0; i < count; i++) {
+        double c = (course += (long)((rng() - 0.5) * 20)) * M_PI / 180;
+
+        walk[i].lat = walk[i - 1].lat + 15 * cos(c) / 111195.0;
+        walk[i].lon = walk[i - 1].lon + 15 * sin(c) / 87900.0;
+        if (walk[i].lat < 37.5 || walk[i].lat > 37.95 ||
+            walk[i].lon < -122.5 || walk[i].lon > -121.93) {
+            walk[i] = walk[i - 1];
+            course += 180;
+        }
+    }
+
+    printf("geofence: %ld fixes through fences in a 50 km square\n", count);
+    printf("  %6s %9s %11s %9s %11s %9s\n",
+           "fences", "grid", "candidates", "ns/fix", "every fence", "events");
+    for (size_t t = 0; t < sizeof(sizes) / sizeof(sizes[0]); t++) {
+        struct gps_fences fs;
+        struct gps_fence_state st;
+        unsigned long grid_events, brute_events = 0;
+        long brute = count < 20000 ? count : 20000;
+        uint8_t *inside;
+        double start, grid_ns, brute_ns;
+
+        geofence_set(&fs, sizes[t]);
+        if (gps_fence_state_init(&st, &fs) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        geofence_events = 0;
+        start = now_ns();
+        for (long i = 0; i < count; i++) {
+            gps_fence_update(&fs, &st, walk[i].lat, walk[i].lon, geofence_cb, NULL);
+        }
+        grid_ns = (now_ns() - start) / count;
+        grid_events = geofence_events;
+
+        // Every fence for every fix, over the first fixes of the walk only
+        geofence_events = 0;
+        gps_fence_state_free(&st);
+        gps_fence_state_init(&st, &fs);
+        for (long i = 0; i < brute; i++) {
+            gps_fence_update(&fs, &st, walk[i].lat, walk[i].lon, geofence_cb, NULL);
+        }
+        inside = calloc(fs.n, 1);
+        start = now_ns();
+        for (long i = 0; i < brute; i++) {
+            for (unsigned int f = 0; f < fs.n; f++) {
+                int in = gps_fence_contains(&fs, &fs.fences[f], walk[i].lat, walk[i].lon);
+
+                if (in != inside[f]) brute_events += in ? 1 : 1000000;
+                inside[f] = in;
+            }
+        }
+        brute_ns = (now_ns() - start) / brute;
+        if (brute_events != geofence_events) errors++;
+
+        printf("  %6u %4ux%-4u %11.2f %9.1f %11.1f %9lu%s\n", fs.n, fs.rows, fs.cols,
+               (double)st.stats.candidates / st.stats.fixes, grid_ns, brute_ns,
+               grid_events % 1000000 + grid_events / 1000000,
+               brute_events != geofence_events ? "  MISMATCH" : "");
+
+        free(inside);
+        gps_fence_state_free(&st);
+        gps_fences_free(&fs);
+    }
+
+    free(walk);
+    return errors ? 1 : 0;
+}
+
+// fixed: the per-sample work of both tools (decode the daemon's strings, a
+// CSV row and a bin record, the monitor's fix lines, a trip step) in doubles
+// as gps_fix used to be, and in the fixed-point integers it is now.
+// Instructions per sample are counted by single-stepping each stage in a
+// traced child, so no hardware counters are needed. On x86 the doubles run
+// on the FPU; on an FPU-less MIPS every double operation in the first
+// column becomes a soft-float library call instead.
+
+#define FIXED_INPUTS 256
+#define FIXED_TRACED 32         // samples single-stepped per stage
+
+// One fix as the gps daemon sends it
+struct fixed_input {
+    int64_t time_ms;
+    char latitude[16], longitude[16], elevation[16], speed[16], course[16];
+    int age;
+};
+
+// struct gps_fix before it went fixed-point
+struct double_fix {
+    unsigned int fields;
+    double latitude, longitude, elevation, speed, course;
+    int age;
+};
+
+static struct fixed_input fixed_inputs[FIXED_INPUTS];
+static struct double_fix double_fixes[FIXED_INPUTS];
+static struct gps_sample fixed_samples[FIXED_INPUTS];
+static char fixed_out[256];
+
+static void fixed_inputs_init(void) {
+    struct synth sy;
+    struct gps_sample s;
+
+    synth_init(&sy);
+    for (int i = 0; i < FIXED_INPUTS; i++) {
+        struct fixed_input *in = &fixed_inputs[i];
+
+        synth_next(&sy, &s);
+        in->time_ms = s.time_ms;
+        gps_decimal_format(in->latitude, 16, s.fix.latitude, GPS_FIX_DEGREE_DIGITS, 6);
+        gps_decimal_format(in->longitude, 16, s.fix.longitude, GPS_FIX_DEGREE_DIGITS, 6);
+        gps_decimal_format(in->elevation, 16, s.fix.elevation, GPS_FIX_ELEVATION_DIGITS, 6);
+        gps_decimal_format(in->speed, 16, s.fix.speed, GPS_FIX_SPEED_DIGITS, 6);
+        gps_decimal_format(in->course, 16, s.fix.course, GPS_FIX_COURSE_DIGITS, 6);
+        in->age = s.fix.age;
+    }
+}
+
+static void parse_double(long n) {
+    for (long i = 0; i < n; i++) {
+        const struct fixed_input *in = &fixed_inputs[i % FIXED_INPUTS];
+        struct double_fix *f = &double_fixes[i % FIXED_INPUTS];
+
+        f->latitude = strtod(in->latitude, NULL);
+        f->longitude = strtod(in->longitude, NULL);
+        f->elevation = strtod(in->elevation, NULL);
+        f->speed = strtod(in->speed, NULL);
+        f->course = strtod(in->course, NULL);
+        f->age = in->age;
+        f->fields = GPS_FIX_ALL;
+    }
+}
+
+static void parse_fixed(long n) {
+    for (long i = 0; i < n; i++) {
+        const struct fixed_input *in = &fixed_inputs[i % FIXED_INPUTS];
+        struct gps_sample *s = &fixed_samples[i % FIXED_INPUTS];
+
+        s->time_ms = in->time_ms;
+        gps_decimal_parse(in->latitude, GPS_FIX_DEGREE_DIGITS, &s->fix.latitude);
+        gps_decimal_parse(in->longitude, GPS_FIX_DEGREE_DIGITS, &s->fix.longitude);
+        gps_decimal_parse(in->elevation, GPS_FIX_ELEVATION_DIGITS, &s->fix.elevation);
+        gps_decimal_parse(in->speed, GPS_FIX_SPEED_DIGITS, &s->fix.speed);
+        gps_decimal_parse(in->course, GPS_FIX_COURSE_DIGITS, &s->fix.course);
+        s->fix.age = in->age;
+        s->fix.fields = GPS_FIX_ALL;
+    }
+}
+
+static int64_t double_scale(double v, double unit, int64_t min, int64_t max) {
+    double scaled = v / unit;
+
+    scaled += scaled < 0 ? -0.5 : 0.5;
+    if (scaled <= min) return min;
+    if (scaled >= max) return max;
+    return (int64_t)scaled;
+}
+
+// The CSV row and the bin record's quantized values, as gps-track.c did them
+static void log_double(long n) {
+    for (long i = 0; i < n; i++) {
+        const struct double_fix *f = &double_fixes[i % FIXED_INPUTS];
+        time_t when = fixed_inputs[i % FIXED_INPUTS].time_ms / 1000;
+        struct tm t;
+
+        localtime_r(&when, &t);
+        snprintf(fixed_out, sizeof(fixed_out),
+                 "%04d-%02d-%02d %02d:%02d:%02d,%.6f,%.6f,%.2f,%.1f,%.1f,%d\n",
+                 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+                 f->latitude, f->longitude, f->speed, f->elevation, f->course, f->age);
+        sink += double_scale(f->latitude, 1e-6, INT32_MIN, INT32_MAX) +
+                double_scale(f->longitude, 1e-6, INT32_MIN, INT32_MAX) +
+                double_scale(f->elevation, 1e-2, INT32_MIN, INT32_MAX) +
+                double_scale(f->speed, 1e-2, 0, UINT16_MAX) +
+                double_scale(f->course, 1e-2, 0, UINT16_MAX);
+    }
+}
+
+static void log_fixed(long n) {
+    uint8_t rec[GPS_TRACK_BIN_RECORD_SIZE];
+
+    for (long i = 0; i < n; i++) {
+        const struct gps_sample *s = &fixed_samples[i % FIXED_INPUTS];
+
+        gps_track_csv_format(fixed_out, sizeof(fixed_out), s);
+        gps_track_bin_encode(rec, s);
+        sink += rec[8];
+    }
+}
+
+static const char *double_direction(double course) {
+    if (course >= 337.5 || course < 22.5) return "N";
+    else if (course < 67.5) return "NE";
+    else if (course < 112.5) return "E";
+    else if (course < 157.5) return "SE";
+    else if (course < 202.5) return "S";
+    else if (course < 247.5) return "SW";
+    else if (course < 292.5) return "W";
+    return "NW";
+}
+
+// gps-monitor's fix box, as render_fix() formatted it
+static void render_double(long n) {
+    for (long i = 0; i < n; i++) {
+        const struct double_fix *f = &double_fixes[i % FIXED_INPUTS];
+
+        snprintf(fixed_out, sizeof(fixed_out), "Latitude:  %9.6f %c",
+                 f->latitude < 0 ? -f->latitude : f->latitude, f->latitude >= 0 ? 'N' : 'S');
+        snprintf(fixed_out, sizeof(fixed_out), "Longitude: %9.6f %c",
+                 f->longitude < 0 ? -f->longitude : f->longitude, f->longitude >= 0 ? 'E' : 'W');
+        snprintf(fixed_out, sizeof(fixed_out), "Speed:      %6.2f m/s  (%6.2f knots)",
+                 f->speed, f->speed * 1.94384);
+        snprintf(fixed_out, sizeof(fixed_out), "Course:     %6.1f (%s)",
+                 f->course, double_direction(f->course));
+        snprintf(fixed_out, sizeof(fixed_out), "Elevation:  %6.1f m", f->elevation);
+    }
+}
+
+static const char *fixed_direction(int32_t course) {
+    static const char *const names[] = { "N", "NE", "E", "SE", "S", "SW", "W", "NW" };
+
+    return names[(course % 36000 + 2250) / 4500 % 8];
+}
+
+static void render_fixed(long n) {
+    char a[16], b[16];
+
+    for (long i = 0; i < n; i++) {
+        const struct gps_fix *f = &fixed_samples[i % FIXED_INPUTS].fix;
+        int32_t knots = ((int64_t)f->speed * 3600 + 926) / 1852;
+
+        gps_decimal_format(a, sizeof(a), f->latitude < 0 ? -f->latitude : f->latitude, 6, 6);
+        snprintf(fixed_out, sizeof(fixed_out), "Latitude:  %9s %c", a, f->latitude >= 0 ? 'N' : 'S');
+        gps_decimal_format(a, sizeof(a), f->longitude < 0 ? -f->longitude : f->longitude, 6, 6);
+        snprintf(fixed_out, sizeof(fixed_out), "Longitude: %9s %c", a, f->longitude >= 0 ? 'E' : 'W');
+        gps_decimal_format(a, sizeof(a), f->speed, 3, 2);
+        gps_decimal_format(b, sizeof(b), knots, 3, 2);
+        snprintf(fixed_out, sizeof(fixed_out), "Speed:      %6s m/s  (%6s knots)", a, b);
+        gps_decimal_format(a, sizeof(a), f->course, 2, 1);
+        snprintf(fixed_out, sizeof(fixed_out), "Course:     %6s (%s)", a, fixed_direction(f->course));
+        gps_decimal_format(a, sizeof(a), f->elevation, 2, 1);
+        snprintf(fixed_out, sizeof(fixed_out), "Elevation:  %6s m", a);
+    }
+}
+
+// The distance from the fix before, as the trip odometer measures it
+static void trip_double(long n) {
+    for (long i = 1; i <= n; i++) {
+        const struct double_fix *a = &double_fixes[(i - 1) % FIXED_INPUTS];
+        const struct double_fix *b = &double_fixes[i % FIXED_INPUTS];
+        double dlat = (b->latitude - a->latitude) * M_PI / 180;
+        double dlon = (b->longitude - a->longitude) * M_PI / 180;
+        double x = dlon * cos((a->latitude + b->latitude) / 2 * M_PI / 180);
+
+        sink += sqrt(x * x + dlat * dlat) * 6371000.0;
+    }
+}
+
+static void trip_fixed(long n) {
+    for (long i = 1; i <= n; i++) {
+        const struct gps_fix *a = &fixed_samples[(i - 1) % FIXED_INPUTS].fix;
+        const struct gps_fix *b = &fixed_samples[i % FIXED_INPUTS].fix;
+
+        sink += gps_trip_distance(a->latitude, a->longitude, b->latitude, b->longitude);
+    }
+}
+
+#if defined(__x86_64__)
+// Whether the x86-64 instruction starting with these bytes is floating-point
+// arithmetic, a conversion or a compare: the operations that become
+// soft-float library calls on a CPU without an FPU. SSE, and the VEX forms
+// (FMA included) glibc's maths picks on newer CPUs.
+static int is_float_op(uint64_t text) {
+    const uint8_t *b = (const uint8_t *)&text;
+    int i = 0, prefix = 0, map = 1;
+    uint8_t op;
+
+    if (b[0] == 0xc5) {
+        prefix = b[1] & 3;
+        op = b[2];
+    } else if (b[0] == 0xc4) {
+        map = b[1] & 0x1f;
+        prefix = b[2] & 3;
+        op = b[3];
+    } else {
+        while (i < 3 && (b[i] == 0x66 || b[i] == 0xf2 || b[i] == 0xf3)) prefix = b[i++];
+        if ((b[i] & 0xf0) == 0x40) i++;     // REX
+        if (b[i] != 0x0f) return 0;
+        op = b[i + 1];
+    }
+
+    if (map == 2) return op >= 0x96 && op <= 0xbf;     // fused multiply-add
+    if (map != 1 || !prefix) return 0;
+    switch (op) {
+        case 0x51: case 0x58: case 0x59: case 0x5c: case 0x5d: case 0x5e: case 0x5f:
+        case 0x2a: case 0x2c: case 0x2d: case 0x5a: case 0x2e: case 0x2f:
+            return 1;
+    }
+    return 0;
+}
+#endif
+
+// User-space instructions per call of fn's loop body: single-step fn(n) in
+// a traced child and take off the cost of fn(0) and the stops around it.
+// On x86-64 the floating-point operations among them are counted into
+// float_ops if given, -1 elsewhere.
+static double count_instructions(void (*fn)(long), long n, double *float_ops) {
+    long steps[2], floats[2];
+
+    for (int run = 0; run < 2; run++) {
+        int status;
+        pid_t pid = fork();
+
+        if (pid < 0) return -1;
+        if (pid == 0) {
+            fn(FIXED_INPUTS);       // resolve lazy bindings and fault in the pages
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+            fn(run ? n : 0);
+            raise(SIGSTOP);
+            _exit(0);
+        }
+
+        steps[run] = 0;
+        floats[run] = 0;
+        if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return -1;
+        for (;;) {
+#if defined(__x86_64__)
+            if (float_ops) {
+                long ip = ptrace(PTRACE_PEEKUSER, pid,
+                                 (void *)offsetof(struct user_regs_struct, rip), NULL);
+
+                floats[run] += is_float_op((uint64_t)ptrace(PTRACE_PEEKTEXT, pid,
+                                                            (void *)ip, NULL));
+            }
+#endif
+            if (ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL) < 0 ||
+                waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+                steps[run] = -1;
+                break;
+            }
+            if (WSTOPSIG(status) == SIGSTOP) break;
+            steps[run]++;
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        if (steps[run] < 0) return -1;
+    }
+    if (float_ops) {
+#if defined(__x86_64__)
+        *float_ops = (double)(floats[1] - floats[0]) / n;
+#else
+        *float_ops = -1;
+#endif
+    }
+    return (double)(steps[1] - steps[0]) / n;
+}
+
+static double stage_ns(void (*fn)(long), long n) {
+    double start = now_ns();
+
+    fn(n);
+    return (now_ns() - start) / n;
+}
+
+static int bench_fixed(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        void (*doubles)(long);
+        void (*fixed)(long);
+    } stages[] = {
+        { "decode", parse_double, parse_fixed },
+        { "log", log_double, log_fixed },
+        { "render", render_double, render_fixed },
+        { "trip", trip_double, trip_fixed },
+    };
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    double total[4] = { 0 };
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Invalid iteration count: %s\n", argv[1]);
+        return 1;
+    }
+
+    fixed_inputs_init();
+    parse_double(FIXED_INPUTS);
+    parse_fixed(FIXED_INPUTS);
+
+    printf("fixed: %ld samples, instructions counted over %d\n", iterations, FIXED_TRACED);
+    printf("  %-8s %12s %12s %12s %12s\n", "", "double ns", "fixed ns", "double insn", "fixed insn");
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        double r[4] = {
+            stage_ns(stages[i].doubles, iterations),
+            stage_ns(stages[i].fixed, iterations),
+            count_instructions(stages[i].doubles, FIXED_TRACED, NULL),
+            count_instructions(stages[i].fixed, FIXED_TRACED, NULL),
+        };
+
+        printf("  %-8s %12.1f %12.1f %12.0f %12.0f\n", stages[i].name, r[0], r[1], r[2], r[3]);
+        for (int j = 0; j < 4; j++) total[j] += r[j];
+    }
+    printf("  %-8s %12.1f %12.1f %12.0f %12.0f\n", "sample", total[0], total[1], total[2], total[3]);
+    printf("  speedup: %.2fx time, %.2fx instructions\n", total[0] / total[1], total[2] / total[3]);
+    return 0;
+}
+
+// kalman: cost of one --kalman update, fed an hour of 10 Hz fixes from a
+// vehicle alternating between parked and driving, and how far the smoothed
+// and the raw fixes are from where it really was. Instructions and
+// floating-point operations per update are counted as for "fixed"; on the
+// Omega2, which has no FPU, each of those operations is a soft-float call.
+
+#define KALMAN_RATE 10          // fixes per second
+#define KALMAN_FIXES (3600 * KALMAN_RATE)
+#define KALMAN_TRACED 64
+
+static struct gps_sample *kalman_fixes;
+static struct gps_kalman kalman_filter;
+static struct gps_fix kalman_out;
+static long kalman_next;
+
+// Roughly normal, from four uniform draws
+static double noise(double sigma) {
+    return (rng() + rng() + rng() + rng() - 2) * sigma * 1.7320508;
+}
+
+static void kalman_restart(void) {
+    gps_kalman_init(&kalman_filter, GPS_KALMAN_ACCEL, GPS_KALMAN_POSITION, GPS_KALMAN_VELOCITY);
+    kalman_next = 0;
+}
+
+static void kalman_run(long n) {
+    for (long i = 0; i < n; i++) {
+        if (kalman_next == KALMAN_FIXES) kalman_restart();
+        gps_kalman_update(&kalman_filter, &kalman_fixes[kalman_next++], &kalman_out);
+    }
+}
+
+// Horizontal distance in metres, equirectangular
+static double kalman_distance(double lat1, double lon1, double lat2, double lon2) {
+    double x = (lon2 - lon1) * cos(lat1 * M_PI / 180) * 111194.93;
+    double y = (lat2 - lat1) * 111194.93;
+
+    return sqrt(x * x + y * y);
+}
+
+static int bench_kalman(int argc, char **argv) {
+    long updates = argc > 1 ? atol(argv[1]) : 1000000;
+    double lat = 37.774929, lon = -122.419418, speed = 0, course = 0;
+    double raw_err = 0, smooth_err = 0, raw_parked = 0, smooth_parked = 0;
+    double raw_speed = 0, smooth_speed = 0, ns, insn, flops;
+    double jump_x = 0, jump_y = 0;
+    long parked = 0, phase_end = 0, jump_end = 0;
+    int driving = 0;
+
+    if (updates <= 0) {
+        fprintf(stderr, "Invalid update count: %s\n", argv[1]);
+        return 1;
+    }
+
+    kalman_fixes = calloc(KALMAN_FIXES, sizeof(*kalman_fixes));
+    if (!kalman_fixes) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Receiver noise of 3 m and 0.2 m/s, the course wandering while parked,
+    // a jump of 30 m for a second or two about once a minute as satellites
+    // come and go, and a sample taken late now and then
+    kalman_restart();
+    for (long i = 0; i < KALMAN_FIXES; i++) {
+        struct gps_sample *s = &kalman_fixes[i];
+        struct gps_fix *fix = &s->fix;
+        double err, reported;
+
+        if (i >= phase_end) {
+            driving = !driving;
+            phase_end = i + (60 + rng() * 300) * KALMAN_RATE;
+        }
+        if (driving) {
+            speed += (rng() - 0.5) * 0.3;
+            if (speed < 2) speed = 2;
+            if (speed > 30) speed = 30;
+            course = fmod(course + (rng() - 0.5) * 2 + 360, 360);
+        } else {
+            speed = 0;
+        }
+        lat += speed / KALMAN_RATE * cos(course * M_PI / 180) / 111194.93;
+        lon += speed / KALMAN_RATE * sin(course * M_PI / 180) / (111194.93 * cos(lat * M_PI / 180));
+
+        if (i >= jump_end) {
+            jump_x = jump_y = 0;
+            if (rng() < 1.0 / (60 * KALMAN_RATE)) {
+                double a = rng() * 2 * M_PI;
+
+                jump_x = 30 * sin(a);
+                jump_y = 30 * cos(a);
+                jump_end = i + (1 + rng()) * KALMAN_RATE;
+            }
+        }
+
+        s->time_ms = 1767225600000LL + i * 1000 / KALMAN_RATE +
+                     (rng() < 0.01 ? 1000 / KALMAN_RATE : 0);
+        reported = fabs(speed + noise(0.2));
+        fix->fields = GPS_FIX_ALL;
+        fix->latitude = lround((lat + (jump_y + noise(3)) / 111194.93) * GPS_FIX_DEGREE);
+        fix->longitude = lround((lon + (jump_x + noise(3)) / (111194.93 * cos(lat * M_PI / 180))) *
+                                GPS_FIX_DEGREE);
+        fix->elevation = lround((10 + noise(5)) * GPS_FIX_METRE);
+        fix->speed = lround(reported * GPS_FIX_MPS);
+        fix->course = lround((driving ? course : rng() * 360) * GPS_FIX_COURSE_DEGREE) % 36000;
+        fix->age = 0;
+
+        kalman_run(1);
+        err = kalman_distance(lat, lon, degrees(fix->latitude), degrees(fix->longitude));
+        raw_err += err * err;
+        if (!driving) raw_parked += err * err;
+        err = kalman_distance(lat, lon, degrees(kalman_out.latitude), degrees(kalman_out.longitude));
+        smooth_err += err * err;
+        if (!driving) smooth_parked += err * err;
+        parked += !driving;
+        raw_speed += (reported - speed) * (reported - speed);
+        err = (double)kalman_out.speed / GPS_FIX_MPS - speed;
+        smooth_speed += err * err;
+    }
+
+    printf("kalman: %d fixes at %d Hz, %.0f%% parked; filter %g:%g:%g\n",
+           KALMAN_FIXES, KALMAN_RATE, 100.0 * parked / KALMAN_FIXES,
+           GPS_KALMAN_ACCEL, GPS_KALMAN_POSITION, GPS_KALMAN_VELOCITY);
+    printf("  rms error      %10s %10s\n", "raw", "smoothed");
+    printf("  position       %8.2f m %8.2f m\n",
+           sqrt(raw_err / KALMAN_FIXES), sqrt(smooth_err / KALMAN_FIXES));
+    printf("  parked         %8.2f m %8.2f m\n",
+           parked ? sqrt(raw_parked / parked) : 0.0, parked ? sqrt(smooth_parked / parked) : 0.0);
+    printf("  speed          %6.2f m/s %6.2f m/s\n",
+           sqrt(raw_speed / KALMAN_FIXES), sqrt(smooth_speed / KALMAN_FIXES));
+    printf("  %lu updates, %lu repeats, %lu jumps rejected, %lu restarts\n",
+           kalman_filter.stats.updates, kalman_filter.stats.repeats,
+           kalman_filter.stats.rejected, kalman_filter.stats.resets);
+
+    kalman_restart();
+    ns = stage_ns(kalman_run, updates);
+    kalman_restart();
+    insn = count_instructions(kalman_run, KALMAN_TRACED, &flops);
+    printf("  per update: %.1f ns, %.0f instructions", ns, insn);
+    if (flops >= 0) printf(", %.0f floating-point operations", flops);
+    printf("\n  at %d Hz: %.1f us of CPU per second (%.4f%% of this core), state %zu bytes\n",
+           KALMAN_RATE, ns * KALMAN_RATE / 1000, ns * KALMAN_RATE / 1e7, sizeof(kalman_filter));
+
+    free(kalman_fixes);
+    return 0;
+}
+
+// query: write a synthetic 1 Hz track of the given size together with its
+// index, the way gps-logger does, then time indexed queries of growing
+// result size and compare one with a scan of the whole file
+
+static void query_count_cb(const struct gps_sample *s, void *priv) {
+    (void)s;
+    (*(uint64_t *)priv)++;
+}
+
+static void query_first_cb(const struct gps_sample *s, void *priv) {
+    struct gps_sample *first = priv;
+
+    if (!first->fix.fields) *first = *s;
+}
+
+static int query_write(const char *path, const char *index_path,
+                       enum gps_track_format format, uint64_t size,
+                       int64_t *first_ms, int64_t *last_ms, uint64_t *fixes) {
+    static char iobuf[1 << 20];
+    uint8_t rec[2 * GPS_TRACK_DELTA_MAX + GPS_TRACK_HEADER_SIZE];
+    struct gps_track_delta d;
+    struct gps_sample sample;
+    struct gps_index ix;
+    struct synth sy;
+    uint64_t offset, slots = 0;
+    size_t len = 0;
+    int can_start = 1;
+    FILE *f;
+
+    f = fopen(path, "w+");
+    if (!f) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        return -1;
+    }
+    setvbuf(f, iobuf, _IOFBF, sizeof(iobuf));
+
+    if (format == GPS_TRACK_CSV) {
+        offset = gps_track_csv_header((char *)rec, sizeof(rec));
+    } else {
+        gps_track_header(rec, format);
+        offset = GPS_TRACK_HEADER_SIZE;
+    }
+    fwrite(rec, offset, 1, f);
+    fflush(f);
+
+    unlink(index_path);
+    if (gps_index_open(&ix, index_path, format, fileno(f), offset, offset) != 0) {
+        fprintf(stderr, "Failed to create %s\n", index_path);
+        fclose(f);
+        return -1;
+    }
+
+    synth_init(&sy);
+    gps_track_delta_reset(&d);
+    *fixes = 0;
+    while (offset < size) {
+        synth_next(&sy, &sample);
+
+        switch (format) {
+            case GPS_TRACK_CSV:
+                len = gps_track_csv_format((char *)rec, sizeof(rec), &sample);
+                break;
+            case GPS_TRACK_BIN:
+                len = 0;
+                can_start = slots % GPS_TRACK_BIN_BLOCK == 0;
+                if (can_start) {
+                    gps_track_bin_sync(rec, *fixes);
+                    len = GPS_TRACK_BIN_RECORD_SIZE;
+                    slots++;
+                }
+                gps_track_bin_encode(rec + len, &sample);
+                len += GPS_TRACK_BIN_RECORD_SIZE;
+                slots++;
+                break;
+            case GPS_TRACK_DELTA:
+                len = gps_track_delta_encode(&d, rec, &sample);
+                can_start = rec[0] == 0xff;
+                break;
+        }
+
+        gps_index_add(&ix, &sample, offset, can_start);
+        fwrite(rec, len, 1, f);
+        offset += len;
+        if ((*fixes)++ == 0) *first_ms = sample.time_ms;
+        *last_ms = sample.time_ms;
+    }
+
+    gps_index_close(&ix);
+    if (fclose(f) != 0 || ix.errors) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static double query_time(const char *path, const struct gps_query *q,
+                         struct gps_query_stats *st, uint64_t *count) {
+    double start = now_ns();
+
+    *count = 0;
+    if (gps_query_run(path, q, query_count_cb, count, st) != 0) return -1;
+    return (now_ns() - start) / 1e6;
+}
+
+static int bench_query(int argc, char **argv) {
+    long mb = argc > 1 ? atol(argv[1]) : 2048;
+    enum gps_track_format format = GPS_TRACK_BIN;
+    const char *dir = argc > 3 ? argv[3] : "/tmp";
+    static const struct {
+        const char *name;
+        int64_t span_ms;
+        int bbox;
+    } queries[] = {
+        { "1 minute", 60 * 1000LL, 0 },
+        { "1 hour", 3600 * 1000LL, 0 },
+        { "1 day", 86400 * 1000LL, 0 },
+        { "1 week", 7 * 86400 * 1000LL, 0 },
+        { "1 day, 1 km box", 86400 * 1000LL, 1 },
+        { "all, 1 km box", 0, 1 },
+    };
+    char path[PATH_MAX], index_path[PATH_MAX + 8], hidden[PATH_MAX + 16];
+    struct gps_query_stats st;
+    struct gps_query q;
+    struct gps_sample at = {};
+    int64_t first_ms = 0, last_ms = 0, mid_ms;
+    uint64_t fixes, count, indexed_count = 0;
+    struct stat track_st, index_st;
+    double start, ms;
+    int errors = 0;
+
+    if (mb <= 0 || (argc > 2 && gps_track_format_parse(argv[2], &format) != 0)) {
+        fprintf(stderr, "Usage: query [MB] [csv|bin|delta] [dir]\n");
+        return 1;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/gps-bench-query.%s", dir,
+                 gps_track_format_name(format)) >= (int)sizeof(path)) {
+        fprintf(stderr, "Directory name too long: %s\n", dir);
+        return 1;
+    }
+    snprintf(index_path, sizeof(index_path), "%s%s", path, GPS_INDEX_SUFFIX);
+    snprintf(hidden, sizeof(hidden), "%s.hidden", index_path);
+
+    start = now_ns();
+    if (query_write(path, index_path, format, (uint64_t)mb << 20,
+                    &first_ms, &last_ms, &fixes) != 0) {
+        unlink(path);
+        unlink(index_path);
+        return 1;
+    }
+    stat(path, &track_st);
+    stat(index_path, &index_st);
+
+    printf("query: %s track of %lld MB, %llu fixes over %.0f days, written in %.1f s\n",
+           gps_track_format_name(format), (long long)track_st.st_size >> 20,
+           (unsigned long long)fixes, (last_ms - first_ms) / 86400e3,
+           (now_ns() - start) / 1e9);
+    printf("  index: %lld bytes, %llu entries\n", (long long)index_st.st_size,
+           (unsigned long long)(index_st.st_size - GPS_INDEX_HEADER_SIZE) / GPS_INDEX_ENTRY_SIZE);
+
+    // Queries are centred on the middle of the track; the box on where the
+    // vehicle was then
+    mid_ms = first_ms + (last_ms - first_ms) / 2;
+    q = (struct gps_query){ .from_ms = mid_ms, .to_ms = mid_ms + 60000 };
+    gps_query_run(path, &q, query_first_cb, &at, &st);
+
+    printf("  %-18s %10s %10s %12s %12s\n", "query", "ms", "matches", "blocks", "MB scanned");
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        q = (struct gps_query){ .from_ms = INT64_MIN, .to_ms = INT64_MAX };
+        if (queries[i].span_ms) {
+            q.from_ms = mid_ms - queries[i].span_ms / 2;
+            q.to_ms = q.from_ms + queries[i].span_ms - 1;
+        }
+        if (queries[i].bbox) {
+            q.bbox = 1;
+            q.min_lat = at.fix.latitude - 4500;
+            q.max_lat = at.fix.latitude + 4500;
+            q.min_lon = at.fix.longitude - 4500;
+            q.max_lon = at.fix.longitude + 4500;
+        }
+
+        ms = query_time(path, &q, &st, &count);
+        if (ms < 0) {
+            fprintf(stderr, "query: failed to read %s\n", path);
+            errors++;
+            break;
+        }
+        printf("  %-18s %10.2f %10llu %5llu/%-6llu %12.1f\n", queries[i].name, ms,
+               (unsigned long long)count, (unsigned long long)st.blocks,
+               (unsigned long long)st.entries + 1, st.bytes / 1048576.0);
+        if (i == 1) indexed_count = count;
+    }
+
+    // The 1 hour query again without the index
+    if (!errors && rename(index_path, hidden) == 0) {
+        q = (struct gps_query){ .from_ms = mid_ms - 1800000, .to_ms = mid_ms + 1800000 - 1 };
+        ms = query_time(path, &q, &st, &count);
+        rename(hidden, index_path);
+        printf("  %-18s %10.2f %10llu %12s %12.1f\n", "1 hour, no index", ms,
+               (unsigned long long)count, "full scan", st.bytes / 1048576.0);
+        if (count != indexed_count) {
+            fprintf(stderr, "query: indexed and full scan disagree (%llu vs %llu)\n",
+                    (unsigned long long)indexed_count, (unsigned long long)count);
+            errors++;
+        }
+    }
+
+    unlink(path);
+    unlink(index_path);
+    return errors ? 1 : 0;
+}
+
+// latency: what one phase timer costs, a clock read plus a histogram update
+
+static int bench_latency(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+    struct gps_latency l = {};
+    double start, bare, timed;
+    int64_t t = 0;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: latency [iterations]\n");
+        return 1;
+    }
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        t += gps_latency_now();
+    }
+    bare = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        gps_latency_since(&l, gps_latency_now());
+    }
+    timed = (now_ns() - start) / iterations;
+    sink = t;
+
+    printf("latency: %ld iterations\n", iterations);
+    printf("  clock read          %6.1f ns\n", bare);
+    printf("  start + record      %6.1f ns per timed phase\n", timed);
+    gps_latency_print(stdout, "  noop", &l);
+    return 0;
+}
+
+// load: N client processes hammer a gps-replay behind a private ubusd, each
+// running one fetch strategy flat out for a fixed time. The legacy variant
+// is gps-logger's original fetch_gps_data(): a lookup and a blocking invoke
+// per sample, then a select() loop draining the socket. The others are
+// libgpsclient's cached-id blocking fetch, its async fetch on uloop and a
+// push subscription.
+
+enum {
+    LOAD_LEGACY,
+    LOAD_CACHED,
+    LOAD_ASYNC,
+    LOAD_SUBSCRIBE,
+    __LOAD_MAX,
+};
+
+static const char *const load_names[__LOAD_MAX] = {
+    [LOAD_LEGACY] = "legacy",
+    [LOAD_CACHED] = "cached",
+    [LOAD_ASYNC] = "async",
+    [LOAD_SUBSCRIBE] = "subscribe",
+};
+
+// What each client process sends back over the results pipe
+struct load_result {
+    unsigned long requests;
+    unsigned long failures;
+    double cpu_s;
+    struct gps_latency latency;
+};
+
+static struct {
+    char socket[64];
+    pid_t ubusd;
+    pid_t replay;
+    int variant;
+    int64_t start_ns;
+    int64_t end_ns;
+    struct gps_conn conn;
+    struct gps_client gps;
+    struct uloop_timeout end_timer;
+    struct load_result res;
+    int legacy_done;            // legacy data callback ran
+} ld;
+
+static pid_t load_spawn(char *const argv[]) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "Failed to run %s\n", argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void load_kill(pid_t *pid) {
+    if (*pid <= 0) return;
+    kill(*pid, SIGTERM);
+    waitpid(*pid, NULL, 0);
+    *pid = 0;
+}
+
+// User plus system time of another process in seconds, -1 without /proc
+static double load_proc_cpu(pid_t pid) {
+    unsigned long utime, stime;
+    char path[64], buf[512], *p;
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (!f) return -1;
+    ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+
+    // Fields 14 and 15, counted after the parenthesised command name
+    p = ok ? strrchr(buf, ')') : NULL;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double load_self_cpu(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// Wait until the gps object is registered on the private ubusd
+static int load_wait_ready(void) {
+    struct ubus_context *ctx = NULL;
+    uint32_t id;
+
+    for (int i = 0; i < 100; i++) {
+        if (!ctx) ctx = ubus_connect(ld.socket);
+        if (ctx && ubus_lookup_id(ctx, "gps", &id) == 0) {
+            ubus_free(ctx);
+            return 0;
+        }
+        usleep(20000);
+    }
+    if (ctx) ubus_free(ctx);
+    return -1;
+}
+
+static void load_legacy_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct gps_fix fix;
+    (void)req;
+    (void)type;
+
+    gps_fix_parse(&fix, msg);
+    ld.legacy_done = 1;
+}
+
+// gps-logger's fetch_gps_data() before libgpsclient, minus the printing
+static int load_legacy_fetch(struct ubus_context *ctx) {
+    struct timeval tv;
+    fd_set fds;
+    int sock = ctx->sock.fd;
+    int timeout_ms = 1000;
+    uint32_t id;
+
+    if (ubus_lookup_id(ctx, "gps", &id) != 0) return -1;
+
+    ld.legacy_done = 0;
+    if (ubus_invoke(ctx, id, "info", NULL, load_legacy_cb, NULL, 1000) != 0) return -1;
+
+    while (!ld.legacy_done && timeout_ms > 0) {
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 10000;
+
+        int ready = select(sock + 1, &fds, NULL, NULL, &tv);
+        if (ready > 0 && FD_ISSET(sock, &fds)) {
+            ubus_handle_event(ctx);
+        } else if (ready < 0) {
+            break;
+        }
+        timeout_ms -= 10;
+    }
+
+    if (ld.legacy_done) {
+        for (int i = 0; i < 10; i++) {
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+            tv.tv_sec = 0;
+            tv.tv_usec = 10000;
+
+            int ready = select(sock + 1, &fds, NULL, NULL, &tv);
+            if (ready > 0 && FD_ISSET(sock, &fds)) {
+                ubus_handle_event(ctx);
+            } else {
+                break;
+            }
+        }
+    }
+
+    return ld.legacy_done ? 0 : -1;
+}
+
+static void load_async_cb(struct gps_client *cl, int ret) {
+    if (ret != 0 || !cl->fix.fields) ld.res.failures++;
+    ld.res.requests++;
+
+    if (gps_latency_now() >= ld.end_ns) {
+        uloop_end();
+    } else if (gps_client_fetch_async(cl, 1000) != 0) {
+        ld.res.failures++;
+        uloop_end();
+    }
+}
+
+static void load_notify_cb(struct gps_client *cl) {
+    if (!cl->fix.fields) ld.res.failures++;
+    ld.res.requests++;
+}
+
+static void load_end_cb(struct uloop_timeout *t) {
+    (void)t;
+    uloop_end();
+}
+
+static void load_sleep_until(int64_t ns) {
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// One client process: connect, warm up, then run the variant until end_ns
+static void load_client(int fd) {
+    struct ubus_context *ctx = NULL;
+    uint32_t id;
+    double cpu;
+
+    if (ld.variant == LOAD_LEGACY) {
+        ctx = ubus_connect(ld.socket);
+        if (!ctx) _exit(1);
+    } else {
+        if (gps_conn_init(&ld.conn, ld.socket) != 0) _exit(1);
+        gps_client_init(&ld.gps, &ld.conn, "gps");
+        if (gps_client_lookup(&ld.gps, &id) != 0) _exit(1);
+    }
+
+    if (ld.variant == LOAD_ASYNC || ld.variant == LOAD_SUBSCRIBE) {
+        uloop_init();
+        gps_conn_add_uloop(&ld.conn);
+        ld.gps.complete_cb = load_async_cb;
+        ld.gps.notify_cb = load_notify_cb;
+        if (ld.variant == LOAD_SUBSCRIBE && gps_client_subscribe(&ld.gps) != 0) _exit(1);
+    }
+
+    load_sleep_until(ld.start_ns);
+    cpu = load_self_cpu();
+    memset(&ld.conn.latency, 0, sizeof(ld.conn.latency));
+
+    switch (ld.variant) {
+        case LOAD_LEGACY:
+            while (gps_latency_now() < ld.end_ns) {
+                int64_t start = gps_latency_now();
+
+                if (load_legacy_fetch(ctx) != 0) ld.res.failures++;
+                gps_latency_since(&ld.res.latency, start);
+                ld.res.requests++;
+            }
+            break;
+        case LOAD_CACHED:
+            while (gps_latency_now() < ld.end_ns) {
+                if (gps_client_fetch(&ld.gps, 1000) != 0 || !ld.gps.fix.fields) {
+                    ld.res.failures++;
+                }
+                ld.res.requests++;
+            }
+            ld.res.latency = ld.conn.latency.request;
+            break;
+        case LOAD_ASYNC:
+        case LOAD_SUBSCRIBE:
+            if (ld.variant == LOAD_ASYNC) gps_client_fetch_async(&ld.gps, 1000);
+            ld.end_timer.cb = load_end_cb;
+            uloop_timeout_set(&ld.end_timer, ld.end_ns > gps_latency_now() ?
+                              (ld.end_ns - gps_latency_now()) / 1000000 : 0);
+            uloop_run();
+            ld.res.latency = ld.conn.latency.request;
+            break;
+    }
+
+    ld.res.cpu_s = load_self_cpu() - cpu;
+    if (write(fd, &ld.res, sizeof(ld.res)) != sizeof(ld.res)) _exit(1);
+    _exit(0);
+}
+
+// Run one variant with fresh gps-replay and client processes
+static int load_variant(int variant, int clients, int seconds, struct load_result *total,
+                        double *ubusd_cpu, double *replay_cpu) {
+    char *replay_argv[] = { getenv("GPS_REPLAY") ? getenv("GPS_REPLAY") : "./gps-replay",
+                            "-u", ld.socket, "-n", NULL, NULL };
+    double ubusd_start, replay_start;
+    struct load_result res;
+    int fds[2], status, ret = 0;
+    pid_t *pids;
+
+    // Only the subscribe variant wants notifications, as fast as they go
+    if (variant == LOAD_SUBSCRIBE) {
+        replay_argv[3] = "-r";
+        replay_argv[4] = "1";
+    }
+
+    ld.replay = load_spawn(replay_argv);
+    if (ld.replay < 0 || load_wait_ready() != 0) {
+        fprintf(stderr, "gps-replay did not come up; set GPS_REPLAY to its path\n");
+        load_kill(&ld.replay);
+        return -1;
+    }
+
+    pids = calloc(clients, sizeof(*pids));
+    if (!pids || pipe(fds) != 0) {
+        free(pids);
+        load_kill(&ld.replay);
+        return -1;
+    }
+
+    ld.variant = variant;
+    ld.start_ns = gps_latency_now() + 500000000LL;
+    ld.end_ns = ld.start_ns + seconds * 1000000000LL;
+    for (int i = 0; i < clients; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(fds[0]);
+            load_client(fds[1]);
+        }
+        if (pids[i] < 0) ret = -1;
+    }
+    close(fds[1]);
+
+    load_sleep_until(ld.start_ns);
+    ubusd_start = load_proc_cpu(ld.ubusd);
+    replay_start = load_proc_cpu(ld.replay);
+    load_sleep_until(ld.end_ns);
+    *ubusd_cpu = load_proc_cpu(ld.ubusd) - ubusd_start;
+    *replay_cpu = load_proc_cpu(ld.replay) - replay_start;
+    if (ubusd_start < 0) *ubusd_cpu = -1;
+    if (replay_start < 0) *replay_cpu = -1;
+
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < clients; i++) {
+        if (read(fds[0], &res, sizeof(res)) != sizeof(res)) {
+            ret = -1;
+            break;
+        }
+        total->requests += res.requests;
+        total->failures += res.failures;
+        total->cpu_s += res.cpu_s;
+        gps_latency_merge(&total->latency, &res.latency);
+    }
+    close(fds[0]);
+
+    for (int i = 0; i < clients; i++) {
+        if (pids[i] <= 0) continue;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            ret = -1;
+        }
+    }
+    free(pids);
+    load_kill(&ld.replay);
+    return ret;
+}
+
+// Servers' CPU per request, null where /proc could not be read
+static void load_json_cpu(FILE *json, double cpu_s, double requests) {
+    if (cpu_s < 0) {
+        fprintf(json, "null");
+    } else {
+        fprintf(json, "%.2f", cpu_s * 1e6 / requests);
+    }
+}
+
+static int bench_load(int argc, char **argv) {
+    int clients = argc > 1 ? atoi(argv[1]) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    const char *json_path = argc > 3 ? argv[3] : NULL;
+    char *ubusd_argv[] = { getenv("UBUSD") ? getenv("UBUSD") : "ubusd",
+                           "-s", ld.socket, NULL };
+    struct load_result total[__LOAD_MAX];
+    double ubusd_cpu[__LOAD_MAX], replay_cpu[__LOAD_MAX];
+    int failed = 0, idle = 0;
+    FILE *json;
+
+    if (clients <= 0 || seconds <= 0) {
+        fprintf(stderr, "Usage: load [clients] [seconds] [json output file]\n");
+        return 1;
+    }
+
+    snprintf(ld.socket, sizeof(ld.socket), "/tmp/gps-bench-%d.sock", (int)getpid());
+    ld.ubusd = load_spawn(ubusd_argv);
+    if (ld.ubusd < 0) return 1;
+
+    printf("load: %d clients for %d s per variant against gps-replay on %s\n",
+           clients, seconds, ld.socket);
+    printf("  %-10s %10s %9s %9s %9s %9s %12s %12s %12s\n", "variant", "req/s", "p50 us",
+           "p99 us", "p999 us", "failed", "client us/r", "ubusd us/r", "replay us/r");
+
+    for (int v = 0; v < __LOAD_MAX; v++) {
+        struct load_result *t = &total[v];
+        double n;
+
+        if (load_variant(v, clients, seconds, t, &ubusd_cpu[v], &replay_cpu[v]) != 0) {
+            failed = 1;
+            break;
+        }
+
+        n = t->requests ? t->requests : 1;
+        printf("  %-10s %10.0f %9.0f %9.0f %9.0f %9lu %12.1f %12.1f %12.1f\n", load_names[v],
+               t->requests / (double)seconds,
+               gps_latency_percentile(&t->latency, 0.5) / 1e3,
+               gps_latency_percentile(&t->latency, 0.99) / 1e3,
+               gps_latency_percentile(&t->latency, 0.999) / 1e3,
+               t->failures, t->cpu_s * 1e6 / n, ubusd_cpu[v] * 1e6 / n, replay_cpu[v] * 1e6 / n);
+        if (t->requests == t->failures) idle = 1;
+    }
+
+    load_kill(&ld.ubusd);
+    unlink(ld.socket);
+    if (failed) {
+        fprintf(stderr, "load: a variant failed to run; is ubusd installed?\n");
+        return 1;
+    }
+    // Requests count the failed ones too; a variant where all failed measured nothing
+    if (idle) fprintf(stderr, "load: a variant got no replies; is gps-replay running?\n");
+
+    if (!json_path) return idle;
+
+    json = fopen(json_path, "w");
+    if (!json) {
+        fprintf(stderr, "Failed to open %s\n", json_path);
+        return 1;
+    }
+
+    // Latencies are histogram bucket upper bounds, so within a factor of two
+    fprintf(json, "{\n  \"benchmark\": \"load\",\n  \"clients\": %d,\n  \"seconds\": %d,\n"
+            "  \"variants\": [\n", clients, seconds);
+    for (int v = 0; v < __LOAD_MAX; v++) {
+        struct load_result *t = &total[v];
+        double n = t->requests ? t->requests : 1;
+
+        fprintf(json, "    {\"name\": \"%s\", \"requests\": %lu, \"failures\": %lu, "
+                "\"requests_per_s\": %.1f,\n", load_names[v], t->requests, t->failures,
+                t->requests / (double)seconds);
+        if (t->latency.count) {
+            fprintf(json, "     \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+                    "\"p999\": %.1f, \"max\": %.1f},\n",
+                    gps_latency_percentile(&t->latency, 0.5) / 1e3,
+                    gps_latency_percentile(&t->latency, 0.99) / 1e3,
+                    gps_latency_percentile(&t->latency, 0.999) / 1e3,
+                    t->latency.max_ns / 1e3);
+        } else {
+            fprintf(json, "     \"latency_us\": null,\n");
+        }
+        fprintf(json, "     \"cpu_us_per_request\": {\"client\": %.2f, \"ubusd\": ",
+                t->cpu_s * 1e6 / n);
+        load_json_cpu(json, ubusd_cpu[v], n);
+        fprintf(json, ", \"replay\": ");
+        load_json_cpu(json, replay_cpu[v], n);
+        fprintf(json, "}}%s\n", v + 1 < __LOAD_MAX ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+    fclose(json);
+
+    printf("  results written to %s\n", json_path);
+    return idle;
+}
+
+// jitter: sample a gps-replay behind a private ubusd, like load, on the
+// logger's absolute deadline scheduler and on the relative re-armed uloop
+// timeout it replaced, and compare when the ticks actually ran against the
+// ideal grid
+
+static struct {
+    struct gps_conn conn;
+    struct gps_client gps;
+    long ticks;
+    long done;
+    int64_t period_ns;
+    int64_t start_ns;
+    int64_t *offset_ns;         // tick k handled at start + k * period + offset
+    struct uloop_timeout timer;
+} jit;
+
+static void jitter_tick(int64_t offset) {
+    jit.offset_ns[jit.done] = offset;
+    if (!jit.gps.req_pending) {
+        gps_client_fetch_async(&jit.gps, 1000);
+    }
+    if (++jit.done == jit.ticks) {
+        uloop_end();
+    }
+}
+
+static void jitter_sched_cb(struct gps_sched *s) {
+    jitter_tick(gps_sched_lateness(s));
+}
+
+// The previous logger loop: re-arm relative to now at the start of each tick
+static void jitter_timer_cb(struct uloop_timeout *t) {
+    int64_t offset = gps_sched_now() - (jit.start_ns + jit.done * jit.period_ns);
+
+    uloop_timeout_set(t, jit.period_ns / 1000000);
+    jitter_tick(offset);
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Prints the offsets and returns their median
+static int64_t jitter_report(const char *name, unsigned long late, unsigned long missed) {
+    int64_t last = jit.offset_ns[jit.ticks - 1];
+    double sum = 0;
+
+    for (long i = 0; i < jit.ticks; i++) {
+        sum += jit.offset_ns[i];
+    }
+    qsort(jit.offset_ns, jit.ticks, sizeof(int64_t), compare_i64);
+
+    printf("  %-10s mean %8.3f ms  p50 %8.3f  p99 %8.3f  max %8.3f  drift at end %9.3f ms"
+           "  late %lu  missed %lu\n", name, sum / jit.ticks / 1e6,
+           jit.offset_ns[jit.ticks / 2] / 1e6, jit.offset_ns[jit.ticks * 99 / 100] / 1e6,
+           jit.offset_ns[jit.ticks - 1] / 1e6, last / 1e6, late, missed);
+    return jit.offset_ns[jit.ticks / 2];
+}
+
+// Wait until the private ubusd takes connections; gps-replay gives up at once
+static int jitter_wait_ubusd(void) {
+    struct ubus_context *ctx;
+
+    for (int i = 0; i < 100; i++) {
+        ctx = ubus_connect(ld.socket);
+        if (ctx) {
+            ubus_free(ctx);
+            return 0;
+        }
+        usleep(20000);
+    }
+    return -1;
+}
+
+static int bench_jitter(int argc, char **argv) {
+    long ticks = argc > 1 ? atol(argv[1]) : 10000;
+    int interval_ms = argc > 2 ? atoi(argv[2]) : 10;
+    char *ubusd_argv[] = { getenv("UBUSD") ? getenv("UBUSD") : "ubusd",
+                           "-s", ld.socket, NULL };
+    char *replay_argv[] = { getenv("GPS_REPLAY") ? getenv("GPS_REPLAY") : "./gps-replay",
+                            "-u", ld.socket, "-n", NULL };
+    struct gps_sched sched = { .cb = jitter_sched_cb };
+    unsigned long late = 0;
+    int64_t median;
+    int ret = 1;
+
+    if (ticks <= 0 || interval_ms <= 0) {
+        fprintf(stderr, "Usage: jitter [ticks] [interval_ms]\n");
+        return 1;
+    }
+
+    jit.ticks = ticks;
+    jit.period_ns = interval_ms * 1000000LL;
+    jit.offset_ns = calloc(ticks, sizeof(int64_t));
+    if (!jit.offset_ns) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    snprintf(ld.socket, sizeof(ld.socket), "/tmp/gps-bench-%d.sock", (int)getpid());
+    ld.ubusd = load_spawn(ubusd_argv);
+    if (ld.ubusd < 0 || jitter_wait_ubusd() != 0) {
+        fprintf(stderr, "ubusd did not come up; set UBUSD to its path\n");
+        goto out;
+    }
+    ld.replay = load_spawn(replay_argv);
+    if (ld.replay < 0 || load_wait_ready() != 0) {
+        fprintf(stderr, "gps-replay did not come up; set GPS_REPLAY to its path\n");
+        goto out;
+    }
+
+    if (gps_conn_init(&jit.conn, ld.socket) != 0) {
+        fprintf(stderr, "Failed to connect to %s\n", ld.socket);
+        goto out;
+    }
+    gps_client_init(&jit.gps, &jit.conn, "gps");
+
+    uloop_init();
+    gps_conn_add_uloop(&jit.conn);
+
+    printf("jitter: %ld ticks every %d ms against gps-replay on %s\n",
+           ticks, interval_ms, ld.socket);
+
+    jit.done = 0;
+    jit.timer.cb = jitter_timer_cb;
+    jit.start_ns = gps_sched_now();
+    uloop_timeout_set(&jit.timer, 0);
+    uloop_run();
+    uloop_timeout_cancel(&jit.timer);
+    for (long i = 0; i < ticks; i++) {
+        if (jit.offset_ns[i] > GPS_SCHED_LATE_NS) late++;
+    }
+    jitter_report("relative", late, 0);
+
+    jit.done = 0;
+    if (gps_sched_start(&sched, jit.period_ns, 0) == 0) {
+        uloop_run();
+        gps_sched_stop(&sched);
+        median = jitter_report("gps_sched", sched.stats.late, sched.stats.missed);
+
+        // Absolute deadlines don't drift, so the typical tick is on time
+        if (median > GPS_SCHED_LATE_NS) {
+            fprintf(stderr, "jitter: gps_sched ticks are %.3f ms late at the median\n",
+                    median / 1e6);
+        } else {
+            ret = 0;
+        }
+    } else {
+        fprintf(stderr, "jitter: failed to start the scheduler\n");
+    }
+
+    gps_client_free(&jit.gps);
+    uloop_done();
+    gps_conn_free(&jit.conn);
+out:
+    load_kill(&ld.replay);
+    load_kill(&ld.ubusd);
+    unlink(ld.socket);
+    free(jit.offset_ns);
+    return ret;
+}
+
+// fanout: one process serving many gps objects with staggered reply
+// delays on a private ubusd, like jitter, polled by one client the way
+// gps-monitor/gps-logger -s do it. A fan-out round should take about as long
+// as the slowest object; asking the objects one after another takes the sum
+// of all delays.
+
+// A fan-out cycle longer than this times the slowest reply fails the bench
+#define FANOUT_SLACK 1.5
+
+static struct fanout_obj {
+    struct ubus_object obj;
+    struct ubus_request_data dreq;
+    struct uloop_timeout reply;
+    int delay_ms;
+    char name[32];
+} *fan_objs;
+
+static struct {
+    struct ubus_context *srv;
+    struct blob_buf b;
+    struct gps_conn conn;
+    struct gps_client *clients;
+    int objects;
+    int done;
+    int failed;
+    int sequential;
+} fan;
+
+static void fanout_reply_cb(struct uloop_timeout *t) {
+    struct fanout_obj *o = container_of(t, struct fanout_obj, reply);
+
+    build_reply(&fan.b);
+    ubus_send_reply(fan.srv, &o->dreq, fan.b.head);
+    ubus_complete_deferred_request(fan.srv, &o->dreq, UBUS_STATUS_OK);
+}
+
+// Answer after the object's delay without blocking the other objects
+static int fanout_info(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg) {
+    struct fanout_obj *o = container_of(obj, struct fanout_obj, obj);
+
+    (void)method;
+    (void)msg;
+    ubus_defer_request(ctx, req, &o->dreq);
+    uloop_timeout_set(&o->reply, o->delay_ms);
+    return UBUS_STATUS_OK;
+}
+
+static const struct ubus_method fanout_methods[] = {
+    UBUS_METHOD_NOARG("info", fanout_info),
+};
+
+static struct ubus_object_type fanout_type = UBUS_OBJECT_TYPE("gps", fanout_methods);
+
+static void fanout_complete_cb(struct gps_client *cl, int ret) {
+    if (ret != 0 || !cl->fix.fields) fan.failed++;
+
+    // Sequential mode: the next request only goes out after this reply
+    if (++fan.done < fan.objects && fan.sequential) {
+        gps_client_fetch_async(&fan.clients[fan.done], 1000);
+        return;
+    }
+    if (fan.done == fan.objects) uloop_end();
+}
+
+// One polling cycle over all objects; returns its length in ms
+static double fanout_round(int sequential) {
+    double start = now_ns();
+
+    fan.done = 0;
+    fan.sequential = sequential;
+    for (int i = 0; i < (sequential ? 1 : fan.objects); i++) {
+        gps_client_fetch_async(&fan.clients[i], 1000);
+    }
+    uloop_run();
+    return (now_ns() - start) / 1e6;
+}
+
+static int bench_fanout(int argc, char **argv) {
+    int objects = argc > 1 ? atoi(argv[1]) : 32;
+    int max_delay_ms = argc > 2 ? atoi(argv[2]) : 50;
+    char *ubusd_argv[] = { getenv("UBUSD") ? getenv("UBUSD") : "ubusd",
+                           "-s", ld.socket, NULL };
+    int rounds = 5;
+    double parallel = 0, sequential = 0, sum_ms = 0;
+    int clients = 0, ret = 1;
+
+    if (objects <= 0 || max_delay_ms <= 0 || max_delay_ms >= 1000) {
+        fprintf(stderr, "Usage: fanout [objects] [max_delay_ms < 1000]\n");
+        return 1;
+    }
+
+    fan.objects = objects;
+    fan_objs = calloc(objects, sizeof(*fan_objs));
+    fan.clients = calloc(objects, sizeof(*fan.clients));
+    if (!fan_objs || !fan.clients) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uloop_init();
+    snprintf(ld.socket, sizeof(ld.socket), "/tmp/gps-bench-%d.sock", (int)getpid());
+    ld.ubusd = load_spawn(ubusd_argv);
+    if (ld.ubusd < 0 || jitter_wait_ubusd() != 0) {
+        fprintf(stderr, "ubusd did not come up; set UBUSD to its path\n");
+        goto out;
+    }
+
+    fan.srv = ubus_connect(ld.socket);
+    if (!fan.srv || gps_conn_init(&fan.conn, ld.socket) != 0) {
+        fprintf(stderr, "Failed to connect to %s\n", ld.socket);
+        goto out;
+    }
+    ubus_add_uloop(fan.srv);
+    gps_conn_add_uloop(&fan.conn);
+
+    // Delays spread evenly up to the maximum, so the slowest object is known
+    for (int i = 0; i < objects; i++) {
+        struct fanout_obj *o = &fan_objs[i];
+
+        snprintf(o->name, sizeof(o->name), "bench.gps%d", i);
+        o->obj.name = o->name;
+        o->obj.type = &fanout_type;
+        o->obj.methods = fanout_methods;
+        o->obj.n_methods = ARRAY_SIZE(fanout_methods);
+        o->reply.cb = fanout_reply_cb;
+        o->delay_ms = (i + 1) * max_delay_ms / objects;
+        sum_ms += o->delay_ms;
+        gps_client_init(&fan.clients[i], &fan.conn, o->name);
+        fan.clients[i].complete_cb = fanout_complete_cb;
+        clients++;
+        if (ubus_add_object(fan.srv, &o->obj) != 0) {
+            fprintf(stderr, "Failed to register ubus object %s\n", o->name);
+            goto out;
+        }
+    }
+
+    printf("fanout: %d objects, reply delays %d..%d ms (sum %.0f ms), %d rounds on %s\n",
+           objects, fan_objs[0].delay_ms, fan_objs[objects - 1].delay_ms, sum_ms, rounds,
+           ld.socket);
+
+    // Untimed round for the object id lookups
+    fanout_round(0);
+    fan.failed = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        parallel += fanout_round(0);
+        sequential += fanout_round(1);
+    }
+
+    printf("  fan-out     %8.1f ms per cycle (%.2fx the slowest reply)\n",
+           parallel / rounds, parallel / rounds / max_delay_ms);
+    printf("  sequential  %8.1f ms per cycle (%.2fx the slowest reply)\n",
+           sequential / rounds, sequential / rounds / max_delay_ms);
+    printf("  failed replies: %d\n", fan.failed);
+
+    if (fan.failed) {
+        fprintf(stderr, "fanout: %d replies failed\n", fan.failed);
+    } else if (parallel / rounds > FANOUT_SLACK * max_delay_ms) {
+        fprintf(stderr, "fanout: a fan-out cycle takes %.1f ms, over %.1fx the slowest reply\n",
+                parallel / rounds, FANOUT_SLACK);
+    } else {
+        ret = 0;
+    }
+
+out:
+    for (int i = 0; i < clients; i++) {
+        gps_client_free(&fan.clients[i]);
+    }
+    if (fan.conn.connected) gps_conn_free(&fan.conn);
+    if (fan.srv) ubus_free(fan.srv);
+    uloop_done();
+    load_kill(&ld.ubusd);
+    unlink(ld.socket);
+    blob_buf_free(&fan.b);
+    free(fan.clients);
+    free(fan_objs);
+    return ret;
+}
+
+static const struct bench benches[] = {
+    { "decode", "[iterations]  Decode an info reply: legacy copy+scan vs gps_fix_parse",
+      bench_decode },
+    { "delta", "[days]        Round trip a synthetic 1 Hz track through the delta stream",
+      bench_delta },
+    { "adaptive", "[days] [min:max]  Samples and track error of --adaptive vs a fixed interval",
+      bench_adaptive },
+    { "simplify", "[track]     Fixes kept and worst error of --simplify at several tolerances",
+      bench_simplify },
+    { "query", "[MB] [fmt]    Indexed time/area queries over a synthetic multi-GB track",
+      bench_query },
+    { "geofence", "[fixes]     Cost per fix of the fence grid from 10 to 10,000 fences",
+      bench_geofence },
+    { "fixed", "[iterations]  Per-sample cost of the double vs fixed-point fix pipeline",
+      bench_fixed },
+    { "kalman", "[updates]    Cost per update and error of the --kalman filter on a 10 Hz drive",
+      bench_kalman },
+    { "jitter", "[ticks] [ms]  Tick timing of gps_sched vs a re-armed timeout (needs ubusd)",
+      bench_jitter },
+    { "fanout", "[n] [ms]      Poll many gps objects at once vs one by one (needs ubusd)",
+      bench_fanout },
+    { "latency", "[iterations]  Cost of one phase timer: clock read plus histogram update",
+      bench_latency },
+    { "load", "[n] [s] [out]  Requests/s, latency and CPU of n clients per fetch strategy",
+      bench_load },
+};
+
+static void print_usage(const char *prog_name) {
+    printf("GPS Bench - Benchmarks for the gps tools' sample path\n\n");
+    printf("Usage: %s <benchmark> [ARGS]\n\n", prog_name);
+    printf("Benchmarks:\n");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        printf("  %-8s %s\n", benches[i].name, benches[i].help);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (strcmp(argv[1], benches[i].name) == 0) {
+            return benches[i].run(argc - 1, argv + 1);
+        }
+    }
+
+    fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+    print_usage(argv[0]);
+    return 1;
+}
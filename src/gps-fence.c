@@ -0,0 +1,383 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gps-fence.h"
+
+#define METRES_PER_DEGREE 111194.93     // on a sphere of radius 6371 km
+#define DEG_TO_RAD (M_PI / 180.0)
+
+// Longest fence file line and most vertices per polygon
+#define FENCE_LINE_MAX 65536
+#define FENCE_POINTS_MAX 4096
+
+void gps_fences_init(struct gps_fences *fs) {
+    memset(fs, 0, sizeof(*fs));
+}
+
+static struct gps_fence *new_fence(struct gps_fences *fs, const char *name) {
+    struct gps_fence *f;
+
+    if (strlen(name) >= GPS_FENCE_NAME_MAX) return NULL;
+
+    if (fs->n == fs->cap) {
+        unsigned int cap = fs->cap ? fs->cap * 2 : 64;
+        struct gps_fence *grown = realloc(fs->fences, cap * sizeof(*grown));
+
+        if (!grown) return NULL;
+        fs->fences = grown;
+        fs->cap = cap;
+    }
+
+    f = &fs->fences[fs->n++];
+    memset(f, 0, sizeof(*f));
+    strcpy(f->name, name);
+    return f;
+}
+
+int gps_fences_add_circle(struct gps_fences *fs, const char *name,
+                          double lat, double lon, double radius) {
+    struct gps_fence *f;
+    double dlat = radius / METRES_PER_DEGREE;
+
+    if (radius <= 0 || fabs(lat) >= 90) return -1;
+    f = new_fence(fs, name);
+    if (!f) return -1;
+
+    f->type = GPS_FENCE_CIRCLE;
+    f->lat = lat;
+    f->lon = lon;
+    f->radius = radius;
+    f->cos_lat = cos(lat * DEG_TO_RAD);
+    f->sin_lat = sin(lat * DEG_TO_RAD);
+    f->min_lat = lat - dlat;
+    f->max_lat = lat + dlat;
+    f->min_lon = lon - dlat / cos(lat * DEG_TO_RAD);
+    f->max_lon = lon + dlat / cos(lat * DEG_TO_RAD);
+    return 0;
+}
+
+int gps_fences_add_polygon(struct gps_fences *fs, const char *name,
+                           const struct gps_fence_point *points, unsigned int count) {
+    struct gps_fence *f;
+
+    if (count < 3) return -1;
+
+    if (fs->npoints + count > fs->points_cap) {
+        unsigned int cap = fs->points_cap ? fs->points_cap : 256;
+        struct gps_fence_point *grown;
+
+        while (cap < fs->npoints + count) cap *= 2;
+        grown = realloc(fs->points, cap * sizeof(*grown));
+        if (!grown) return -1;
+        fs->points = grown;
+        fs->points_cap = cap;
+    }
+
+    f = new_fence(fs, name);
+    if (!f) return -1;
+
+    f->type = GPS_FENCE_POLYGON;
+    f->first = fs->npoints;
+    f->count = count;
+    f->min_lat = f->max_lat = points[0].lat;
+    f->min_lon = f->max_lon = points[0].lon;
+    for (unsigned int i = 0; i < count; i++) {
+        fs->points[fs->npoints++] = points[i];
+        if (points[i].lat < f->min_lat) f->min_lat = points[i].lat;
+        if (points[i].lat > f->max_lat) f->max_lat = points[i].lat;
+        if (points[i].lon < f->min_lon) f->min_lon = points[i].lon;
+        if (points[i].lon > f->max_lon) f->max_lon = points[i].lon;
+    }
+    return 0;
+}
+
+static unsigned int clamp_cell(double x, unsigned int n) {
+    if (x < 0) return 0;
+    if (x >= n) return n - 1;
+    return (unsigned int)x;
+}
+
+// Lay the grid over the box around all fences and list each fence in every
+// cell its bounding box overlaps
+int gps_fences_build(struct gps_fences *fs) {
+    double min_lat, max_lat, min_lon, max_lon, w, h, side, scale, size = 0;
+    uint64_t entries = 0, cells;
+
+    free(fs->cell_start);
+    free(fs->cell_fences);
+    fs->cell_start = NULL;
+    fs->cell_fences = NULL;
+    fs->rows = fs->cols = 0;
+    if (fs->n == 0) return 0;
+
+    min_lat = max_lat = fs->fences[0].min_lat;
+    min_lon = max_lon = fs->fences[0].min_lon;
+    for (unsigned int i = 0; i < fs->n; i++) {
+        const struct gps_fence *f = &fs->fences[i];
+
+        if (f->min_lat < min_lat) min_lat = f->min_lat;
+        if (f->max_lat > max_lat) max_lat = f->max_lat;
+        if (f->min_lon < min_lon) min_lon = f->min_lon;
+        if (f->max_lon > max_lon) max_lon = f->max_lon;
+    }
+
+    // Square cells on the ground, in degrees of latitude, a fraction of the
+    // mean fence size: a fix then only meets fences near it however the
+    // fences are spread, while each fence covers a handful of cells
+    scale = cos((min_lat + max_lat) / 2 * DEG_TO_RAD);
+    for (unsigned int i = 0; i < fs->n; i++) {
+        const struct gps_fence *f = &fs->fences[i];
+
+        size += sqrt((f->max_lat - f->min_lat) * (f->max_lon - f->min_lon) * scale);
+    }
+    side = size / fs->n / GPS_FENCE_CELL_FRACTION;
+
+    // No more than GPS_FENCE_CELLS_PER_FENCE cells per fence on average,
+    // so a few fences far apart don't get a grid mostly empty
+    h = max_lat - min_lat;
+    w = (max_lon - min_lon) * scale;
+    if (side * side * fs->n * GPS_FENCE_CELLS_PER_FENCE < w * h) {
+        side = sqrt(w * h / ((double)fs->n * GPS_FENCE_CELLS_PER_FENCE));
+    }
+    if (!(side > 0)) side = (w > h ? w : h) / fs->n;
+    if (!(side > 0)) side = 1e-6;
+
+    for (;;) {
+        fs->cell_lat = side;
+        fs->cell_lon = side / cos((min_lat + max_lat) / 2 * DEG_TO_RAD);
+        cells = (uint64_t)((max_lat - min_lat) / fs->cell_lat + 1) *
+                (uint64_t)((max_lon - min_lon) / fs->cell_lon + 1);
+        if (cells <= GPS_FENCE_MAX_CELLS) break;
+        side *= 1.25;
+    }
+    fs->lat0 = min_lat;
+    fs->lon0 = min_lon;
+    fs->rows = (unsigned int)((max_lat - min_lat) / fs->cell_lat + 1);
+    fs->cols = (unsigned int)((max_lon - min_lon) / fs->cell_lon + 1);
+
+    fs->cell_start = calloc((size_t)fs->rows * fs->cols + 1, sizeof(*fs->cell_start));
+    if (!fs->cell_start) return -1;
+
+    // Count the fences of each cell, then turn the counts into offsets and
+    // fill in from the back
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned int i = 0; i < fs->n; i++) {
+            const struct gps_fence *f = &fs->fences[i];
+            unsigned int r0 = clamp_cell((f->min_lat - fs->lat0) / fs->cell_lat, fs->rows);
+            unsigned int r1 = clamp_cell((f->max_lat - fs->lat0) / fs->cell_lat, fs->rows);
+            unsigned int c0 = clamp_cell((f->min_lon - fs->lon0) / fs->cell_lon, fs->cols);
+            unsigned int c1 = clamp_cell((f->max_lon - fs->lon0) / fs->cell_lon, fs->cols);
+
+            for (unsigned int r = r0; r <= r1; r++) {
+                for (unsigned int c = c0; c <= c1; c++) {
+                    size_t cell = (size_t)r * fs->cols + c;
+
+                    if (pass == 0) {
+                        fs->cell_start[cell + 1]++;
+                        entries++;
+                    } else {
+                        fs->cell_fences[--fs->cell_start[cell + 1]] = i;
+                    }
+                }
+            }
+        }
+
+        if (pass == 0) {
+            if (entries > UINT32_MAX) return -1;
+            for (size_t c = 1; c <= (size_t)fs->rows * fs->cols; c++) {
+                fs->cell_start[c] += fs->cell_start[c - 1];
+            }
+            fs->cell_fences = malloc((entries ? entries : 1) * sizeof(*fs->cell_fences));
+            if (!fs->cell_fences) return -1;
+        }
+    }
+
+    // Filling from the back left each end pointing at its cell's start
+    memmove(fs->cell_start, fs->cell_start + 1, (size_t)fs->rows * fs->cols * sizeof(*fs->cell_start));
+    fs->cell_start[(size_t)fs->rows * fs->cols] = entries;
+    return 0;
+}
+
+// One fence per line, '#' starts a comment:
+//   circle <name> <lat> <lon> <radius in metres>
+//   polygon <name> <lat>,<lon> <lat>,<lon> <lat>,<lon> ...
+int gps_fences_load(struct gps_fences *fs, const char *path) {
+    static char line[FENCE_LINE_MAX];
+    static struct gps_fence_point points[FENCE_POINTS_MAX];
+    char *save, *kind, *name, *tok, *end;
+    unsigned int lineno = 0, count;
+    double lat, lon, radius;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        fprintf(stderr, "Failed to open fence file: %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if ((tok = strchr(line, '#'))) *tok = '\0';
+
+        kind = strtok_r(line, " \t\r\n", &save);
+        if (!kind) continue;
+        name = strtok_r(NULL, " \t\r\n", &save);
+        if (!name || strlen(name) >= GPS_FENCE_NAME_MAX) {
+            fprintf(stderr, "%s:%u: missing or too long fence name\n", path, lineno);
+            goto fail;
+        }
+
+        if (strcmp(kind, "circle") == 0) {
+            if (sscanf(save, "%lf %lf %lf", &lat, &lon, &radius) != 3 ||
+                gps_fences_add_circle(fs, name, lat, lon, radius) != 0) {
+                fprintf(stderr, "%s:%u: invalid circle\n", path, lineno);
+                goto fail;
+            }
+        } else if (strcmp(kind, "polygon") == 0) {
+            count = 0;
+            while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+                if (count == FENCE_POINTS_MAX) {
+                    fprintf(stderr, "%s:%u: more than %d points\n", path, lineno, FENCE_POINTS_MAX);
+                    goto fail;
+                }
+                points[count].lat = strtod(tok, &end);
+                if (*end != ',') break;
+                points[count].lon = strtod(end + 1, &end);
+                if (*end) break;
+                count++;
+            }
+            if (tok || gps_fences_add_polygon(fs, name, points, count) != 0) {
+                fprintf(stderr, "%s:%u: invalid polygon\n", path, lineno);
+                goto fail;
+            }
+        } else {
+            fprintf(stderr, "%s:%u: unknown fence type %s\n", path, lineno, kind);
+            goto fail;
+        }
+    }
+
+    fclose(f);
+    if (gps_fences_build(fs) != 0) {
+        fprintf(stderr, "Out of memory indexing %u fences\n", fs->n);
+        return -1;
+    }
+    return 0;
+
+fail:
+    fclose(f);
+    return -1;
+}
+
+void gps_fences_free(struct gps_fences *fs) {
+    free(fs->fences);
+    free(fs->points);
+    free(fs->cell_start);
+    free(fs->cell_fences);
+    gps_fences_init(fs);
+}
+
+int gps_fence_contains(const struct gps_fences *fs, const struct gps_fence *f,
+                       double lat, double lon) {
+    const struct gps_fence_point *p;
+    int in = 0;
+
+    if (lat < f->min_lat || lat > f->max_lat || lon < f->min_lon || lon > f->max_lon) {
+        return 0;
+    }
+
+    // cos of the mean latitude, to first order around the centre
+    if (f->type == GPS_FENCE_CIRCLE) {
+        double x = (lon - f->lon) * (f->cos_lat - f->sin_lat * (lat - f->lat) / 2 * DEG_TO_RAD);
+        double y = lat - f->lat;
+
+        return sqrt(x * x + y * y) * METRES_PER_DEGREE <= f->radius;
+    }
+
+    // Count the edges crossed by a ray due east
+    p = &fs->points[f->first];
+    for (uint32_t i = 0, j = f->count - 1; i < f->count; j = i++) {
+        if ((p[i].lat > lat) != (p[j].lat > lat) &&
+            lon < (p[j].lon - p[i].lon) * (lat - p[i].lat) / (p[j].lat - p[i].lat) + p[i].lon) {
+            in = !in;
+        }
+    }
+    return in;
+}
+
+int gps_fence_state_init(struct gps_fence_state *st, const struct gps_fences *fs) {
+    unsigned int n = fs->n ? fs->n : 1;
+
+    memset(st, 0, sizeof(*st));
+    st->inside = calloc(n, sizeof(*st->inside));
+    st->current = calloc(n, sizeof(*st->current));
+    st->next = calloc(n, sizeof(*st->next));
+    if (!st->inside || !st->current || !st->next) {
+        gps_fence_state_free(st);
+        return -1;
+    }
+    return 0;
+}
+
+// Take in a position and report the fences left and entered since the one
+// before, exits first. Costs the fences of one grid cell plus those the
+// position was in. Returns the number of events.
+int gps_fence_update(const struct gps_fences *fs, struct gps_fence_state *st,
+                     double lat, double lon, gps_fence_cb cb, void *priv) {
+    double r = (lat - fs->lat0) / fs->cell_lat;
+    double c = (lon - fs->lon0) / fs->cell_lon;
+    unsigned int nnext = 0;
+    uint32_t *swap;
+    int events = 0;
+
+    st->stats.fixes++;
+
+    // Bit 1: in the fence before this fix, bit 2: in it now
+    if (fs->rows && r >= 0 && r < fs->rows && c >= 0 && c < fs->cols) {
+        size_t cell = (size_t)r * fs->cols + (size_t)c;
+
+        for (uint32_t i = fs->cell_start[cell]; i < fs->cell_start[cell + 1]; i++) {
+            uint32_t id = fs->cell_fences[i];
+
+            st->stats.candidates++;
+            if (gps_fence_contains(fs, &fs->fences[id], lat, lon)) {
+                st->next[nnext++] = id;
+                st->inside[id] |= 2;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < st->ncurrent; i++) {
+        uint32_t id = st->current[i];
+
+        if (st->inside[id] & 2) continue;
+        st->inside[id] = 0;
+        st->stats.exits++;
+        events++;
+        if (cb) cb(&fs->fences[id], 0, priv);
+    }
+
+    for (unsigned int i = 0; i < nnext; i++) {
+        uint32_t id = st->next[i];
+
+        if (!(st->inside[id] & 1)) {
+            st->stats.enters++;
+            events++;
+            if (cb) cb(&fs->fences[id], 1, priv);
+        }
+        st->inside[id] = 1;
+    }
+
+    swap = st->current;
+    st->current = st->next;
+    st->next = swap;
+    st->ncurrent = nnext;
+    return events;
+}
+
+void gps_fence_state_free(struct gps_fence_state *st) {
+    free(st->inside);
+    free(st->current);
+    free(st->next);
+    memset(st, 0, sizeof(*st));
+}
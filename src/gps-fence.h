@@ -0,0 +1,88 @@
+#ifndef GPS_FENCE_H
+#define GPS_FENCE_H
+
+#include <stdint.h>
+
+// Longest fence name, terminating NUL included
+#define GPS_FENCE_NAME_MAX 32
+
+// Grid cells are the mean fence size over GPS_FENCE_CELL_FRACTION, with no
+// more than GPS_FENCE_CELLS_PER_FENCE cells per fence and GPS_FENCE_MAX_CELLS
+// in all
+#define GPS_FENCE_CELL_FRACTION 2
+#define GPS_FENCE_CELLS_PER_FENCE 64
+#define GPS_FENCE_MAX_CELLS (1 << 22)
+
+enum gps_fence_type {
+    GPS_FENCE_CIRCLE,
+    GPS_FENCE_POLYGON,
+};
+
+struct gps_fence_point {
+    double lat, lon;
+};
+
+struct gps_fence {
+    char name[GPS_FENCE_NAME_MAX];
+    enum gps_fence_type type;
+    double min_lat, max_lat;        // bounding box, degrees
+    double min_lon, max_lon;
+    double lat, lon, radius;        // circle: centre and metres
+    double cos_lat, sin_lat;        // circle: of the centre latitude
+    uint32_t first, count;          // polygon: vertices in gps_fences.points
+};
+
+// A set of circle and polygon fences and a uniform grid over them. Each grid
+// cell lists the fences whose bounding box overlaps it, so a fix is only
+// tested against the fences of its own cell. Cells are sized from the fences
+// themselves, half the mean fence across, so the candidates per fix follow
+// how many fences actually lie around the fix rather than their total count.
+// Polygons are taken in plain latitude/longitude and must not cross the
+// antimeridian.
+struct gps_fences {
+    struct gps_fence *fences;
+    unsigned int n, cap;
+    struct gps_fence_point *points;
+    unsigned int npoints, points_cap;
+
+    double lat0, lon0;              // grid origin, south-west corner
+    double cell_lat, cell_lon;      // cell size, degrees
+    unsigned int rows, cols;
+    uint32_t *cell_start;           // fences of cell i: cell_fences[cell_start[i]..[i + 1])
+    uint32_t *cell_fences;
+};
+
+// Which fences one receiver is in. Enter and exit events come from
+// comparing the fences found for a fix with those of the fix before.
+struct gps_fence_state {
+    uint8_t *inside;                // per fence
+    uint32_t *current, *next;       // fences the position is in, before and after a fix
+    unsigned int ncurrent;
+    struct {
+        unsigned long fixes;
+        unsigned long candidates;   // fences tested
+        unsigned long enters;
+        unsigned long exits;
+    } stats;
+};
+
+typedef void (*gps_fence_cb)(const struct gps_fence *f, int enter, void *priv);
+
+void gps_fences_init(struct gps_fences *fs);
+int gps_fences_add_circle(struct gps_fences *fs, const char *name,
+                          double lat, double lon, double radius);
+int gps_fences_add_polygon(struct gps_fences *fs, const char *name,
+                           const struct gps_fence_point *points, unsigned int count);
+int gps_fences_build(struct gps_fences *fs);
+int gps_fences_load(struct gps_fences *fs, const char *path);
+void gps_fences_free(struct gps_fences *fs);
+
+int gps_fence_contains(const struct gps_fences *fs, const struct gps_fence *f,
+                       double lat, double lon);
+
+int gps_fence_state_init(struct gps_fence_state *st, const struct gps_fences *fs);
+int gps_fence_update(const struct gps_fences *fs, struct gps_fence_state *st,
+                     double lat, double lon, gps_fence_cb cb, void *priv);
+void gps_fence_state_free(struct gps_fence_state *st);
+
+#endif
@@ -0,0 +1,212 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gps-fix.h"
+
+// Same order as the GPS_FIX_* bits, so attribute i sets bit (1 << i)
+enum {
+    GPS_ATTR_LATITUDE,
+    GPS_ATTR_LONGITUDE,
+    GPS_ATTR_ELEVATION,
+    GPS_ATTR_SPEED,
+    GPS_ATTR_COURSE,
+    GPS_ATTR_AGE,
+    __GPS_ATTR_MAX
+};
+
+// UNSPEC accepts any type: the gps daemon sends most values as strings but
+// the age as an integer, and other providers may send native numbers
+static const struct blobmsg_policy gps_fix_policy[__GPS_ATTR_MAX] = {
+    [GPS_ATTR_LATITUDE]  = { .name = "latitude",  .type = BLOBMSG_TYPE_UNSPEC },
+    [GPS_ATTR_LONGITUDE] = { .name = "longitude", .type = BLOBMSG_TYPE_UNSPEC },
+    [GPS_ATTR_ELEVATION] = { .name = "elevation", .type = BLOBMSG_TYPE_UNSPEC },
+    [GPS_ATTR_SPEED]     = { .name = "speed",     .type = BLOBMSG_TYPE_UNSPEC },
+    [GPS_ATTR_COURSE]    = { .name = "course",    .type = BLOBMSG_TYPE_UNSPEC },
+    [GPS_ATTR_AGE]       = { .name = "age",       .type = BLOBMSG_TYPE_UNSPEC },
+};
+
+static const int32_t pow10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+// Decimal places of each attribute, in GPS_ATTR_* order
+static const int attr_digits[__GPS_ATTR_MAX] = {
+    [GPS_ATTR_LATITUDE]  = GPS_FIX_DEGREE_DIGITS,
+    [GPS_ATTR_LONGITUDE] = GPS_FIX_DEGREE_DIGITS,
+    [GPS_ATTR_ELEVATION] = GPS_FIX_ELEVATION_DIGITS,
+    [GPS_ATTR_SPEED]     = GPS_FIX_SPEED_DIGITS,
+    [GPS_ATTR_COURSE]    = GPS_FIX_COURSE_DIGITS,
+    [GPS_ATTR_AGE]       = 0,
+};
+
+static int32_t saturate(int64_t v) {
+    return v > INT32_MAX ? INT32_MAX : v < -INT32_MAX ? -INT32_MAX : (int32_t)v;
+}
+
+// An integer number of whole units in units of 10^-digits
+static int32_t whole_units(int64_t v, int digits) {
+    return saturate(saturate(v) * (int64_t)pow10[digits]);
+}
+
+// Parse a decimal number ("-12.3456789") into an integer in units of
+// 10^-digits, rounding half away from zero and saturating at +-INT32_MAX.
+// Integer arithmetic only, unlike strtod(). Returns the end of the number,
+// or NULL if s doesn't start with one.
+const char *gps_decimal_parse(const char *s, int digits, int32_t *value) {
+    const char *p = s;
+    int64_t v = 0;
+    int neg = 0, any = 0, frac = 0;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '-' || *p == '+') neg = *p++ == '-';
+
+    for (; *p >= '0' && *p <= '9'; p++, any = 1) {
+        if (v <= INT32_MAX) v = v * 10 + (*p - '0');
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, any = 1) {
+            if (frac < digits) {
+                if (v <= INT32_MAX) v = v * 10 + (*p - '0');
+            } else if (frac == digits) {
+                v += *p >= '5';
+            } else {
+                continue;
+            }
+            frac++;
+        }
+    }
+    if (!any) return NULL;
+
+    for (; frac < digits && v <= INT32_MAX; frac++) v *= 10;
+    *value = saturate(neg ? -v : v);
+    return p;
+}
+
+// Format value, in units of 10^-digits, with `shown` decimal places,
+// rounding half away from zero. Digits are written by hand rather than by
+// printf, which is most of the cost of a CSV row or a screen of fields.
+// Returns the length of the number, truncated to len - 1 like snprintf().
+int gps_decimal_format(char *buf, size_t len, int32_t value, int digits, int shown) {
+    uint32_t mag = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    uint32_t unit = pow10[digits], whole, frac;
+    char tmp[24], *p = tmp + sizeof(tmp);
+    size_t n;
+
+    if (shown < digits) {
+        uint32_t step = pow10[digits - shown];
+
+        mag = (mag + step / 2) / step;
+        unit = pow10[shown];
+    }
+    whole = mag / unit;
+    frac = mag % unit;
+    if (shown > digits) frac *= pow10[shown - digits];
+
+    for (int i = 0; i < shown; i++) {
+        *--p = '0' + frac % 10;
+        frac /= 10;
+    }
+    if (shown) *--p = '.';
+    do {
+        *--p = '0' + whole % 10;
+        whole /= 10;
+    } while (whole);
+    if (value < 0 && mag) *--p = '-';
+
+    n = tmp + sizeof(tmp) - p;
+    if (len) {
+        size_t copy = n < len ? n : len - 1;
+
+        memcpy(buf, p, copy);
+        buf[copy] = '\0';
+    }
+    return n;
+}
+
+// Read a numeric attribute of any encoding in units of 10^-digits. The gps
+// daemon's strings never touch floating point.
+static int attr_to_fixed(struct blob_attr *attr, int digits, int32_t *val) {
+    double d;
+
+    switch (blobmsg_type(attr)) {
+        case BLOBMSG_TYPE_STRING:
+            return gps_decimal_parse(blobmsg_get_string(attr), digits, val) != NULL;
+        case BLOBMSG_TYPE_DOUBLE:
+            // A NaN counts as missing; converting it to an integer is undefined
+            d = blobmsg_get_double(attr) * pow10[digits];
+            if (isnan(d)) return 0;
+            *val = d >= INT32_MAX ? INT32_MAX : d <= -INT32_MAX ? -INT32_MAX :
+                   (int32_t)(d + (d < 0 ? -0.5 : 0.5));
+            return 1;
+        case BLOBMSG_TYPE_INT64:
+            *val = whole_units((int64_t)blobmsg_get_u64(attr), digits);
+            return 1;
+        case BLOBMSG_TYPE_INT32:
+            *val = whole_units((int32_t)blobmsg_get_u32(attr), digits);
+            return 1;
+        case BLOBMSG_TYPE_INT16:
+            *val = whole_units((int16_t)blobmsg_get_u16(attr), digits);
+            return 1;
+        case BLOBMSG_TYPE_INT8:
+            *val = whole_units(blobmsg_get_u8(attr), digits);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Decode a gps info reply or notification in a single pass over the message
+int gps_fix_parse(struct gps_fix *fix, struct blob_attr *msg) {
+    struct blob_attr *tb[__GPS_ATTR_MAX];
+    int32_t *dest[__GPS_ATTR_MAX] = {
+        [GPS_ATTR_LATITUDE]  = &fix->latitude,
+        [GPS_ATTR_LONGITUDE] = &fix->longitude,
+        [GPS_ATTR_ELEVATION] = &fix->elevation,
+        [GPS_ATTR_SPEED]     = &fix->speed,
+        [GPS_ATTR_COURSE]    = &fix->course,
+    };
+    int32_t age;
+
+    memset(fix, 0, sizeof(*fix));
+    if (!msg) return -1;
+
+    blobmsg_parse(gps_fix_policy, __GPS_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
+
+    for (int i = 0; i < __GPS_ATTR_MAX; i++) {
+        if (!tb[i] || !dest[i]) continue;
+        if (attr_to_fixed(tb[i], attr_digits[i], dest[i])) {
+            fix->fields |= 1 << i;
+        }
+    }
+
+    if (tb[GPS_ATTR_AGE] && attr_to_fixed(tb[GPS_ATTR_AGE], 0, &age)) {
+        fix->age = age;
+        fix->fields |= GPS_FIX_AGE;
+    }
+
+    return 0;
+}
+
+// Add the fields a fix carries to b as native numbers, named like the gps
+// daemon's reply so gps_fix_parse() reads them back
+void gps_fix_add_blob(struct blob_buf *b, const struct gps_fix *fix) {
+    const int32_t *src[__GPS_ATTR_MAX] = {
+        [GPS_ATTR_LATITUDE]  = &fix->latitude,
+        [GPS_ATTR_LONGITUDE] = &fix->longitude,
+        [GPS_ATTR_ELEVATION] = &fix->elevation,
+        [GPS_ATTR_SPEED]     = &fix->speed,
+        [GPS_ATTR_COURSE]    = &fix->course,
+    };
+
+    for (int i = 0; i < __GPS_ATTR_MAX; i++) {
+        if (src[i] && (fix->fields & (1 << i))) {
+            blobmsg_add_double(b, gps_fix_policy[i].name,
+                               (double)*src[i] / pow10[attr_digits[i]]);
+        }
+    }
+
+    if (fix->fields & GPS_FIX_AGE) {
+        blobmsg_add_u32(b, "age", fix->age);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef GPS_FIX_H
+#define GPS_FIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libubox/blobmsg.h>
+
+// Fields present in a struct gps_fix
+enum {
+    GPS_FIX_LATITUDE  = (1 << 0),
+    GPS_FIX_LONGITUDE = (1 << 1),
+    GPS_FIX_ELEVATION = (1 << 2),
+    GPS_FIX_SPEED     = (1 << 3),
+    GPS_FIX_COURSE    = (1 << 4),
+    GPS_FIX_AGE       = (1 << 5),
+};
+
+#define GPS_FIX_POSITION (GPS_FIX_LATITUDE | GPS_FIX_LONGITUDE)
+#define GPS_FIX_ALL ((GPS_FIX_AGE << 1) - 1)
+
+// Decimal places of the fixed-point members, and the matching scale: a
+// latitude of 1 degree is stored as GPS_FIX_DEGREE
+#define GPS_FIX_DEGREE_DIGITS 6
+#define GPS_FIX_ELEVATION_DIGITS 2
+#define GPS_FIX_SPEED_DIGITS 3
+#define GPS_FIX_COURSE_DIGITS 2
+
+#define GPS_FIX_DEGREE 1000000      // latitude, longitude: 1e-6 degrees
+#define GPS_FIX_METRE 100           // elevation: cm
+#define GPS_FIX_MPS 1000            // speed: mm/s
+#define GPS_FIX_COURSE_DEGREE 100   // course: 1/100 degree
+
+// One decoded gps info reply. Fixed size and self-contained, so it can be
+// filled straight from the ubus callback without copying the message.
+// Values are fixed-point integers, parsed from the daemon's decimal strings
+// without going through a double, so the MT7688 (no FPU) decodes, logs and
+// displays a fix without soft-float.
+struct gps_fix {
+    unsigned int fields;    // GPS_FIX_* bits for the members below
+    int32_t latitude;       // 1e-6 degrees, north positive
+    int32_t longitude;      // 1e-6 degrees, east positive
+    int32_t elevation;      // cm
+    int32_t speed;          // mm/s
+    int32_t course;         // 1/100 degree clockwise from north
+    int age;                // seconds since the receiver produced the fix
+};
+
+int gps_fix_parse(struct gps_fix *fix, struct blob_attr *msg);
+void gps_fix_add_blob(struct blob_buf *b, const struct gps_fix *fix);
+
+const char *gps_decimal_parse(const char *s, int digits, int32_t *value);
+int gps_decimal_format(char *buf, size_t len, int32_t value, int digits, int shown);
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gps-history.h"
+
+static struct gps_history_entry *entry(const struct gps_history *h, uint64_t seq) {
+    return &h->entries[seq % h->window];
+}
+
+// Keep the deque monotonic: drop every later entry the new one beats. With
+// max set the deque front is the window maximum, otherwise the minimum.
+static void deque_push(struct gps_history *h, struct gps_history_deque *d,
+                       uint64_t seq, int max) {
+    int32_t speed = entry(h, seq)->speed;
+
+    while (d->tail > d->head) {
+        int32_t back = entry(h, d->seq[(d->tail - 1) % h->window])->speed;
+
+        if (max ? back > speed : back < speed) break;
+        d->tail--;
+    }
+    d->seq[d->tail++ % h->window] = seq;
+}
+
+static void deque_expire(struct gps_history *h, struct gps_history_deque *d) {
+    while (d->tail > d->head && d->seq[d->head % h->window] < h->head) {
+        d->head++;
+    }
+}
+
+// num / den rounded half away from zero, den > 0
+static int64_t div_round(int64_t num, int64_t den) {
+    return (num + (num < 0 ? -den : den) / 2) / den;
+}
+
+static int age_bucket(int age) {
+    return age < GPS_HISTORY_AGE_BUCKETS ? age : GPS_HISTORY_AGE_BUCKETS - 1;
+}
+
+// Move the regression origin to the oldest entry; exact in integers
+static void rebase(struct gps_history *h, int64_t base) {
+    int64_t d = base - h->base;
+
+    h->sxy -= d * h->sy;
+    h->sxx += -2 * d * h->sx + h->elevation_n * d * d;
+    h->sx -= h->elevation_n * d;
+    h->base = base;
+}
+
+static void drop_oldest(struct gps_history *h) {
+    struct gps_history_entry *e = entry(h, h->head);
+    int64_t x = e->t - h->base;
+
+    if (e->fields & GPS_FIX_SPEED) {
+        h->speed_sum -= e->speed;
+        h->speed_n--;
+    }
+    if (e->fields & GPS_FIX_ELEVATION) {
+        h->elevation_n--;
+        h->sx -= x;
+        h->sxx -= x * x;
+        h->sy -= e->elevation;
+        h->sxy -= x * e->elevation;
+    }
+    if (e->fields & GPS_FIX_AGE) {
+        h->age_hist[age_bucket(e->age)]--;
+        h->age_n--;
+    }
+
+    h->head++;
+    deque_expire(h, &h->speed_min);
+    deque_expire(h, &h->speed_max);
+}
+
+// Account a fix to its sparkline column, starting new columns as time moves
+static void add_column(struct gps_history *h, const struct gps_history_entry *e) {
+    int64_t index = e->t / h->column_span;
+    struct gps_history_column *c;
+
+    // Clear the columns skipped since the newest one, at most a full ring
+    if (index > h->column_last) {
+        int64_t first = h->column_last + 1;
+
+        if (index - first >= h->columns_n) first = index - h->columns_n + 1;
+        for (int64_t i = first; i <= index; i++) {
+            c = &h->columns[i % h->columns_n];
+            memset(c, 0, sizeof(*c));
+            c->index = i;
+        }
+        h->column_last = index;
+    }
+
+    c = &h->columns[index % h->columns_n];
+    if (c->index != index) return;
+
+    if (e->fields & GPS_FIX_SPEED) {
+        c->speed_sum += e->speed;
+        c->speed_n++;
+    }
+    if (e->fields & GPS_FIX_ELEVATION) {
+        c->elevation_sum += e->elevation;
+        c->elevation_n++;
+    }
+}
+
+int gps_history_init(struct gps_history *h, unsigned int window, unsigned int columns) {
+    memset(h, 0, sizeof(*h));
+    if (window == 0 || window > GPS_HISTORY_MAX_WINDOW || columns == 0) return -1;
+
+    h->window = window;
+    h->columns_n = columns;
+    h->column_span = (window + columns - 1) / columns;
+    h->column_last = -1;
+    h->entries = calloc(window, sizeof(*h->entries));
+    h->speed_min.seq = calloc(window, sizeof(uint64_t));
+    h->speed_max.seq = calloc(window, sizeof(uint64_t));
+    h->columns = calloc(columns, sizeof(*h->columns));
+
+    if (!h->entries || !h->speed_min.seq || !h->speed_max.seq || !h->columns) {
+        gps_history_free(h);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < columns; i++) {
+        h->columns[i].index = -1;
+    }
+    return 0;
+}
+
+void gps_history_free(struct gps_history *h) {
+    free(h->entries);
+    free(h->speed_min.seq);
+    free(h->speed_max.seq);
+    free(h->columns);
+    memset(h, 0, sizeof(*h));
+}
+
+// Record the fix for second t (NULL if there is none) and drop whatever
+// fell out of the window. Every step is O(1) amortised.
+void gps_history_add(struct gps_history *h, int64_t t, const struct gps_fix *fix) {
+    struct gps_history_entry *e;
+    int64_t x;
+
+    while (h->tail > h->head && entry(h, h->head)->t <= t - h->window) {
+        drop_oldest(h);
+    }
+
+    if (!fix || !fix->fields) return;
+
+    // At most one entry per second: a second fix in the same second is ignored
+    if (h->tail > h->head && entry(h, h->tail - 1)->t >= t) return;
+
+    if (h->tail - h->head == h->window) {
+        drop_oldest(h);
+    }
+
+    if (h->tail == h->head) {
+        h->base = t;
+    } else if (t - h->base > 2 * (int64_t)h->window) {
+        rebase(h, entry(h, h->head)->t);
+    }
+
+    e = entry(h, h->tail);
+    e->t = t;
+    e->fields = fix->fields;
+    e->speed = (fix->speed + (fix->speed < 0 ? -5 : 5)) / 10;
+    e->elevation = fix->elevation > GPS_HISTORY_ELEVATION_MAX ? GPS_HISTORY_ELEVATION_MAX :
+                   fix->elevation < -GPS_HISTORY_ELEVATION_MAX ? -GPS_HISTORY_ELEVATION_MAX :
+                   fix->elevation;
+    e->age = fix->age < 0 ? 0 : fix->age > 255 ? 255 : fix->age;
+    h->tail++;
+
+    if (e->fields & GPS_FIX_SPEED) {
+        h->speed_sum += e->speed;
+        h->speed_n++;
+        deque_push(h, &h->speed_min, h->tail - 1, 0);
+        deque_push(h, &h->speed_max, h->tail - 1, 1);
+    }
+    if (e->fields & GPS_FIX_ELEVATION) {
+        x = t - h->base;
+        h->elevation_n++;
+        h->sx += x;
+        h->sxx += x * x;
+        h->sy += e->elevation;
+        h->sxy += x * e->elevation;
+    }
+    if (e->fields & GPS_FIX_AGE) {
+        h->age_hist[age_bucket(e->age)]++;
+        h->age_n++;
+    }
+
+    add_column(h, e);
+}
+
+unsigned int gps_history_count(const struct gps_history *h) {
+    return h->tail - h->head;
+}
+
+// Speed statistics in cm/s, the mean rounded; returns the number of fixes
+// they cover
+int gps_history_speed(const struct gps_history *h, int32_t *min, int32_t *mean,
+                      int32_t *max) {
+    if (!h->speed_n) return 0;
+
+    *min = entry(h, h->speed_min.seq[h->speed_min.head % h->window])->speed;
+    *max = entry(h, h->speed_max.seq[h->speed_max.head % h->window])->speed;
+    *mean = div_round(h->speed_sum, h->speed_n);
+    return h->speed_n;
+}
+
+// Least-squares elevation slope over the window in cm/min, rounded; returns
+// the fixes it covers. The slope is num / den cm/s; it is scaled to minutes
+// after the division so num never has to hold 60 times its value.
+int gps_history_elevation_trend(const struct gps_history *h, int64_t *cm_per_min) {
+    int64_t n = h->elevation_n;
+    int64_t den = n * h->sxx - h->sx * h->sx;
+    int64_t num = n * h->sxy - h->sx * h->sy;
+
+    if (h->elevation_n < 2 || den == 0) return 0;
+
+    *cm_per_min = num / den * 60 + div_round(num % den * 60, den);
+    return h->elevation_n;
+}
+
+// Fix age (seconds) at the given percentile, the nearest-rank one, or -1
+// without ages
+int gps_history_age_percentile(const struct gps_history *h, unsigned int percent) {
+    unsigned int rank, seen = 0;
+
+    if (!h->age_n) return -1;
+
+    rank = ((uint64_t)percent * h->age_n + 99) / 100;
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < GPS_HISTORY_AGE_BUCKETS; i++) {
+        seen += h->age_hist[i];
+        if (seen >= rank) return i;
+    }
+    return GPS_HISTORY_AGE_BUCKETS - 1;
+}
+
+// Fill levels[columns_n] with the column means of field (GPS_FIX_SPEED or
+// GPS_FIX_ELEVATION) scaled to 0..nlevels-1, oldest first; -1 for columns
+// without data. Returns the number of columns with data.
+int gps_history_sparkline(const struct gps_history *h, int64_t now, unsigned int field,
+                          int *levels, int nlevels) {
+    int64_t newest = now / h->column_span;
+    int64_t means[h->columns_n], lo = 0, hi = 0;
+    int filled = 0;
+
+    for (unsigned int i = 0; i < h->columns_n; i++) {
+        int64_t index = newest - h->columns_n + 1 + i;
+        const struct gps_history_column *c = &h->columns[(index % h->columns_n + h->columns_n) % h->columns_n];
+        uint32_t n = field == GPS_FIX_SPEED ? c->speed_n : c->elevation_n;
+
+        levels[i] = -1;
+        if (index < 0 || c->index != index || n == 0) continue;
+
+        means[i] = div_round(field == GPS_FIX_SPEED ? c->speed_sum : c->elevation_sum, n);
+        levels[i] = 0;
+        if (!filled || means[i] < lo) lo = means[i];
+        if (!filled || means[i] > hi) hi = means[i];
+        filled++;
+    }
+
+    for (unsigned int i = 0; i < h->columns_n; i++) {
+        if (levels[i] < 0) continue;
+        levels[i] = hi > lo ? div_round((means[i] - lo) * (nlevels - 1), hi - lo) : 0;
+    }
+    return filled;
+}
@@ -0,0 +1,80 @@
+#ifndef GPS_HISTORY_H
+#define GPS_HISTORY_H
+
+#include <stdint.h>
+
+#include "gps-fix.h"
+
+// Fix ages are counted in one bucket per second; the last bucket holds
+// everything older
+#define GPS_HISTORY_AGE_BUCKETS 64
+
+// Longest supported window and largest elevation magnitude (cm, 100 km);
+// together they keep the exact integer regression sums and the trend's
+// products of them in range
+#define GPS_HISTORY_MAX_WINDOW (60 * 60)
+#define GPS_HISTORY_ELEVATION_MAX 10000000
+
+struct gps_history_entry {
+    int64_t t;              // seconds
+    int32_t speed;          // cm/s
+    int32_t elevation;      // cm
+    uint8_t age;            // seconds, saturated
+    uint8_t fields;         // GPS_FIX_* fields present
+};
+
+// Per-column means for the sparklines
+struct gps_history_column {
+    int64_t index;          // t / column_span
+    int64_t speed_sum;
+    int64_t elevation_sum;
+    uint32_t speed_n;
+    uint32_t elevation_n;
+};
+
+// Monotonic deque of entry sequence numbers, for the window min and max
+struct gps_history_deque {
+    uint64_t *seq;
+    uint64_t head, tail;    // live items are [head, tail)
+};
+
+// The fixes of the last `window` seconds, at most one per second, with
+// rolling statistics updated as entries enter and leave: speed min/max/mean,
+// the elevation trend (least-squares slope) and fix-age percentiles. All
+// storage is allocated by gps_history_init(); adding a fix never allocates.
+struct gps_history {
+    unsigned int window;            // seconds, also the ring capacity
+    struct gps_history_entry *entries;
+    uint64_t head, tail;            // live entries are [head, tail)
+
+    struct gps_history_deque speed_min;
+    struct gps_history_deque speed_max;
+    int64_t speed_sum;
+    unsigned int speed_n;
+
+    // Exact sums for the elevation regression, with x = t - base
+    int64_t base;
+    int64_t elevation_n, sx, sxx, sy, sxy;
+
+    unsigned int age_hist[GPS_HISTORY_AGE_BUCKETS];
+    unsigned int age_n;
+
+    struct gps_history_column *columns;
+    unsigned int columns_n;
+    unsigned int column_span;       // seconds per sparkline column
+    int64_t column_last;            // index of the newest column
+};
+
+int gps_history_init(struct gps_history *h, unsigned int window, unsigned int columns);
+void gps_history_add(struct gps_history *h, int64_t t, const struct gps_fix *fix);
+void gps_history_free(struct gps_history *h);
+
+unsigned int gps_history_count(const struct gps_history *h);
+int gps_history_speed(const struct gps_history *h, int32_t *min, int32_t *mean,
+                      int32_t *max);
+int gps_history_elevation_trend(const struct gps_history *h, int64_t *cm_per_min);
+int gps_history_age_percentile(const struct gps_history *h, unsigned int percent);
+int gps_history_sparkline(const struct gps_history *h, int64_t now, unsigned int field,
+                          int *levels, int nlevels);
+
+#endif
@@ -0,0 +1,514 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gps-index.h"
+
+// Little-endian helpers, independent of the host byte order
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static int has_position(const struct gps_fix *fix) {
+    return (fix->fields & (GPS_FIX_LATITUDE | GPS_FIX_LONGITUDE)) ==
+           (GPS_FIX_LATITUDE | GPS_FIX_LONGITUDE);
+}
+
+// Walk the fixes of a block of track data, base being its offset in the file.
+// Bin data must start at a sync marker. Damaged data is skipped like
+// gps_track_reader does; returns the length of the whole records seen.
+size_t gps_index_scan(const uint8_t *data, size_t len, uint64_t base,
+                      enum gps_track_format format, gps_index_scan_cb cb, void *priv) {
+    struct gps_track_delta d;
+    struct gps_sample s;
+    size_t pos = 0, start = 0;
+    uint64_t slot = 0;
+    int fresh = 0;
+    int ret;
+
+    switch (format) {
+        case GPS_TRACK_BIN:
+            while (len - pos >= GPS_TRACK_BIN_RECORD_SIZE) {
+                const uint8_t *rec = data + pos;
+
+                if (gps_track_bin_is_sync(rec, NULL)) {
+                    start = pos;
+                    fresh = 1;
+                    slot = 1;
+                    pos += GPS_TRACK_BIN_RECORD_SIZE;
+                    continue;
+                }
+                if (slot % GPS_TRACK_BIN_BLOCK == 0) {
+                    pos++;
+                    continue;
+                }
+
+                slot++;
+                pos += GPS_TRACK_BIN_RECORD_SIZE;
+                if (gps_track_bin_decode(rec, &s) == 0) {
+                    cb(&s, base + start, fresh, priv);
+                    fresh = 0;
+                }
+            }
+            return pos;
+
+        case GPS_TRACK_DELTA:
+            gps_track_delta_reset(&d);
+            while (pos < len) {
+                ret = gps_track_delta_decode(&d, data + pos, len - pos, &s);
+                if (ret == 0) break;
+                if (ret < 0) {
+                    gps_track_delta_reset(&d);
+                    pos++;
+                    continue;
+                }
+                cb(&s, base + pos, data[pos] == 0xff, priv);
+                pos += ret;
+            }
+            return pos;
+
+        case GPS_TRACK_CSV:
+            while (pos < len) {
+                const uint8_t *nl = memchr(data + pos, '\n', len - pos);
+                char line[160];
+                size_t n;
+
+                if (!nl) break;
+                n = nl - (data + pos) + 1;
+                if (n < sizeof(line)) {
+                    memcpy(line, data + pos, n);
+                    line[n] = '\0';
+                    if (gps_track_csv_parse(line, &s) == 0) {
+                        cb(&s, base + pos, 1, priv);
+                    }
+                }
+                pos += n;
+            }
+            return pos;
+    }
+    return 0;
+}
+
+void gps_index_entry_encode(uint8_t *buf, const struct gps_index_entry *e) {
+    put_le64(buf, e->first_ms);
+    put_le64(buf + 8, e->last_ms);
+    put_le64(buf + 16, e->upto_ms);
+    put_le64(buf + 24, e->offset);
+    put_le32(buf + 32, e->length);
+    put_le32(buf + 36, e->count);
+    put_le32(buf + 40, e->min_lat);
+    put_le32(buf + 44, e->max_lat);
+    put_le32(buf + 48, e->min_lon);
+    put_le32(buf + 52, e->max_lon);
+}
+
+void gps_index_entry_decode(const uint8_t *buf, struct gps_index_entry *e) {
+    e->first_ms = get_le64(buf);
+    e->last_ms = get_le64(buf + 8);
+    e->upto_ms = get_le64(buf + 16);
+    e->offset = get_le64(buf + 24);
+    e->length = get_le32(buf + 32);
+    e->count = get_le32(buf + 36);
+    e->min_lat = get_le32(buf + 40);
+    e->max_lat = get_le32(buf + 44);
+    e->min_lon = get_le32(buf + 48);
+    e->max_lon = get_le32(buf + 52);
+}
+
+static void index_header(uint8_t *buf, enum gps_track_format format) {
+    memset(buf, 0, GPS_INDEX_HEADER_SIZE);
+    memcpy(buf, GPS_INDEX_MAGIC, 4);
+    buf[4] = GPS_INDEX_VERSION;
+    buf[5] = format;
+    buf[6] = GPS_INDEX_ENTRY_SIZE & 0xff;
+    buf[7] = GPS_INDEX_ENTRY_SIZE >> 8;
+}
+
+static int index_header_valid(const uint8_t *buf, enum gps_track_format format) {
+    uint8_t expect[GPS_INDEX_HEADER_SIZE];
+
+    index_header(expect, format);
+    return memcmp(buf, expect, 8) == 0;
+}
+
+static void index_add_cb(const struct gps_sample *s, uint64_t block_start, int can_start,
+                         void *priv) {
+    gps_index_add(priv, s, block_start, can_start);
+}
+
+// Find the last entry of an index file that belongs to the track. Entries
+// of blocks past the end of the track, cut off with a batch that failed to
+// write, are passed over. Returns the number of entries up to it, 0 for an
+// index of no use.
+static uint64_t last_entry(int fd, enum gps_track_format format, uint64_t data_start,
+                           uint64_t track_size, struct gps_index_entry *last) {
+    uint8_t header[GPS_INDEX_HEADER_SIZE], buf[GPS_INDEX_ENTRY_SIZE];
+    uint64_t n = 0;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) return 0;
+    if (st.st_size >= GPS_INDEX_HEADER_SIZE + GPS_INDEX_ENTRY_SIZE) {
+        n = (st.st_size - GPS_INDEX_HEADER_SIZE) / GPS_INDEX_ENTRY_SIZE;
+    }
+    if (!n || pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        !index_header_valid(header, format)) {
+        return 0;
+    }
+
+    for (; n; n--) {
+        if (pread(fd, buf, sizeof(buf), GPS_INDEX_HEADER_SIZE +
+                  (n - 1) * GPS_INDEX_ENTRY_SIZE) != sizeof(buf)) {
+            return 0;
+        }
+        gps_index_entry_decode(buf, last);
+        if (last->offset + last->length <= track_size) {
+            return last->offset >= data_start ? n : 0;
+        }
+    }
+    return 0;
+}
+
+// Where the part of a track its index doesn't cover starts: the end of the
+// last indexed block, or data_start without a usable index
+uint64_t gps_index_covered(const char *path, enum gps_track_format format,
+                           uint64_t data_start, uint64_t track_size) {
+    struct gps_index_entry last;
+    uint64_t end = data_start;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return data_start;
+    if (last_entry(fd, format, data_start, track_size, &last)) {
+        end = last.offset + last.length;
+    }
+    close(fd);
+    return end;
+}
+
+// Open or create the index of a track being appended to. An index that
+// doesn't belong to the track is rebuilt; either way fixes past the last
+// entry are scanned so the index picks up where the track is.
+int gps_index_open(struct gps_index *ix, const char *path, enum gps_track_format format,
+                   int track_fd, uint64_t data_start, uint64_t track_size) {
+    uint8_t header[GPS_INDEX_HEADER_SIZE];
+    uint64_t resume = data_start;
+    struct gps_index_entry last;
+    const uint8_t *map;
+
+    memset(ix, 0, sizeof(*ix));
+    ix->format = format;
+    ix->upto_ms = INT64_MIN;
+
+    ix->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ix->fd < 0) {
+        gps_index_close(ix);
+        return -1;
+    }
+
+    ix->entries = last_entry(ix->fd, format, data_start, track_size, &last);
+    if (ix->entries) {
+        resume = last.offset + last.length;
+        ix->upto_ms = last.upto_ms;
+    }
+
+    // Drop a torn entry, or start over
+    index_header(header, format);
+    if (ftruncate(ix->fd, GPS_INDEX_HEADER_SIZE + ix->entries * GPS_INDEX_ENTRY_SIZE) != 0 ||
+        (ix->entries == 0 && pwrite(ix->fd, header, sizeof(header), 0) != sizeof(header)) ||
+        lseek(ix->fd, 0, SEEK_END) < 0) {
+        gps_index_close(ix);
+        return -1;
+    }
+
+    if (resume < track_size) {
+        map = mmap(NULL, track_size, PROT_READ, MAP_SHARED, track_fd, 0);
+        if (map == MAP_FAILED) {
+            gps_index_close(ix);
+            return -1;
+        }
+        gps_index_scan(map + resume, track_size - resume, resume, format, index_add_cb, ix);
+        munmap((void *)map, track_size);
+    }
+
+    return 0;
+}
+
+// Account for a fix appended at offset; a block that can start there closes
+// the current one and writes out its entry
+void gps_index_add(struct gps_index *ix, const struct gps_sample *s, uint64_t offset,
+                   int can_start) {
+    struct gps_index_entry *e = &ix->cur;
+    uint8_t buf[GPS_INDEX_ENTRY_SIZE];
+
+    if (e->count && can_start &&
+        (ix->format != GPS_TRACK_CSV || e->count >= GPS_INDEX_CSV_BLOCK)) {
+        e->length = offset - e->offset;
+        if (e->last_ms > ix->upto_ms) ix->upto_ms = e->last_ms;
+        e->upto_ms = ix->upto_ms;
+
+        gps_index_entry_encode(buf, e);
+        if (ix->fd >= 0 && write(ix->fd, buf, sizeof(buf)) != sizeof(buf)) {
+            ix->errors++;
+        }
+        ix->entries++;
+        e->count = 0;
+    }
+
+    if (e->count == 0) {
+        e->offset = offset;
+        e->first_ms = e->last_ms = s->time_ms;
+        e->min_lat = e->min_lon = INT32_MAX;
+        e->max_lat = e->max_lon = INT32_MIN;
+    }
+
+    if (s->time_ms < e->first_ms) e->first_ms = s->time_ms;
+    if (s->time_ms > e->last_ms) e->last_ms = s->time_ms;
+    if (has_position(&s->fix)) {
+        int32_t lat = s->fix.latitude;
+        int32_t lon = s->fix.longitude;
+
+        if (lat < e->min_lat) e->min_lat = lat;
+        if (lat > e->max_lat) e->max_lat = lat;
+        if (lon < e->min_lon) e->min_lon = lon;
+        if (lon > e->max_lon) e->max_lon = lon;
+    }
+    e->count++;
+}
+
+// The open block needs no entry: it is rebuilt from the track when reopened
+void gps_index_close(struct gps_index *ix) {
+    if (ix->fd >= 0) close(ix->fd);
+    ix->fd = -1;
+}
+
+static int days_in_month(int year, int month) {
+    static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+    return days[month - 1] + (month == 2 && leap);
+}
+
+// Local time as written in CSV tracks, "YYYY-MM-DD[ HH:MM[:SS[.mmm]]]"
+// with a space or a T, or Unix seconds
+int gps_query_parse_time(const char *arg, int64_t *ms) {
+    struct tm t = { .tm_isdst = -1 };
+    int32_t sec_ms = 0;
+    const char *p;
+    char *end;
+    int n, len = 0;
+
+    long long secs = strtoll(arg, &end, 10);
+    if (end != arg && *end == '\0') {
+        // strtoll saturates on overflow, which this also rejects
+        if (secs > INT64_MAX / 1000 || secs < INT64_MIN / 1000) return -1;
+        *ms = secs * 1000;
+        return 0;
+    }
+
+    // len ends up after the last part read, the date or the minutes
+    n = sscanf(arg, "%d-%d-%d%n%*1[ T]%d:%d%n", &t.tm_year, &t.tm_mon, &t.tm_mday, &len,
+               &t.tm_hour, &t.tm_min, &len);
+    if (n != 3 && n != 5) return -1;
+    if (t.tm_mon < 1 || t.tm_mon > 12 || t.tm_mday < 1 ||
+        t.tm_mday > days_in_month(t.tm_year, t.tm_mon)) {
+        return -1;
+    }
+    if (n == 5 && (t.tm_hour < 0 || t.tm_hour > 23 || t.tm_min < 0 || t.tm_min > 59)) {
+        return -1;
+    }
+    if (n == 5 && arg[len] == ':') {
+        p = gps_decimal_parse(arg + len + 1, 3, &sec_ms);
+        if (!p || *p != '\0' || sec_ms < 0 || sec_ms >= 60000) return -1;
+    } else if (arg[len] != '\0') {
+        return -1;
+    }
+
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    t.tm_sec = sec_ms / 1000;
+    *ms = (int64_t)mktime(&t) * 1000 + sec_ms % 1000;
+    return 0;
+}
+
+// "lat1,lon1,lat2,lon2", any two opposite corners
+int gps_query_parse_bbox(const char *arg, struct gps_query *q) {
+    int32_t v[4];
+    const char *p = arg;
+
+    for (int i = 0; i < 4; i++) {
+        if (i > 0 && *p++ != ',') return -1;
+        p = gps_decimal_parse(p, GPS_FIX_DEGREE_DIGITS, &v[i]);
+        if (!p) return -1;
+    }
+    if (*p) return -1;
+
+    q->bbox = 1;
+    q->min_lat = v[0] < v[2] ? v[0] : v[2];
+    q->max_lat = v[0] < v[2] ? v[2] : v[0];
+    q->min_lon = v[1] < v[3] ? v[1] : v[3];
+    q->max_lon = v[1] < v[3] ? v[3] : v[1];
+    return 0;
+}
+
+struct query_ctx {
+    const struct gps_query *q;
+    gps_query_cb cb;
+    void *priv;
+    struct gps_query_stats *stats;
+};
+
+static void query_scan_cb(const struct gps_sample *s, uint64_t block_start, int can_start,
+                          void *priv) {
+    struct query_ctx *qc = priv;
+    const struct gps_query *q = qc->q;
+    (void)block_start;
+    (void)can_start;
+
+    qc->stats->fixes++;
+    if (s->time_ms < q->from_ms || s->time_ms > q->to_ms) return;
+    if (q->bbox) {
+        if (!has_position(&s->fix)) return;
+
+        int32_t lat = s->fix.latitude;
+        int32_t lon = s->fix.longitude;
+        if (lat < q->min_lat || lat > q->max_lat || lon < q->min_lon || lon > q->max_lon) {
+            return;
+        }
+    }
+
+    qc->stats->matches++;
+    qc->cb(s, qc->priv);
+}
+
+static int entry_matches(const struct gps_index_entry *e, const struct gps_query *q) {
+    if (e->first_ms > q->to_ms || e->last_ms < q->from_ms) return 0;
+    if (!q->bbox) return 1;
+    return e->min_lat <= q->max_lat && e->max_lat >= q->min_lat &&
+           e->min_lon <= q->max_lon && e->max_lon >= q->min_lon;
+}
+
+static void query_block(struct query_ctx *qc, const uint8_t *map, uint64_t offset,
+                        uint64_t len, enum gps_track_format format) {
+    qc->stats->blocks++;
+    qc->stats->bytes += len;
+    gps_index_scan(map + offset, len, offset, format, query_scan_cb, qc);
+}
+
+// Memory-map the track and its index, bisect the index for the first block
+// that can hold from_ms and scan only the blocks whose time range and
+// bounding box overlap the query, then the unindexed tail. Without a usable
+// index the whole track is scanned. Entries are assumed to follow wall
+// clock order, so blocks after a large backwards clock step may be missed.
+int gps_query_run(const char *path, const struct gps_query *q, gps_query_cb cb, void *priv,
+                  struct gps_query_stats *stats) {
+    struct query_ctx qc = { q, cb, priv, stats };
+    char index_path[PATH_MAX + sizeof(GPS_INDEX_SUFFIX)];
+    const uint8_t *map, *index = MAP_FAILED;
+    struct gps_index_entry e;
+    struct stat st, ist;
+    uint64_t size, start, n = 0, lo, hi;
+    const uint8_t *nl;
+    int fd, ifd, format;
+
+    memset(stats, 0, sizeof(*stats));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < GPS_TRACK_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    format = gps_track_header_parse(map);
+    if (format >= 0) {
+        start = GPS_TRACK_HEADER_SIZE;
+    } else if (memcmp(map, "timestamp,", 10) == 0 && (nl = memchr(map, '\n', size))) {
+        format = GPS_TRACK_CSV;
+        start = nl - map + 1;
+    } else {
+        munmap((void *)map, size);
+        return -1;
+    }
+
+    // A track without a name for its index is scanned whole, like one without
+    if (snprintf(index_path, sizeof(index_path), "%s%s", path, GPS_INDEX_SUFFIX) >=
+        (int)sizeof(index_path)) {
+        ifd = -1;
+    } else {
+        ifd = open(index_path, O_RDONLY);
+    }
+    if (ifd >= 0 && fstat(ifd, &ist) == 0 &&
+        ist.st_size >= GPS_INDEX_HEADER_SIZE + GPS_INDEX_ENTRY_SIZE) {
+        index = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+        if (index != MAP_FAILED && index_header_valid(index, format)) {
+            n = (ist.st_size - GPS_INDEX_HEADER_SIZE) / GPS_INDEX_ENTRY_SIZE;
+        }
+    }
+    if (ifd >= 0) close(ifd);
+
+    // An index whose last block runs past the track belongs to another file
+    if (n) {
+        gps_index_entry_decode(index + GPS_INDEX_HEADER_SIZE + (n - 1) * GPS_INDEX_ENTRY_SIZE, &e);
+        if (e.offset < start || e.offset + e.length > size) n = 0;
+    }
+
+    if (n) {
+        stats->indexed = 1;
+        stats->entries = n;
+
+        // First entry whose blocks so far reach from_ms
+        lo = 0;
+        hi = n;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+
+            gps_index_entry_decode(index + GPS_INDEX_HEADER_SIZE + mid * GPS_INDEX_ENTRY_SIZE, &e);
+            if (e.upto_ms < q->from_ms) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        for (uint64_t i = lo; i < n; i++) {
+            gps_index_entry_decode(index + GPS_INDEX_HEADER_SIZE + i * GPS_INDEX_ENTRY_SIZE, &e);
+            if (e.first_ms > q->to_ms) break;
+            if (entry_matches(&e, q)) query_block(&qc, map, e.offset, e.length, format);
+        }
+
+        gps_index_entry_decode(index + GPS_INDEX_HEADER_SIZE + (n - 1) * GPS_INDEX_ENTRY_SIZE, &e);
+        start = e.offset + e.length;
+    }
+
+    if (start < size) query_block(&qc, map, start, size - start, format);
+
+    if (index != MAP_FAILED) munmap((void *)index, ist.st_size);
+    munmap((void *)map, size);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef GPS_INDEX_H
+#define GPS_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gps-track.h"
+
+// Sparse sidecar index of a track file, <track>.idx, so a time or area query
+// only reads the blocks that can match. The track is cut into blocks at
+// points a reader can start from: every sync marker of a bin or delta track
+// and every GPS_INDEX_CSV_BLOCK rows of a CSV track. Each finished block
+// gets one entry; the block still being written is found by scanning the
+// track past the last entry.
+//
+// Header: "GPSI", u8 version, u8 track format, u16 entry size, 8 bytes reserved
+// Entry:  i64 first time_ms, i64 last time_ms, i64 latest last time_ms of
+//         this and every earlier entry, u64 block offset, u32 block length,
+//         u32 fixes, i32 min/max latitude, i32 min/max longitude (1e-6 deg)
+#define GPS_INDEX_MAGIC "GPSI"
+#define GPS_INDEX_VERSION 1
+#define GPS_INDEX_HEADER_SIZE 16
+#define GPS_INDEX_ENTRY_SIZE 56
+#define GPS_INDEX_CSV_BLOCK 256
+#define GPS_INDEX_SUFFIX ".idx"
+
+struct gps_index_entry {
+    int64_t first_ms;
+    int64_t last_ms;
+    int64_t upto_ms;            // never decreases, so entries can be bisected
+    uint64_t offset;
+    uint32_t length;
+    uint32_t count;
+    int32_t min_lat, max_lat;   // min > max when no fix had a position
+    int32_t min_lon, max_lon;
+};
+
+// Index being built alongside a track as fixes are appended to it
+struct gps_index {
+    int fd;
+    enum gps_track_format format;
+    struct gps_index_entry cur;     // block being filled, count 0 before its first fix
+    int64_t upto_ms;
+    uint64_t entries;
+    unsigned long errors;
+};
+
+// Time range, inclusive, and optionally an area in 1e-6 degrees
+struct gps_query {
+    int64_t from_ms;
+    int64_t to_ms;
+    int bbox;
+    int32_t min_lat, max_lat;
+    int32_t min_lon, max_lon;
+};
+
+struct gps_query_stats {
+    int indexed;                // an index was found and used
+    uint64_t entries;           // index entries
+    uint64_t blocks;            // blocks scanned, the unindexed tail counting as one
+    uint64_t bytes;             // track bytes scanned
+    uint64_t fixes;             // fixes decoded
+    uint64_t matches;
+};
+
+// Called for every fix found by a scan: its offset in the track and whether a
+// block may start there (block_start then being the offset to start from)
+typedef void (*gps_index_scan_cb)(const struct gps_sample *s, uint64_t block_start,
+                                  int can_start, void *priv);
+typedef void (*gps_query_cb)(const struct gps_sample *s, void *priv);
+
+size_t gps_index_scan(const uint8_t *data, size_t len, uint64_t base,
+                      enum gps_track_format format, gps_index_scan_cb cb, void *priv);
+
+void gps_index_entry_encode(uint8_t *buf, const struct gps_index_entry *e);
+void gps_index_entry_decode(const uint8_t *buf, struct gps_index_entry *e);
+
+int gps_index_open(struct gps_index *ix, const char *path, enum gps_track_format format,
+                   int track_fd, uint64_t data_start, uint64_t track_size);
+void gps_index_add(struct gps_index *ix, const struct gps_sample *s, uint64_t offset,
+                   int can_start);
+void gps_index_close(struct gps_index *ix);
+uint64_t gps_index_covered(const char *path, enum gps_track_format format,
+                           uint64_t data_start, uint64_t track_size);
+
+int gps_query_parse_time(const char *arg, int64_t *ms);
+int gps_query_parse_bbox(const char *arg, struct gps_query *q);
+int gps_query_run(const char *path, const struct gps_query *q, gps_query_cb cb, void *priv,
+                  struct gps_query_stats *stats);
+
+#endif
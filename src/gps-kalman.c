@@ -0,0 +1,265 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gps-kalman.h"
+
+#define METRES_PER_DEGREE 111194.93     // on a sphere of radius 6371 km
+#define METRES_PER_UNIT (METRES_PER_DEGREE / GPS_FIX_DEGREE)
+#define DEG_TO_RAD (M_PI / 180.0)
+
+// Uncertainty of a velocity nothing has been measured about, m/s
+#define UNKNOWN_VELOCITY 50.0
+
+enum { EAST, NORTH, UP };
+
+void gps_kalman_init(struct gps_kalman *k, double accel, double position, double velocity) {
+    memset(k, 0, sizeof(*k));
+    k->accel = accel;
+    k->position = position;
+    k->velocity = velocity;
+}
+
+static void set_origin(struct gps_kalman *k, int32_t lat, int32_t lon) {
+    k->lat0 = lat;
+    k->lon0 = lon;
+    k->scale_x = METRES_PER_UNIT * cos((double)lat / GPS_FIX_DEGREE * DEG_TO_RAD);
+}
+
+static void axis_start(struct gps_kalman_axis *a, double p, double sigma) {
+    a->p = p;
+    a->v = 0;
+    a->pp = sigma * sigma;
+    a->pv = 0;
+    a->vv = UNKNOWN_VELOCITY * UNKNOWN_VELOCITY;
+}
+
+// x = F x, P = F P F' + Q with F = [1 dt; 0 1] and Q from a white noise
+// acceleration of spectral density q
+static void axis_predict(struct gps_kalman_axis *a, double dt, double q) {
+    double dt2 = dt * dt;
+
+    a->p += a->v * dt;
+    a->pp += dt * (2 * a->pv + dt * a->vv) + q * dt2 * dt / 3;
+    a->pv += dt * a->vv + q * dt2 / 2;
+    a->vv += q * dt;
+}
+
+// Measure the position: H = [1 0]
+static void axis_position(struct gps_kalman_axis *a, double z, double r) {
+    double s = a->pp + r;
+    double k0 = a->pp / s, k1 = a->pv / s;
+    double y = z - a->p;
+
+    a->p += k0 * y;
+    a->v += k1 * y;
+    a->vv -= k1 * a->pv;
+    a->pv -= k0 * a->pv;
+    a->pp -= k0 * a->pp;
+}
+
+// Measure the velocity: H = [0 1]
+static void axis_velocity(struct gps_kalman_axis *a, double z, double r) {
+    double s = a->vv + r;
+    double k0 = a->pv / s, k1 = a->vv / s;
+    double y = z - a->v;
+
+    a->p += k0 * y;
+    a->v += k1 * y;
+    a->pp -= k0 * a->pv;
+    a->pv -= k0 * a->vv;
+    a->vv -= k1 * a->vv;
+}
+
+// Speed and course as a velocity measurement; a speed of zero needs no
+// course
+static void velocity(struct gps_kalman *k, const struct gps_fix *fix) {
+    double r = k->velocity * k->velocity;
+    double speed = (double)fix->speed / GPS_FIX_MPS;
+    double course = (double)fix->course / GPS_FIX_COURSE_DEGREE * DEG_TO_RAD;
+
+    if (!(fix->fields & GPS_FIX_SPEED)) return;
+    if (!(fix->fields & GPS_FIX_COURSE)) {
+        if (fix->speed != 0) return;
+        course = 0;
+    }
+    axis_velocity(&k->axis[EAST], speed * sin(course), r);
+    axis_velocity(&k->axis[NORTH], speed * cos(course), r);
+}
+
+static void reset(struct gps_kalman *k, const struct gps_fix *fix) {
+    double vertical = k->position * GPS_KALMAN_VERTICAL;
+
+    set_origin(k, fix->latitude, fix->longitude);
+    axis_start(&k->axis[EAST], 0, k->position);
+    axis_start(&k->axis[NORTH], 0, k->position);
+    k->have_up = (fix->fields & GPS_FIX_ELEVATION) != 0;
+    axis_start(&k->axis[UP], (double)fix->elevation / GPS_FIX_METRE, vertical);
+    velocity(k, fix);
+    k->have_state = 1;
+    k->jumping = 0;
+}
+
+// Move the origin under the estimate, keeping the part below a unit
+static void recentre(struct gps_kalman *k) {
+    struct gps_kalman_axis *e = &k->axis[EAST], *n = &k->axis[NORTH];
+    int32_t dlat = (int32_t)lround(n->p / METRES_PER_UNIT);
+    int32_t dlon = (int32_t)lround(e->p / k->scale_x);
+
+    n->p -= dlat * METRES_PER_UNIT;
+    e->p -= dlon * k->scale_x;
+    e->p *= cos((double)(k->lat0 + dlat) / GPS_FIX_DEGREE * DEG_TO_RAD) /
+            cos((double)k->lat0 / GPS_FIX_DEGREE * DEG_TO_RAD);
+    set_origin(k, k->lat0 + dlat, k->lon0 + dlon);
+}
+
+static int32_t clamp(double v) {
+    if (v >= INT32_MAX) return INT32_MAX;
+    if (v <= INT32_MIN) return INT32_MIN;
+    return (int32_t)lround(v);
+}
+
+// The estimate as a fix: position, and speed and course from the velocity
+static void estimate(const struct gps_kalman *k, const struct gps_fix *fix, struct gps_fix *out) {
+    double ve = k->axis[EAST].v, vn = k->axis[NORTH].v;
+    double course = atan2(ve, vn) / DEG_TO_RAD;
+    int32_t lon = k->lon0 + clamp(k->axis[EAST].p / k->scale_x);
+
+    if (course < 0) course += 360;
+    if (lon > 180 * GPS_FIX_DEGREE) lon -= 360 * GPS_FIX_DEGREE;
+    if (lon < -180 * GPS_FIX_DEGREE) lon += 360 * GPS_FIX_DEGREE;
+
+    memset(out, 0, sizeof(*out));
+    out->fields = GPS_FIX_POSITION | GPS_FIX_SPEED | GPS_FIX_COURSE | (fix->fields & GPS_FIX_AGE);
+    out->latitude = k->lat0 + clamp(k->axis[NORTH].p / METRES_PER_UNIT);
+    out->longitude = lon;
+    out->speed = clamp(sqrt(ve * ve + vn * vn) * GPS_FIX_MPS);
+    out->course = clamp(course * GPS_FIX_COURSE_DEGREE) % (360 * GPS_FIX_COURSE_DEGREE);
+    out->age = fix->age;
+    if (k->have_up) {
+        out->fields |= GPS_FIX_ELEVATION;
+        out->elevation = clamp(k->axis[UP].p * GPS_FIX_METRE);
+    }
+}
+
+static int same_fix(const struct gps_fix *a, const struct gps_fix *b) {
+    return a->fields == b->fields && a->latitude == b->latitude &&
+           a->longitude == b->longitude && a->elevation == b->elevation &&
+           a->speed == b->speed && a->course == b->course;
+}
+
+// Take in a fix and write the smoothed one to out. Returns 0 with out
+// untouched until there has been a fix with a position.
+int gps_kalman_update(struct gps_kalman *k, const struct gps_sample *s, struct gps_fix *out) {
+    const struct gps_fix *fix = &s->fix;
+    int64_t fix_ms = s->time_ms - (fix->fields & GPS_FIX_AGE ? (int64_t)fix->age * 1000 : 0);
+    double q = k->accel * k->accel;
+    double r = k->position * k->position;
+    double rz = r * GPS_KALMAN_VERTICAL * GPS_KALMAN_VERTICAL;
+    double dt, ze, zn, ye, yn, d2;
+    int32_t dlon;
+
+    if ((fix->fields & GPS_FIX_POSITION) != GPS_FIX_POSITION) {
+        if (!k->have_state) return 0;
+        estimate(k, fix, out);
+        return 1;
+    }
+
+    if (!k->have_state) {
+        reset(k, fix);
+        k->fix_ms = fix_ms;
+        k->last = *fix;
+        k->stats.updates++;
+        estimate(k, fix, out);
+        return 1;
+    }
+
+    // Polled again before the receiver had a new fix: nothing to take in
+    if (same_fix(fix, &k->last)) {
+        k->stats.repeats++;
+        estimate(k, fix, out);
+        return 1;
+    }
+
+    // A new fix that seems no newer than the state (age is whole seconds,
+    // samples are taken late) is measured at the state's time
+    dt = fix_ms > k->fix_ms ? (fix_ms - k->fix_ms) / 1000.0 : 0;
+    if (fix_ms > k->fix_ms) k->fix_ms = fix_ms;
+    k->last = *fix;
+    k->stats.updates++;
+
+    axis_predict(&k->axis[EAST], dt, q);
+    axis_predict(&k->axis[NORTH], dt, q);
+    axis_predict(&k->axis[UP], dt, q);
+
+    // Squared distance of the position from the prediction, in standard
+    // deviations
+    dlon = fix->longitude - k->lon0;
+    if (dlon > 180 * GPS_FIX_DEGREE) dlon -= 360 * GPS_FIX_DEGREE;
+    if (dlon < -180 * GPS_FIX_DEGREE) dlon += 360 * GPS_FIX_DEGREE;
+    ze = dlon * k->scale_x;
+    zn = (double)(fix->latitude - k->lat0) * METRES_PER_UNIT;
+    ye = ze - k->axis[EAST].p;
+    yn = zn - k->axis[NORTH].p;
+    d2 = ye * ye / (k->axis[EAST].pp + r) + yn * yn / (k->axis[NORTH].pp + r);
+    if (d2 > GPS_KALMAN_GATE * GPS_KALMAN_GATE) {
+        k->stats.rejected++;
+        if (!k->jumping) {
+            k->jumping = 1;
+            k->jump_ms = fix_ms;
+        } else if (fix_ms - k->jump_ms >= GPS_KALMAN_JUMP_MS) {
+            k->stats.resets++;
+            reset(k, fix);
+            estimate(k, fix, out);
+            return 1;
+        }
+    } else {
+        k->jumping = 0;
+        axis_position(&k->axis[EAST], ze, r);
+        axis_position(&k->axis[NORTH], zn, r);
+    }
+
+    // Speed and course come from the Doppler shift, not the position, and
+    // still hold while the position jumps
+    velocity(k, fix);
+
+    if ((fix->fields & GPS_FIX_ELEVATION) && !k->jumping) {
+        double z = (double)fix->elevation / GPS_FIX_METRE;
+
+        if (!k->have_up) {
+            k->have_up = 1;
+            axis_start(&k->axis[UP], z, k->position * GPS_KALMAN_VERTICAL);
+        } else {
+            axis_position(&k->axis[UP], z, rz);
+        }
+    }
+
+    if (fabs(k->axis[EAST].p) > GPS_KALMAN_RECENTRE ||
+        fabs(k->axis[NORTH].p) > GPS_KALMAN_RECENTRE) {
+        recentre(k);
+    }
+
+    estimate(k, fix, out);
+    return 1;
+}
+
+// accel[:position[:velocity]], each one positive
+int gps_kalman_parse(const char *arg, double *accel, double *position, double *velocity) {
+    double v[3] = { GPS_KALMAN_ACCEL, GPS_KALMAN_POSITION, GPS_KALMAN_VELOCITY };
+    const char *p = arg;
+    char *end;
+
+    // every field given has to be a number up to the next colon or the end
+    for (int i = 0; i < 3; i++) {
+        v[i] = strtod(p, &end);
+        if (end == p || !isfinite(v[i]) || v[i] <= 0) return -1;
+        if (*end == '\0') break;
+        if (*end != ':' || i == 2) return -1;
+        p = end + 1;
+    }
+
+    *accel = v[0];
+    *position = v[1];
+    *velocity = v[2];
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef GPS_KALMAN_H
+#define GPS_KALMAN_H
+
+#include <stdint.h>
+
+#include "gps-track.h"
+
+// Defaults for --kalman: how hard the receiver can change its velocity
+// (m/s^2), and how noisy its reported position (m) and velocity (m/s) are.
+// Vertical position is taken to be GPS_KALMAN_VERTICAL times noisier.
+#define GPS_KALMAN_ACCEL 1.0
+#define GPS_KALMAN_POSITION 5.0
+#define GPS_KALMAN_VELOCITY 0.5
+#define GPS_KALMAN_VERTICAL 2.0
+
+// A position this many standard deviations away from the prediction is a
+// jump and is not taken in; if the positions stay off for GPS_KALMAN_JUMP_MS
+// the receiver really is somewhere else and the filter starts over there.
+#define GPS_KALMAN_GATE 5.0
+#define GPS_KALMAN_JUMP_MS 3000
+
+// The local frame is moved to the estimate once it is this far (m) from
+// its origin, so the flat-earth scale stays right on a long drive
+#define GPS_KALMAN_RECENTRE 10000.0
+
+// Position and velocity along one axis, and their covariance
+struct gps_kalman_axis {
+    double p, v;                // m, m/s
+    double pp, pv, vv;          // symmetric 2x2, m^2, m^2/s, m^2/s^2
+};
+
+// Constant-velocity Kalman filter over a stream of fixes. East, north and
+// up are filtered as three independent axes in metres around a local
+// origin, so every step is a handful of multiply-adds on 2x2 matrices,
+// written out by hand; the state is this struct alone. The time step is
+// the time of the fix, the sample time less its age, and a fix already
+// taken in (the same fix polled again) changes nothing.
+struct gps_kalman {
+    double accel;               // process noise, m/s^2
+    double position;            // measurement noise, m
+    double velocity;            // m/s
+    int have_state, have_up;
+    int64_t fix_ms;             // time of the fix the state is at
+    struct gps_fix last;        // last fix taken in
+    int32_t lat0, lon0;         // local origin, struct gps_fix units
+    double scale_x;             // metres per 1e-6 degree of longitude there
+    struct gps_kalman_axis axis[3];     // east, north, up
+    int jumping;                // the last position was rejected
+    int64_t jump_ms;            // since the fix of this time
+    struct {
+        unsigned long updates;
+        unsigned long repeats;      // fixes already taken in
+        unsigned long rejected;     // positions off by more than the gate
+        unsigned long resets;
+    } stats;
+};
+
+void gps_kalman_init(struct gps_kalman *k, double accel, double position, double velocity);
+int gps_kalman_update(struct gps_kalman *k, const struct gps_sample *s, struct gps_fix *out);
+int gps_kalman_parse(const char *arg, double *accel, double *position, double *velocity);
+
+#endif
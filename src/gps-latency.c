@@ -0,0 +1,81 @@
+#include <time.h>
+
+#include "gps-latency.h"
+
+int64_t gps_latency_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket(int64_t ns) {
+    uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+    int i = us ? 64 - __builtin_clzll(us) : 0;
+
+    return i < GPS_LATENCY_BUCKETS ? i : GPS_LATENCY_BUCKETS - 1;
+}
+
+void gps_latency_add(struct gps_latency *l, int64_t ns) {
+    if (ns < 0) ns = 0;
+
+    l->count++;
+    l->sum_ns += ns;
+    if ((uint64_t)ns > l->max_ns) l->max_ns = ns;
+    l->buckets[bucket(ns)]++;
+}
+
+// Fold src into dst, e.g. to sum up several sources
+void gps_latency_merge(struct gps_latency *dst, const struct gps_latency *src) {
+    dst->count += src->count;
+    dst->sum_ns += src->sum_ns;
+    if (src->max_ns > dst->max_ns) dst->max_ns = src->max_ns;
+    for (int i = 0; i < GPS_LATENCY_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+// Upper bound of the bucket holding quantile q, capped at the maximum seen
+int64_t gps_latency_percentile(const struct gps_latency *l, double q) {
+    uint64_t rank = q * l->count, seen = 0;
+    int64_t bound;
+
+    if (!l->count) return 0;
+    if (rank < 1) rank = 1;
+
+    for (int i = 0; i < GPS_LATENCY_BUCKETS; i++) {
+        seen += l->buckets[i];
+        if (seen >= rank) {
+            bound = (1LL << i) * 1000;
+            return i < GPS_LATENCY_BUCKETS - 1 && bound < (int64_t)l->max_ns ?
+                   bound : (int64_t)l->max_ns;
+        }
+    }
+    return l->max_ns;
+}
+
+void gps_latency_print(FILE *f, const char *name, const struct gps_latency *l) {
+    fprintf(f, "%-8s %8llu  mean %9.3f ms  p50 %9.3f  p99 %9.3f  max %9.3f\n", name,
+            (unsigned long long)l->count, l->count ? l->sum_ns / 1e6 / l->count : 0.0,
+            gps_latency_percentile(l, 0.5) / 1e6, gps_latency_percentile(l, 0.99) / 1e6,
+            l->max_ns / 1e6);
+}
+
+// A table named name: count, mean/p50/p99/max in us and the raw buckets
+void gps_latency_add_blob(struct blob_buf *b, const char *name, const struct gps_latency *l) {
+    void *table = blobmsg_open_table(b, name);
+    void *buckets;
+
+    blobmsg_add_u64(b, "count", l->count);
+    blobmsg_add_u64(b, "mean_us", l->count ? l->sum_ns / l->count / 1000 : 0);
+    blobmsg_add_u64(b, "p50_us", gps_latency_percentile(l, 0.5) / 1000);
+    blobmsg_add_u64(b, "p99_us", gps_latency_percentile(l, 0.99) / 1000);
+    blobmsg_add_u64(b, "max_us", l->max_ns / 1000);
+
+    buckets = blobmsg_open_array(b, "buckets");
+    for (int i = 0; i < GPS_LATENCY_BUCKETS; i++) {
+        blobmsg_add_u32(b, NULL, l->buckets[i]);
+    }
+    blobmsg_close_array(b, buckets);
+    blobmsg_close_table(b, table);
+}
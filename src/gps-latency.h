@@ -0,0 +1,33 @@
+#ifndef GPS_LATENCY_H
+#define GPS_LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <libubox/blobmsg.h>
+
+// Bucket 0 counts phases under 1 us, bucket i >= 1 those of [2^(i-1), 2^i)
+// us; the last one everything from about 4 s up
+#define GPS_LATENCY_BUCKETS 24
+
+// Fixed-bucket histogram of one phase's duration. Recording is a clock read
+// and a few additions, cheap enough to leave on in production.
+struct gps_latency {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint32_t buckets[GPS_LATENCY_BUCKETS];
+};
+
+int64_t gps_latency_now(void);
+void gps_latency_add(struct gps_latency *l, int64_t ns);
+void gps_latency_merge(struct gps_latency *dst, const struct gps_latency *src);
+int64_t gps_latency_percentile(const struct gps_latency *l, double q);
+void gps_latency_print(FILE *f, const char *name, const struct gps_latency *l);
+void gps_latency_add_blob(struct blob_buf *b, const char *name, const struct gps_latency *l);
+
+// Record the time since start, a gps_latency_now() value
+static inline void gps_latency_since(struct gps_latency *l, int64_t start) {
+    gps_latency_add(l, gps_latency_now() - start);
+}
+
+#endif
@@ -1,184 +1,822 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <syslog.h>
 #include <getopt.h>
 #include <libubus.h>
+#include <libubox/uloop.h>
 #include <libubox/blobmsg_json.h>
 #include <libubox/blobmsg.h>
 
-static int running = 1;
-static struct ubus_context *ctx = NULL;
-static FILE *csv_file = NULL;
-static const char *output_file = "/tmp/gps-log.csv";
+#include "gpsclient.h"
+#include "gps-adapt.h"
+#include "gps-fence.h"
+#include "gps-index.h"
+#include "gps-kalman.h"
+#include "gps-sched.h"
+#include "gps-simplify.h"
+#include "gps-track.h"
+#include "gps-trip.h"
+#include "gps-writer.h"
 
-static struct blob_buf gps_response_buf = {};
-static int gps_callback_called = 0;
-static int gps_response_status = 0;
+// How long to wait for the gps daemon to answer an info request
+#define GPS_REQUEST_TIMEOUT_MS 1000
 
-// Helper function to get GPS value as string
-static const char *get_gps_value(const char *key) {
-    struct blob_attr *attr;
-    int rem;
+// Notifications older than this no longer count as a live push feed
+#define GPS_PUSH_STALE_MS 3000
 
-    if (!gps_response_buf.head) return NULL;
+// Largest encoded sample in any format (a CSV row with smoothed columns)
+#define GPS_RECORD_MAX 192
 
-    blobmsg_for_each_attr(attr, gps_response_buf.head, rem) {
-        const char *name = blobmsg_name(attr);
-        if (name && strcmp(name, key) == 0) {
-            if (blobmsg_type(attr) == BLOBMSG_TYPE_STRING) {
-                return blobmsg_get_string(attr);
-            }
-        }
+// Most gps objects one logger watches
+#define GPS_MAX_SOURCES 64
+
+// Most fixes per source kept for the ubus history method
+#define HISTORY_MAX 16384
+
+// Most fixes in one history reply, well inside libubus' message limit at a
+// few hundred bytes each; callers page through the rest with `next`
+#define HISTORY_REPLY_MAX 256
+
+// Room for the track's name and the suffix of any file named after it
+#define SIDECAR_PATH_MAX (PATH_MAX + 16)
+
+// A rotation that failed is tried again after this long, doubling up to the
+// maximum, rather than on every sample past --rotate-size
+#define ROTATE_RETRY_MIN_S 60
+#define ROTATE_RETRY_MAX_S 3600
+
+// A fix taken while the active file couldn't be opened, with its smoothed copy
+struct held_fix {
+    struct gps_sample sample;
+    struct gps_fix smoothed;
+};
+
+// One watched gps object and the track it is logged to
+struct source {
+    struct gps_client gps;
+    char output[PATH_MAX];
+    FILE *track_file;
+    uint64_t track_slots;       // binary slots in the file, sync markers included
+    uint64_t track_fixes;       // binary fixes in the file
+    struct gps_track_delta delta;   // delta encoder, picks up the file's last block
+    struct gps_index index;     // sidecar index of the active file
+    struct gps_adapt adapt;     // sample period this source asks for with --adaptive
+    struct gps_simplify simplify;   // drops fixes on a straight line with --simplify
+    struct gps_kalman kalman;   // smooths the fixes with --kalman
+    struct gps_sample smoothed[2];  // the last two fixes smoothed, found by time
+    struct gps_fence_state fence;   // fences this receiver is in
+    struct gps_trip trip;       // odometer, kept in <output>.trip between runs
+    off_t segment_size;         // bytes in the active file, buffered ones included
+    struct gps_writer writer;
+    struct uloop_process compress_proc;
+    int rotate_pending;
+    struct gps_sample *recent;  // last history_size fixes, for the ubus object
+    uint64_t recent_seq;        // sequence number of the next fix
+    unsigned long samples;      // rows written
+    unsigned long rotations;
+    unsigned long rotate_failures;  // in a row, 0 once a rotation works
+    int64_t rotate_retry_ns;    // gps_latency_now() of the next attempt after one
+    struct uloop_timeout reopen_timer;  // opens the file again after a rotation couldn't
+    struct held_fix *held;      // fixes waiting for that, up to history_size
+    unsigned int nheld;
+    unsigned long lost;         // fixes that didn't fit in held
+    unsigned long compress_failures;
+};
+
+static struct gps_conn conn;
+static struct source *sources;
+static int nsources;
+static const char *output_file = NULL;
+static char output_path[PATH_MAX];  // output_file made absolute
+static enum gps_track_format format = GPS_TRACK_CSV;
+static unsigned int batch = 16;
+static unsigned int history_size = 256;
+static int flush_interval = 60;
+static enum gps_writer_sync sync_policy = GPS_WRITER_SYNC_NEVER;
+
+// Rotation: the active file is renamed to <output>.1 and older segments
+// shift up to <output>.<keep>; rotated segments are gzipped in the background
+static off_t rotate_size = 0;
+static int rotate_interval = 0;
+static int keep = 5;
+static struct uloop_timeout rotate_timer;
+
+// SIGUSR1 is turned into a read event on this pipe and handled in the loop
+static int flush_pipe[2] = { -1, -1 };
+static struct uloop_fd flush_fd;
+static double interval = 30;
+static int align = 0;
+static int adaptive = 0;
+// Limits and thresholds, copied to every source
+static struct gps_adapt adapt_config = {
+    .turn_rate = GPS_ADAPT_TURN_RATE,
+    .accel = GPS_ADAPT_ACCEL,
+    .spacing = GPS_ADAPT_SPACING,
+};
+static int64_t started_ns;
+
+// Trip summary printed every trip_summary seconds in the foreground
+static int trip_summary = 600;
+static struct uloop_timeout trip_timer;
+
+// --simplify: largest distance of a dropped fix from the kept track, and
+// longest time between kept fixes
+static double simplify = 0;
+static double simplify_gap = 60;
+static int poll_only = 0;
+
+// --kalman: CSV rows carry a smoothed copy of each fix
+static int kalman = 0;
+static double kalman_accel = GPS_KALMAN_ACCEL;
+static double kalman_position = GPS_KALMAN_POSITION;
+static double kalman_velocity = GPS_KALMAN_VELOCITY;
+
+static struct gps_sched sched;
+
+// The gps-logger ubus object serving recent fixes and statistics
+static struct blob_buf reply;
+static int object_registered;
+static struct ubus_object logger_object;
+
+// --geofence: enter/exit events go out as ubus gps.geofence events, to syslog,
+// to stdout in the foreground and to --fence-events
+static struct gps_fences fences;
+static struct blob_buf fence_msg;
+static FILE *fence_events;
+static int daemon_mode;
+
+// Original ubus socket handler, wrapped so socket wakeups can be counted
+static uloop_fd_handler ubus_sock_handler;
+
+// Wakeup accounting, printed on exit to verify the process idles between samples
+static struct {
+    unsigned long wakeups;      // returns from the kernel into one of our handlers
+} stats;
+
+// Phases of a sample not covered by libgpsclient or the writers: how late
+// the tick ran and encoding the record
+static struct {
+    struct gps_latency wake;
+    struct gps_latency encode;
+} latency;
+
+// Encode one fixed-size record, preceded by a sync marker at each block start
+static size_t encode_bin_record(struct source *src, uint8_t *rec,
+                                const struct gps_sample *sample) {
+    size_t len = 0;
+
+    if (src->track_slots % GPS_TRACK_BIN_BLOCK == 0) {
+        gps_track_bin_sync(rec, src->track_fixes);
+        len += GPS_TRACK_BIN_RECORD_SIZE;
+        src->track_slots++;
     }
-    return NULL;
+
+    gps_track_bin_encode(rec + len, sample);
+    len += GPS_TRACK_BIN_RECORD_SIZE;
+    src->track_slots++;
+    src->track_fixes++;
+    return len;
 }
 
-static void gps_data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
-    (void)req;
-    gps_callback_called = 1;
-    gps_response_status = type;
-
-    if (msg) {
-        blob_buf_free(&gps_response_buf);
-        blob_buf_init(&gps_response_buf, 0);
-
-        struct blob_attr *attr;
-        int rem;
-        blobmsg_for_each_attr(attr, msg, rem) {
-            const char *name = blobmsg_name(attr);
-            if (!name) continue;
-
-            enum blobmsg_type attr_type = blobmsg_type(attr);
-            if (attr_type == BLOBMSG_TYPE_STRING) {
-                blobmsg_add_string(&gps_response_buf, name, blobmsg_get_string(attr));
-            } else if (attr_type == BLOBMSG_TYPE_INT32) {
-                blobmsg_add_u32(&gps_response_buf, name, blobmsg_get_u32(attr));
-            } else if (attr_type == BLOBMSG_TYPE_INT64) {
-                blobmsg_add_u64(&gps_response_buf, name, blobmsg_get_u64(attr));
-            } else if (attr_type == BLOBMSG_TYPE_DOUBLE) {
-                blobmsg_add_double(&gps_response_buf, name, blobmsg_get_double(attr));
+static void rotate_track(struct source *src);
+
+// Follow the motion of this source; the shared timer runs at the shortest
+// period any source asks for
+static void adapt_period(struct source *src, const struct gps_sample *sample) {
+    int64_t period;
+
+    gps_adapt_update(&src->adapt, sample);
+
+    period = src->adapt.period_ns;
+    for (int i = 0; i < nsources; i++) {
+        if (sources[i].adapt.period_ns < period) period = sources[i].adapt.period_ns;
+    }
+    gps_sched_set_period(&sched, period);
+}
+
+static size_t csv_header(char *buf, size_t len) {
+    return kalman ? gps_track_csv_header_smoothed(buf, len) : gps_track_csv_header(buf, len);
+}
+
+// The smoothed copy of a fix about to be written. --simplify writes either
+// the fix just taken or the one before it, so two are enough.
+static const struct gps_fix *smoothed_fix(const struct source *src,
+                                          const struct gps_sample *sample) {
+    static const struct gps_fix none;
+
+    for (int i = 0; i < 2; i++) {
+        if (src->smoothed[i].time_ms == sample->time_ms) return &src->smoothed[i].fix;
+    }
+    return &none;
+}
+
+// Encode one fix into the track and its index, or hold it while the active
+// file is missing after a rotation
+static void write_record(struct source *src, const struct gps_sample *sample,
+                         const struct gps_fix *smoothed) {
+    uint8_t rec[GPS_RECORD_MAX];
+    uint64_t offset = src->segment_size;
+    int64_t start;
+    int can_start = 1;
+    size_t len = 0;
+
+    if (!src->track_file) {
+        if (src->held && src->nheld < history_size) {
+            src->held[src->nheld].sample = *sample;
+            src->held[src->nheld++].smoothed = *smoothed;
+        } else {
+            src->lost++;
+        }
+        return;
+    }
+
+    start = gps_latency_now();
+    switch (format) {
+        case GPS_TRACK_CSV:
+            if (kalman) {
+                len = gps_track_csv_format_smoothed((char *)rec, sizeof(rec), sample,
+                                                    smoothed);
+            } else {
+                len = gps_track_csv_format((char *)rec, sizeof(rec), sample);
             }
+            break;
+        case GPS_TRACK_BIN:
+            len = encode_bin_record(src, rec, sample);
+            can_start = len > GPS_TRACK_BIN_RECORD_SIZE;
+            break;
+        case GPS_TRACK_DELTA:
+            len = gps_track_delta_encode(&src->delta, rec, sample);
+            can_start = rec[0] == 0xff;
+            break;
+    }
+    gps_index_add(&src->index, sample, offset, can_start);
+    gps_latency_since(&latency.encode, start);
+
+    // Counted as it is buffered; write_error_cb takes a failed batch back
+    // out, this record included, since the writer holds a full batch and
+    // only flushes once this one is in
+    src->samples++;
+    src->segment_size += len;
+    gps_writer_append(&src->writer, rec, len);
+
+    if (rotate_size && src->segment_size >= rotate_size) {
+        rotate_track(src);
+    }
+}
+
+static void write_sample(struct source *src, const struct gps_sample *sample) {
+    write_record(src, sample, smoothed_fix(src, sample));
+}
+
+// The fix being checked against the fences, for the event callback
+struct fence_fix {
+    struct source *src;
+    const struct gps_sample *sample;
+};
+
+static void fence_event_cb(const struct gps_fence *f, int enter, void *priv) {
+    struct fence_fix *ff = priv;
+    const struct gps_sample *sample = ff->sample;
+    const char *event = enter ? "enter" : "exit";
+
+    if (conn.connected) {
+        blob_buf_init(&fence_msg, 0);
+        blobmsg_add_string(&fence_msg, "source", ff->src->gps.name);
+        blobmsg_add_string(&fence_msg, "fence", f->name);
+        blobmsg_add_string(&fence_msg, "event", event);
+        blobmsg_add_u64(&fence_msg, "time", sample->time_ms);
+        blobmsg_add_double(&fence_msg, "latitude", (double)sample->fix.latitude / GPS_FIX_DEGREE);
+        blobmsg_add_double(&fence_msg, "longitude", (double)sample->fix.longitude / GPS_FIX_DEGREE);
+        ubus_send_event(&conn.ctx, "gps.geofence", fence_msg.head);
+    }
+
+    syslog(LOG_NOTICE, "%s %s %s", ff->src->gps.name, enter ? "entered" : "left", f->name);
+    if (!daemon_mode) {
+        printf("%s: %s %s\n", ff->src->gps.name, enter ? "entered" : "left", f->name);
+    }
+    if (fence_events) {
+        char lat[16], lon[16];
+
+        gps_decimal_format(lat, sizeof(lat), sample->fix.latitude, GPS_FIX_DEGREE_DIGITS, 6);
+        gps_decimal_format(lon, sizeof(lon), sample->fix.longitude, GPS_FIX_DEGREE_DIGITS, 6);
+        fprintf(fence_events, "%lld,%s,%s,%s,%s,%s\n", (long long)sample->time_ms,
+                ff->src->gps.name, f->name, event, lat, lon);
+        fflush(fence_events);
+    }
+}
+
+static void log_gps_data(struct source *src) {
+    struct gps_sample sample, kept[2];
+    struct timespec now;
+    int n;
+
+    if (!src->gps.fix.fields) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    sample.time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    sample.fix = src->gps.fix;
+
+    src->recent[src->recent_seq++ % history_size] = sample;
+    gps_trip_add(&src->trip, gps_sched_now() / 1000000, &sample.fix);
+
+    if (kalman) {
+        src->smoothed[0] = src->smoothed[1];
+        src->smoothed[1].time_ms = sample.time_ms;
+        if (!gps_kalman_update(&src->kalman, &sample, &src->smoothed[1].fix)) {
+            src->smoothed[1].fix.fields = 0;
+        }
+    }
+
+    if (fences.n && (sample.fix.fields & GPS_FIX_POSITION) == GPS_FIX_POSITION) {
+        struct fence_fix ff = { src, &sample };
+
+        gps_fence_update(&fences, &src->fence, (double)sample.fix.latitude / GPS_FIX_DEGREE,
+                         (double)sample.fix.longitude / GPS_FIX_DEGREE, fence_event_cb, &ff);
+    }
+
+    // The ubus history keeps every fix, the track only those the
+    // simplification can't reconstruct
+    if (simplify) {
+        n = gps_simplify_add(&src->simplify, &sample, kept);
+        for (int i = 0; i < n; i++) {
+            write_sample(src, &kept[i]);
         }
     } else {
-        blob_buf_free(&gps_response_buf);
-        memset(&gps_response_buf, 0, sizeof(gps_response_buf));
+        write_sample(src, &sample);
     }
+
+    if (adaptive) adapt_period(src, &sample);
 }
 
-static int fetch_gps_data(void) {
-    uint32_t id;
-    int ret;
+// An info request finished: log the reply, or report why there is none
+static void gps_complete_cb(struct gps_client *cl, int ret) {
+    struct source *src = container_of(cl, struct source, gps);
 
-    if (!ctx) {
-        fprintf(stderr, "UBus context not available\n");
-        return -1;
+    if (ret == UBUS_STATUS_TIMEOUT) {
+        stats.wakeups++;
+        fprintf(stderr, "%s: Timeout waiting for GPS response\n", cl->name);
+        return;
     }
 
-    ret = ubus_lookup_id(ctx, "gps", &id);
-    if (ret != 0) {
-        fprintf(stderr, "GPS service not found\n");
-        return -1;
+    // Log whatever arrived, even if the status wasn't OK
+    if (cl->fix.fields) {
+        log_gps_data(src);
     }
+}
 
-    gps_callback_called = 0;
-    gps_response_status = 0;
-    blob_buf_free(&gps_response_buf);
-    memset(&gps_response_buf, 0, sizeof(gps_response_buf));
-    ret = ubus_invoke(ctx, id, "info", NULL, gps_data_cb, NULL, 1000);
+// Start an asynchronous info request; the reply is logged from gps_complete_cb
+static int fetch_gps_data(struct source *src) {
+    const char *name = src->gps.name;
+    int ret;
 
-    if (ret != 0) {
-        fprintf(stderr, "Failed to call GPS info (error: %d)\n", ret);
+    // The object id is cached; it is only resolved again after the object or
+    // ubusd went away
+    ret = gps_client_fetch_async(&src->gps, GPS_REQUEST_TIMEOUT_MS);
+    if (ret == UBUS_STATUS_CONNECTION_FAILED) {
+        fprintf(stderr, "UBus not connected, retrying\n");
+        return -1;
+    } else if (ret == UBUS_STATUS_NOT_FOUND) {
+        fprintf(stderr, "%s: GPS service not found\n", name);
+        return -1;
+    } else if (ret != 0) {
+        fprintf(stderr, "%s: Failed to call GPS info (error: %d)\n", name, ret);
         return -1;
     }
 
-    // Process ubus events to ensure callback is executed
-    fd_set fds;
-    struct timeval tv;
-    int sock = ctx->sock.fd;
-    int timeout_ms = 1000;
+    return 0;
+}
+
+// Fan out to every source at once; each reply is logged as it arrives, so a
+// tick takes as long as the slowest object rather than the sum of all
+static void sample_cb(struct gps_sched *s) {
+    stats.wakeups++;
+    gps_latency_add(&latency.wake, gps_sched_lateness(s));
+
+    for (int i = 0; i < nsources; i++) {
+        struct source *src = &sources[i];
 
-    while (!gps_callback_called && timeout_ms > 0) {
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000;
+        // Never stack requests if the daemon is slower than the interval
+        if (src->gps.req_pending) {
+            continue;
+        }
+
+        // With a live push feed the latest fix is already in gps.fix
+        if (gps_client_push_live(&src->gps, GPS_PUSH_STALE_MS)) {
+            log_gps_data(src);
+            continue;
+        }
 
-        int ready = select(sock + 1, &fds, NULL, NULL, &tv);
-        if (ready > 0 && FD_ISSET(sock, &fds)) {
-            ubus_handle_event(ctx);
-        } else if (ready < 0) {
+        // Without ubusd every request would fail the same way
+        if (fetch_gps_data(src) != 0 && !conn.connected) {
             break;
         }
-        timeout_ms -= 10;
     }
+}
 
-    if (gps_callback_called) {
-        for (int i = 0; i < 10; i++) {
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = 0;
-            tv.tv_usec = 10000;
+// Phases timed along the sample path, in order
+enum {
+    PHASE_WAKE,         // tick lateness against its deadline
+    PHASE_LOOKUP,       // object id lookup
+    PHASE_REQUEST,      // info request, send to reply
+    PHASE_DECODE,       // reply or notification to struct gps_fix
+    PHASE_ENCODE,       // fix to CSV row or binary record
+    PHASE_WRITE,        // write() of a batch
+    PHASE_SYNC,         // fdatasync()
+    __PHASE_MAX
+};
 
-            int ready = select(sock + 1, &fds, NULL, NULL, &tv);
-            if (ready > 0 && FD_ISSET(sock, &fds)) {
-                ubus_handle_event(ctx);
-            } else {
-                break;
-            }
+static const char *const phase_names[__PHASE_MAX] = {
+    "wake", "lookup", "request", "decode", "encode", "write", "sync",
+};
+
+static void ubus_sock_cb(struct uloop_fd *u, unsigned int events) {
+    stats.wakeups++;
+    ubus_sock_handler(u, events);
+}
+
+// Every phase of the sample path, the writers' summed over all sources
+static void collect_latency(struct gps_latency *phases) {
+    memset(phases, 0, __PHASE_MAX * sizeof(*phases));
+    phases[PHASE_WAKE] = latency.wake;
+    phases[PHASE_LOOKUP] = conn.latency.lookup;
+    phases[PHASE_REQUEST] = conn.latency.request;
+    phases[PHASE_DECODE] = conn.latency.decode;
+    phases[PHASE_ENCODE] = latency.encode;
+    for (int i = 0; i < nsources; i++) {
+        gps_latency_merge(&phases[PHASE_WRITE], &sources[i].writer.write_latency);
+        gps_latency_merge(&phases[PHASE_SYNC], &sources[i].writer.sync_latency);
+    }
+}
+
+static void print_latency(FILE *f) {
+    struct gps_latency phases[__PHASE_MAX];
+
+    collect_latency(phases);
+    for (int i = 0; i < __PHASE_MAX; i++) {
+        gps_latency_print(f, phase_names[i], &phases[i]);
+    }
+}
+
+// SIGUSR1 arrived: write out whatever is buffered and dump the phase timings
+static void flush_fd_cb(struct uloop_fd *u, unsigned int events) {
+    char drain[16];
+
+    (void)events;
+    stats.wakeups++;
+    while (read(u->fd, drain, sizeof(drain)) > 0);
+
+    for (int i = 0; i < nsources; i++) {
+        gps_writer_flush(&sources[i].writer);
+    }
+    print_latency(stderr);
+}
+
+static void format_trip(char *buf, size_t len, const struct source *src) {
+    const struct gps_trip *t = &src->trip;
+
+    snprintf(buf, len, "Trip: %.2f km, moving %.0f min, stopped %.0f min, avg %.1f km/h, "
+             "max %.1f km/h, climb %.0f m, descent %.0f m",
+             t->distance / 1e6, t->moving_ms / 60000.0, t->stopped_ms / 60000.0,
+             gps_trip_average_speed(t) * 0.0036, t->max_speed * 0.0036,
+             t->climb / 100.0, t->descent / 100.0);
+}
+
+static void print_trip(FILE *f, const struct source *src) {
+    char line[256];
+
+    format_trip(line, sizeof(line), src);
+    fprintf(f, "%s\n", line);
+}
+
+// The trip totals of every source, to stdout or, detached, to syslog
+static void report_trips(void) {
+    char line[256];
+
+    for (int i = 0; i < nsources; i++) {
+        format_trip(line, sizeof(line), &sources[i]);
+        if (daemon_mode) {
+            syslog(LOG_INFO, "%s %s", sources[i].gps.name, line);
+        } else if (nsources > 1) {
+            printf("%s %s\n", sources[i].gps.name, line);
+        } else {
+            printf("%s\n", line);
         }
     }
+    if (!daemon_mode) fflush(stdout);
+}
 
-    return gps_callback_called ? 0 : -1;
+static void trip_timer_cb(struct uloop_timeout *t) {
+    stats.wakeups++;
+    report_trips();
+    uloop_timeout_set(t, trip_summary * 1000);
 }
 
-static void log_gps_data(void) {
-    if (!csv_file) return;
+static void print_source_stats(const struct source *src) {
+    const struct gps_writer *w = &src->writer;
 
-    if (fetch_gps_data() != 0) {
-        return;
+    printf("Samples: %lu, timeouts: %lu\n", src->samples, src->gps.stats.timeouts);
+    print_trip(stdout, src);
+    if (adaptive) {
+        double hours = (gps_sched_now() - started_ns) / 3.6e12;
+
+        printf("Adaptive: %.1f samples per hour (mean interval %.1f s), now every %.1f s; "
+               "%lu at the minimum for a manoeuvre, %lu backing off while parked\n",
+               hours > 0 ? src->samples / hours : 0.0,
+               src->samples ? hours * 3600 / src->samples : 0.0,
+               src->adapt.period_ns / 1e9, src->adapt.stats.manoeuvres, src->adapt.stats.parked);
+    }
+    printf("Requests: %lu, notifications: %lu, lookups: %lu\n",
+           src->gps.stats.requests, src->gps.stats.notifications, src->gps.stats.lookups);
+    if (fences.n) {
+        printf("Geofence: %lu enters, %lu exits, %.1f fences tested per fix\n",
+               src->fence.stats.enters, src->fence.stats.exits,
+               src->fence.stats.fixes ? (double)src->fence.stats.candidates / src->fence.stats.fixes : 0.0);
     }
+    if (simplify) {
+        printf("Simplified: %lu of %lu fixes kept (%.1f%%, %.1fx fewer) within %g m\n",
+               src->simplify.stats.out, src->simplify.stats.in,
+               src->simplify.stats.in ? 100.0 * src->simplify.stats.out / src->simplify.stats.in : 0.0,
+               src->simplify.stats.out ? (double)src->simplify.stats.in / src->simplify.stats.out : 0.0,
+               simplify);
+    }
+    if (kalman) {
+        printf("Kalman: %lu fixes taken in, %lu repeated, %lu jumps rejected, %lu restarts\n",
+               src->kalman.stats.updates, src->kalman.stats.repeats,
+               src->kalman.stats.rejected, src->kalman.stats.resets);
+    }
+    printf("Rotations: %lu, failed in a row: %lu, compression failures: %lu, "
+           "fixes lost without a file: %lu\n",
+           src->rotations, src->rotate_failures, src->compress_failures, src->lost);
+    printf("Writes: %lu (%.1f bytes per write), syncs: %lu, %.1f syscalls per hour\n",
+           w->stats.writes, w->stats.writes ? (double)w->stats.bytes / w->stats.writes : 0.0,
+           w->stats.syncs, gps_writer_syscalls_per_hour(w));
+}
 
-    if (!gps_response_buf.head) {
-        return;
+static void print_stats(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    for (int i = 0; i < nsources; i++) {
+        if (nsources > 1) {
+            printf("%s -> %s\n", sources[i].gps.name, sources[i].output);
+        }
+        print_source_stats(&sources[i]);
     }
+    printf("Reconnects: %lu\n", conn.reconnects);
+    printf("Wakeups: %lu over %lu intervals (%.2f per interval)\n",
+           stats.wakeups, sched.stats.ticks,
+           sched.stats.ticks ? (double)stats.wakeups / sched.stats.ticks : 0.0);
+    printf("Ticks: %lu late (>%lld ms), %lu missed, lateness mean %.3f ms, max %.3f ms\n",
+           sched.stats.late, GPS_SCHED_LATE_NS / 1000000, sched.stats.missed,
+           sched.stats.ticks ? (double)sched.stats.sum_late_ns / sched.stats.ticks / 1e6 : 0.0,
+           sched.stats.max_late_ns / 1e6);
+    print_latency(stdout);
+    printf("CPU time: %ld.%03lds user, %ld.%03lds system, %ld voluntary context switches\n",
+           (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+           (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000,
+           ru.ru_nvcsw);
+}
 
-    // Get current timestamp
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestamp[64];
-    snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d %02d:%02d:%02d",
-           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-           t->tm_hour, t->tm_min, t->tm_sec);
-
-    // Extract GPS values
-    const char *lat_str = get_gps_value("latitude");
-    const char *lon_str = get_gps_value("longitude");
-    const char *speed_str = get_gps_value("speed");
-    const char *elevation_str = get_gps_value("elevation");
-    const char *course_str = get_gps_value("course");
-    const char *age_str = get_gps_value("age");
-
-    // Write to CSV: timestamp,latitude,longitude,speed,elevation,course,age
-    fprintf(csv_file, "%s,%s,%s,%s,%s,%s,%s\n",
-            timestamp,
-            lat_str ? lat_str : "",
-            lon_str ? lon_str : "",
-            speed_str ? speed_str : "",
-            elevation_str ? elevation_str : "",
-            course_str ? course_str : "",
-            age_str ? age_str : "");
-
-    fflush(csv_file);
+// history: the last fixes from the in-memory ring, without touching the file
+enum {
+    HISTORY_SOURCE,
+    HISTORY_COUNT,
+    HISTORY_SINCE,
+    __HISTORY_MAX
+};
+
+static const struct blobmsg_policy history_policy[__HISTORY_MAX] = {
+    [HISTORY_SOURCE] = { .name = "source", .type = BLOBMSG_TYPE_STRING },
+    [HISTORY_COUNT]  = { .name = "count",  .type = BLOBMSG_TYPE_UNSPEC },
+    [HISTORY_SINCE]  = { .name = "since",  .type = BLOBMSG_TYPE_UNSPEC },
+};
+
+// ubus call passes small JSON numbers as int32 and large ones as int64
+static int attr_to_u64(struct blob_attr *attr, uint64_t *val) {
+    if (!attr) return 0;
+
+    switch (blobmsg_type(attr)) {
+        case BLOBMSG_TYPE_INT64:
+            *val = blobmsg_get_u64(attr);
+            return 1;
+        case BLOBMSG_TYPE_INT32:
+            *val = (int32_t)blobmsg_get_u32(attr) < 0 ? 0 : blobmsg_get_u32(attr);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static struct source *find_source(struct blob_attr *name) {
+    if (!name) return &sources[0];
+
+    for (int i = 0; i < nsources; i++) {
+        if (strcmp(sources[i].gps.name, blobmsg_get_string(name)) == 0) {
+            return &sources[i];
+        }
+    }
+    return NULL;
+}
+
+// Fixes newer than `since` (default: the oldest kept), at most `count`
+// (default: all kept); without `since` the newest `count`. A reply carries
+// at most HISTORY_REPLY_MAX of them, and `next` in it is the `since` for
+// the following call.
+static int logger_history(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg) {
+    struct blob_attr *tb[__HISTORY_MAX];
+    struct source *src;
+    uint64_t count = history_size, first, oldest, seq;
+    void *fixes, *entry;
+
+    (void)obj;
+    (void)method;
+    blobmsg_parse(history_policy, __HISTORY_MAX, tb, blob_data(msg), blob_len(msg));
+
+    src = find_source(tb[HISTORY_SOURCE]);
+    if (!src) return UBUS_STATUS_NOT_FOUND;
+
+    attr_to_u64(tb[HISTORY_COUNT], &count);
+    if (count > history_size) count = history_size;
+
+    oldest = src->recent_seq > history_size ? src->recent_seq - history_size : 0;
+    if (attr_to_u64(tb[HISTORY_SINCE], &first)) {
+        if (first < oldest) first = oldest;
+        if (first > src->recent_seq) first = src->recent_seq;
+    } else {
+        first = src->recent_seq < oldest + count ? oldest : src->recent_seq - count;
+    }
+    if (count > HISTORY_REPLY_MAX) count = HISTORY_REPLY_MAX;
+
+    blob_buf_init(&reply, 0);
+    blobmsg_add_string(&reply, "source", src->gps.name);
+    fixes = blobmsg_open_array(&reply, "fixes");
+    for (seq = first; seq < src->recent_seq && seq - first < count; seq++) {
+        const struct gps_sample *sample = &src->recent[seq % history_size];
+
+        entry = blobmsg_open_table(&reply, NULL);
+        blobmsg_add_u64(&reply, "seq", seq);
+        blobmsg_add_u64(&reply, "time", sample->time_ms);
+        gps_fix_add_blob(&reply, &sample->fix);
+        blobmsg_close_table(&reply, entry);
+    }
+    blobmsg_close_array(&reply, fixes);
+    blobmsg_add_u64(&reply, "next", seq);
+
+    if (ubus_send_reply(ctx, req, reply.head) != 0) return UBUS_STATUS_UNKNOWN_ERROR;
+    return UBUS_STATUS_OK;
 }
 
+static int logger_stats(struct ubus_context *ctx, struct ubus_object *obj,
+                        struct ubus_request_data *req, const char *method,
+                        struct blob_attr *msg) {
+    void *table, *entry, *trip;
+
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    blob_buf_init(&reply, 0);
+    blobmsg_add_u64(&reply, "wakeups", stats.wakeups);
+    blobmsg_add_u64(&reply, "ticks", sched.stats.ticks);
+    blobmsg_add_u64(&reply, "late", sched.stats.late);
+    blobmsg_add_u64(&reply, "missed", sched.stats.missed);
+    blobmsg_add_u64(&reply, "reconnects", conn.reconnects);
+
+    table = blobmsg_open_table(&reply, "sources");
+    for (int i = 0; i < nsources; i++) {
+        const struct source *src = &sources[i];
+
+        entry = blobmsg_open_table(&reply, src->gps.name);
+        blobmsg_add_string(&reply, "output", src->output);
+        blobmsg_add_u64(&reply, "samples", src->samples);
+        if (simplify) {
+            blobmsg_add_u64(&reply, "fixes", src->simplify.stats.in);
+        }
+        trip = blobmsg_open_table(&reply, "trip");
+        blobmsg_add_double(&reply, "distance", src->trip.distance / 1000.0);
+        blobmsg_add_double(&reply, "moving", src->trip.moving_ms / 1000.0);
+        blobmsg_add_double(&reply, "stopped", src->trip.stopped_ms / 1000.0);
+        blobmsg_add_double(&reply, "avg_speed", gps_trip_average_speed(&src->trip) / 1000.0);
+        blobmsg_add_double(&reply, "max_speed", src->trip.max_speed / 1000.0);
+        blobmsg_add_double(&reply, "climb", src->trip.climb / 100.0);
+        blobmsg_add_double(&reply, "descent", src->trip.descent / 100.0);
+        blobmsg_close_table(&reply, trip);
+        if (fences.n) {
+            blobmsg_add_u64(&reply, "fence_enters", src->fence.stats.enters);
+            blobmsg_add_u64(&reply, "fence_exits", src->fence.stats.exits);
+        }
+        if (kalman) {
+            blobmsg_add_u64(&reply, "kalman_rejected", src->kalman.stats.rejected);
+            blobmsg_add_u64(&reply, "kalman_resets", src->kalman.stats.resets);
+        }
+        if (adaptive) {
+            blobmsg_add_u32(&reply, "interval_ms", src->adapt.period_ns / 1000000);
+            blobmsg_add_u64(&reply, "manoeuvres", src->adapt.stats.manoeuvres);
+            blobmsg_add_u64(&reply, "parked", src->adapt.stats.parked);
+        }
+        blobmsg_add_u64(&reply, "next", src->recent_seq);
+        blobmsg_add_u64(&reply, "timeouts", src->gps.stats.timeouts);
+        blobmsg_add_u64(&reply, "requests", src->gps.stats.requests);
+        blobmsg_add_u64(&reply, "notifications", src->gps.stats.notifications);
+        blobmsg_add_u64(&reply, "rotations", src->rotations);
+        blobmsg_add_u64(&reply, "writes", src->writer.stats.writes);
+        blobmsg_add_u64(&reply, "bytes", src->writer.stats.bytes);
+        blobmsg_add_u64(&reply, "syncs", src->writer.stats.syncs);
+        blobmsg_add_u64(&reply, "buffered", src->writer.len);
+        blobmsg_close_table(&reply, entry);
+    }
+    blobmsg_close_table(&reply, table);
+
+    if (ubus_send_reply(ctx, req, reply.head) != 0) return UBUS_STATUS_UNKNOWN_ERROR;
+    return UBUS_STATUS_OK;
+}
+
+// Same as SIGUSR1; replies with the number of bytes written out
+static int logger_flush(struct ubus_context *ctx, struct ubus_object *obj,
+                        struct ubus_request_data *req, const char *method,
+                        struct blob_attr *msg) {
+    uint64_t before = 0, after = 0;
+
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    for (int i = 0; i < nsources; i++) {
+        before += sources[i].writer.stats.bytes;
+        gps_writer_flush(&sources[i].writer);
+        after += sources[i].writer.stats.bytes;
+    }
+
+    blob_buf_init(&reply, 0);
+    blobmsg_add_u64(&reply, "written", after - before);
+    if (ubus_send_reply(ctx, req, reply.head) != 0) return UBUS_STATUS_UNKNOWN_ERROR;
+    return UBUS_STATUS_OK;
+}
+
+static int logger_latency(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg) {
+    struct gps_latency phases[__PHASE_MAX];
+
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    collect_latency(phases);
+    blob_buf_init(&reply, 0);
+    for (int i = 0; i < __PHASE_MAX; i++) {
+        gps_latency_add_blob(&reply, phase_names[i], &phases[i]);
+    }
+    if (ubus_send_reply(ctx, req, reply.head) != 0) return UBUS_STATUS_UNKNOWN_ERROR;
+    return UBUS_STATUS_OK;
+}
+
+static const struct ubus_method logger_methods[] = {
+    UBUS_METHOD("history", logger_history, history_policy),
+    UBUS_METHOD_NOARG("stats", logger_stats),
+    UBUS_METHOD_NOARG("flush", logger_flush),
+    UBUS_METHOD_NOARG("latency", logger_latency),
+};
+
+static struct ubus_object_type logger_object_type =
+    UBUS_OBJECT_TYPE("gps-logger", logger_methods);
+
+// libubus registers the object again by itself after a reconnect
+static struct ubus_object logger_object = {
+    .name = "gps-logger",
+    .type = &logger_object_type,
+    .methods = logger_methods,
+    .n_methods = ARRAY_SIZE(logger_methods),
+};
+
 static void signal_handler(int sig) {
     (void)sig;
-    running = 0;
+    uloop_end();
+}
+
+static void flush_signal_handler(int sig) {
+    int saved_errno = errno;
+
+    (void)sig;
+    if (write(flush_pipe[1], "", 1) < 0) {
+        // Pipe already full: a flush is pending anyway
+    }
+    errno = saved_errno;
 }
 
 static void daemonize(void) {
@@ -212,50 +850,768 @@ static void daemonize(void) {
     close(STDERR_FILENO);
 }
 
+static int index_name(const struct source *src, char *buf, size_t len) {
+    int ret = snprintf(buf, len, "%s%s", src->output, GPS_INDEX_SUFFIX);
+
+    return ret >= 0 && (size_t)ret < len ? 0 : -1;
+}
+
+static int trip_name(const struct source *src, char *buf, size_t len) {
+    int ret = snprintf(buf, len, "%s.trip", src->output);
+
+    return ret >= 0 && (size_t)ret < len ? 0 : -1;
+}
+
+// Offset of the last sync marker in [from, to) of the track, -1 if none
+static off_t last_sync(FILE *f, off_t from, off_t to) {
+    static uint8_t buf[4096];
+    off_t found = -1;
+    size_t len;
+
+    // Chunks overlap by a marker less one byte, so none is missed at a seam
+    while (to - from >= 8) {
+        len = to - from < (off_t)sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        if (fseeko(f, from, SEEK_SET) != 0 || fread(buf, 1, len, f) != len) break;
+        for (size_t i = 0; i + 8 <= len; i++) {
+            if (buf[i] == 0xff && memcmp(buf + i, GPS_TRACK_SYNC_MAGIC, 8) == 0) {
+                found = from + i;
+            }
+        }
+        from += len - 7;
+    }
+    return found;
+}
+
+// Decode the last delta block so new fixes continue it, and cut off a record
+// torn by a crash. Returns the length of the valid data, which is never
+// shorter than the data up to the start of that block.
+static off_t recover_delta(struct source *src, off_t size) {
+    static uint8_t buf[32768];
+    char path[SIDECAR_PATH_MAX];
+    struct gps_sample sample;
+    off_t block, base;
+    size_t len = 0, pos = 0, want;
+    int ret;
+
+    // Blocks are far smaller than the tail searched first. One that isn't
+    // is damaged, and its start is looked for past what the index covers,
+    // or through the whole track without one.
+    block = last_sync(src->track_file, size - (off_t)sizeof(buf) > GPS_TRACK_HEADER_SIZE ?
+                      size - (off_t)sizeof(buf) : GPS_TRACK_HEADER_SIZE, size);
+    if (block < 0) {
+        block = last_sync(src->track_file, index_name(src, path, sizeof(path)) != 0 ?
+                          GPS_TRACK_HEADER_SIZE : gps_index_covered(path, GPS_TRACK_DELTA,
+                                                                    GPS_TRACK_HEADER_SIZE, size),
+                          size);
+    }
+
+    // Without a block to continue the next fix starts one, after whatever
+    // is there
+    gps_track_delta_reset(&src->delta);
+    if (block < 0) return size;
+
+    base = block;
+    for (;;) {
+        if (len - pos < GPS_TRACK_DELTA_MAX && base + (off_t)len < size) {
+            memmove(buf, buf + pos, len - pos);
+            base += pos;
+            len -= pos;
+            pos = 0;
+            want = sizeof(buf) - len;
+            if (size - base - (off_t)len < (off_t)want) want = size - base - len;
+            if (fseeko(src->track_file, base + len, SEEK_SET) != 0 ||
+                fread(buf + len, 1, want, src->track_file) != want) {
+                gps_track_delta_reset(&src->delta);
+                return size;
+            }
+            len += want;
+        }
+
+        ret = gps_track_delta_decode(&src->delta, buf + pos, len - pos, &sample);
+        if (ret <= 0) break;
+        pos += ret;
+    }
+
+    return base + pos;
+}
+
+// Open the sidecar index, catching up with fixes it doesn't cover yet
+static int open_index(struct source *src, off_t data_start) {
+    char path[SIDECAR_PATH_MAX];
+
+    if (index_name(src, path, sizeof(path)) != 0) {
+        fprintf(stderr, "Index file name too long for %s\n", src->output);
+        return -1;
+    }
+    if (gps_index_open(&src->index, path, format, fileno(src->track_file),
+                       data_start, src->segment_size) != 0) {
+        fprintf(stderr, "Failed to open index file: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Open the output for appending and write the format header if it is new.
+// A binary file cut short by a crash is trimmed back to its last whole record.
+static int open_track(struct source *src) {
+    uint8_t header[GPS_TRACK_HEADER_SIZE];
+    char line[256], expected[256];
+    FILE *track_file;
+    struct stat st;
+    off_t torn;
+
+    track_file = src->track_file = fopen(src->output, "a+");
+    if (!track_file || fstat(fileno(track_file), &st) != 0) {
+        fprintf(stderr, "Failed to open output file: %s\n", src->output);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        if (format == GPS_TRACK_CSV) {
+            st.st_size = csv_header(line, sizeof(line));
+            fputs(line, track_file);
+        } else {
+            gps_track_header(header, format);
+            fwrite(header, sizeof(header), 1, track_file);
+            st.st_size = GPS_TRACK_HEADER_SIZE;
+        }
+        fflush(track_file);
+    }
+
+    src->segment_size = st.st_size;
+    if (format == GPS_TRACK_CSV) {
+        // Rows with and without smoothed columns don't mix in one file
+        csv_header(expected, sizeof(expected));
+        rewind(track_file);
+        if (!fgets(line, sizeof(line), track_file) || strcmp(line, expected) != 0) {
+            fprintf(stderr, kalman ? "%s has no smoothed columns, use another file for --kalman\n" :
+                                     "%s has smoothed columns, log to it with --kalman\n",
+                    src->output);
+            return -1;
+        }
+        return open_index(src, strlen(line));
+    }
+
+    rewind(track_file);
+    if (fread(header, sizeof(header), 1, track_file) != 1 ||
+        gps_track_header_parse(header) != (int)format) {
+        fprintf(stderr, "%s is not a %s track file\n", src->output,
+                gps_track_format_name(format));
+        return -1;
+    }
+
+    if (format == GPS_TRACK_DELTA) {
+        torn = st.st_size - recover_delta(src, st.st_size);
+    } else {
+        torn = (st.st_size - GPS_TRACK_HEADER_SIZE) % GPS_TRACK_BIN_RECORD_SIZE;
+    }
+    if (torn != 0) {
+        fprintf(stderr, "Dropping %ld bytes of a torn record at the end of %s\n",
+                (long)torn, src->output);
+        st.st_size -= torn;
+        if (ftruncate(fileno(track_file), st.st_size) != 0) {
+            fprintf(stderr, "Failed to truncate %s\n", src->output);
+            return -1;
+        }
+    }
+
+    src->segment_size = st.st_size;
+    src->track_slots = (st.st_size - GPS_TRACK_HEADER_SIZE) / GPS_TRACK_BIN_RECORD_SIZE;
+    src->track_fixes = gps_track_bin_count(st.st_size);
+    return open_index(src, GPS_TRACK_HEADER_SIZE);
+}
+
+// A batch failed to write and the writer cut the file back to the data
+// before it; forget the fixes it held. The delta encoder starts a block of
+// its own with the next fix, and the index drops the blocks that are gone.
+static void write_error_cb(struct gps_writer *w) {
+    struct source *src = container_of(w, struct source, writer);
+    char line[256];
+    off_t data_start = GPS_TRACK_HEADER_SIZE;
+
+    src->samples -= w->pending;
+    src->segment_size = w->committed;
+    if (format == GPS_TRACK_CSV) {
+        data_start = csv_header(line, sizeof(line));
+    } else {
+        src->track_slots = (w->committed - GPS_TRACK_HEADER_SIZE) / GPS_TRACK_BIN_RECORD_SIZE;
+        src->track_fixes = gps_track_bin_count(w->committed);
+    }
+    gps_track_delta_reset(&src->delta);
+
+    gps_index_close(&src->index);
+    open_index(src, data_start);
+}
+
+// Returns -1 if the name doesn't fit, so no other file is renamed or
+// unlinked in its place
+static int segment_name(const struct source *src, char *buf, size_t len, int n,
+                        const char *suffix) {
+    int ret = snprintf(buf, len, "%s.%d%s", src->output, n, suffix);
+
+    return ret >= 0 && (size_t)ret < len ? 0 : -1;
+}
+
+static void compress_done_cb(struct uloop_process *p, int ret) {
+    struct source *src = container_of(p, struct source, compress_proc);
+
+    stats.wakeups++;
+
+    if (!WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+        fprintf(stderr, "Failed to compress rotated segment (status %d)\n", ret);
+        src->compress_failures++;
+    }
+
+    if (src->rotate_pending) {
+        src->rotate_pending = 0;
+        rotate_track(src);
+    }
+}
+
+// gzip a rotated segment in a niced child so sampling never waits on it
+static void compress_segment(struct source *src, const char *path) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "Fork failed, leaving %s uncompressed\n", path);
+        return;
+    }
+
+    if (pid == 0) {
+        setpriority(PRIO_PROCESS, 0, 19);
+        execlp("gzip", "gzip", "-f", path, (char *)NULL);
+        _exit(127);
+    }
+
+    src->compress_proc.pid = pid;
+    src->compress_proc.cb = compress_done_cb;
+    uloop_process_add(&src->compress_proc);
+}
+
+// Log the first of a run of failures only, and put off the next attempt
+static void rotate_failed(struct source *src, const char *why) {
+    int64_t delay = ROTATE_RETRY_MIN_S;
+
+    for (unsigned long i = 0; i < src->rotate_failures && delay < ROTATE_RETRY_MAX_S; i++) {
+        delay *= 2;
+    }
+    if (delay > ROTATE_RETRY_MAX_S) delay = ROTATE_RETRY_MAX_S;
+
+    if (src->rotate_failures++ == 0) {
+        fprintf(stderr, "Failed to rotate %s: %s; retrying after %d s, backing off to %d s\n",
+                src->output, why, ROTATE_RETRY_MIN_S, ROTATE_RETRY_MAX_S);
+    }
+    src->rotate_retry_ns = gps_latency_now() + delay * 1000000000LL;
+}
+
+// Start the new segment after a rotation. If it can't be opened, fixes are
+// held (as many as the history keeps) and the open is retried on the
+// rotation backoff, rather than giving up on logging altogether.
+static int reopen_track(struct source *src) {
+    unsigned int n = src->nheld;
+
+    if (open_track(src) != 0) {
+        if (src->track_file) fclose(src->track_file);
+        src->track_file = NULL;
+        if (!src->held) src->held = calloc(history_size, sizeof(*src->held));
+        rotate_failed(src, "can't open the new segment");
+        uloop_timeout_set(&src->reopen_timer,
+                          (src->rotate_retry_ns - gps_latency_now()) / 1000000);
+        return -1;
+    }
+
+    gps_writer_set_fd(&src->writer, fileno(src->track_file));
+    if (src->rotate_failures) {
+        fprintf(stderr, "Opened %s after %lu failed attempts, %u fixes held, %lu lost\n",
+                src->output, src->rotate_failures, n, src->lost);
+        src->rotate_failures = 0;
+    }
+
+    // A rotation while writing them out may hold the rest again
+    src->nheld = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        struct held_fix h = src->held[i];
+
+        write_record(src, &h.sample, &h.smoothed);
+    }
+    return 0;
+}
+
+static void reopen_timer_cb(struct uloop_timeout *t) {
+    struct source *src = container_of(t, struct source, reopen_timer);
+
+    stats.wakeups++;
+    reopen_track(src);
+}
+
+// Move the active file aside and start a new segment with its own header
+static void rotate_track(struct source *src) {
+    static const char *suffixes[] = { "", ".gz" };
+    char from[SIDECAR_PATH_MAX], to[SIDECAR_PATH_MAX];
+
+    // Nothing to rotate until reopen_track gets a file again
+    if (!src->track_file) return;
+
+    // gzip works on <output>.1 by name; shifting it now would race with it
+    if (src->compress_proc.pending) {
+        src->rotate_pending = 1;
+        return;
+    }
+
+    if (src->rotate_failures && gps_latency_now() < src->rotate_retry_ns) return;
+
+    // The longest name of all; the ones below fit if it does
+    if (segment_name(src, to, sizeof(to), keep > 1 ? keep : 1, ".gz") != 0) {
+        rotate_failed(src, "segment name too long");
+        return;
+    }
+
+    gps_writer_flush(&src->writer);
+
+    // Drop the oldest segment and shift the others up by one
+    for (int i = keep; i >= 1; i--) {
+        for (size_t j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+            segment_name(src, from, sizeof(from), i, suffixes[j]);
+            if (i == keep) {
+                unlink(from);
+            } else {
+                segment_name(src, to, sizeof(to), i + 1, suffixes[j]);
+                rename(from, to);
+            }
+        }
+    }
+
+    segment_name(src, to, sizeof(to), 1, "");
+    if (rename(src->output, to) != 0) {
+        rotate_failed(src, strerror(errno));
+        return;
+    }
+    if (src->rotate_failures) {
+        fprintf(stderr, "Rotated %s after %lu failed attempts\n", src->output,
+                src->rotate_failures);
+        src->rotate_failures = 0;
+    }
+
+    // Rotated segments get compressed, so only the active file is indexed
+    gps_index_close(&src->index);
+    if (index_name(src, from, sizeof(from)) == 0) unlink(from);
+
+    fclose(src->track_file);
+    src->track_file = NULL;
+    src->rotations++;
+    compress_segment(src, to);
+    reopen_track(src);
+}
+
+// Rotate at every multiple of rotate_interval since the epoch
+static void rotate_timer_cb(struct uloop_timeout *t) {
+    time_t now = time(NULL);
+
+    if (t) {
+        stats.wakeups++;
+        for (int i = 0; i < nsources; i++) {
+            rotate_track(&sources[i]);
+        }
+    }
+    uloop_timeout_set(&rotate_timer,
+                      ((now / rotate_interval + 1) * rotate_interval - now) * 1000);
+}
+
+// Convert a bin or delta track to CSV on stdout
+static int export_track(const char *to, const char *path) {
+    static struct gps_track_reader reader;
+    struct gps_sample sample;
+    char line[160];
+    FILE *f;
+
+    if (strcmp(to, "csv") != 0) {
+        fprintf(stderr, "Unsupported export format: %s\n", to);
+        return 1;
+    }
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open track file: %s\n", path);
+        return 1;
+    }
+
+    if (gps_track_reader_open(&reader, f) != 0 || reader.format == GPS_TRACK_CSV) {
+        fprintf(stderr, "%s is not a bin or delta track file\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    gps_track_csv_header(line, sizeof(line));
+    fputs(line, stdout);
+
+    while (gps_track_reader_next(&reader, &sample)) {
+        gps_track_csv_format(line, sizeof(line), &sample);
+        fputs(line, stdout);
+    }
+
+    if (reader.resyncs) {
+        fprintf(stderr, "Skipped damaged data %lu time(s), resynchronising at the next block\n",
+                reader.resyncs);
+    }
+    if (reader.torn) {
+        fprintf(stderr, "Ignoring a torn record at the end of the track\n");
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void query_cb(const struct gps_sample *s, void *priv) {
+    char line[160];
+    (void)priv;
+
+    gps_track_csv_format(line, sizeof(line), s);
+    fputs(line, stdout);
+}
+
+// Print the fixes of a track within a time range and area as CSV
+static int query_track(const char *path, const struct gps_query *q) {
+    struct gps_query_stats st;
+    char line[80];
+
+    gps_track_csv_header(line, sizeof(line));
+    fputs(line, stdout);
+
+    if (gps_query_run(path, q, query_cb, NULL, &st) != 0) {
+        fprintf(stderr, "Failed to read track file: %s\n", path);
+        return 1;
+    }
+
+    if (!st.indexed) {
+        fprintf(stderr, "No index for %s, scanned the whole track\n", path);
+    }
+    fprintf(stderr, "%llu matches, %llu of %llu blocks scanned (%llu bytes, %llu fixes)\n",
+            (unsigned long long)st.matches, (unsigned long long)st.blocks,
+            (unsigned long long)st.entries + 1, (unsigned long long)st.bytes,
+            (unsigned long long)st.fixes);
+    return 0;
+}
+
+// With several sources each gets its own file: the object name goes in
+// front of the extension, /tmp/gps-log.csv becoming /tmp/gps-log-gps2.csv
+static int source_output(struct source *src, const char *name) {
+    const char *slash = strrchr(output_file, '/');
+    const char *dot = strrchr(output_file, '.');
+    int len;
+
+    if (nsources == 1) {
+        len = snprintf(src->output, sizeof(src->output), "%s", output_file);
+    } else {
+        if (!dot || (slash && dot < slash)) dot = output_file + strlen(output_file);
+        len = snprintf(src->output, sizeof(src->output), "%.*s-%s%s",
+                       (int)(dot - output_file), output_file, name, dot);
+    }
+    return len < (int)sizeof(src->output) ? 0 : -1;
+}
+
+// Split a comma separated list of object names in place
+static int parse_sources(char *list, const char **names) {
+    int n = 0;
+
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if (n == GPS_MAX_SOURCES) return -1;
+        names[n++] = name;
+    }
+    return n;
+}
+
+// Byte count with an optional k, M or G suffix
+static off_t parse_size(const char *arg) {
+    char *end;
+    long long size = strtoll(arg, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+    return *end ? -1 : size;
+}
+
+// min:max in seconds, fractions allowed
+static int parse_adaptive(const char *arg, struct gps_adapt *a) {
+    double min, max;
+    char end;
+
+    if (sscanf(arg, "%lf:%lf%c", &min, &max, &end) != 2 || min < 0.01 || max < min) {
+        return -1;
+    }
+
+    a->min_ns = (int64_t)(min * 1e9);
+    a->max_ns = (int64_t)(max * 1e9);
+    a->period_ns = a->min_ns;
+    return 0;
+}
+
+// metres[:seconds], the gap keeping its default when left out
+static int parse_simplify(const char *arg, double *tolerance, double *gap) {
+    double m, s = *gap;
+    char end;
+
+    if (sscanf(arg, "%lf:%lf%c", &m, &s, &end) != 2 && sscanf(arg, "%lf%c", &m, &end) != 1) {
+        return -1;
+    }
+    if (m <= 0 || s < 0) return -1;
+
+    *tolerance = m;
+    *gap = s;
+    return 0;
+}
+
 static void print_usage(const char *prog_name) {
-    printf("GPS Logger - Log GPS coordinates to CSV file\n\n");
-    printf("Usage: %s [OPTIONS]\n\n", prog_name);
+    printf("GPS Logger - Log GPS coordinates to a CSV or binary track file\n\n");
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("       %s --export csv <file>\n", prog_name);
+    printf("       %s --query [--from T] [--to T] [--bbox lat,lon,lat,lon] <file>\n\n", prog_name);
     printf("Options:\n");
-    printf("  -i, --interval <seconds>  Logging interval in seconds (default: 30)\n");
-    printf("  -o, --output <file>       Output CSV file path (default: /tmp/gps-log.csv)\n");
+    printf("  -i, --interval <seconds>  Logging interval in seconds, fractions allowed (default: 30)\n");
+    printf("  -a, --align               Align samples to multiples of the interval in wall-clock time\n");
+    printf("  -A, --adaptive <min:max>  Vary the interval with the motion, between min and max seconds\n");
+    printf("  -M, --adapt-thresholds <turn:accel:spacing>\n");
+    printf("                            Turn rate (deg/s) and acceleration (m/s^2) that drop to min,\n");
+    printf("                            metres between samples when cruising (default: %g:%g:%g)\n",
+           GPS_ADAPT_TURN_RATE, GPS_ADAPT_ACCEL, GPS_ADAPT_SPACING);
+    printf("  -s, --sources <a,b,...>   Gps ubus objects to log (default: gps)\n");
+    printf("  -e, --simplify <m[:s]>    Leave out fixes within m metres of the line between the kept\n");
+    printf("                            ones, keeping one at least every s seconds (default: 60)\n");
+    printf("  -K, --kalman <a[:p[:v]]>  Add smoothed copies of the fixes to each CSV row; a is how hard\n");
+    printf("                            the receiver accelerates (m/s^2), p and v the noise of its\n");
+    printf("                            position (m) and speed (m/s) (default: %g:%g:%g)\n",
+           GPS_KALMAN_ACCEL, GPS_KALMAN_POSITION, GPS_KALMAN_VELOCITY);
+    printf("  -G, --geofence <file>     Report entering and leaving the circles and polygons in file\n");
+    printf("  -E, --fence-events <file> Append geofence events to file as CSV\n");
+    printf("  -o, --output <file>       Output file path (default: /tmp/gps-log.csv or .bin);\n");
+    printf("                            with several sources, one file per object: gps-log-<name>.csv\n");
+    printf("  -f, --format <fmt>        Output format: csv, bin or delta (default: csv)\n");
+    printf("  -x, --export <csv>        Convert a bin or delta track file to CSV on stdout\n");
+    printf("  -q, --query               Print the fixes of a track file matching the options below\n");
+    printf("  -F, --from <time>         Query start, local \"YYYY-MM-DD HH:MM[:SS[.mmm]]\" or Unix seconds\n");
+    printf("  -T, --to <time>           Query end, inclusive\n");
+    printf("  -B, --bbox <lat,lon,lat,lon>  Query area, two opposite corners\n");
     printf("  -d, --daemon              Run as daemon in background\n");
+    printf("  -b, --batch <records>     Records to collect before writing (default: 16)\n");
+    printf("  -t, --flush-interval <s>  Longest a record stays buffered (default: 60)\n");
+    printf("  -S, --sync <policy>       fdatasync: never, batch or every (default: never)\n");
+    printf("  -r, --rotate-size <size>  Rotate the file at this size (k/M suffix allowed)\n");
+    printf("  -R, --rotate-interval <s> Rotate every s seconds, on multiples of s since the epoch\n");
+    printf("  -k, --keep <n>            Rotated segments to keep (default: 5)\n");
+    printf("  -P, --trip-summary <s>    Print the trip totals every s seconds (syslog with -d), 0 for never (default: 600)\n");
+    printf("  -H, --history <n>         Fixes per source kept in memory for ubus, up to 16384 (default: 256)\n");
+    printf("  -p, --poll                Always poll, never subscribe to notifications\n");
     printf("  -h, --help                Show this help message\n\n");
     printf("Examples:\n");
     printf("  %s                        Log every 30s to /tmp/gps-log.csv\n", prog_name);
     printf("  %s -i 60 -o /tmp/gps.csv  Log every 60s to /tmp/gps.csv\n", prog_name);
-    printf("  %s -d -i 10               Run as daemon, log every 10s\n\n", prog_name);
+    printf("  %s -d -i 10               Run as daemon, log every 10s\n", prog_name);
+    printf("  %s -f bin -i 1            Log every second to /tmp/gps-log.bin\n", prog_name);
+    printf("  %s -f delta -e 5          Log every second, leaving out fixes on straight lines\n", prog_name);
+    printf("  %s -A 1:300               Log every second when turning, every 5 min when parked\n", prog_name);
+    printf("  %s -s gps,gps2 -i 1       Log two receivers to /tmp/gps-log-gps.csv and -gps2.csv\n", prog_name);
+    printf("  %s -x csv /tmp/gps-log.bin  Print a binary track as CSV\n", prog_name);
+    printf("  %s -q -F '2024-05-01 14:00' -T '2024-05-01 14:30' /tmp/gps-log.csv\n\n", prog_name);
     printf("CSV Format:\n");
-    printf("  timestamp,latitude,longitude,speed,elevation,course,age\n");
+    printf("  timestamp,latitude,longitude,speed,elevation,course,age\n\n");
+    printf("Send SIGUSR1 to write out buffered records immediately and print phase timings.\n");
+    printf("Recent fixes and statistics: ubus call gps-logger history|stats|flush|latency\n");
+    printf("Geofence events: ubus listen gps.geofence\n");
 }
 
 int main(int argc, char **argv) {
-    int interval = 30;
-    int daemon_mode = 0;
+    const char *names[GPS_MAX_SOURCES] = { "gps" };
+    const char *export_to = NULL;
+    struct gps_query query = { .from_ms = INT64_MIN, .to_ms = INT64_MAX };
+    const char *fence_file = NULL, *fence_events_file = NULL;
+    char path[SIDECAR_PATH_MAX];
+    char end;
+    int query_mode = 0;
     int opt;
 
     static struct option long_options[] = {
         {"interval", required_argument, 0, 'i'},
+        {"align",    no_argument,       0, 'a'},
+        {"adaptive", required_argument, 0, 'A'},
+        {"adapt-thresholds", required_argument, 0, 'M'},
+        {"sources",  required_argument, 0, 's'},
+        {"simplify", required_argument, 0, 'e'},
+        {"kalman",   required_argument, 0, 'K'},
+        {"geofence", required_argument, 0, 'G'},
+        {"fence-events", required_argument, 0, 'E'},
         {"output",   required_argument, 0, 'o'},
+        {"format",   required_argument, 0, 'f'},
+        {"export",   required_argument, 0, 'x'},
+        {"query",    no_argument,       0, 'q'},
+        {"from",     required_argument, 0, 'F'},
+        {"to",       required_argument, 0, 'T'},
+        {"bbox",     required_argument, 0, 'B'},
+        {"batch",    required_argument, 0, 'b'},
+        {"flush-interval", required_argument, 0, 't'},
+        {"sync",     required_argument, 0, 'S'},
+        {"rotate-size", required_argument, 0, 'r'},
+        {"rotate-interval", required_argument, 0, 'R'},
+        {"keep",     required_argument, 0, 'k'},
+        {"history",  required_argument, 0, 'H'},
+        {"trip-summary", required_argument, 0, 'P'},
         {"daemon",   no_argument,       0, 'd'},
+        {"poll",     no_argument,       0, 'p'},
         {"help",     no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "i:o:dh", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:aA:M:s:e:K:G:E:o:f:x:qF:T:B:b:t:S:r:R:k:H:P:dph", long_options, NULL)) != -1) {
         switch (opt) {
             case 'i':
-                interval = atoi(optarg);
-                if (interval <= 0) {
+                interval = atof(optarg);
+                if (interval < 0.01) {
                     fprintf(stderr, "Invalid interval: %s\n", optarg);
                     return 1;
                 }
                 break;
+            case 'a':
+                align = 1;
+                break;
+            case 'A':
+                if (parse_adaptive(optarg, &adapt_config) != 0) {
+                    fprintf(stderr, "Invalid adaptive range: %s\n", optarg);
+                    return 1;
+                }
+                adaptive = 1;
+                break;
+            case 'M':
+                if (sscanf(optarg, "%lf:%lf:%lf%c", &adapt_config.turn_rate,
+                           &adapt_config.accel, &adapt_config.spacing, &end) != 3 ||
+                    adapt_config.turn_rate <= 0 || adapt_config.accel <= 0 ||
+                    adapt_config.spacing <= 0) {
+                    fprintf(stderr, "Invalid adaptive thresholds: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                nsources = parse_sources(optarg, names);
+                if (nsources <= 0) {
+                    fprintf(stderr, "Invalid source list: %s (at most %d objects)\n",
+                            optarg, GPS_MAX_SOURCES);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (parse_simplify(optarg, &simplify, &simplify_gap) != 0) {
+                    fprintf(stderr, "Invalid simplification: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'K':
+                if (gps_kalman_parse(optarg, &kalman_accel, &kalman_position,
+                                     &kalman_velocity) != 0) {
+                    fprintf(stderr, "Invalid Kalman filter noise: %s\n", optarg);
+                    return 1;
+                }
+                kalman = 1;
+                break;
+            case 'G':
+                fence_file = optarg;
+                break;
+            case 'E':
+                fence_events_file = optarg;
+                break;
             case 'o':
                 output_file = optarg;
                 break;
+            case 'f':
+                if (gps_track_format_parse(optarg, &format) != 0) {
+                    fprintf(stderr, "Invalid format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'x':
+                export_to = optarg;
+                break;
+            case 'q':
+                query_mode = 1;
+                break;
+            case 'F':
+                if (gps_query_parse_time(optarg, &query.from_ms) != 0) {
+                    fprintf(stderr, "Invalid time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'T':
+                if (gps_query_parse_time(optarg, &query.to_ms) != 0) {
+                    fprintf(stderr, "Invalid time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                if (gps_query_parse_bbox(optarg, &query) != 0) {
+                    fprintf(stderr, "Invalid bounding box: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                if (batch <= 0) {
+                    fprintf(stderr, "Invalid batch size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                flush_interval = atoi(optarg);
+                if (flush_interval < 0) {
+                    fprintf(stderr, "Invalid flush interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                if (gps_writer_sync_parse(optarg, &sync_policy) != 0) {
+                    fprintf(stderr, "Invalid sync policy: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                rotate_size = parse_size(optarg);
+                if (rotate_size <= 0) {
+                    fprintf(stderr, "Invalid rotate size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                rotate_interval = atoi(optarg);
+                if (rotate_interval <= 0) {
+                    fprintf(stderr, "Invalid rotate interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                keep = atoi(optarg);
+                if (keep <= 0) {
+                    fprintf(stderr, "Invalid segment count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                history_size = atoi(optarg);
+                if ((int)history_size <= 0 || history_size > HISTORY_MAX) {
+                    fprintf(stderr, "Invalid history size (1-%d): %s\n", HISTORY_MAX, optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                trip_summary = atoi(optarg);
+                if (trip_summary < 0) {
+                    fprintf(stderr, "Invalid trip summary interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
             case 'd':
                 daemon_mode = 1;
                 break;
+            case 'p':
+                poll_only = 1;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -265,64 +1621,263 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (export_to) {
+        if (optind >= argc) {
+            fprintf(stderr, "--export needs a track file\n");
+            return 1;
+        }
+        return export_track(export_to, argv[optind]);
+    }
+
+    if (query_mode) {
+        if (optind >= argc) {
+            fprintf(stderr, "--query needs a track file\n");
+            return 1;
+        }
+        return query_track(argv[optind], &query);
+    }
+
+    if (adaptive && align) {
+        fprintf(stderr, "--align and --adaptive can't be combined\n");
+        return 1;
+    }
+
+    if (kalman && format != GPS_TRACK_CSV) {
+        fprintf(stderr, "--kalman needs the csv format\n");
+        return 1;
+    }
+
+    if (!output_file) {
+        output_file = format == GPS_TRACK_BIN ? "/tmp/gps-log.bin" :
+                      format == GPS_TRACK_DELTA ? "/tmp/gps-log.dlt" : "/tmp/gps-log.csv";
+    }
+
+    // The daemon runs in /, and every file beside the track (segments,
+    // index, trip state) is named after it
+    if (output_file[0] != '/') {
+        if (!getcwd(output_path, sizeof(output_path)) ||
+            strlen(output_path) + 1 + strlen(output_file) >= sizeof(output_path)) {
+            fprintf(stderr, "Failed to resolve output path: %s\n", output_file);
+            return 1;
+        }
+        strcat(output_path, "/");
+        strcat(output_path, output_file);
+        output_file = output_path;
+    }
+
+    // Fences are loaded and indexed once, before any fix arrives
+    gps_fences_init(&fences);
+    if (fence_file && gps_fences_load(&fences, fence_file) != 0) {
+        return 1;
+    }
+    if (fence_events_file) {
+        fence_events = fopen(fence_events_file, "a");
+        if (!fence_events) {
+            fprintf(stderr, "Failed to open fence event file: %s\n", fence_events_file);
+            return 1;
+        }
+    }
+
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    if (pipe(flush_pipe) != 0) {
+        fprintf(stderr, "Failed to create signal pipe\n");
+        return 1;
+    }
+    fcntl(flush_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(flush_pipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGUSR1, flush_signal_handler);
 
     // Connect to ubus
-    ctx = ubus_connect(NULL);
-    if (!ctx) {
+    if (gps_conn_init(&conn, NULL) != 0) {
         fprintf(stderr, "Failed to connect to ubus\n");
         return 1;
     }
 
-    // Open CSV file
-    int file_exists = (access(output_file, F_OK) == 0);
-    csv_file = fopen(output_file, "a");
-    if (!csv_file) {
-        fprintf(stderr, "Failed to open output file: %s\n", output_file);
-        ubus_free(ctx);
+    if (nsources == 0) nsources = 1;
+    sources = calloc(nsources, sizeof(*sources));
+    if (!sources) {
+        fprintf(stderr, "Out of memory\n");
+        gps_conn_free(&conn);
         return 1;
     }
 
-    // Write CSV header if file is new
-    if (!file_exists) {
-        fprintf(csv_file, "timestamp,latitude,longitude,speed,elevation,course,age\n");
-        fflush(csv_file);
+    // One client, track file and write buffer per source
+    for (int i = 0; i < nsources; i++) {
+        struct source *src = &sources[i];
+
+        gps_client_init(&src->gps, &conn, names[i]);
+        src->gps.complete_cb = gps_complete_cb;
+        src->index.fd = -1;
+        src->reopen_timer.cb = reopen_timer_cb;
+        src->adapt = adapt_config;
+        gps_simplify_init(&src->simplify, simplify, (int64_t)(simplify_gap * 1000));
+        gps_kalman_init(&src->kalman, kalman_accel, kalman_position, kalman_velocity);
+
+        src->recent = calloc(history_size, sizeof(*src->recent));
+        if (!src->recent || gps_fence_state_init(&src->fence, &fences) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        if (source_output(src, names[i]) != 0) {
+            fprintf(stderr, "Output path too long for %s\n", names[i]);
+            return 1;
+        }
+
+        // The trip carries on from the last clean exit
+        if (trip_name(src, path, sizeof(path)) != 0) {
+            fprintf(stderr, "Trip state file name too long for %s\n", src->output);
+            return 1;
+        }
+        if (gps_trip_load(&src->trip, path) != 0) {
+            fprintf(stderr, "Ignoring unreadable trip state %s\n", path);
+        }
+        if (open_track(src) != 0 ||
+            gps_writer_init(&src->writer, fileno(src->track_file), batch * GPS_RECORD_MAX,
+                            batch, flush_interval * 1000, sync_policy) != 0) {
+            if (src->track_file) fclose(src->track_file);
+            gps_conn_free(&conn);
+            return 1;
+        }
+        src->writer.error_cb = write_error_cb;
     }
 
+    // Fence events, and trip summaries when detached, go to syslog
+    openlog("gps-logger", LOG_PID, LOG_DAEMON);
+
     if (daemon_mode) {
         daemonize();
     } else {
         printf("GPS Logger started\n");
-        printf("Logging to: %s\n", output_file);
-        printf("Interval: %d seconds\n", interval);
+        for (int i = 0; i < nsources; i++) {
+            printf("Logging %s to: %s (%s)\n", sources[i].gps.name, sources[i].output,
+                   gps_track_format_name(format));
+        }
+        if (adaptive) {
+            printf("Interval: adaptive, %g to %g seconds\n",
+                   adapt_config.min_ns / 1e9, adapt_config.max_ns / 1e9);
+        } else {
+            printf("Interval: %g seconds%s\n", interval, align ? ", aligned" : "");
+        }
+        if (fences.n) {
+            printf("Geofence: %u fences from %s, %ux%u grid\n",
+                   fences.n, fence_file, fences.rows, fences.cols);
+        }
+        if (simplify) {
+            printf("Simplify: within %g m, a fix at least every %g seconds\n",
+                   simplify, simplify_gap);
+        }
+        if (kalman) {
+            printf("Kalman: %g m/s^2 acceleration, %g m position and %g m/s speed noise\n",
+                   kalman_accel, kalman_position, kalman_velocity);
+        }
+        printf("Writes: every %u records or %d seconds, sync %s\n",
+               batch, flush_interval, gps_writer_sync_name(sync_policy));
         printf("Press Ctrl+C to stop\n\n");
     }
 
-    // Main logging loop
-    while (running) {
-        log_gps_data();
+    // Main loop: sleep in the kernel until the next sample or ubus reply
+    uloop_init();
+    gps_conn_add_uloop(&conn);
+    ubus_sock_handler = conn.ctx.sock.cb;
+    conn.ctx.sock.cb = ubus_sock_cb;
+
+    trip_timer.cb = trip_timer_cb;
+    if (trip_summary) {
+        uloop_timeout_set(&trip_timer, trip_summary * 1000);
+    }
+
+    rotate_timer.cb = rotate_timer_cb;
+    if (rotate_interval) {
+        rotate_timer_cb(NULL);
+    }
+
+    // A second logger can't take the name; it still logs, just without it
+    if (ubus_add_object(&conn.ctx, &logger_object) == 0) {
+        object_registered = 1;
+    } else {
+        fprintf(stderr, "Failed to register the gps-logger ubus object\n");
+    }
 
-        // Sleep for the specified interval, checking for signals periodically
-        for (int i = 0; i < interval && running; i++) {
-            sleep(1);
+    flush_fd.fd = flush_pipe[0];
+    flush_fd.cb = flush_fd_cb;
+    uloop_fd_add(&flush_fd, ULOOP_READ);
+
+    for (int i = 0; i < nsources && !poll_only; i++) {
+        if (gps_client_subscribe(&sources[i].gps) != 0) {
+            fprintf(stderr, "Failed to register subscriber for %s, polling only\n",
+                    sources[i].gps.name);
         }
     }
 
-    // Cleanup
-    if (csv_file) {
-        fclose(csv_file);
+    sched.cb = sample_cb;
+    started_ns = gps_sched_now();
+    if (adaptive) interval = adapt_config.min_ns / 1e9;
+    if (gps_sched_start(&sched, (int64_t)(interval * 1e9), align) == 0) {
+        uloop_run();
+    } else {
+        fprintf(stderr, "Failed to start the sampling timer\n");
     }
 
-    if (ctx) {
-        blob_buf_free(&gps_response_buf);
-        ubus_free(ctx);
+    // Cleanup: nothing buffered is lost on SIGINT/SIGTERM
+    for (int i = 0; i < nsources; i++) {
+        struct gps_sample last;
+
+        if (simplify && gps_simplify_flush(&sources[i].simplify, &last)) {
+            write_sample(&sources[i], &last);
+        }
+        uloop_timeout_cancel(&sources[i].reopen_timer);
+        if (!sources[i].track_file && reopen_track(&sources[i]) != 0) {
+            sources[i].lost += sources[i].nheld;
+            uloop_timeout_cancel(&sources[i].reopen_timer);
+        }
+        gps_writer_flush(&sources[i].writer);
+        gps_writer_free(&sources[i].writer);
+    }
+    uloop_timeout_cancel(&rotate_timer);
+    uloop_timeout_cancel(&trip_timer);
+    gps_sched_stop(&sched);
+    for (int i = 0; i < nsources; i++) {
+        gps_client_free(&sources[i].gps);
     }
+    uloop_fd_delete(&flush_fd);
+    if (object_registered && conn.connected) {
+        ubus_remove_object(&conn.ctx, &logger_object);
+    }
+    uloop_done();
+    blob_buf_free(&reply);
+    blob_buf_free(&fence_msg);
+
+    for (int i = 0; i < nsources; i++) {
+        if (sources[i].track_file) {
+            fclose(sources[i].track_file);
+        }
+        gps_index_close(&sources[i].index);
+        gps_fence_state_free(&sources[i].fence);
+        if (trip_name(&sources[i], path, sizeof(path)) != 0 ||
+            gps_trip_save(&sources[i].trip, path) != 0) {
+            fprintf(stderr, "Failed to save trip state %s\n", path);
+        }
+        free(sources[i].recent);
+        free(sources[i].held);
+    }
+    close(flush_pipe[0]);
+    close(flush_pipe[1]);
+
+    gps_conn_free(&conn);
 
     if (!daemon_mode) {
         printf("\nGPS Logger stopped\n");
+        print_stats();
+    } else {
+        report_trips();
     }
+    closelog();
+    free(sources);
+    if (fence_events) fclose(fence_events);
+    gps_fences_free(&fences);
 
     return 0;
 }
\ No newline at end of file
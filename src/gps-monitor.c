@@ -1,41 +1,100 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <ncurses.h>
 #include <libubus.h>
+#include <libubox/uloop.h>
 #include <libubox/blobmsg_json.h>
 #include <libubox/blobmsg.h>
 
-static int running = 1;
-static struct ubus_context *ctx = NULL;
+#include "gpsclient.h"
+#include "gps-history.h"
+#include "gps-kalman.h"
+#include "gps-trip.h"
 
-void signal_handler(int sig);
+// Notifications older than this no longer count as a live push feed
+#define GPS_PUSH_STALE_MS 3000
 
-static struct blob_buf gps_response_buf = {};
-static int gps_callback_called = 0;
-static int gps_response_status = 0;
+// How long to wait for the gps daemon to answer an info request
+#define GPS_REQUEST_TIMEOUT_MS 1000
 
-// Helper function to get GPS value as string
-static const char *get_gps_value(const char *key) {
-    struct blob_attr *attr;
-    int rem;
-    
-    if (!gps_response_buf.head) return NULL;
-    
-    blobmsg_for_each_attr(attr, gps_response_buf.head, rem) {
-        const char *name = blobmsg_name(attr);
-        if (name && strcmp(name, key) == 0) {
-            if (blobmsg_type(attr) == BLOBMSG_TYPE_STRING) {
-                return blobmsg_get_string(attr);
-            }
-        }
-    }
-    return NULL;
-}
+// Most gps objects one monitor watches
+#define GPS_MAX_SOURCES 64
+
+static struct gps_conn conn;
+
+// One sample per second of the last few minutes, for the History box
+#define HISTORY_COLUMNS 56      // sparkline width, a full box row
+static struct gps_history history;
+static int history_minutes = 5;
+static int unicode = 0;
+
+static const char *const spark_ascii[] = { ".", ":", "-", "=", "+", "*", "#", "@" };
+static const char *const spark_unicode[] = {
+    "\u2581", "\u2582", "\u2583", "\u2584", "\u2585", "\u2586", "\u2587", "\u2588"
+};
+#define SPARK_LEVELS 8
+
+// One uloop watches stdin, the ubus socket and the timers below; the
+// screen is redrawn when something changed, at most fps times a second
+static int fps = 10;
+static struct uloop_fd stdin_fd;
+static struct uloop_timeout poll_timer;
+static struct uloop_timeout frame_timer;
+static struct uloop_timeout clock_timer;
+static int64_t last_frame_ms;
+
+// SIGWINCH and SIGUSR1 are turned into read events on this pipe, one byte
+// with the signal number each
+static int signal_pipe[2] = { -1, -1 };
+static struct uloop_fd signal_fd;
+
+// Terminal output accounting, only with -D
+static int debug = 0;
+static int io_fd = -1;
+static unsigned long long term_bytes;
+static unsigned long frames;
+
+// Output rate over the last whole second, shown in the status bar with -D
+static struct {
+    time_t second;
+    unsigned long long bytes;   // term_bytes at the start of the second
+    unsigned long frames;       // frames at the start of the second
+    char text[48];
+} rate;
+
+// Phases of getting a fix on screen. The first three are timed by
+// libgpsclient on the connection.
+enum {
+    PHASE_LOOKUP,       // object id lookup
+    PHASE_REQUEST,      // info request, send to reply
+    PHASE_DECODE,       // reply or notification to struct gps_fix
+    PHASE_RENDER,       // formatting the frame into curses' virtual screen
+    PHASE_REFRESH,      // doupdate(): diffing and writing to the terminal
+    __PHASE_MAX
+};
+
+static const char *const phase_names[__PHASE_MAX] = {
+    "lookup", "request", "decode", "render", "refresh",
+};
+
+static struct {
+    struct gps_latency render;
+    struct gps_latency refresh;
+} latency;
+
+// With -D the timings are shown above the status bar, one row per phase
+#define OVERLAY_ROWS (debug ? __PHASE_MAX : 0)
+
+void signal_handler(int sig);
 
 // Helper function to draw a centered box
 // Returns the x position where the box starts
@@ -87,332 +146,1061 @@ static void draw_centered_box_content(int y, int start_x, int box_width, const c
     attroff(COLOR_PAIR(color_pair));
 }
 
-static void gps_data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
-    (void)req;
-    gps_callback_called = 1;
-    gps_response_status = type;
-    
-    // Process message if it exists, regardless of type (some responses may still contain data)
-    if (msg) {
-        // Copy the response into our buffer so it persists
-        blob_buf_free(&gps_response_buf);
-        blob_buf_init(&gps_response_buf, 0);
-        
-        // Copy all attributes from the message
-        struct blob_attr *attr;
-        int rem;
-        blobmsg_for_each_attr(attr, msg, rem) {
-            const char *name = blobmsg_name(attr);
-            if (!name) continue;
-            
-            enum blobmsg_type attr_type = blobmsg_type(attr);
-            if (attr_type == BLOBMSG_TYPE_STRING) {
-                blobmsg_add_string(&gps_response_buf, name, blobmsg_get_string(attr));
-            } else if (attr_type == BLOBMSG_TYPE_INT32) {
-                blobmsg_add_u32(&gps_response_buf, name, blobmsg_get_u32(attr));
-            } else if (attr_type == BLOBMSG_TYPE_INT64) {
-                blobmsg_add_u64(&gps_response_buf, name, blobmsg_get_u64(attr));
-            } else if (attr_type == BLOBMSG_TYPE_DOUBLE) {
-                blobmsg_add_double(&gps_response_buf, name, blobmsg_get_double(attr));
-            }
-        }
-    } else {
-        blob_buf_free(&gps_response_buf);
-        memset(&gps_response_buf, 0, sizeof(gps_response_buf));
-    }
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void display_gps_data(void) {
-    uint32_t id;
-    int ret;
-    const char *lat_str, *lon_str, *speed_str, *elevation_str, *course_str, *age_str;
-    double lat, lon, speed_ms, speed_knots, elevation, course;
+// Bytes written by this process so far, from the wchar line of /proc/self/io
+static unsigned long long written_bytes(void) {
+    char buf[256], *p;
+    ssize_t len;
+
+    if (io_fd < 0) return 0;
+
+    len = pread(io_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+
+    p = strstr(buf, "wchar:");
+    return p ? strtoull(p + 6, NULL, 10) : 0;
+}
+
+// Fields that change from frame to frame. Their positions are fixed by
+// layout_screen(); each frame only rewrites a field whose text changed.
+enum {
+    FIELD_MESSAGE,
+    FIELD_LATITUDE,
+    FIELD_LONGITUDE,
+    FIELD_SPEED,
+    FIELD_COURSE,
+    FIELD_ELEVATION,
+    FIELD_AGE,
+    FIELD_HISTORY_SPEED,
+    FIELD_HISTORY_SPEED_LINE,
+    FIELD_HISTORY_ELEVATION,
+    FIELD_HISTORY_ELEVATION_LINE,
+    FIELD_HISTORY_AGE,
+    FIELD_TRIP_DISTANCE,
+    FIELD_TRIP_TIME,
+    FIELD_TRIP_SPEED,
+    FIELD_TRIP_CLIMB,
+    FIELD_TIME,
+    FIELD_STATUS,
+    FIELD_LATENCY,      // __PHASE_MAX rows of the -D overlay
+    FIELD_LATENCY_LAST = FIELD_LATENCY + __PHASE_MAX - 1,
+    __FIELD_MAX
+};
+
+struct field {
+    int y, x;
+    int width;          // 0 when the field is not on screen
+    attr_t attr;
+    char text[128];     // what is on screen now
+};
+
+// What the screen shows; a change in any of these means a new layout
+enum view {
+    VIEW_NONE,
+    VIEW_MESSAGE,       // one line at the top: ubus or gps service trouble
+    VIEW_TIMEOUT,
+    VIEW_FIX,
+    VIEW_ERROR,         // reply without data
+    VIEW_GRID,          // one card per source
+};
+
+static struct field fields[__FIELD_MAX];
+
+// With several sources each gets a card in a grid: a state line, position,
+// navigation and elevation/age
+#define CARD_LINES 4
+#define CARD_WIDTH 38
+
+// One watched gps object and what the screen shows for it, updated as
+// replies and notifications arrive
+struct source {
+    struct gps_client gps;
+    struct gps_fix fix;
+    int fix_ret;                // result of the last info request
+    int fix_status;             // status the gps service replied with
+    struct gps_trip trip;
+    char trip_path[PATH_MAX];   // where the trip is kept between runs
+    struct gps_kalman kalman;   // --kalman
+    struct gps_fix smoothed;    // no fields until a fix with a position
+    struct field card[CARD_LINES];
+};
+
+// Trip state files are <prefix>-<object>.trip
+static const char *trip_prefix = "/tmp/gps-monitor";
+
+// --kalman: the single-source view shows each fix smoothed next to it
+static int kalman = 0;
+static double kalman_accel = GPS_KALMAN_ACCEL;
+static double kalman_position = GPS_KALMAN_POSITION;
+static double kalman_velocity = GPS_KALMAN_VELOCITY;
+
+static struct source *sources;
+static int nsources;
+static int cards_shown;
+
+static struct {
     int maxy, maxx;
-    
-    // Get screen dimensions
-    getmaxyx(stdscr, maxy, maxx);
-    
-    // Only erase content area (not status bar), starting from after title (line 2)
-    // This avoids erasing the status bar and minimizes redraw
-    const int content_start_y = 2;
-    if (content_start_y < maxy - 1) {
-        for (int i = content_start_y; i < maxy - 1; i++) {
-            move(i, 0);
-            clrtoeol();
-        }
-    }
-    
-    if (!ctx) {
-        mvprintw(0, 0, "UBus context not available");
-        wnoutrefresh(stdscr);
-        doupdate();
-        return;
-    }
-    
-    // Look up the GPS service
-    ret = ubus_lookup_id(ctx, "gps", &id);
-    if (ret != 0) {
-        mvprintw(0, 0, "GPS service not found");
-        wnoutrefresh(stdscr);
-        doupdate();
-        return;
+    enum view view;
+    unsigned int mask;  // GPS_FIX_* fields shown in VIEW_FIX
+} layout;
+
+static void init_field(struct field *f, int y, int x, int width, attr_t attr) {
+    f->y = y;
+    f->x = x;
+    f->width = width < (int)sizeof(f->text) ? width : (int)sizeof(f->text) - 1;
+    f->attr = attr;
+    // All of it: a sparkline compares every cell, not just a string
+    memset(f->text, 0, sizeof(f->text));
+}
+
+static void place_field(int id, int y, int x, int width, attr_t attr) {
+    init_field(&fields[id], y, x, width, attr);
+}
+
+// Rewrite a field only if its text changed, padding over the old text
+static void draw_field(struct field *f, const char *text) {
+    if (f->width <= 0 || strcmp(f->text, text) == 0) return;
+
+    attron(f->attr);
+    mvprintw(f->y, f->x, "%-*.*s", f->width, f->width, text);
+    attroff(f->attr);
+    snprintf(f->text, sizeof(f->text), "%s", text);
+}
+
+static void set_field(int id, const char *text) {
+    draw_field(&fields[id], text);
+}
+
+// Sparkline fields keep one level digit per column (' ' without data) as
+// their text and redraw only the columns that changed
+static void set_sparkline(int id, const int *levels, int n) {
+    struct field *f = &fields[id];
+    const char *const *glyphs = unicode ? spark_unicode : spark_ascii;
+
+    if (n > f->width) n = f->width;
+
+    attron(f->attr);
+    for (int i = 0; i < n; i++) {
+        char level = levels[i] < 0 ? ' ' : '0' + levels[i];
+
+        if (f->text[i] == level) continue;
+        mvaddstr(f->y, f->x + i, level == ' ' ? " " : glyphs[levels[i]]);
+        f->text[i] = level;
     }
-    
-    // Call the info method (pass NULL for empty request, not empty blob_buf)
-    gps_callback_called = 0;
-    gps_response_status = 0;
-    blob_buf_free(&gps_response_buf);
-    memset(&gps_response_buf, 0, sizeof(gps_response_buf));
-    ret = ubus_invoke(ctx, id, "info", NULL, gps_data_cb, NULL, 1000);
-    
-    if (ret != 0) {
-        mvprintw(0, 0, "Failed to call GPS info (error: %d)", ret);
-        wnoutrefresh(stdscr);
-        doupdate();
-        return;
+    attroff(f->attr);
+}
+
+// A box content row with its borders; the text is a field filled per frame
+static int field_row(int id, int y, int start_x, int box_width, int color_pair) {
+    draw_centered_box_content(y, start_x, box_width, "", 1);
+    place_field(id, y, start_x + 2, box_width - 4, COLOR_PAIR(color_pair));
+    return y + 1;
+}
+
+static void clear_fields(void) {
+    for (int i = 0; i < __FIELD_MAX; i++) {
+        fields[i].width = 0;
     }
-    
-    // Process ubus events to ensure callback is executed
-    fd_set fds;
-    struct timeval tv;
-    int sock = ctx->sock.fd;
-    int timeout_ms = 1000; // 1 second timeout
-    
-    // Wait for callback to be called, with timeout
-    // Continue processing events until callback is called
-    while (!gps_callback_called && timeout_ms > 0) {
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000; // 10ms increments
-        
-        int ready = select(sock + 1, &fds, NULL, NULL, &tv);
-        if (ready > 0 && FD_ISSET(sock, &fds)) {
-            ubus_handle_event(ctx);
-        } else if (ready < 0) {
-            break;
+    for (int i = 0; i < nsources; i++) {
+        for (int j = 0; j < CARD_LINES; j++) {
+            sources[i].card[j].width = 0;
         }
-        timeout_ms -= 10;
     }
-    
-    // Process any remaining events after callback to ensure full response
-    if (gps_callback_called) {
-        // Give a bit more time for any remaining data
-        for (int i = 0; i < 10; i++) {
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = 0;
-            tv.tv_usec = 10000; // 10ms
-            
-            int ready = select(sock + 1, &fds, NULL, NULL, &tv);
-            if (ready > 0 && FD_ISSET(sock, &fds)) {
-                ubus_handle_event(ctx);
-            } else {
-                break;
-            }
-        }
+}
+
+// The -D overlay rows above the status bar
+static void place_overlay(int maxy, int maxx) {
+    for (int i = 0; i < OVERLAY_ROWS; i++) {
+        place_field(FIELD_LATENCY + i, maxy - 1 - OVERLAY_ROWS + i, 0, maxx, A_DIM);
     }
-    
-    int y = 0;
-    
+}
+
+// Draw everything static for this view: title, borders, box titles
+static void layout_screen(enum view view, unsigned int mask, int maxy, int maxx) {
+    const int box_width = 60;
+    int y = 0, start_x, rows;
+    char title[32];
+
+    layout.maxy = maxy;
+    layout.maxx = maxx;
+    layout.view = view;
+    layout.mask = mask;
+
+    erase();
+    clear_fields();
+
+    // Status bar at bottom with exit instructions
+    place_field(FIELD_STATUS, maxy - 1, 0, maxx, A_REVERSE | A_BOLD);
+    place_overlay(maxy, maxx);
+
+    if (view == VIEW_MESSAGE) {
+        place_field(FIELD_MESSAGE, 0, 0, maxx, A_NORMAL);
+        return;
+    }
+
     // Title
     attron(A_BOLD | A_UNDERLINE);
     mvprintw(y++, (maxx - 13) / 2, "GPS Monitor");
     attroff(A_BOLD | A_UNDERLINE);
     y++;
-    
-    if (!gps_callback_called) {
-        const int box_width = 60;
-        int start_x = draw_centered_box_top(y++, box_width, maxx, 1);
-        draw_centered_box_content(y++, start_x, box_width, "Timeout waiting for GPS response", 2);
+
+    if (view == VIEW_TIMEOUT) {
+        start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+        y = field_row(FIELD_MESSAGE, y, start_x, box_width, 2);
         draw_centered_box_bottom(y++, start_x, box_width, 1);
-        wnoutrefresh(stdscr);
-        doupdate();
         return;
     }
-    
-    // Check if we got data, even if status wasn't OK
-    if (gps_response_buf.head) {
-        // Extract GPS values
-        lat_str = get_gps_value("latitude");
-        lon_str = get_gps_value("longitude");
-        speed_str = get_gps_value("speed");
-        elevation_str = get_gps_value("elevation");
-        course_str = get_gps_value("course");
-        age_str = get_gps_value("age");
-        
-        // Parse and format latitude/longitude
-        if (lat_str && lon_str) {
-            lat = atof(lat_str);
-            lon = atof(lon_str);
-            
+
+    if (view == VIEW_FIX) {
+        if ((mask & GPS_FIX_POSITION) == GPS_FIX_POSITION) {
             // Location box
-            const int box_width = 60;
-            int start_x = draw_centered_box_top(y++, box_width, maxx, 1);
-            draw_centered_box_title(y++, start_x, box_width, "Location", 1);
+            start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+            draw_centered_box_title(y++, start_x, box_width,
+                                    kalman ? "Location (raw | smoothed)" : "Location", 1);
             draw_centered_box_separator(y++, start_x, box_width, 1);
-            
-            char lat_line[64];
-            snprintf(lat_line, sizeof(lat_line), "Latitude:  %9.6f%c %c",
-                   (lat < 0 ? -lat : lat), ACS_DEGREE, (lat >= 0 ? 'N' : 'S'));
-            draw_centered_box_content(y++, start_x, box_width, lat_line, 3);
-            
-            char lon_line[64];
-            snprintf(lon_line, sizeof(lon_line), "Longitude: %9.6f%c %c",
-                   (lon < 0 ? -lon : lon), ACS_DEGREE, (lon >= 0 ? 'E' : 'W'));
-            draw_centered_box_content(y++, start_x, box_width, lon_line, 3);
-            
+            y = field_row(FIELD_LATITUDE, y, start_x, box_width, 3);
+            y = field_row(FIELD_LONGITUDE, y, start_x, box_width, 3);
             draw_centered_box_bottom(y++, start_x, box_width, 1);
             y++;
         }
-        
-        // Parse and display speed in knots
-        if (speed_str) {
-            speed_ms = atof(speed_str);
-            speed_knots = speed_ms * 1.94384; // Convert m/s to knots
-            
+
+        if (mask & GPS_FIX_SPEED) {
             // Navigation box
-            const int box_width = 60;
-            int start_x = draw_centered_box_top(y++, box_width, maxx, 1);
-            draw_centered_box_title(y++, start_x, box_width, "Navigation", 1);
+            start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+            draw_centered_box_title(y++, start_x, box_width,
+                                    kalman ? "Navigation (raw | smoothed)" : "Navigation", 1);
             draw_centered_box_separator(y++, start_x, box_width, 1);
-            
-            char speed_line[64];
-            snprintf(speed_line, sizeof(speed_line), "Speed:      %6.2f m/s  (%6.2f knots)",
-                   speed_ms, speed_knots);
-            draw_centered_box_content(y++, start_x, box_width, speed_line, 3);
-            
-            if (course_str) {
-                course = atof(course_str);
-                const char *direction = "N";
-                if (course >= 337.5 || course < 22.5) direction = "N";
-                else if (course >= 22.5 && course < 67.5) direction = "NE";
-                else if (course >= 67.5 && course < 112.5) direction = "E";
-                else if (course >= 112.5 && course < 157.5) direction = "SE";
-                else if (course >= 157.5 && course < 202.5) direction = "S";
-                else if (course >= 202.5 && course < 247.5) direction = "SW";
-                else if (course >= 247.5 && course < 292.5) direction = "W";
-                else if (course >= 292.5 && course < 337.5) direction = "NW";
-                
-                char course_line[64];
-                snprintf(course_line, sizeof(course_line), "Course:     %6.1f%c (%s)",
-                       course, ACS_DEGREE, direction);
-                draw_centered_box_content(y++, start_x, box_width, course_line, 3);
-            }
-            
-            if (elevation_str) {
-                elevation = atof(elevation_str);
-                char elev_line[64];
-                snprintf(elev_line, sizeof(elev_line), "Elevation:  %6.1f m", elevation);
-                draw_centered_box_content(y++, start_x, box_width, elev_line, 3);
-            }
-            
+            y = field_row(FIELD_SPEED, y, start_x, box_width, 3);
+            if (mask & GPS_FIX_COURSE)
+                y = field_row(FIELD_COURSE, y, start_x, box_width, 3);
+            if (mask & GPS_FIX_ELEVATION)
+                y = field_row(FIELD_ELEVATION, y, start_x, box_width, 3);
             draw_centered_box_bottom(y++, start_x, box_width, 1);
             y++;
         }
-        
-        // Display age if available
-        if (age_str) {
-            const int box_width = 60;
-            int start_x = draw_centered_box_top(y++, box_width, maxx, 1);
-            
-            char age_line[64];
-            snprintf(age_line, sizeof(age_line), "Data Age: %s seconds", age_str);
-            draw_centered_box_content(y++, start_x, box_width, age_line, 3);
-            
+
+        if (mask & GPS_FIX_AGE) {
+            start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+            y = field_row(FIELD_AGE, y, start_x, box_width, 3);
             draw_centered_box_bottom(y++, start_x, box_width, 1);
             y++;
         }
-        
-    } else {
-        const int box_width = 60;
-        int start_x = draw_centered_box_top(y++, box_width, maxx, 1);
-        
-        char error_line[64];
-        if (gps_response_status != UBUS_STATUS_OK) {
-            snprintf(error_line, sizeof(error_line), "Error: GPS service returned error: %d", gps_response_status);
-        } else {
-            snprintf(error_line, sizeof(error_line), "No GPS data available");
+
+        // Trip box, only if it fits above the timestamp and status bar
+        if ((mask & GPS_FIX_POSITION) == GPS_FIX_POSITION &&
+            y + 7 + 1 + 3 < maxy - OVERLAY_ROWS) {
+            start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+            draw_centered_box_title(y++, start_x, box_width, "Trip", 1);
+            draw_centered_box_separator(y++, start_x, box_width, 1);
+            y = field_row(FIELD_TRIP_DISTANCE, y, start_x, box_width, 3);
+            y = field_row(FIELD_TRIP_TIME, y, start_x, box_width, 3);
+            y = field_row(FIELD_TRIP_SPEED, y, start_x, box_width, 3);
+            if (mask & GPS_FIX_ELEVATION)
+                y = field_row(FIELD_TRIP_CLIMB, y, start_x, box_width, 3);
+            draw_centered_box_bottom(y++, start_x, box_width, 1);
+            y++;
+        }
+
+        // History box, only if it fits above the timestamp and status bar
+        rows = 3 + (mask & GPS_FIX_SPEED ? 2 : 0) + (mask & GPS_FIX_ELEVATION ? 2 : 0) +
+               (mask & GPS_FIX_AGE ? 1 : 0) + 1;
+        if (rows > 4 && y + rows + 1 + 3 < maxy - OVERLAY_ROWS) {
+            snprintf(title, sizeof(title), "History (last %d min)", history_minutes);
+            start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+            draw_centered_box_title(y++, start_x, box_width, title, 1);
+            draw_centered_box_separator(y++, start_x, box_width, 1);
+            if (mask & GPS_FIX_SPEED) {
+                y = field_row(FIELD_HISTORY_SPEED, y, start_x, box_width, 3);
+                y = field_row(FIELD_HISTORY_SPEED_LINE, y, start_x, box_width, 3);
+            }
+            if (mask & GPS_FIX_ELEVATION) {
+                y = field_row(FIELD_HISTORY_ELEVATION, y, start_x, box_width, 3);
+                y = field_row(FIELD_HISTORY_ELEVATION_LINE, y, start_x, box_width, 3);
+            }
+            if (mask & GPS_FIX_AGE)
+                y = field_row(FIELD_HISTORY_AGE, y, start_x, box_width, 3);
+            draw_centered_box_bottom(y++, start_x, box_width, 1);
+            y++;
         }
-        draw_centered_box_content(y++, start_x, box_width, error_line, 2);
-        
+    } else {
+        start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+        y = field_row(FIELD_MESSAGE, y, start_x, box_width, 2);
         draw_centered_box_bottom(y++, start_x, box_width, 1);
         y++;
     }
-    
+
+    // Timestamp box
+    start_x = draw_centered_box_top(y++, box_width, maxx, 1);
+    draw_centered_box_content(y, start_x, box_width, "", 1);
+    place_field(FIELD_TIME, y++, start_x + 2, box_width - 4, A_BOLD | COLOR_PAIR(1));
+    draw_centered_box_bottom(y++, start_x, box_width, 1);
+}
+
+// Longest number formatted by decimal(), NUL included
+#define DECIMAL_MAX 16
+
+// A fixed-point value, in units of 10^-digits, as text with `shown` decimals
+static const char *decimal(char *buf, int32_t value, int digits, int shown) {
+    gps_decimal_format(buf, DECIMAL_MAX, value, digits, shown);
+    return buf;
+}
+
+static int32_t abs32(int32_t v) {
+    return v < 0 ? -v : v;
+}
+
+// m/s to knots (1852 m per hour), in the same fixed-point unit
+static int32_t knots(int32_t speed) {
+    return (int32_t)(((int64_t)speed * 3600 + (speed < 0 ? -926 : 926)) / 1852);
+}
+
+// Eight 45 degree sectors, north centred on 0
+static const char *course_direction(int32_t course) {
+    static const char *const names[] = { "N", "NE", "E", "SE", "S", "SW", "W", "NW" };
+
+    course = course % (360 * GPS_FIX_COURSE_DEGREE);
+    if (course < 0) course += 360 * GPS_FIX_COURSE_DEGREE;
+    return names[(course + 45 * GPS_FIX_COURSE_DEGREE / 2) / (45 * GPS_FIX_COURSE_DEGREE) % 8];
+}
+
+// A row of the fix boxes; with --kalman the smoothed value follows the raw
+// one in a second column
+static void set_fix_field(int id, const char *raw, const char *smoothed) {
+    char line[128];
+
+    if (!kalman) {
+        set_field(id, raw);
+        return;
+    }
+    snprintf(line, sizeof(line), "%-37s| %s", raw, smoothed);
+    set_field(id, line);
+}
+
+// Format the current fix, and its smoothed copy, into their fields, in
+// integers only
+static void render_fix(const struct gps_fix *fix, const struct gps_fix *smoothed) {
+    char line[64], other[32], a[DECIMAL_MAX], b[DECIMAL_MAX];
+
+    if ((fix->fields & GPS_FIX_POSITION) == GPS_FIX_POSITION) {
+        snprintf(line, sizeof(line), "Latitude:  %9s%c %c",
+                 decimal(a, abs32(fix->latitude), GPS_FIX_DEGREE_DIGITS, 6), ACS_DEGREE,
+                 (fix->latitude >= 0 ? 'N' : 'S'));
+        other[0] = '\0';
+        if (smoothed->fields & GPS_FIX_LATITUDE) {
+            snprintf(other, sizeof(other), "%9s%c %c",
+                     decimal(a, abs32(smoothed->latitude), GPS_FIX_DEGREE_DIGITS, 6),
+                     ACS_DEGREE, (smoothed->latitude >= 0 ? 'N' : 'S'));
+        }
+        set_fix_field(FIELD_LATITUDE, line, other);
+
+        snprintf(line, sizeof(line), "Longitude: %9s%c %c",
+                 decimal(a, abs32(fix->longitude), GPS_FIX_DEGREE_DIGITS, 6), ACS_DEGREE,
+                 (fix->longitude >= 0 ? 'E' : 'W'));
+        other[0] = '\0';
+        if (smoothed->fields & GPS_FIX_LONGITUDE) {
+            snprintf(other, sizeof(other), "%9s%c %c",
+                     decimal(a, abs32(smoothed->longitude), GPS_FIX_DEGREE_DIGITS, 6),
+                     ACS_DEGREE, (smoothed->longitude >= 0 ? 'E' : 'W'));
+        }
+        set_fix_field(FIELD_LONGITUDE, line, other);
+    }
+
+    // Display speed in knots
+    if (fix->fields & GPS_FIX_SPEED) {
+        snprintf(line, sizeof(line), "Speed:      %6s m/s  (%6s knots)",
+                 decimal(a, fix->speed, GPS_FIX_SPEED_DIGITS, 2),
+                 decimal(b, knots(fix->speed), GPS_FIX_SPEED_DIGITS, 2));
+        other[0] = '\0';
+        if (smoothed->fields & GPS_FIX_SPEED) {
+            snprintf(other, sizeof(other), "%6s m/s",
+                     decimal(a, smoothed->speed, GPS_FIX_SPEED_DIGITS, 2));
+        }
+        set_fix_field(FIELD_SPEED, line, other);
+
+        if (fix->fields & GPS_FIX_COURSE) {
+            snprintf(line, sizeof(line), "Course:     %6s%c (%s)",
+                     decimal(a, fix->course, GPS_FIX_COURSE_DIGITS, 1), ACS_DEGREE,
+                     course_direction(fix->course));
+            other[0] = '\0';
+            if (smoothed->fields & GPS_FIX_COURSE) {
+                snprintf(other, sizeof(other), "%6s%c (%s)",
+                         decimal(a, smoothed->course, GPS_FIX_COURSE_DIGITS, 1), ACS_DEGREE,
+                         course_direction(smoothed->course));
+            }
+            set_fix_field(FIELD_COURSE, line, other);
+        }
+
+        if (fix->fields & GPS_FIX_ELEVATION) {
+            snprintf(line, sizeof(line), "Elevation:  %6s m",
+                     decimal(a, fix->elevation, GPS_FIX_ELEVATION_DIGITS, 1));
+            other[0] = '\0';
+            if (smoothed->fields & GPS_FIX_ELEVATION) {
+                snprintf(other, sizeof(other), "%6s m",
+                         decimal(a, smoothed->elevation, GPS_FIX_ELEVATION_DIGITS, 1));
+            }
+            set_fix_field(FIELD_ELEVATION, line, other);
+        }
+    }
+
+    if (fix->fields & GPS_FIX_AGE) {
+        snprintf(line, sizeof(line), "Data Age: %d seconds", fix->age);
+        set_field(FIELD_AGE, line);
+    }
+}
+
+// Rolling statistics and sparklines; all O(1) except the column scan
+static void render_history(int64_t now) {
+    int levels[HISTORY_COLUMNS];
+    int32_t min, mean, max;
+    int64_t trend;
+    char line[96], a[DECIMAL_MAX], b[DECIMAL_MAX], c[DECIMAL_MAX];
+
+    // Speeds in cm/s
+    if (gps_history_speed(&history, &min, &mean, &max)) {
+        snprintf(line, sizeof(line), "Speed:     min %6s  avg %6s  max %6s m/s",
+                 decimal(a, min, 2, 2), decimal(b, mean, 2, 2), decimal(c, max, 2, 2));
+    } else {
+        snprintf(line, sizeof(line), "Speed:     no data");
+    }
+    set_field(FIELD_HISTORY_SPEED, line);
+    gps_history_sparkline(&history, now, GPS_FIX_SPEED, levels, SPARK_LEVELS);
+    set_sparkline(FIELD_HISTORY_SPEED_LINE, levels, HISTORY_COLUMNS);
+
+    if (gps_history_elevation_trend(&history, &trend)) {
+        // Held at +-21474 km/min, far past anything a receiver reports
+        if (trend > INT32_MAX) trend = INT32_MAX;
+        if (trend < -INT32_MAX) trend = -INT32_MAX;
+        b[0] = '+';
+        gps_decimal_format(b + 1, sizeof(b) - 1, trend, GPS_FIX_ELEVATION_DIGITS, 2);
+        snprintf(line, sizeof(line), "Elevation: trend %7s m/min", trend < 0 ? b + 1 : b);
+    } else {
+        snprintf(line, sizeof(line), "Elevation: no trend yet");
+    }
+    set_field(FIELD_HISTORY_ELEVATION, line);
+    gps_history_sparkline(&history, now, GPS_FIX_ELEVATION, levels, SPARK_LEVELS);
+    set_sparkline(FIELD_HISTORY_ELEVATION_LINE, levels, HISTORY_COLUMNS);
+
+    if (gps_history_age_percentile(&history, 100) >= 0) {
+        snprintf(line, sizeof(line), "Fix age:   p50 %d s  p95 %d s  max %d s",
+                 gps_history_age_percentile(&history, 50),
+                 gps_history_age_percentile(&history, 95),
+                 gps_history_age_percentile(&history, 100));
+    } else {
+        snprintf(line, sizeof(line), "Fix age:   no data");
+    }
+    set_field(FIELD_HISTORY_AGE, line);
+}
+
+// "h:mm:ss", held at 99999:59:59 (11 years) so it fits DURATION_MAX
+#define DURATION_MAX 16
+#define DURATION_MAX_S (100000 * 3600L - 1)
+
+static void format_duration(char *buf, size_t len, int64_t ms) {
+    long s = ms < 0 ? 0 : ms / 1000 > DURATION_MAX_S ? DURATION_MAX_S : (long)(ms / 1000);
+
+    snprintf(buf, len, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+// Trip distance in km, from mm
+static const char *trip_km(char *buf, int64_t distance) {
+    return decimal(buf, (int32_t)(distance / 1000), 3, 2);
+}
+
+// Trip totals since the last reset, kept across restarts
+static void render_trip(const struct gps_trip *t) {
+    char line[64], moving[DURATION_MAX], stopped[DURATION_MAX], a[DECIMAL_MAX], b[DECIMAL_MAX];
+
+    snprintf(line, sizeof(line), "Distance:  %9s km", trip_km(a, t->distance));
+    set_field(FIELD_TRIP_DISTANCE, line);
+
+    format_duration(moving, sizeof(moving), t->moving_ms);
+    format_duration(stopped, sizeof(stopped), t->stopped_ms);
+    snprintf(line, sizeof(line), "Moving:    %9s   Stopped: %s", moving, stopped);
+    set_field(FIELD_TRIP_TIME, line);
+
+    snprintf(line, sizeof(line), "Speed:     avg %6s  max %6s m/s",
+             decimal(a, gps_trip_average_speed(t), GPS_FIX_SPEED_DIGITS, 2),
+             decimal(b, t->max_speed, GPS_FIX_SPEED_DIGITS, 2));
+    set_field(FIELD_TRIP_SPEED, line);
+
+    snprintf(line, sizeof(line), "Climb:     %+7lld m  %+7lld m",
+             (long long)((t->climb + 50) / 100), -(long long)((t->descent + 50) / 100));
+    set_field(FIELD_TRIP_CLIMB, line);
+}
+
+// Which view a source needs, with the message to show instead of a fix
+static enum view source_view(const struct source *src, char *message, size_t len) {
+    int ret = src->fix_ret;
+
+    message[0] = '\0';
+    if (!conn.connected) {
+        snprintf(message, len, "UBus disconnected, reconnecting");
+        return VIEW_MESSAGE;
+    } else if (ret == UBUS_STATUS_NOT_FOUND || ret == UBUS_STATUS_CONNECTION_FAILED) {
+        snprintf(message, len, "GPS service not found");
+        return VIEW_MESSAGE;
+    } else if (ret != 0 && ret != UBUS_STATUS_TIMEOUT) {
+        snprintf(message, len, "Failed to call GPS info (error: %d)", ret);
+        return VIEW_MESSAGE;
+    } else if (ret == UBUS_STATUS_TIMEOUT) {
+        snprintf(message, len, "Timeout waiting for GPS response");
+        return VIEW_TIMEOUT;
+    }
+
+    // Check if we got data, even if status wasn't OK
+    if (src->fix.fields) return VIEW_FIX;
+
+    if (src->fix_status != UBUS_STATUS_OK) {
+        snprintf(message, len, "Error: GPS service returned error: %d", src->fix_status);
+    } else {
+        snprintf(message, len, "No GPS data available");
+    }
+    return VIEW_ERROR;
+}
+
+// As many cards as fit, left to right and top to bottom, below a title row
+static void layout_grid(int maxy, int maxx) {
+    const int height = CARD_LINES + 2;
+    int cols = maxx / CARD_WIDTH, rows = (maxy - 2 - OVERLAY_ROWS) / height;
+
+    layout.maxy = maxy;
+    layout.maxx = maxx;
+    layout.view = VIEW_GRID;
+    layout.mask = 0;
+
+    erase();
+    clear_fields();
+
+    attron(A_BOLD | A_UNDERLINE);
+    mvprintw(0, 0, "GPS Monitor");
+    attroff(A_BOLD | A_UNDERLINE);
+    place_field(FIELD_TIME, 0, maxx - 20, 19, A_BOLD);
+    place_field(FIELD_STATUS, maxy - 1, 0, maxx, A_REVERSE | A_BOLD);
+    place_overlay(maxy, maxx);
+
+    if (cols < 1) cols = 1;
+    if (rows < 0) rows = 0;
+    cards_shown = nsources < cols * rows ? nsources : cols * rows;
+
+    for (int i = 0; i < cards_shown; i++) {
+        struct source *src = &sources[i];
+        int y = 1 + i / cols * height, x = i % cols * CARD_WIDTH;
+
+        attron(COLOR_PAIR(1));
+        mvaddch(y, x, ACS_ULCORNER);
+        hline(ACS_HLINE, CARD_WIDTH - 2);
+        mvaddch(y, x + CARD_WIDTH - 1, ACS_URCORNER);
+        attroff(COLOR_PAIR(1));
+        attron(A_BOLD);
+        mvprintw(y, x + 2, " %.*s ", CARD_WIDTH - 6, src->gps.name);
+        attroff(A_BOLD);
+        for (int j = 0; j < CARD_LINES; j++) {
+            draw_centered_box_content(y + 1 + j, x, CARD_WIDTH, "", 1);
+            init_field(&src->card[j], y + 1 + j, x + 2, CARD_WIDTH - 4,
+                       j == 0 ? A_BOLD : COLOR_PAIR(3));
+        }
+        draw_centered_box_bottom(y + height - 1, x, CARD_WIDTH, 1);
+    }
+}
+
+// Fill one grid card; missing fields show as '-'
+static void render_card(struct source *src) {
+    const struct gps_fix *f = &src->fix;
+    char message[64], line[64], a[DECIMAL_MAX], b[DECIMAL_MAX];
+
+    if (source_view(src, message, sizeof(message)) != VIEW_FIX) {
+        draw_field(&src->card[0], message);
+        for (int j = 1; j < CARD_LINES; j++) {
+            draw_field(&src->card[j], "");
+        }
+        return;
+    }
+
+    snprintf(line, sizeof(line), "%s",
+             gps_client_push_live(&src->gps, GPS_PUSH_STALE_MS) ? "push" : "poll");
+    if (f->fields & GPS_FIX_AGE) {
+        snprintf(line + strlen(line), sizeof(line) - strlen(line), ", data age %d s", f->age);
+    }
+    draw_field(&src->card[0], line);
+
+    if ((f->fields & GPS_FIX_POSITION) == GPS_FIX_POSITION) {
+        snprintf(line, sizeof(line), "%10s %c  %11s %c",
+                 decimal(a, abs32(f->latitude), GPS_FIX_DEGREE_DIGITS, 6),
+                 f->latitude >= 0 ? 'N' : 'S',
+                 decimal(b, abs32(f->longitude), GPS_FIX_DEGREE_DIGITS, 6),
+                 f->longitude >= 0 ? 'E' : 'W');
+    } else {
+        snprintf(line, sizeof(line), "-");
+    }
+    draw_field(&src->card[1], line);
+
+    if ((f->fields & (GPS_FIX_SPEED | GPS_FIX_COURSE)) == (GPS_FIX_SPEED | GPS_FIX_COURSE)) {
+        snprintf(line, sizeof(line), "%6s m/s  course %5s (%s)",
+                 decimal(a, f->speed, GPS_FIX_SPEED_DIGITS, 2),
+                 decimal(b, f->course, GPS_FIX_COURSE_DIGITS, 1), course_direction(f->course));
+    } else if (f->fields & GPS_FIX_SPEED) {
+        snprintf(line, sizeof(line), "%6s m/s", decimal(a, f->speed, GPS_FIX_SPEED_DIGITS, 2));
+    } else {
+        snprintf(line, sizeof(line), "-");
+    }
+    draw_field(&src->card[2], line);
+
+    if (f->fields & GPS_FIX_ELEVATION) {
+        snprintf(line, sizeof(line), "elevation %s m",
+                 decimal(a, f->elevation, GPS_FIX_ELEVATION_DIGITS, 1));
+    } else {
+        snprintf(line, sizeof(line), "-");
+    }
+    snprintf(line + strlen(line), sizeof(line) - strlen(line), "  trip %s km",
+             trip_km(a, src->trip.distance));
+    draw_field(&src->card[3], line);
+}
+
+// One source: the full screen with boxes per field group and the history
+static void render_single(int maxy, int maxx) {
+    struct source *src = &sources[0];
+    unsigned int mask = 0;
+    char message[64];
+    enum view view;
+
+    view = source_view(src, message, sizeof(message));
+    if (view == VIEW_FIX) {
+        mask = src->fix.fields;
+    }
+
+    // Borders are only drawn again when the terminal size or the set of
+    // boxes changed
+    if (maxy != layout.maxy || maxx != layout.maxx ||
+        view != layout.view || mask != layout.mask) {
+        layout_screen(view, mask, maxy, maxx);
+    }
+
+    set_field(FIELD_MESSAGE, message);
+    if (view == VIEW_FIX) {
+        render_fix(&src->fix, &src->smoothed);
+        render_trip(&src->trip);
+        render_history(monotonic_ms() / 1000);
+    }
+}
+
+static void render_grid(int maxy, int maxx) {
+    if (maxy != layout.maxy || maxx != layout.maxx || layout.view != VIEW_GRID) {
+        layout_grid(maxy, maxx);
+    }
+
+    for (int i = 0; i < cards_shown; i++) {
+        render_card(&sources[i]);
+    }
+}
+
+static void collect_latency(struct gps_latency *phases) {
+    phases[PHASE_LOOKUP] = conn.latency.lookup;
+    phases[PHASE_REQUEST] = conn.latency.request;
+    phases[PHASE_DECODE] = conn.latency.decode;
+    phases[PHASE_RENDER] = latency.render;
+    phases[PHASE_REFRESH] = latency.refresh;
+}
+
+static void print_latency(FILE *f) {
+    struct gps_latency phases[__PHASE_MAX];
+
+    collect_latency(phases);
+    for (int i = 0; i < __PHASE_MAX; i++) {
+        gps_latency_print(f, phase_names[i], &phases[i]);
+    }
+}
+
+static void render_overlay(void) {
+    struct gps_latency phases[__PHASE_MAX];
+    char line[96];
+
+    collect_latency(phases);
+    for (int i = 0; i < __PHASE_MAX; i++) {
+        const struct gps_latency *l = &phases[i];
+
+        snprintf(line, sizeof(line), "%-8s %7llu  mean %8.3f ms  p50 %8.3f  p99 %8.3f  max %8.3f",
+                 phase_names[i], (unsigned long long)l->count,
+                 l->count ? l->sum_ns / 1e6 / l->count : 0.0,
+                 gps_latency_percentile(l, 0.5) / 1e6, gps_latency_percentile(l, 0.99) / 1e6,
+                 l->max_ns / 1e6);
+        set_field(FIELD_LATENCY + i, line);
+    }
+}
+
+static void display_gps_data(void) {
+    unsigned long lookups = 0;
+    char line[160], mode[32];
+    int64_t start = gps_latency_now();
+    int maxy, maxx, live = 0;
+
+    // Get screen dimensions
+    getmaxyx(stdscr, maxy, maxx);
+
+    if (nsources > 1) {
+        render_grid(maxy, maxx);
+    } else {
+        render_single(maxy, maxx);
+    }
+
     // Print timestamp
     time_t now = time(NULL);
     struct tm *t = localtime(&now);
-    char time_str[64];
-    snprintf(time_str, sizeof(time_str), "%04d-%02d-%02d %02d:%02d:%02d",
-           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-           t->tm_hour, t->tm_min, t->tm_sec);
-    
-    const int box_width = 60;
-    int start_x = draw_centered_box_top(y++, box_width, maxx, 1);
-    
-    attron(A_BOLD | COLOR_PAIR(1));
-    mvaddch(y, start_x, ACS_VLINE);
-    mvprintw(y, start_x + 2, "%s", time_str);
-    mvaddch(y, start_x + box_width - 1, ACS_VLINE);
-    attroff(A_BOLD | COLOR_PAIR(1));
-    y++;
-    
-    draw_centered_box_bottom(y++, start_x, box_width, 1);
-    
-    // Clear any remaining lines below our content (but not status bar)
-    if (y < maxy - 2) {
-        for (int i = y; i < maxy - 1; i++) {
-            move(i, 0);
-            clrtoeol();
+    snprintf(line, sizeof(line), "%04d-%02d-%02d %02d:%02d:%02d",
+             t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+             t->tm_hour, t->tm_min, t->tm_sec);
+    set_field(FIELD_TIME, line);
+
+    for (int i = 0; i < nsources; i++) {
+        live += gps_client_push_live(&sources[i].gps, GPS_PUSH_STALE_MS);
+        lookups += sources[i].gps.stats.lookups;
+    }
+    if (nsources > 1) {
+        snprintf(mode, sizeof(mode), "push %d/%d", live, nsources);
+        if (cards_shown < nsources) {
+            snprintf(mode + strlen(mode), sizeof(mode) - strlen(mode),
+                     ", %d shown", cards_shown);
         }
+    } else {
+        snprintf(mode, sizeof(mode), "%s", live ? "push" : "poll");
     }
-    
-    // Status bar at bottom with exit instructions (only update if changed)
-    static char last_status_msg[64] = "";
-    char status_msg[] = "Press 'q' or ESC to quit";
-    y = maxy - 1;
-    
-    // Only redraw status bar if message changed or first time
-    if (strcmp(last_status_msg, status_msg) != 0) {
-        attron(A_REVERSE | A_BOLD);
-        mvprintw(y, 0, "%s", status_msg);
-        // Clear rest of line
-        int msg_len = strlen(status_msg);
-        for (int i = msg_len; i < maxx; i++) {
-            mvaddch(y, i, ' ');
+
+    snprintf(line, sizeof(line),
+             "Press 'q' or ESC to quit, 'r' to reset the trip  |  %s  lookups %lu  reconnects %lu",
+             mode, lookups, conn.reconnects);
+    if (debug) {
+        // Updated once a second, so the counter itself adds little output
+        if (now != rate.second) {
+            snprintf(rate.text, sizeof(rate.text), "  |  %llu B/s  %.1f B/frame",
+                     term_bytes - rate.bytes, frames > rate.frames ?
+                     (double)(term_bytes - rate.bytes) / (frames - rate.frames) : 0.0);
+            rate.second = now;
+            rate.bytes = term_bytes;
+            rate.frames = frames;
+            render_overlay();
         }
-        attroff(A_REVERSE | A_BOLD);
-        strncpy(last_status_msg, status_msg, sizeof(last_status_msg) - 1);
-        last_status_msg[sizeof(last_status_msg) - 1] = '\0';
+        strncat(line, rate.text, sizeof(line) - strlen(line) - 1);
     }
-    
-    // Use optimized refresh - prepare all updates, then do single screen update
+    set_field(FIELD_STATUS, line);
+
+    // Use optimized refresh - prepare all updates, then do single screen update.
+    // Only curses writes between the two counter reads, so the difference is
+    // what this frame sent to the terminal.
     wnoutrefresh(stdscr);
-    doupdate();
+    gps_latency_since(&latency.render, start);
+
+    start = gps_latency_now();
+    if (debug) {
+        unsigned long long before = written_bytes();
+
+        doupdate();
+        term_bytes += written_bytes() - before;
+    } else {
+        doupdate();
+    }
+    gps_latency_since(&latency.refresh, start);
+    frames++;
 }
 
 void signal_handler(int sig) {
     (void)sig;
-    running = 0;
-    if (ctx) {
-        ubus_free(ctx);
-        ctx = NULL;
+    uloop_end();
+}
+
+// Draw a frame now, or as soon as the frame-rate cap allows
+static void request_redraw(void) {
+    int64_t wait = last_frame_ms + 1000 / fps - monotonic_ms();
+
+    if (frame_timer.pending) return;
+    uloop_timeout_set(&frame_timer, wait > 0 ? (int)wait : 0);
+}
+
+static void frame_timer_cb(struct uloop_timeout *t) {
+    (void)t;
+    last_frame_ms = monotonic_ms();
+    display_gps_data();
+}
+
+// Redraw on every wall-clock second for the timestamp box, and record the
+// second's fix in the history (shown for a single source only)
+static void clock_timer_cb(struct uloop_timeout *t) {
+    const struct source *src = &sources[0];
+    struct timespec now;
+    int valid = conn.connected && src->fix_ret == 0 && src->fix.fields;
+
+    if (nsources == 1) {
+        gps_history_add(&history, monotonic_ms() / 1000, valid ? &src->fix : NULL);
     }
-    endwin();
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    uloop_timeout_set(t, 1000 - now.tv_nsec / 1000000);
+    request_redraw();
+}
+
+// Take a new reply or notification; redraw only if it changes the screen.
+// Each new fix also goes into the trip, and the filter with --kalman.
+static void update_fix(struct source *src, const struct gps_fix *f, int ret, int status) {
+    struct gps_sample sample;
+    struct timespec now;
+
+    if (memcmp(&src->fix, f, sizeof(src->fix)) == 0 &&
+        ret == src->fix_ret && status == src->fix_status) {
+        return;
+    }
+
+    if (ret == 0 && f->fields) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        sample.time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        sample.fix = *f;
+        gps_trip_add(&src->trip, monotonic_ms(), f);
+        if (kalman) gps_kalman_update(&src->kalman, &sample, &src->smoothed);
+    }
+
+    memcpy(&src->fix, f, sizeof(src->fix));
+    src->fix_ret = ret;
+    src->fix_status = status;
+    request_redraw();
+}
+
+static void gps_complete_cb(struct gps_client *cl, int ret) {
+    update_fix(container_of(cl, struct source, gps), &cl->fix, ret, cl->status);
+}
+
+static void gps_notify_cb(struct gps_client *cl) {
+    update_fix(container_of(cl, struct source, gps), &cl->fix, 0, UBUS_STATUS_OK);
+}
+
+// Without a live push feed, ask each source for a fix once per frame
+// period. All requests go out at once and replies are taken as they come,
+// so a cycle takes as long as the slowest source. Requests never stack: a
+// slow gps service only delays its own next one.
+static void poll_timer_cb(struct uloop_timeout *t) {
+    int ret;
+
+    uloop_timeout_set(t, 1000 / fps);
+
+    if (!conn.connected) {
+        request_redraw();
+        return;
+    }
+
+    for (int i = 0; i < nsources; i++) {
+        struct source *src = &sources[i];
+
+        if (src->gps.req_pending || gps_client_push_live(&src->gps, GPS_PUSH_STALE_MS)) {
+            continue;
+        }
+
+        // The object id is cached until the object or ubusd goes away
+        ret = gps_client_fetch_async(&src->gps, GPS_REQUEST_TIMEOUT_MS);
+        if (ret != 0) {
+            struct gps_fix none = {};
+
+            update_fix(src, &none, ret, UBUS_STATUS_OK);
+        }
+    }
+}
+
+static void stdin_cb(struct uloop_fd *u, unsigned int events) {
+    int ch;
+
+    (void)u;
+    (void)events;
+    while ((ch = getch()) != ERR) {
+        if (ch == 'q' || ch == 'Q' || ch == 27) { // 'q', 'Q', or ESC
+            uloop_end();
+            return;
+        }
+        if (ch == 'r' || ch == 'R') {
+            for (int i = 0; i < nsources; i++) {
+                gps_trip_init(&sources[i].trip);
+            }
+            request_redraw();
+        }
+    }
+}
+
+static void pipe_signal_handler(int sig) {
+    char c = sig;
+
+    if (write(signal_pipe[1], &c, 1) < 0) {
+        // Pipe already full: the same signal is most likely pending anyway
+    }
+}
+
+// SIGWINCH: let curses pick up the new size and lay out again. SIGUSR1: dump
+// the phase timings to stderr, repainting the screen if that is the terminal.
+static void signal_cb(struct uloop_fd *u, unsigned int events) {
+    int resized = 0, dump = 0;
+    struct winsize ws;
+    char buf[16];
+    ssize_t len;
+
+    (void)events;
+    while ((len = read(u->fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < len; i++) {
+            resized |= buf[i] == SIGWINCH;
+            dump |= buf[i] == SIGUSR1;
+        }
+    }
+
+    if (dump) {
+        print_latency(stderr);
+        if (isatty(STDERR_FILENO)) clearok(curscr, TRUE);
+    }
+    if (resized && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+        resizeterm(ws.ws_row, ws.ws_col);
+    }
+    request_redraw();
+}
+
+static void print_usage(const char *prog_name) {
+    printf("GPS Monitor - Live view of the gps ubus service\n\n");
+    printf("Usage: %s [OPTIONS]\n\n", prog_name);
+    printf("Options:\n");
+    printf("  -s, --sources <a,b,...>   Gps ubus objects to watch, in a grid if several (default: gps)\n");
+    printf("  -f, --fps <n>             Redraw and poll at most n times a second (default: 10)\n");
+    printf("  -w, --window <minutes>    History window for statistics and sparklines (default: 5, max: 60)\n");
+    printf("  -u, --unicode             Draw sparklines with Unicode block characters\n");
+    printf("  -t, --trip <prefix>       Keep each trip in <prefix>-<object>.trip between runs\n");
+    printf("                            (default: /tmp/gps-monitor)\n");
+    printf("  -K, --kalman <a[:p[:v]]>  Show a single source's fix smoothed next to it; a is how hard\n");
+    printf("                            the receiver accelerates (m/s^2), p and v the noise of its\n");
+    printf("                            position (m) and speed (m/s) (default: %g:%g:%g)\n",
+           GPS_KALMAN_ACCEL, GPS_KALMAN_POSITION, GPS_KALMAN_VELOCITY);
+    printf("  -D, --debug               Show bytes written per frame and phase timings\n");
+    printf("  -h, --help                Show this help message\n");
+}
+
+// Split a comma separated list of object names in place
+static int parse_sources(char *list, const char **names) {
+    int n = 0;
+
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if (n == GPS_MAX_SOURCES) return -1;
+        names[n++] = name;
+    }
+    return n;
 }
 
 int main(int argc, char **argv) {
-    (void)argc;
-    (void)argv;
-    
+    const char *names[GPS_MAX_SOURCES] = { "gps" };
+    int opt;
+
+    static struct option long_options[] = {
+        {"sources", required_argument, 0, 's'},
+        {"fps",     required_argument, 0, 'f'},
+        {"window",  required_argument, 0, 'w'},
+        {"unicode", no_argument, 0, 'u'},
+        {"trip",    required_argument, 0, 't'},
+        {"kalman",  required_argument, 0, 'K'},
+        {"debug",   no_argument, 0, 'D'},
+        {"help",    no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "s:f:w:ut:K:Dh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                nsources = parse_sources(optarg, names);
+                if (nsources <= 0) {
+                    fprintf(stderr, "Invalid source list: %s (at most %d objects)\n",
+                            optarg, GPS_MAX_SOURCES);
+                    return 1;
+                }
+                break;
+            case 'f':
+                fps = atoi(optarg);
+                if (fps <= 0 || fps > 100) {
+                    fprintf(stderr, "Invalid frame rate: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                history_minutes = atoi(optarg);
+                if (history_minutes <= 0 || history_minutes * 60 > GPS_HISTORY_MAX_WINDOW) {
+                    fprintf(stderr, "Invalid history window: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                unicode = 1;
+                break;
+            case 't':
+                trip_prefix = optarg;
+                break;
+            case 'K':
+                if (gps_kalman_parse(optarg, &kalman_accel, &kalman_position,
+                                     &kalman_velocity) != 0) {
+                    fprintf(stderr, "Invalid Kalman filter noise: %s\n", optarg);
+                    return 1;
+                }
+                kalman = 1;
+                break;
+            case 'D':
+                debug = 1;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (debug) {
+        io_fd = open("/proc/self/io", O_RDONLY);
+    }
+
+    if (nsources == 0) nsources = 1;
+    sources = calloc(nsources, sizeof(*sources));
+    if (!sources) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Pick up the trips where the last run left them
+    for (int i = 0; i < nsources; i++) {
+        struct source *src = &sources[i];
+
+        if (snprintf(src->trip_path, sizeof(src->trip_path), "%s-%s.trip",
+                     trip_prefix, names[i]) >= (int)sizeof(src->trip_path)) {
+            fprintf(stderr, "Trip path too long for %s\n", names[i]);
+            return 1;
+        }
+        if (gps_trip_load(&src->trip, src->trip_path) != 0) {
+            fprintf(stderr, "Ignoring unreadable trip state %s\n", src->trip_path);
+        }
+        gps_kalman_init(&src->kalman, kalman_accel, kalman_position, kalman_velocity);
+    }
+
+    // All history storage is allocated here, none per sample
+    if (gps_history_init(&history, history_minutes * 60, HISTORY_COLUMNS) != 0) {
+        fprintf(stderr, "Failed to allocate history\n");
+        return 1;
+    }
+
+    // The block characters need the terminal's UTF-8 locale
+    if (unicode) {
+        setlocale(LC_ALL, "");
+    }
+
     // Initialize ncurses
     initscr();
     cbreak();
     noecho();
     nodelay(stdscr, TRUE); // Non-blocking input
     keypad(stdscr, TRUE);
+    set_escdelay(25); // ESC quits without waiting a second for a key sequence
     curs_set(0); // Hide cursor
+    leaveok(stdscr, TRUE); // and never move it back after an update
     
     // Initialize colors if available
     if (has_colors()) {
@@ -427,34 +1215,78 @@ int main(int argc, char **argv) {
     signal(SIGTERM, signal_handler);
     
     // Connect to ubus
-    ctx = ubus_connect(NULL);
-    if (!ctx) {
+    if (gps_conn_init(&conn, NULL) != 0) {
         endwin();
         fprintf(stderr, "Failed to connect to ubus\n");
         return 1;
     }
-    
-    // Main loop
-    while (running) {
-        // Check for keyboard input
-        int ch = getch();
-        if (ch == 'q' || ch == 'Q' || ch == 27) { // 'q', 'Q', or ESC
-            running = 0;
-            break;
-        }
-        
-        display_gps_data();
-        
-        // Wait 100ms before next update (faster response to input)
-        usleep(100000);
+    for (int i = 0; i < nsources; i++) {
+        gps_client_init(&sources[i].gps, &conn, names[i]);
+        sources[i].gps.complete_cb = gps_complete_cb;
+        sources[i].gps.notify_cb = gps_notify_cb;
     }
-    
+
+    if (pipe(signal_pipe) == 0) {
+        fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+        signal(SIGWINCH, pipe_signal_handler);
+        signal(SIGUSR1, pipe_signal_handler);
+    }
+
+    // Main loop: sleep until a key, a ubus message or a timer needs us
+    uloop_init();
+    gps_conn_add_uloop(&conn);
+
+    // Push mode; if the subscriber can't be registered we simply keep polling
+    for (int i = 0; i < nsources; i++) {
+        gps_client_subscribe(&sources[i].gps);
+    }
+
+    stdin_fd.fd = STDIN_FILENO;
+    stdin_fd.cb = stdin_cb;
+    uloop_fd_add(&stdin_fd, ULOOP_READ);
+
+    if (signal_pipe[0] >= 0) {
+        signal_fd.fd = signal_pipe[0];
+        signal_fd.cb = signal_cb;
+        uloop_fd_add(&signal_fd, ULOOP_READ);
+    }
+
+    frame_timer.cb = frame_timer_cb;
+    clock_timer.cb = clock_timer_cb;
+    poll_timer.cb = poll_timer_cb;
+    clock_timer_cb(&clock_timer);
+    poll_timer_cb(&poll_timer);
+
+    uloop_run();
+
     // Cleanup
-    if (ctx) {
-        ubus_free(ctx);
+    uloop_timeout_cancel(&frame_timer);
+    uloop_timeout_cancel(&clock_timer);
+    uloop_timeout_cancel(&poll_timer);
+    uloop_fd_delete(&stdin_fd);
+    uloop_fd_delete(&signal_fd);
+    for (int i = 0; i < nsources; i++) {
+        gps_client_free(&sources[i].gps);
     }
-    
+    uloop_done();
+    gps_conn_free(&conn);
+    gps_history_free(&history);
+
     endwin();
+
+    for (int i = 0; i < nsources; i++) {
+        if (gps_trip_save(&sources[i].trip, sources[i].trip_path) != 0) {
+            fprintf(stderr, "Failed to save trip state %s\n", sources[i].trip_path);
+        }
+    }
+    free(sources);
+
+    if (debug) {
+        printf("Frames: %lu, bytes written: %llu (%.1f per frame)\n",
+               frames, term_bytes, frames ? (double)term_bytes / frames : 0.0);
+        print_latency(stdout);
+    }
     
     return 0;
 }
@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <libubus.h>
+#include <libubox/uloop.h>
+#include <libubox/blobmsg.h>
+
+#include "gps-fix.h"
+#include "gps-track.h"
+#include "gps-sched.h"
+
+// Stand-in for the gps daemon: registers a "gps" ubus object answering
+// "info" in the same shape as the real service and notifies subscribers of
+// every new fix, so gps-monitor and gps-logger can be exercised and
+// benchmarked on a plain Linux box running ubusd.
+//
+// Fixes come from a recorded track (any format gps-logger writes) replayed
+// in real time or N times faster, or from a synthetic circle when no track
+// is given. Replies can be delayed, dropped or damaged on purpose; all the
+// randomness comes from a seeded generator so a run can be repeated exactly.
+
+#define EARTH_RADIUS_M 6371000.0
+#define DEG_TO_RAD (M_PI / 180.0)
+
+// Deferred info replies in flight at once with -L
+#define MAX_PENDING 256
+
+static struct ubus_context *ctx = NULL;
+static struct blob_buf b;
+static struct uloop_timeout fix_timer;
+static int period_ms = 1000;
+static int notify = 1;
+
+// The fix being served and the monotonic time it became current
+static struct gps_fix current;
+static int64_t current_ns;
+
+// Synthetic track: a circle around a fixed centre at constant speed
+static struct {
+    double center_lat, center_lon;
+    double radius_m;
+    double speed_ms;
+    double angle;            // radians travelled around the circle
+} sim = {
+    .center_lat = 37.774929,
+    .center_lon = -122.419418,
+    .radius_m = 200.0,
+    .speed_ms = 5.0,
+};
+
+// Recorded track
+static FILE *track = NULL;
+static struct gps_track_reader reader;
+static int loop = 0;
+static double speed = 1.0;
+static struct {
+    struct gps_sample next;     // the sample due next
+    int64_t start_ns;           // monotonic time track time t0_ms is served
+    int64_t t0_ms;
+} replay;
+
+// Fault injection
+static int latency_ms = 0;
+static int jitter_ms = 0;
+static double drop_pct = 0;
+static double malformed_pct = 0;
+static uint64_t seed = 1;
+
+static struct pending {
+    struct ubus_request_data req;
+    struct uloop_timeout timeout;
+    int used;
+} pending[MAX_PENDING];
+
+// Ways a field of a reply gets damaged with -m
+enum {
+    DAMAGE_NONE,
+    DAMAGE_TEXT,        // not a number
+    DAMAGE_EMPTY,       // empty string
+    DAMAGE_MISSING,     // left out
+    DAMAGE_TYPE,        // u32 where a string is expected and vice versa
+    __DAMAGE_MAX,
+};
+
+static struct {
+    unsigned long fixes;
+    unsigned long notifications;
+    unsigned long replies;
+    unsigned long delayed;
+    unsigned long busy;         // -L pool full, answered at once
+    unsigned long dropped;
+    unsigned long malformed;
+    unsigned long loops;
+} stats;
+
+// xorshift64*: fast, and the same sequence for the same --seed everywhere
+static uint64_t rand_next(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545f4914f6cdd1dULL;
+}
+
+static int chance(double pct) {
+    return pct > 0 && (rand_next() >> 11) * (100.0 / 9007199254740992.0) < pct;
+}
+
+static void sim_step(double dt) {
+    sim.angle += sim.speed_ms * dt / sim.radius_m;
+    if (sim.angle >= 2 * M_PI) sim.angle -= 2 * M_PI;
+
+    double north = sim.radius_m * cos(sim.angle);
+    double east = sim.radius_m * sin(sim.angle);
+    current.latitude = lround((sim.center_lat + north / EARTH_RADIUS_M / DEG_TO_RAD) *
+                              GPS_FIX_DEGREE);
+    current.longitude = lround((sim.center_lon +
+        east / (EARTH_RADIUS_M * cos(sim.center_lat * DEG_TO_RAD)) / DEG_TO_RAD) * GPS_FIX_DEGREE);
+    current.elevation = lround((10.0 + 5.0 * sin(sim.angle * 2)) * GPS_FIX_METRE);
+    current.speed = lround(sim.speed_ms * GPS_FIX_MPS);
+
+    // Moving counter-clockwise seen from above, heading is tangent to the circle
+    current.course = lround(fmod(sim.angle / DEG_TO_RAD + 90.0, 360.0) * GPS_FIX_COURSE_DEGREE);
+
+    current.age = 0;
+    current.fields = GPS_FIX_ALL;
+    current_ns = gps_sched_now();
+}
+
+static void add_value(const char *name, int32_t value, int digits, int is_age, int damage) {
+    char buf[32];
+
+    switch (damage) {
+        case DAMAGE_TEXT:
+            blobmsg_add_string(&b, name, "n/a");
+            return;
+        case DAMAGE_EMPTY:
+            blobmsg_add_string(&b, name, "");
+            return;
+        case DAMAGE_MISSING:
+            return;
+        case DAMAGE_TYPE:
+            is_age = !is_age;
+            break;
+    }
+
+    if (is_age) {
+        for (int i = 0; i < digits; i++) value /= 10;
+        blobmsg_add_u32(&b, name, (uint32_t)value);
+    } else {
+        gps_decimal_format(buf, sizeof(buf), value, digits, 6);
+        blobmsg_add_string(&b, name, buf);
+    }
+}
+
+// Fill b with the current fix, formatted like the gps daemon's info reply
+static void fill_fix(void) {
+    const struct {
+        const char *name;
+        unsigned int field;
+        int32_t value;
+        int digits;
+    } fields[] = {
+        { "age", GPS_FIX_AGE,
+          current.age + (int32_t)((gps_sched_now() - current_ns) / 1000000000), 0 },
+        { "latitude", GPS_FIX_LATITUDE, current.latitude, GPS_FIX_DEGREE_DIGITS },
+        { "longitude", GPS_FIX_LONGITUDE, current.longitude, GPS_FIX_DEGREE_DIGITS },
+        { "elevation", GPS_FIX_ELEVATION, current.elevation, GPS_FIX_ELEVATION_DIGITS },
+        { "course", GPS_FIX_COURSE, current.course, GPS_FIX_COURSE_DIGITS },
+        { "speed", GPS_FIX_SPEED, current.speed, GPS_FIX_SPEED_DIGITS },
+    };
+    size_t bad = ARRAY_SIZE(fields);
+    int damage = DAMAGE_NONE;
+
+    if (chance(malformed_pct)) {
+        bad = rand_next() % ARRAY_SIZE(fields);
+        damage = 1 + rand_next() % (__DAMAGE_MAX - 1);
+        stats.malformed++;
+    }
+
+    blob_buf_init(&b, 0);
+    for (size_t i = 0; i < ARRAY_SIZE(fields); i++) {
+        if (!(current.fields & fields[i].field) && i != bad) continue;
+        add_value(fields[i].name, fields[i].value, fields[i].digits, i == 0,
+                  i == bad ? damage : DAMAGE_NONE);
+    }
+}
+
+static void pending_cb(struct uloop_timeout *t) {
+    struct pending *p = container_of(t, struct pending, timeout);
+
+    fill_fix();
+    ubus_send_reply(ctx, &p->req, b.head);
+    ubus_complete_deferred_request(ctx, &p->req, UBUS_STATUS_OK);
+    p->used = 0;
+    stats.replies++;
+}
+
+static int reply_delay(void) {
+    int delay = latency_ms;
+
+    if (jitter_ms > 0) {
+        delay += (int)(rand_next() % (2 * jitter_ms + 1)) - jitter_ms;
+    }
+    return delay > 0 ? delay : 0;
+}
+
+static int gps_info(struct ubus_context *ctx, struct ubus_object *obj,
+                    struct ubus_request_data *req, const char *method,
+                    struct blob_attr *msg) {
+    static struct ubus_request_data lost;
+
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    // A dropped request is deferred and never completed, so the caller
+    // sees nothing until its own timeout
+    if (chance(drop_pct)) {
+        ubus_defer_request(ctx, req, &lost);
+        stats.dropped++;
+        return UBUS_STATUS_OK;
+    }
+
+    if (latency_ms > 0 || jitter_ms > 0) {
+        for (int i = 0; i < MAX_PENDING; i++) {
+            struct pending *p = &pending[i];
+
+            if (p->used) continue;
+            ubus_defer_request(ctx, req, &p->req);
+            p->used = 1;
+            p->timeout.cb = pending_cb;
+            uloop_timeout_set(&p->timeout, reply_delay());
+            stats.delayed++;
+            return UBUS_STATUS_OK;
+        }
+        stats.busy++;
+    }
+
+    fill_fix();
+    ubus_send_reply(ctx, req, b.head);
+    stats.replies++;
+    return UBUS_STATUS_OK;
+}
+
+static const struct ubus_method gps_methods[] = {
+    UBUS_METHOD_NOARG("info", gps_info),
+};
+
+static struct ubus_object_type gps_object_type = UBUS_OBJECT_TYPE("gps", gps_methods);
+
+static struct ubus_object gps_object = {
+    .name = "gps",
+    .type = &gps_object_type,
+    .methods = gps_methods,
+    .n_methods = ARRAY_SIZE(gps_methods),
+};
+
+// Make fix current and push it to subscribers
+static void serve(const struct gps_fix *fix) {
+    current = *fix;
+    current_ns = gps_sched_now();
+    stats.fixes++;
+
+    if (!notify || !gps_object.has_subscribers) return;
+
+    if (chance(drop_pct)) {
+        stats.dropped++;
+        return;
+    }
+    fill_fix();
+    ubus_notify(ctx, &gps_object, "info", b.head, -1);
+    stats.notifications++;
+}
+
+static void sim_timer_cb(struct uloop_timeout *t) {
+    uloop_timeout_set(t, period_ms);
+    sim_step(period_ms / 1000.0);
+    serve(&current);
+}
+
+static int64_t sample_due(int64_t time_ms) {
+    return replay.start_ns + (int64_t)((time_ms - replay.t0_ms) * 1e6 / speed);
+}
+
+// Read the sample after replay.next, going back to the start of the track
+// with -l. Time going backwards (a loop, or a clock step in the recording)
+// restarts the schedule one period after the previous sample.
+static int track_next(void) {
+    struct gps_sample *s = &replay.next;
+    int64_t last_ms = s->time_ms;
+
+    if (!gps_track_reader_next(&reader, s)) {
+        if (!loop) return 0;
+
+        rewind(track);
+        if (gps_track_reader_open(&reader, track) != 0 ||
+            !gps_track_reader_next(&reader, s)) {
+            return 0;
+        }
+        stats.loops++;
+    }
+
+    if (s->time_ms < last_ms) {
+        replay.start_ns = sample_due(last_ms) + (int64_t)(period_ms * 1e6 / speed);
+        replay.t0_ms = s->time_ms;
+    }
+    return 1;
+}
+
+// Serve every sample that has come due; at high speeds that can be several
+// per wakeup, each one notified on its own
+static void replay_timer_cb(struct uloop_timeout *t) {
+    int64_t now = gps_sched_now();
+    int64_t due;
+
+    while ((due = sample_due(replay.next.time_ms)) <= now) {
+        serve(&replay.next.fix);
+        if (!track_next()) {
+            printf("End of track reached\n");
+            uloop_end();
+            return;
+        }
+    }
+
+    uloop_timeout_set(t, (int)((due - now + 999999) / 1000000));
+}
+
+static int open_track(const char *path) {
+    track = fopen(path, "r");
+    if (!track) {
+        fprintf(stderr, "Failed to open track file: %s\n", path);
+        return -1;
+    }
+
+    if (gps_track_reader_open(&reader, track) != 0) {
+        fprintf(stderr, "%s is not a csv, bin or delta track file\n", path);
+        return -1;
+    }
+
+    if (!gps_track_reader_next(&reader, &replay.next)) {
+        fprintf(stderr, "%s holds no fixes\n", path);
+        return -1;
+    }
+
+    replay.start_ns = gps_sched_now();
+    replay.t0_ms = replay.next.time_ms;
+    return 0;
+}
+
+static int parse_percent(const char *arg, double *pct) {
+    char *end;
+
+    *pct = strtod(arg, &end);
+    if (end == arg || *end || *pct < 0 || *pct > 100) {
+        fprintf(stderr, "Invalid percentage: %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_usage(const char *prog_name) {
+    printf("GPS Replay - Stand-in gps ubus object for testing and benchmarks\n\n");
+    printf("Usage: %s [OPTIONS]\n\n", prog_name);
+    printf("Options:\n");
+    printf("  -t, --track <file>        Replay a csv, bin or delta track (default: synthetic circle)\n");
+    printf("  -x, --speed <factor>      Replay speed, 1 is real time (default: 1)\n");
+    printf("  -l, --loop                Start the track over at the end instead of exiting\n");
+    printf("  -r, --rate <ms>           Time between synthetic fixes in milliseconds (default: 1000)\n");
+    printf("  -s, --service <name>      Ubus object name (default: gps)\n");
+    printf("  -u, --ubus <socket>       Ubus socket path (default: ubusd's own)\n");
+    printf("  -n, --no-notify           Only answer info, never notify subscribers\n");
+    printf("  -L, --latency <ms[:jit]>  Delay info replies by ms, +/- up to jit ms\n");
+    printf("  -d, --drop <percent>      Leave this share of requests and notifications unanswered\n");
+    printf("  -m, --malformed <percent> Damage one field of this share of replies\n");
+    printf("  -S, --seed <n>            Seed for the fault injection (default: 1)\n");
+    printf("  -h, --help                Show this help message\n");
+}
+
+int main(int argc, char **argv) {
+    const char *track_path = NULL;
+    const char *ubus_socket = NULL;
+    char *end;
+    int opt;
+
+    static struct option long_options[] = {
+        {"track",     required_argument, 0, 't'},
+        {"speed",     required_argument, 0, 'x'},
+        {"loop",      no_argument,       0, 'l'},
+        {"rate",      required_argument, 0, 'r'},
+        {"service",   required_argument, 0, 's'},
+        {"ubus",      required_argument, 0, 'u'},
+        {"no-notify", no_argument,       0, 'n'},
+        {"latency",   required_argument, 0, 'L'},
+        {"drop",      required_argument, 0, 'd'},
+        {"malformed", required_argument, 0, 'm'},
+        {"seed",      required_argument, 0, 'S'},
+        {"help",      no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:x:lr:s:u:nL:d:m:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                track_path = optarg;
+                break;
+            case 'x':
+                speed = strtod(optarg, &end);
+                if (end == optarg || *end || speed <= 0) {
+                    fprintf(stderr, "Invalid speed: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                loop = 1;
+                break;
+            case 'r':
+                period_ms = atoi(optarg);
+                if (period_ms <= 0) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                gps_object.name = optarg;
+                break;
+            case 'u':
+                ubus_socket = optarg;
+                break;
+            case 'n':
+                notify = 0;
+                break;
+            case 'L':
+                latency_ms = strtol(optarg, &end, 10);
+                if (*end == ':') jitter_ms = strtol(end + 1, &end, 10);
+                if (end == optarg || *end || latency_ms < 0 || jitter_ms < 0) {
+                    fprintf(stderr, "Invalid latency: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                if (parse_percent(optarg, &drop_pct) != 0) return 1;
+                break;
+            case 'm':
+                if (parse_percent(optarg, &malformed_pct) != 0) return 1;
+                break;
+            case 'S':
+                seed = strtoull(optarg, &end, 0);
+                if (end == optarg || *end) {
+                    fprintf(stderr, "Invalid seed: %s\n", optarg);
+                    return 1;
+                }
+                // xorshift never leaves zero
+                if (seed == 0) seed = 1;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (track_path && open_track(track_path) != 0) {
+        if (track) fclose(track);
+        return 1;
+    }
+
+    uloop_init();
+
+    ctx = ubus_connect(ubus_socket);
+    if (!ctx) {
+        fprintf(stderr, "Failed to connect to ubus\n");
+        return 1;
+    }
+    ubus_add_uloop(ctx);
+
+    if (ubus_add_object(ctx, &gps_object) != 0) {
+        fprintf(stderr, "Failed to register ubus object %s\n", gps_object.name);
+        ubus_free(ctx);
+        return 1;
+    }
+
+    if (track) {
+        fix_timer.cb = replay_timer_cb;
+        uloop_timeout_set(&fix_timer, 0);
+        printf("GPS Replay serving '%s' from %s (%s) at %gx%s\n",
+               gps_object.name, track_path, gps_track_format_name(reader.format),
+               speed, notify ? "" : " (notifications disabled)");
+    } else {
+        sim_step(0);
+        fix_timer.cb = sim_timer_cb;
+        uloop_timeout_set(&fix_timer, period_ms);
+        printf("GPS Replay serving '%s', synthetic fix every %d ms%s\n",
+               gps_object.name, period_ms, notify ? "" : " (notifications disabled)");
+    }
+    fflush(stdout);
+
+    uloop_run();
+
+    printf("\nGPS Replay stopped after %lu fixes: %lu notifications, %lu replies\n",
+           stats.fixes, stats.notifications, stats.replies);
+    if (latency_ms > 0 || jitter_ms > 0) {
+        printf("Delayed %lu replies, %lu answered at once with all %d slots busy\n",
+               stats.delayed, stats.busy, MAX_PENDING);
+    }
+    if (drop_pct > 0 || malformed_pct > 0) {
+        printf("Dropped %lu, damaged %lu\n", stats.dropped, stats.malformed);
+    }
+    if (track) {
+        if (loop) printf("Track restarted %lu times\n", stats.loops);
+        if (reader.skipped || reader.resyncs) {
+            printf("Skipped %lu unreadable rows, resynchronised %lu times\n",
+                   reader.skipped, reader.resyncs);
+        }
+        fclose(track);
+    }
+
+    ubus_free(ctx);
+    uloop_done();
+    blob_buf_free(&b);
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "gps-sched.h"
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int64_t gps_sched_now(void) {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+// How long after its deadline the current tick is being handled
+int64_t gps_sched_lateness(const struct gps_sched *s) {
+    return gps_sched_now() - s->deadline_ns;
+}
+
+static void sched_fd_cb(struct uloop_fd *u, unsigned int events) {
+    struct gps_sched *s = container_of(u, struct gps_sched, fd);
+    uint64_t expirations;
+    int64_t late;
+
+    (void)events;
+    if (read(u->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    // The timer re-arms itself in the kernel; if we were blocked for more
+    // than a period, the skipped deadlines are counted and not replayed
+    s->deadline_ns += (int64_t)expirations * s->period_ns;
+    s->stats.missed += expirations - 1;
+    s->stats.ticks++;
+
+    late = gps_sched_lateness(s);
+    if (late > GPS_SCHED_LATE_NS) s->stats.late++;
+    if (late > s->stats.max_late_ns) s->stats.max_late_ns = late;
+    s->stats.sum_late_ns += late;
+
+    s->cb(s);
+}
+
+// Start ticking every period_ns. The first tick is immediate, or with align
+// on the next multiple of the period in wall-clock time, so one second
+// periods land on whole seconds.
+int gps_sched_start(struct gps_sched *s, int64_t period_ns, int align) {
+    struct itimerspec its;
+    int64_t first = gps_sched_now();
+
+    if (align) {
+        first += period_ns - clock_ns(CLOCK_REALTIME) % period_ns;
+    }
+
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->period_ns = period_ns;
+    s->deadline_ns = first - period_ns;
+
+    s->fd.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->fd.fd < 0) {
+        fprintf(stderr, "timerfd_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    its.it_value.tv_sec = first / 1000000000LL;
+    its.it_value.tv_nsec = first % 1000000000LL;
+    its.it_interval.tv_sec = period_ns / 1000000000LL;
+    its.it_interval.tv_nsec = period_ns % 1000000000LL;
+    if (timerfd_settime(s->fd.fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        fprintf(stderr, "timerfd_settime failed: %s\n", strerror(errno));
+        close(s->fd.fd);
+        s->fd.fd = -1;
+        return -1;
+    }
+
+    s->fd.cb = sched_fd_cb;
+    uloop_fd_add(&s->fd, ULOOP_READ);
+    return 0;
+}
+
+// Change the period from the next tick on. The next deadline moves to one
+// new period after the last tick, or now if that has already passed.
+int gps_sched_set_period(struct gps_sched *s, int64_t period_ns) {
+    struct itimerspec its;
+    int64_t next = s->deadline_ns + period_ns;
+    int64_t now = gps_sched_now();
+
+    if (period_ns == s->period_ns) return 0;
+    if (next < now) next = now;
+
+    its.it_value.tv_sec = next / 1000000000LL;
+    its.it_value.tv_nsec = next % 1000000000LL;
+    its.it_interval.tv_sec = period_ns / 1000000000LL;
+    its.it_interval.tv_nsec = period_ns % 1000000000LL;
+    if (timerfd_settime(s->fd.fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        fprintf(stderr, "timerfd_settime failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Expirations are counted from the new first deadline
+    s->deadline_ns = next - period_ns;
+    s->period_ns = period_ns;
+    return 0;
+}
+
+void gps_sched_stop(struct gps_sched *s) {
+    if (!s->fd.registered) return;
+
+    uloop_fd_delete(&s->fd);
+    close(s->fd.fd);
+    s->fd.fd = -1;
+}
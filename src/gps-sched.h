@@ -0,0 +1,32 @@
+#ifndef GPS_SCHED_H
+#define GPS_SCHED_H
+
+#include <stdint.h>
+#include <libubox/uloop.h>
+
+// A tick is counted late when it is handled this long after its deadline
+#define GPS_SCHED_LATE_NS (10 * 1000000LL)
+
+// Periodic ticks on absolute CLOCK_MONOTONIC deadlines (a timerfd in the
+// uloop), so the period never stretches by the time spent handling a tick.
+struct gps_sched {
+    struct uloop_fd fd;
+    int64_t period_ns;
+    int64_t deadline_ns;        // deadline of the tick being handled
+    void (*cb)(struct gps_sched *s);
+    struct {
+        unsigned long ticks;    // callbacks run
+        unsigned long late;     // ticks handled more than GPS_SCHED_LATE_NS late
+        unsigned long missed;   // deadlines that passed without a callback
+        int64_t max_late_ns;
+        int64_t sum_late_ns;
+    } stats;
+};
+
+int gps_sched_start(struct gps_sched *s, int64_t period_ns, int align);
+int gps_sched_set_period(struct gps_sched *s, int64_t period_ns);
+void gps_sched_stop(struct gps_sched *s);
+int64_t gps_sched_lateness(const struct gps_sched *s);
+int64_t gps_sched_now(void);
+
+#endif
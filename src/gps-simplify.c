@@ -0,0 +1,145 @@
+#include <math.h>
+#include <string.h>
+
+#include "gps-simplify.h"
+
+#define METRES_PER_DEGREE 111194.93     // on a sphere of radius 6371 km
+#define DEG_TO_RAD (M_PI / 180.0)
+
+void gps_simplify_init(struct gps_simplify *sp, double tolerance, int64_t max_gap_ms) {
+    memset(sp, 0, sizeof(*sp));
+    sp->tolerance = tolerance;
+    sp->max_gap_ms = max_gap_ms;
+}
+
+static void set_anchor(struct gps_simplify *sp, const struct gps_sample *s) {
+    sp->anchor = *s;
+    sp->have_anchor = 1;
+    sp->cone = 0;
+    sp->reach = 0;
+    sp->scale_x = METRES_PER_DEGREE / GPS_FIX_DEGREE *
+                  cos((double)s->fix.latitude / GPS_FIX_DEGREE * DEG_TO_RAD);
+}
+
+static double wrap(double a) {
+    while (a > M_PI) a -= 2 * M_PI;
+    while (a <= -M_PI) a += 2 * M_PI;
+    return a;
+}
+
+// Position relative to the anchor in metres, east and north
+static double offset(const struct gps_simplify *sp, const struct gps_sample *s,
+                     double *x, double *y) {
+    *x = (double)(s->fix.longitude - sp->anchor.fix.longitude) * sp->scale_x;
+    *y = (double)(s->fix.latitude - sp->anchor.fix.latitude) * METRES_PER_DEGREE / GPS_FIX_DEGREE;
+    return sqrt(*x * *x + *y * *y);
+}
+
+// Whether the line from the anchor to s passes within the tolerance of
+// every fix since the anchor. The cone bounds the distance to the ray from
+// the anchor; s being the farthest fix so far keeps each one alongside the
+// segment rather than beyond its end.
+static int fits(const struct gps_simplify *sp, const struct gps_sample *s) {
+    double x, y, d = offset(sp, s, &x, &y);
+    double rel;
+
+    if (s->fix.fields != sp->anchor.fix.fields) return 0;
+    if (!sp->cone) return 1;
+    if (d < sp->reach) return 0;
+
+    rel = wrap(atan2(y, x) - sp->ref);
+    return rel >= sp->lo && rel <= sp->hi;
+}
+
+// Narrow the cone to the directions passing within the tolerance of s
+static void narrow(struct gps_simplify *sp, const struct gps_sample *s) {
+    double x, y, d = offset(sp, s, &x, &y);
+    double half, rel;
+
+    if (d > sp->reach) sp->reach = d;
+
+    // Any line from the anchor passes close enough to a fix this near
+    if (d <= sp->tolerance) return;
+
+    half = asin(sp->tolerance / d);
+    if (!sp->cone) {
+        sp->ref = atan2(y, x);
+        sp->lo = -half;
+        sp->hi = half;
+        sp->cone = 1;
+        return;
+    }
+
+    rel = wrap(atan2(y, x) - sp->ref);
+    if (rel - half > sp->lo) sp->lo = rel - half;
+    if (rel + half < sp->hi) sp->hi = rel + half;
+}
+
+// Take in the next fix. Returns how many fixes to keep, in order, in out:
+// none while s may still be dropped, up to two when it ends a line.
+int gps_simplify_add(struct gps_simplify *sp, const struct gps_sample *s,
+                     struct gps_sample out[2]) {
+    int n = 0;
+
+    sp->stats.in++;
+
+    // Without a position there is no line to put it on: keep it, and start
+    // again from the next fix that has one
+    if ((s->fix.fields & GPS_FIX_POSITION) != GPS_FIX_POSITION) {
+        if (sp->have_held) out[n++] = sp->held;
+        out[n++] = *s;
+        sp->have_held = 0;
+        sp->have_anchor = 0;
+        sp->stats.out += n;
+        return n;
+    }
+
+    if (!sp->have_anchor) {
+        set_anchor(sp, s);
+        out[n++] = *s;
+        sp->stats.out += n;
+        return n;
+    }
+
+    // s is off the line: it ends at the fix before, which becomes the anchor
+    if (!fits(sp, s)) {
+        if (sp->have_held) {
+            out[n++] = sp->held;
+            set_anchor(sp, &sp->held);
+            sp->have_held = 0;
+        }
+        if (n == 0 || !fits(sp, s)) {
+            out[n++] = *s;
+            set_anchor(sp, s);
+            sp->stats.out += n;
+            return n;
+        }
+    }
+
+    narrow(sp, s);
+
+    // s is a valid end, keep it so no stretch goes unrecorded for too long
+    if (sp->max_gap_ms && s->time_ms - sp->anchor.time_ms >= sp->max_gap_ms) {
+        out[n++] = *s;
+        set_anchor(sp, s);
+        sp->have_held = 0;
+        sp->stats.out += n;
+        return n;
+    }
+
+    sp->held = *s;
+    sp->have_held = 1;
+    sp->stats.out += n;
+    return n;
+}
+
+// Give up the held fix, at the end of the track
+int gps_simplify_flush(struct gps_simplify *sp, struct gps_sample *out) {
+    if (!sp->have_held) return 0;
+
+    *out = sp->held;
+    set_anchor(sp, &sp->held);
+    sp->have_held = 0;
+    sp->stats.out++;
+    return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef GPS_SIMPLIFY_H
+#define GPS_SIMPLIFY_H
+
+#include <stdint.h>
+
+#include "gps-track.h"
+
+// Streaming track simplification with a bound on the cross-track error.
+// Kept fixes are joined by straight lines; a fix is dropped only if every
+// fix between the last kept one (the anchor) and the next kept one lies
+// within `tolerance` metres of the line between them. Each fix narrows the
+// range of directions from the anchor that a line may take: the cone of
+// directions passing within the tolerance of it. A fix pointing outside
+// the cone ends the line at the fix before it, which is kept and becomes
+// the next anchor.
+//
+// The last fix is held back until the next one shows whether it is needed,
+// so output lags input by one fix. Memory is constant and each fix costs a
+// handful of trigonometric calls.
+struct gps_simplify {
+    double tolerance;           // metres
+    int64_t max_gap_ms;         // longest time between kept fixes, 0 for none
+    struct gps_sample anchor;   // last kept fix
+    struct gps_sample held;     // latest fix, not kept yet
+    int have_anchor, have_held;
+    double scale_x;             // metres per fix unit (1e-6 degree) of longitude at the anchor
+    int cone;                   // a direction range is set
+    double ref;                 // direction of the range's first fix, radians
+    double lo, hi;              // allowed directions relative to ref
+    double reach;               // farthest distance from the anchor so far
+    struct {
+        unsigned long in;
+        unsigned long out;
+    } stats;
+};
+
+void gps_simplify_init(struct gps_simplify *sp, double tolerance, int64_t max_gap_ms);
+int gps_simplify_add(struct gps_simplify *sp, const struct gps_sample *s,
+                     struct gps_sample out[2]);
+int gps_simplify_flush(struct gps_simplify *sp, struct gps_sample *out);
+
+#endif
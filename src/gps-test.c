@@ -0,0 +1,439 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+
+#include "gps-fix.h"
+#include "gpsclient.h"
+
+// Checks libgpsclient against a stand-in gps object behind a private ubusd,
+// so nothing else on the box is touched. The stand-in is this program run
+// as `gps-test serve`, in its own process so that a blocking fetch in the
+// test cannot stall it. Run by `make test`; UBUSD overrides the ubusd
+// started.
+
+#define FIX_ALL (GPS_FIX_LATITUDE | GPS_FIX_LONGITUDE | GPS_FIX_ELEVATION | \
+                 GPS_FIX_SPEED | GPS_FIX_COURSE | GPS_FIX_AGE)
+
+// How the stand-in can damage one field of its replies
+enum {
+    DAMAGE_NONE,
+    DAMAGE_TEXT,                // not a number
+    DAMAGE_EMPTY,               // an empty string
+    DAMAGE_MISSING,             // left out
+    DAMAGE_TYPE,                // a string sent as an integer and the other way round
+    __DAMAGE_MAX,
+};
+
+static const char *const damage_names[__DAMAGE_MAX] = {
+    [DAMAGE_NONE] = "none",
+    [DAMAGE_TEXT] = "text",
+    [DAMAGE_EMPTY] = "empty",
+    [DAMAGE_MISSING] = "missing",
+    [DAMAGE_TYPE] = "type",
+};
+
+// The stand-in's one fix, shaped like the gps daemon's info reply: strings,
+// but the age an integer
+static const struct {
+    const char *name;
+    const char *value;
+    int is_int;
+} fix_fields[] = {
+    { "age", "1", 1 },
+    { "latitude", "37.774900", 0 },
+    { "longitude", "-122.419400", 0 },
+    { "elevation", "16.0", 0 },
+    { "course", "90.0", 0 },
+    { "speed", "1.5", 0 },
+};
+
+static struct {
+    char socket[64];
+    pid_t ubusd;
+    pid_t service;
+    struct gps_conn conn;
+    struct gps_client gps;
+    struct uloop_timeout deadline;
+    int completed;              // async fetches completed, timed out included
+    int ret;                    // status of the last one
+    int failures;
+} t;
+
+// The stand-in, in the serving process
+static struct svc_pending {
+    struct ubus_request_data dreq;
+    struct uloop_timeout reply;
+    int busy;
+} svc_pending[8];
+
+static struct {
+    struct ubus_context *ctx;
+    struct blob_buf b;
+    int delay_ms;
+    const char *field;          // field to damage, NULL for none
+    int damage;
+    struct uloop_timeout notify;
+} svc;
+
+static void svc_fill(void) {
+    blob_buf_init(&svc.b, 0);
+    for (size_t i = 0; i < ARRAY_SIZE(fix_fields); i++) {
+        const char *name = fix_fields[i].name, *value = fix_fields[i].value;
+        int damage = svc.field && strcmp(svc.field, name) == 0 ? svc.damage : DAMAGE_NONE;
+        int as_int = fix_fields[i].is_int;
+
+        switch (damage) {
+            case DAMAGE_TEXT:
+                blobmsg_add_string(&svc.b, name, "n/a");
+                continue;
+            case DAMAGE_EMPTY:
+                blobmsg_add_string(&svc.b, name, "");
+                continue;
+            case DAMAGE_MISSING:
+                continue;
+            case DAMAGE_TYPE:
+                as_int = !as_int;
+                break;
+        }
+        if (as_int) {
+            blobmsg_add_u32(&svc.b, name, atoi(value));
+        } else {
+            blobmsg_add_string(&svc.b, name, value);
+        }
+    }
+}
+
+static void svc_reply_cb(struct uloop_timeout *to) {
+    struct svc_pending *p = container_of(to, struct svc_pending, reply);
+
+    svc_fill();
+    ubus_send_reply(svc.ctx, &p->dreq, svc.b.head);
+    ubus_complete_deferred_request(svc.ctx, &p->dreq, UBUS_STATUS_OK);
+    p->busy = 0;
+}
+
+// Answer after the delay, without holding up other requests
+static int svc_info(struct ubus_context *ctx, struct ubus_object *obj,
+                    struct ubus_request_data *req, const char *method,
+                    struct blob_attr *msg) {
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    for (size_t i = 0; i < ARRAY_SIZE(svc_pending); i++) {
+        struct svc_pending *p = &svc_pending[i];
+
+        if (p->busy) continue;
+        p->busy = 1;
+        p->reply.cb = svc_reply_cb;
+        ubus_defer_request(ctx, req, &p->dreq);
+        uloop_timeout_set(&p->reply, svc.delay_ms);
+        return UBUS_STATUS_OK;
+    }
+    return UBUS_STATUS_UNKNOWN_ERROR;
+}
+
+static const struct ubus_method svc_methods[] = {
+    UBUS_METHOD_NOARG("info", svc_info),
+};
+
+static struct ubus_object_type svc_type = UBUS_OBJECT_TYPE("gps", svc_methods);
+
+static struct ubus_object svc_object = {
+    .name = "gps",
+    .type = &svc_type,
+    .methods = svc_methods,
+    .n_methods = ARRAY_SIZE(svc_methods),
+};
+
+// Push the fix to subscribers every 100 ms
+static void svc_notify_cb(struct uloop_timeout *to) {
+    if (svc_object.has_subscribers) {
+        svc_fill();
+        ubus_notify(svc.ctx, &svc_object, "info", svc.b.head, -1);
+    }
+    uloop_timeout_set(to, 100);
+}
+
+// gps-test serve <socket> <delay ms> [<field> <damage>]: register the
+// stand-in gps object and serve it until SIGTERM
+static int serve(int argc, char **argv) {
+    if (argc < 3) return 1;
+    svc.delay_ms = atoi(argv[2]);
+    if (argc > 4) {
+        svc.field = argv[3];
+        for (int i = 0; i < __DAMAGE_MAX; i++) {
+            if (strcmp(damage_names[i], argv[4]) == 0) svc.damage = i;
+        }
+    }
+
+    uloop_init();
+    svc.ctx = ubus_connect(argv[1]);
+    if (!svc.ctx) return 1;
+    ubus_add_uloop(svc.ctx);
+    if (ubus_add_object(svc.ctx, &svc_object) != 0) return 1;
+
+    svc.notify.cb = svc_notify_cb;
+    uloop_timeout_set(&svc.notify, 100);
+    uloop_run();
+
+    ubus_free(svc.ctx);
+    uloop_done();
+    blob_buf_free(&svc.b);
+    return 0;
+}
+
+static pid_t spawn(char *const argv[]) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "Failed to run %s\n", argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop(pid_t *pid) {
+    if (*pid <= 0) return;
+    kill(*pid, SIGTERM);
+    waitpid(*pid, NULL, 0);
+    *pid = 0;
+}
+
+// Wait until the private ubusd takes connections
+static int wait_ubusd(void) {
+    struct ubus_context *ctx;
+
+    for (int i = 0; i < 100; i++) {
+        ctx = ubus_connect(t.socket);
+        if (ctx) {
+            ubus_free(ctx);
+            return 0;
+        }
+        usleep(20000);
+    }
+    return -1;
+}
+
+// Wait until the gps object is registered on the private ubusd
+static int wait_ready(void) {
+    struct ubus_context *ctx = NULL;
+    uint32_t id;
+
+    for (int i = 0; i < 100; i++) {
+        if (!ctx) ctx = ubus_connect(t.socket);
+        if (ctx && ubus_lookup_id(ctx, "gps", &id) == 0) {
+            ubus_free(ctx);
+            return 0;
+        }
+        usleep(20000);
+    }
+    if (ctx) ubus_free(ctx);
+    return -1;
+}
+
+// Start the stand-in answering info after delay ms, one field damaged as
+// damage says when field is given
+static int start_service(const char *delay, const char *field, const char *damage) {
+    char *argv[] = { "/proc/self/exe", "serve", t.socket, (char *)delay,
+                     (char *)field, (char *)damage, NULL };
+
+    t.service = spawn(argv);
+    if (t.service < 0 || wait_ready() != 0) {
+        fprintf(stderr, "the stand-in gps object did not come up\n");
+        stop(&t.service);
+        return -1;
+    }
+    return 0;
+}
+
+static void check(int ok, const char *what) {
+    printf("  %-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) t.failures++;
+}
+
+static int has_position(const struct gps_fix *fix) {
+    return (fix->fields & GPS_FIX_POSITION) == GPS_FIX_POSITION;
+}
+
+static void deadline_cb(struct uloop_timeout *to) {
+    (void)to;
+    uloop_end();
+}
+
+// Let uloop deliver replies, notifications and object events for ms
+static void run_for(int ms) {
+    uloop_timeout_set(&t.deadline, ms);
+    uloop_run();
+    uloop_timeout_cancel(&t.deadline);
+}
+
+static void complete_cb(struct gps_client *cl, int ret) {
+    (void)cl;
+    t.completed++;
+    t.ret = ret;
+    uloop_end();
+}
+
+static void test_lookup(void) {
+    uint32_t id = 0;
+
+    printf("lookup\n");
+    check(gps_client_lookup(&t.gps, &id) == 0 && t.gps.id_valid && t.gps.id == id,
+          "finds the gps object");
+    check(gps_client_lookup(&t.gps, &id) == 0 && t.gps.stats.lookups == 1,
+          "keeps the id instead of asking ubusd again");
+}
+
+static void test_fetch(void) {
+    printf("fetch\n");
+    check(gps_client_fetch(&t.gps, 1000) == 0 && t.gps.fix.fields == FIX_ALL,
+          "blocking fetch decodes a fix");
+    check(t.gps.fix.latitude == 37774900 && t.gps.fix.longitude == -122419400 &&
+          t.gps.fix.age == 1, "with the values sent");
+
+    t.completed = 0;
+    check(gps_client_fetch_async(&t.gps, 1000) == 0, "async fetch is sent");
+    check(gps_client_fetch_async(&t.gps, 1000) == -1, "a second one waits for the first");
+    run_for(2000);
+    check(t.completed == 1 && t.ret == UBUS_STATUS_OK && has_position(&t.gps.fix),
+          "async fetch completes with a fix");
+}
+
+static void test_subscribe(void) {
+    unsigned long n;
+
+    printf("subscribe\n");
+    check(gps_client_subscribe(&t.gps) == 0 && t.gps.subscribed, "subscribes to the object");
+    run_for(1000);
+    check(t.gps.stats.notifications > 0 && has_position(&t.gps.fix), "fixes are pushed");
+
+    // The gps service restarts under a new object id, this time slow to
+    // answer info for the timeout check below
+    stop(&t.service);
+    run_for(300);
+    check(!t.gps.id_valid && !t.gps.subscribed, "drops the id when the object goes away");
+    if (start_service("1000", NULL, NULL) != 0) {
+        t.failures++;
+        return;
+    }
+    n = t.gps.stats.notifications;
+    run_for(1000);
+    check(t.gps.id_valid && t.gps.subscribed && t.gps.stats.lookups == 1,
+          "picks up the new id from ubusd's event and resubscribes");
+    check(t.gps.stats.notifications > n, "fixes are pushed again");
+}
+
+static void test_timeout(void) {
+    printf("timeout\n");
+    t.completed = 0;
+    check(gps_client_fetch_async(&t.gps, 200) == 0, "async fetch is sent");
+    run_for(2000);
+    check(t.completed == 1 && t.ret == UBUS_STATUS_TIMEOUT && t.gps.stats.timeouts == 1,
+          "a reply later than the timeout completes it as timed out");
+    check(!t.gps.req_pending && gps_client_fetch_async(&t.gps, 2000) == 0,
+          "the next fetch can be sent");
+    run_for(3000);
+    check(t.completed == 2 && t.ret == UBUS_STATUS_OK && has_position(&t.gps.fix),
+          "and gets its reply");
+}
+
+// Restart the stand-in damaging field in every reply and fetch once
+static int fetch_damaged(const char *field, const char *damage) {
+    stop(&t.service);
+    if (start_service("0", field, damage) != 0) return -1;
+    run_for(300);
+    return gps_client_fetch(&t.gps, 1000);
+}
+
+static void test_malformed(void) {
+    static const struct {
+        const char *field;
+        const char *damage;
+        unsigned int lost;
+        const char *what;
+    } cases[] = {
+        { "latitude", "text", GPS_FIX_LATITUDE, "a field that is not a number is left out" },
+        { "elevation", "empty", GPS_FIX_ELEVATION, "an empty field is left out" },
+        { "speed", "missing", GPS_FIX_SPEED, "a missing field is left out" },
+    };
+
+    printf("malformed\n");
+    for (size_t i = 0; i < ARRAY_SIZE(cases); i++) {
+        check(fetch_damaged(cases[i].field, cases[i].damage) == 0 &&
+              t.gps.fix.fields == (FIX_ALL & ~cases[i].lost), cases[i].what);
+    }
+
+    check(fetch_damaged("latitude", "type") == 0 && t.gps.fix.fields == FIX_ALL &&
+          t.gps.fix.latitude == 37 * GPS_FIX_DEGREE,
+          "a u32 latitude is read as whole degrees");
+    check(fetch_damaged("age", "type") == 0 && t.gps.fix.fields == FIX_ALL &&
+          t.gps.fix.age == 1,
+          "an age sent as a string is read");
+}
+
+int main(int argc, char **argv) {
+    char *ubusd_argv[] = { getenv("UBUSD") ? getenv("UBUSD") : "ubusd",
+                           "-s", t.socket, NULL };
+
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return serve(argc - 1, argv + 1);
+    }
+
+    snprintf(t.socket, sizeof(t.socket), "/tmp/gps-test-%d.sock", (int)getpid());
+    t.ubusd = spawn(ubusd_argv);
+    if (t.ubusd < 0) return 1;
+    if (wait_ubusd() != 0) {
+        fprintf(stderr, "ubusd did not come up; set UBUSD to its path\n");
+        stop(&t.ubusd);
+        unlink(t.socket);
+        return 1;
+    }
+    if (start_service("0", NULL, NULL) != 0) {
+        stop(&t.ubusd);
+        unlink(t.socket);
+        return 1;
+    }
+
+    uloop_init();
+    t.deadline.cb = deadline_cb;
+    if (gps_conn_init(&t.conn, t.socket) != 0) {
+        fprintf(stderr, "Failed to connect to %s\n", t.socket);
+        t.failures++;
+    } else {
+        gps_conn_add_uloop(&t.conn);
+        gps_client_init(&t.gps, &t.conn, "gps");
+        t.gps.complete_cb = complete_cb;
+
+        test_lookup();
+        test_fetch();
+        test_subscribe();
+        test_timeout();
+        test_malformed();
+
+        gps_client_free(&t.gps);
+        gps_conn_free(&t.conn);
+    }
+    uloop_done();
+
+    stop(&t.service);
+    stop(&t.ubusd);
+    unlink(t.socket);
+
+    printf("%s\n", t.failures ? "FAILED" : "passed");
+    return t.failures ? 1 : 0;
+}
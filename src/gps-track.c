@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gps-track.h"
+
+static const char *format_names[] = {
+    [GPS_TRACK_CSV] = "csv",
+    [GPS_TRACK_BIN] = "bin",
+    [GPS_TRACK_DELTA] = "delta",
+};
+
+const char *gps_track_format_name(enum gps_track_format format) {
+    return format_names[format];
+}
+
+int gps_track_format_parse(const char *name, enum gps_track_format *format) {
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            *format = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Little-endian helpers, independent of the host byte order
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+    return p[0] | (uint16_t)p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static int64_t clamp(int64_t v, int64_t min, int64_t max) {
+    return v < min ? min : v > max ? max : v;
+}
+
+// Fixed-point values stored by both binary formats, indexed by GPS_TRACK_Q_*
+enum {
+    GPS_TRACK_Q_TIME,
+    GPS_TRACK_Q_LATITUDE,
+    GPS_TRACK_Q_LONGITUDE,
+    GPS_TRACK_Q_ELEVATION,
+    GPS_TRACK_Q_SPEED,
+    GPS_TRACK_Q_COURSE,
+    GPS_TRACK_Q_AGE,
+    __GPS_TRACK_Q_MAX
+};
+
+// The fix is already fixed-point; only speed is stored coarser, in cm/s
+static void quantize(int64_t *q, const struct gps_sample *s) {
+    const struct gps_fix *fix = &s->fix;
+
+    q[GPS_TRACK_Q_TIME] = s->time_ms;
+    q[GPS_TRACK_Q_LATITUDE] = fix->latitude;
+    q[GPS_TRACK_Q_LONGITUDE] = fix->longitude;
+    q[GPS_TRACK_Q_ELEVATION] = fix->elevation;
+    q[GPS_TRACK_Q_SPEED] = clamp(((int64_t)fix->speed + 5) / 10, 0, UINT16_MAX);
+    q[GPS_TRACK_Q_COURSE] = clamp(fix->course, 0, UINT16_MAX);
+    q[GPS_TRACK_Q_AGE] = clamp(fix->age, 0, 255);
+}
+
+static void dequantize(struct gps_sample *s, const int64_t *q, unsigned int fields) {
+    struct gps_fix *fix = &s->fix;
+
+    s->time_ms = q[GPS_TRACK_Q_TIME];
+    fix->latitude = q[GPS_TRACK_Q_LATITUDE];
+    fix->longitude = q[GPS_TRACK_Q_LONGITUDE];
+    fix->elevation = q[GPS_TRACK_Q_ELEVATION];
+    fix->speed = q[GPS_TRACK_Q_SPEED] * 10;
+    fix->course = q[GPS_TRACK_Q_COURSE];
+    fix->age = q[GPS_TRACK_Q_AGE];
+    fix->fields = fields;
+}
+
+size_t gps_track_csv_header(char *buf, size_t len) {
+    return snprintf(buf, len, "timestamp,latitude,longitude,speed,elevation,course,age\n");
+}
+
+// Header for rows written by gps_track_csv_format_smoothed()
+size_t gps_track_csv_header_smoothed(char *buf, size_t len) {
+    return snprintf(buf, len, "timestamp,latitude,longitude,speed,elevation,course,age,"
+                    "smooth_latitude,smooth_longitude,smooth_speed,smooth_elevation,"
+                    "smooth_course\n");
+}
+
+// Values of one fix as CSV fields, missing ones empty
+struct csv_fields {
+    char lat[16], lon[16], speed[16], elevation[16], course[16];
+};
+
+// To the resolution of the bin record: speed in cm/s, elevation in cm and
+// course in 1/100 degree. Elevation and course had one decimal until the
+// fixed-point rework; the parser reads either.
+static void csv_fields(struct csv_fields *f, const struct gps_fix *fix) {
+    memset(f, 0, sizeof(*f));
+    if (fix->fields & GPS_FIX_LATITUDE)
+        gps_decimal_format(f->lat, sizeof(f->lat), fix->latitude, GPS_FIX_DEGREE_DIGITS, 6);
+    if (fix->fields & GPS_FIX_LONGITUDE)
+        gps_decimal_format(f->lon, sizeof(f->lon), fix->longitude, GPS_FIX_DEGREE_DIGITS, 6);
+    if (fix->fields & GPS_FIX_SPEED)
+        gps_decimal_format(f->speed, sizeof(f->speed), fix->speed, GPS_FIX_SPEED_DIGITS, 2);
+    if (fix->fields & GPS_FIX_ELEVATION)
+        gps_decimal_format(f->elevation, sizeof(f->elevation), fix->elevation,
+                           GPS_FIX_ELEVATION_DIGITS, 2);
+    if (fix->fields & GPS_FIX_COURSE)
+        gps_decimal_format(f->course, sizeof(f->course), fix->course, GPS_FIX_COURSE_DIGITS, 2);
+}
+
+// Local time to the millisecond, so rows sampled faster than once a second
+// keep their order and spacing
+static void csv_timestamp(char *buf, size_t len, int64_t time_ms) {
+    time_t when = time_ms / 1000;
+    int ms = time_ms % 1000;
+    struct tm t;
+    size_t n;
+
+    if (ms < 0) {
+        ms += 1000;
+        when--;
+    }
+    localtime_r(&when, &t);
+    n = strftime(buf, len, "%Y-%m-%d %H:%M:%S", &t);
+    snprintf(buf + n, len - n, ".%03d", ms);
+}
+
+// Format one CSV row; fields missing from the fix are left empty
+size_t gps_track_csv_format(char *buf, size_t len, const struct gps_sample *s) {
+    const struct gps_fix *fix = &s->fix;
+    struct csv_fields f;
+    char when[32], age[16] = "";
+
+    csv_timestamp(when, sizeof(when), s->time_ms);
+    csv_fields(&f, fix);
+    if (fix->fields & GPS_FIX_AGE)
+        snprintf(age, sizeof(age), "%d", fix->age);
+
+    // timestamp,latitude,longitude,speed,elevation,course,age
+    return snprintf(buf, len, "%s,%s,%s,%s,%s,%s,%s\n",
+                    when, f.lat, f.lon, f.speed, f.elevation, f.course, age);
+}
+
+// A row as above followed by a smoothed copy of the fix. Readers of the
+// plain format stop after age, so these files still read back as the raw
+// track.
+size_t gps_track_csv_format_smoothed(char *buf, size_t len, const struct gps_sample *s,
+                                     const struct gps_fix *smoothed) {
+    const struct gps_fix *fix = &s->fix;
+    struct csv_fields f, sm;
+    char when[32], age[16] = "";
+
+    csv_timestamp(when, sizeof(when), s->time_ms);
+    csv_fields(&f, fix);
+    csv_fields(&sm, smoothed);
+    if (fix->fields & GPS_FIX_AGE)
+        snprintf(age, sizeof(age), "%d", fix->age);
+
+    return snprintf(buf, len, "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n",
+                    when, f.lat, f.lon, f.speed, f.elevation, f.course, age,
+                    sm.lat, sm.lon, sm.speed, sm.elevation, sm.course);
+}
+
+// Parse a row written by gps_track_csv_format(); empty fields are missing
+// from the fix. Seconds without milliseconds, as older logs have them, are
+// read too. Returns -1 for the header line or a malformed row.
+int gps_track_csv_parse(const char *line, struct gps_sample *s) {
+    int32_t *dest[] = {
+        &s->fix.latitude, &s->fix.longitude, &s->fix.speed,
+        &s->fix.elevation, &s->fix.course, NULL,
+    };
+    static const unsigned int bits[] = {
+        GPS_FIX_LATITUDE, GPS_FIX_LONGITUDE, GPS_FIX_SPEED,
+        GPS_FIX_ELEVATION, GPS_FIX_COURSE, GPS_FIX_AGE,
+    };
+    static const int digits[] = {
+        GPS_FIX_DEGREE_DIGITS, GPS_FIX_DEGREE_DIGITS, GPS_FIX_SPEED_DIGITS,
+        GPS_FIX_ELEVATION_DIGITS, GPS_FIX_COURSE_DIGITS, 0,
+    };
+    struct tm t = { .tm_isdst = -1 };
+    const char *p;
+    int32_t v, sec_ms;
+    int n = 0;
+
+    memset(s, 0, sizeof(*s));
+    sscanf(line, "%d-%d-%d %d:%d:%n", &t.tm_year, &t.tm_mon, &t.tm_mday,
+           &t.tm_hour, &t.tm_min, &n);
+    if (!n || !(p = gps_decimal_parse(line + n, 3, &sec_ms)) || *p != ',' || sec_ms < 0) {
+        return -1;
+    }
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    t.tm_sec = sec_ms / 1000;
+    s->time_ms = (int64_t)mktime(&t) * 1000 + sec_ms % 1000;
+
+    // latitude,longitude,speed,elevation,course,age
+    for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++) {
+        if (!p || *p != ',') return -1;
+        p++;
+        if (*p == ',' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+        p = gps_decimal_parse(p, digits[i], &v);
+        if (!p) return -1;
+
+        if (dest[i]) {
+            *dest[i] = v;
+        } else {
+            s->fix.age = v;
+        }
+        s->fix.fields |= bits[i];
+    }
+
+    return 0;
+}
+
+void gps_track_header(uint8_t *buf, enum gps_track_format format) {
+    memset(buf, 0, GPS_TRACK_HEADER_SIZE);
+    memcpy(buf, GPS_TRACK_MAGIC, 4);
+    buf[4] = GPS_TRACK_VERSION;
+    buf[5] = format;
+    if (format == GPS_TRACK_BIN) {
+        put_le16(buf + 6, GPS_TRACK_BIN_RECORD_SIZE);
+        put_le16(buf + 8, GPS_TRACK_BIN_BLOCK);
+    } else {
+        put_le16(buf + 8, GPS_TRACK_DELTA_BLOCK);
+    }
+}
+
+// Returns the format of a track file header, or -1 if it isn't one we write
+int gps_track_header_parse(const uint8_t *buf) {
+    uint8_t expect[GPS_TRACK_HEADER_SIZE];
+
+    if (buf[5] != GPS_TRACK_BIN && buf[5] != GPS_TRACK_DELTA) return -1;
+
+    gps_track_header(expect, buf[5]);
+    if (memcmp(buf, expect, GPS_TRACK_HEADER_SIZE) != 0) return -1;
+    return buf[5];
+}
+
+void gps_track_bin_encode(uint8_t *buf, const struct gps_sample *s) {
+    int64_t q[__GPS_TRACK_Q_MAX];
+
+    quantize(q, s);
+    put_le64(buf, q[GPS_TRACK_Q_TIME]);
+    put_le32(buf + 8, q[GPS_TRACK_Q_LATITUDE]);
+    put_le32(buf + 12, q[GPS_TRACK_Q_LONGITUDE]);
+    put_le32(buf + 16, q[GPS_TRACK_Q_ELEVATION]);
+    put_le16(buf + 20, q[GPS_TRACK_Q_SPEED]);
+    put_le16(buf + 22, q[GPS_TRACK_Q_COURSE]);
+    buf[24] = q[GPS_TRACK_Q_AGE];
+    buf[25] = s->fix.fields;
+}
+
+// Returns 0 for a fix, -1 for a sync marker or anything else that isn't one
+int gps_track_bin_decode(const uint8_t *buf, struct gps_sample *s) {
+    int64_t q[__GPS_TRACK_Q_MAX];
+
+    if (buf[25] == 0xff) return -1;
+
+    q[GPS_TRACK_Q_TIME] = (int64_t)get_le64(buf);
+    q[GPS_TRACK_Q_LATITUDE] = (int32_t)get_le32(buf + 8);
+    q[GPS_TRACK_Q_LONGITUDE] = (int32_t)get_le32(buf + 12);
+    q[GPS_TRACK_Q_ELEVATION] = (int32_t)get_le32(buf + 16);
+    q[GPS_TRACK_Q_SPEED] = get_le16(buf + 20);
+    q[GPS_TRACK_Q_COURSE] = get_le16(buf + 22);
+    q[GPS_TRACK_Q_AGE] = buf[24];
+    dequantize(s, q, buf[25]);
+    return 0;
+}
+
+void gps_track_bin_sync(uint8_t *buf, uint64_t index) {
+    memset(buf, 0, GPS_TRACK_BIN_RECORD_SIZE);
+    memcpy(buf, GPS_TRACK_SYNC_MAGIC, 8);
+    put_le64(buf + 8, index);
+    buf[25] = 0xff;
+}
+
+int gps_track_bin_is_sync(const uint8_t *buf, uint64_t *index) {
+    if (memcmp(buf, GPS_TRACK_SYNC_MAGIC, 8) != 0 || buf[25] != 0xff) return 0;
+    if (index) *index = get_le64(buf + 8);
+    return 1;
+}
+
+// File offset of the Nth fix (0-based)
+off_t gps_track_bin_offset(uint64_t n) {
+    uint64_t slot = n + n / (GPS_TRACK_BIN_BLOCK - 1) + 1;
+
+    return GPS_TRACK_HEADER_SIZE + (off_t)slot * GPS_TRACK_BIN_RECORD_SIZE;
+}
+
+// Number of complete fixes in a file of the given size
+uint64_t gps_track_bin_count(off_t size) {
+    uint64_t slots;
+
+    if (size <= GPS_TRACK_HEADER_SIZE) return 0;
+
+    slots = (size - GPS_TRACK_HEADER_SIZE) / GPS_TRACK_BIN_RECORD_SIZE;
+    return slots - (slots + GPS_TRACK_BIN_BLOCK - 1) / GPS_TRACK_BIN_BLOCK;
+}
+
+// Delta stream: a block starts with GPS_TRACK_SYNC_MAGIC, the GPS_FIX_* mask
+// shared by the whole block and the first fix in full. Each following fix is
+// a change mask byte (GPS_TRACK_DELTA_TIME plus GPS_FIX_* bits), then zig-zag
+// varints for the time delta's change and for every field that moved. The
+// mask byte never has the top bit set, so a block start is unambiguous.
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// Returns the number of bytes read, 0 if the buffer ends first, -1 if invalid
+static int get_varint(const uint8_t *p, size_t len, uint64_t *v) {
+    *v = 0;
+    for (size_t n = 0; n < len && n < 10; n++) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) return n + 1;
+    }
+    return len < 10 ? 0 : -1;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+void gps_track_delta_reset(struct gps_track_delta *d) {
+    memset(d, 0, sizeof(*d));
+}
+
+// Encode one sample into buf (at least GPS_TRACK_DELTA_MAX bytes)
+size_t gps_track_delta_encode(struct gps_track_delta *d, uint8_t *buf,
+                              const struct gps_sample *s) {
+    int64_t q[__GPS_TRACK_Q_MAX];
+    unsigned int mask = 0;
+    size_t n;
+    int64_t dt;
+
+    quantize(q, s);
+
+    if (d->count == 0 || d->count >= GPS_TRACK_DELTA_BLOCK ||
+        d->fields != s->fix.fields) {
+        memcpy(buf, GPS_TRACK_SYNC_MAGIC, 8);
+        buf[8] = s->fix.fields;
+        n = 9 + put_varint(buf + 9, zigzag(q[GPS_TRACK_Q_TIME]));
+        for (int i = GPS_TRACK_Q_LATITUDE; i < __GPS_TRACK_Q_MAX; i++) {
+            if (s->fix.fields & (1 << (i - 1)))
+                n += put_varint(buf + n, zigzag(q[i]));
+        }
+
+        d->fields = s->fix.fields;
+        d->count = 1;
+        d->dt = 0;
+        memcpy(d->last, q, sizeof(q));
+        return n;
+    }
+
+    dt = q[GPS_TRACK_Q_TIME] - d->last[GPS_TRACK_Q_TIME];
+    n = 1;
+    if (dt != d->dt) {
+        mask |= GPS_TRACK_DELTA_TIME;
+        n += put_varint(buf + n, zigzag(dt - d->dt));
+    }
+    for (int i = GPS_TRACK_Q_LATITUDE; i < __GPS_TRACK_Q_MAX; i++) {
+        if (!(d->fields & (1 << (i - 1))) || q[i] == d->last[i]) continue;
+        mask |= 1 << (i - 1);
+        n += put_varint(buf + n, zigzag(q[i] - d->last[i]));
+    }
+    buf[0] = mask;
+
+    d->count++;
+    d->dt = dt;
+    memcpy(d->last, q, sizeof(q));
+    return n;
+}
+
+// Decode the next sample. Returns the bytes consumed, 0 if buf holds only
+// part of a record, -1 if the data is not a valid record here.
+int gps_track_delta_decode(struct gps_track_delta *d, const uint8_t *buf, size_t len,
+                           struct gps_sample *s) {
+    int64_t q[__GPS_TRACK_Q_MAX];
+    unsigned int mask;
+    uint64_t v;
+    size_t n;
+    int ret;
+
+    if (len == 0) return 0;
+
+    if (buf[0] == 0xff) {
+        if (len < 9) return 0;
+        if (memcmp(buf, GPS_TRACK_SYNC_MAGIC, 8) != 0 || buf[8] & ~GPS_FIX_ALL) return -1;
+
+        memset(q, 0, sizeof(q));
+        n = 9;
+        for (int i = GPS_TRACK_Q_TIME; i < __GPS_TRACK_Q_MAX; i++) {
+            if (i > GPS_TRACK_Q_TIME && !(buf[8] & (1 << (i - 1)))) continue;
+            ret = get_varint(buf + n, len - n, &v);
+            if (ret <= 0) return ret;
+            q[i] = unzigzag(v);
+            n += ret;
+        }
+
+        d->fields = buf[8];
+        d->count = 1;
+        d->dt = 0;
+    } else {
+        mask = buf[0];
+        if (d->count == 0 || mask & ~(GPS_TRACK_DELTA_TIME | d->fields)) return -1;
+
+        memcpy(q, d->last, sizeof(q));
+        n = 1;
+        if (mask & GPS_TRACK_DELTA_TIME) {
+            ret = get_varint(buf + n, len - n, &v);
+            if (ret <= 0) return ret;
+            n += ret;
+            d->dt += unzigzag(v);
+        }
+        q[GPS_TRACK_Q_TIME] += d->dt;
+        for (int i = GPS_TRACK_Q_LATITUDE; i < __GPS_TRACK_Q_MAX; i++) {
+            if (!(mask & (1 << (i - 1)))) continue;
+            ret = get_varint(buf + n, len - n, &v);
+            if (ret <= 0) return ret;
+            q[i] += unzigzag(v);
+            n += ret;
+        }
+
+        d->count++;
+    }
+
+    memcpy(d->last, q, sizeof(q));
+    dequantize(s, q, d->fields);
+    return n;
+}
+
+// Detect the format from the header (or the CSV header line) and position
+// the reader at the first sample
+int gps_track_reader_open(struct gps_track_reader *r, FILE *f) {
+    char line[160];
+    int format;
+
+    memset(r, 0, sizeof(*r));
+    r->f = f;
+    r->synced = 1;
+    gps_track_delta_reset(&r->delta);
+
+    if (fread(r->buf, GPS_TRACK_HEADER_SIZE, 1, f) == 1) {
+        format = gps_track_header_parse(r->buf);
+        if (format >= 0) {
+            r->format = format;
+            return 0;
+        }
+    }
+
+    rewind(f);
+    if (!fgets(line, sizeof(line), f) || strncmp(line, "timestamp,", 10) != 0) {
+        return -1;
+    }
+    r->format = GPS_TRACK_CSV;
+    return 0;
+}
+
+// Make at least need bytes available at r->pos unless the file ends first
+static size_t reader_fill(struct gps_track_reader *r, size_t need) {
+    size_t n;
+
+    if (r->len - r->pos < need && !r->eof) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        n = fread(r->buf + r->len, 1, sizeof(r->buf) - r->len, r->f);
+        if (n == 0) r->eof = 1;
+        r->len += n;
+    }
+    return r->len - r->pos;
+}
+
+static int reader_next_bin(struct gps_track_reader *r, struct gps_sample *s) {
+    for (;;) {
+        const uint8_t *rec;
+        size_t avail = reader_fill(r, GPS_TRACK_BIN_RECORD_SIZE);
+
+        if (avail < GPS_TRACK_BIN_RECORD_SIZE) {
+            r->torn = avail > 0;
+            return 0;
+        }
+
+        rec = r->buf + r->pos;
+        if (gps_track_bin_is_sync(rec, NULL)) {
+            r->pos += GPS_TRACK_BIN_RECORD_SIZE;
+            r->slot = 1;
+            r->synced = 1;
+            continue;
+        }
+
+        // Every block starts with a sync marker; without one the records
+        // are no longer aligned, so scan ahead byte by byte for the next
+        if (r->slot % GPS_TRACK_BIN_BLOCK == 0) {
+            if (r->synced) r->resyncs++;
+            r->synced = 0;
+            r->pos++;
+            continue;
+        }
+
+        r->pos += GPS_TRACK_BIN_RECORD_SIZE;
+        r->slot++;
+        if (gps_track_bin_decode(rec, s) == 0) return 1;
+    }
+}
+
+static int reader_next_delta(struct gps_track_reader *r, struct gps_sample *s) {
+    for (;;) {
+        size_t avail = reader_fill(r, GPS_TRACK_DELTA_MAX);
+        int ret;
+
+        if (avail == 0) return 0;
+
+        ret = gps_track_delta_decode(&r->delta, r->buf + r->pos, avail, s);
+        if (ret == 0) {
+            if (r->eof) {
+                r->torn = 1;
+                return 0;
+            }
+            continue;
+        }
+
+        // Skip damaged data up to the next block start
+        if (ret < 0) {
+            if (r->synced) r->resyncs++;
+            r->synced = 0;
+            gps_track_delta_reset(&r->delta);
+            r->pos++;
+            continue;
+        }
+
+        r->synced = 1;
+        r->pos += ret;
+        return 1;
+    }
+}
+
+// Read the next sample; returns 1, or 0 at the end of the file
+int gps_track_reader_next(struct gps_track_reader *r, struct gps_sample *s) {
+    char line[160];
+
+    switch (r->format) {
+        case GPS_TRACK_BIN:
+            return reader_next_bin(r, s);
+        case GPS_TRACK_DELTA:
+            return reader_next_delta(r, s);
+        case GPS_TRACK_CSV:
+            while (fgets(line, sizeof(line), r->f)) {
+                if (gps_track_csv_parse(line, s) == 0) return 1;
+                r->skipped++;
+            }
+            return 0;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef GPS_TRACK_H
+#define GPS_TRACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "gps-fix.h"
+
+// Track file formats written by gps-logger
+
+enum gps_track_format {
+    GPS_TRACK_CSV,
+    GPS_TRACK_BIN,
+    GPS_TRACK_DELTA,
+};
+
+// One logged sample: a decoded fix and the wall-clock time it was taken
+struct gps_sample {
+    int64_t time_ms;        // Unix epoch, milliseconds
+    struct gps_fix fix;
+};
+
+// Binary track: a 16 byte header followed by fixed-size little-endian slots.
+// Every GPS_TRACK_BIN_BLOCK slots the first one is a sync marker carrying the
+// index of the next fix, so a reader can realign after a torn write and the
+// Nth fix sits at a computable offset (gps_track_bin_offset()).
+//
+// Header: "GPST", u8 version, u8 format, u16 record size, u16 block slots,
+//         6 bytes reserved
+// Record: i64 time_ms, i32 latitude (1e-6 deg), i32 longitude (1e-6 deg),
+//         i32 elevation (cm), u16 speed (cm/s), u16 course (1/100 deg),
+//         u8 age (s, saturated), u8 GPS_FIX_* fields
+// Sync:   8 byte GPS_TRACK_SYNC_MAGIC, u64 index of the next fix, zero
+//         padding, fields byte 0xff
+#define GPS_TRACK_MAGIC "GPST"
+#define GPS_TRACK_VERSION 1
+#define GPS_TRACK_HEADER_SIZE 16
+#define GPS_TRACK_BIN_RECORD_SIZE 26
+#define GPS_TRACK_BIN_BLOCK 256
+#define GPS_TRACK_SYNC_MAGIC "\377GPSSYNC"
+
+// Delta track: the same header, then blocks of at most GPS_TRACK_DELTA_BLOCK
+// fixes. Each block opens with GPS_TRACK_SYNC_MAGIC and one fix in full; the
+// rest are zig-zag varint deltas against the previous fix, so a block decodes
+// on its own. A fix changing which fields are present starts a new block.
+#define GPS_TRACK_DELTA_BLOCK 256
+#define GPS_TRACK_DELTA_MAX 80          // worst-case encoded size of one fix
+#define GPS_TRACK_DELTA_TIME (1 << 6)   // change mask bit: sample spacing changed
+
+// Encoder or decoder state for one delta stream
+struct gps_track_delta {
+    unsigned int fields;    // GPS_FIX_* fields of the current block
+    unsigned int count;     // fixes so far in the current block, 0 before any
+    int64_t dt;             // previous time delta, ms
+    int64_t last[7];        // previous fix in stored units
+};
+
+// Sequential reader for a track file in any of the formats. CSV rows that
+// don't parse are skipped; damaged binary data is skipped up to the next
+// sync marker.
+struct gps_track_reader {
+    FILE *f;
+    enum gps_track_format format;
+    struct gps_track_delta delta;
+    uint8_t buf[65536];
+    size_t len, pos;
+    int eof;
+    int synced;
+    uint64_t slot;              // bin: slots since the last sync marker
+    unsigned long resyncs;      // times damaged data was skipped
+    unsigned long skipped;      // CSV rows that did not parse
+    int torn;                   // the file ends inside a record
+};
+
+const char *gps_track_format_name(enum gps_track_format format);
+int gps_track_format_parse(const char *name, enum gps_track_format *format);
+
+size_t gps_track_csv_header(char *buf, size_t len);
+size_t gps_track_csv_format(char *buf, size_t len, const struct gps_sample *s);
+size_t gps_track_csv_header_smoothed(char *buf, size_t len);
+size_t gps_track_csv_format_smoothed(char *buf, size_t len, const struct gps_sample *s,
+                                     const struct gps_fix *smoothed);
+int gps_track_csv_parse(const char *line, struct gps_sample *s);
+
+void gps_track_header(uint8_t *buf, enum gps_track_format format);
+int gps_track_header_parse(const uint8_t *buf);
+
+void gps_track_bin_encode(uint8_t *buf, const struct gps_sample *s);
+int gps_track_bin_decode(const uint8_t *buf, struct gps_sample *s);
+void gps_track_bin_sync(uint8_t *buf, uint64_t index);
+int gps_track_bin_is_sync(const uint8_t *buf, uint64_t *index);
+off_t gps_track_bin_offset(uint64_t n);
+uint64_t gps_track_bin_count(off_t size);
+
+void gps_track_delta_reset(struct gps_track_delta *d);
+size_t gps_track_delta_encode(struct gps_track_delta *d, uint8_t *buf,
+                              const struct gps_sample *s);
+int gps_track_delta_decode(struct gps_track_delta *d, const uint8_t *buf, size_t len,
+                           struct gps_sample *s);
+
+int gps_track_reader_open(struct gps_track_reader *r, FILE *f);
+int gps_track_reader_next(struct gps_track_reader *r, struct gps_sample *s);
+
+#endif
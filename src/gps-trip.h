@@ -0,0 +1,60 @@
+#ifndef GPS_TRIP_H
+#define GPS_TRIP_H
+
+#include <stdint.h>
+
+#include "gps-fix.h"
+
+// Below this reported speed (mm/s) the receiver counts as stopped
+#define GPS_TRIP_MOVING 500
+
+// Without a reported speed, the receiver has to get this far (mm) from
+// where it stopped before it counts as moving again
+#define GPS_TRIP_JITTER 10000
+
+// Elevation changes smaller than this (cm) are noise, not climb
+#define GPS_TRIP_CLIMB_STEP 300
+
+// Fixes older than this (seconds) are not used
+#define GPS_TRIP_MAX_AGE 10
+
+// A longer gap between fixes (receiver off, logger stopped) is not counted
+// as time, and the distance across it is not counted either
+#define GPS_TRIP_MAX_GAP_MS (5 * 60 * 1000)
+
+// Trip odometer fed one fix at a time: distance, moving and stopped time,
+// top speed, climb and descent. Each fix costs a distance and a few
+// comparisons, all in integers like the fix itself, and the state is this
+// struct alone. Distance only grows while moving and is measured from the
+// last point counted, so position jitter while stopped adds nothing.
+// Times are CLOCK_MONOTONIC ms, so a wall clock step cannot stall the trip;
+// only the totals outlive the process, and a new run starts measuring from
+// its first fix.
+struct gps_trip {
+    int64_t distance;           // mm
+    int64_t moving_ms;
+    int64_t stopped_ms;
+    int32_t max_speed;          // mm/s
+    int64_t climb;              // cm
+    int64_t descent;
+    unsigned long fixes;        // fixes counted
+    unsigned long rejected;     // stale or without a position
+
+    // Where distance and climb are measured from in this run, in struct
+    // gps_fix units
+    int have_position, have_elevation;
+    int64_t last_ms;            // last fix taken
+    int64_t position_ms;
+    int32_t latitude, longitude;
+    int32_t elevation;
+};
+
+void gps_trip_init(struct gps_trip *t);
+void gps_trip_add(struct gps_trip *t, int64_t time_ms, const struct gps_fix *fix);
+int32_t gps_trip_average_speed(const struct gps_trip *t);
+int64_t gps_trip_distance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2);
+
+int gps_trip_load(struct gps_trip *t, const char *path);
+int gps_trip_save(const struct gps_trip *t, const char *path);
+
+#endif
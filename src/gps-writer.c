@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gps-writer.h"
+
+static const char *sync_names[] = {
+    [GPS_WRITER_SYNC_NEVER] = "never",
+    [GPS_WRITER_SYNC_BATCH] = "batch",
+    [GPS_WRITER_SYNC_EVERY] = "every",
+};
+
+const char *gps_writer_sync_name(enum gps_writer_sync sync) {
+    return sync_names[sync];
+}
+
+int gps_writer_sync_parse(const char *name, enum gps_writer_sync *sync) {
+    for (size_t i = 0; i < sizeof(sync_names) / sizeof(sync_names[0]); i++) {
+        if (strcmp(name, sync_names[i]) == 0) {
+            *sync = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The oldest buffered record has waited long enough
+static void writer_timer_cb(struct uloop_timeout *t) {
+    struct gps_writer *w = container_of(t, struct gps_writer, timer);
+
+    gps_writer_flush(w);
+}
+
+int gps_writer_init(struct gps_writer *w, int fd, size_t size, unsigned int batch,
+                    int max_delay_ms, enum gps_writer_sync sync) {
+    memset(w, 0, sizeof(*w));
+    w->buf = malloc(size);
+    if (!w->buf) return -1;
+
+    gps_writer_set_fd(w, fd);
+    w->size = size;
+    w->batch = batch ? batch : 1;
+    w->max_delay_ms = max_delay_ms;
+    w->sync = sync;
+    w->timer.cb = writer_timer_cb;
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+    return 0;
+}
+
+// Write to another file, appending after what it holds now
+void gps_writer_set_fd(struct gps_writer *w, int fd) {
+    struct stat st;
+
+    w->fd = fd;
+    w->committed = fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+int gps_writer_sync(struct gps_writer *w) {
+    int64_t start = gps_latency_now();
+    int ret;
+
+    w->stats.syncs++;
+    ret = fdatasync(w->fd);
+    gps_latency_since(&w->sync_latency, start);
+    if (ret != 0) {
+        fprintf(stderr, "fdatasync failed: %s\n", strerror(errno));
+        w->stats.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+// Write out everything buffered with one write() (more only on short writes)
+int gps_writer_flush(struct gps_writer *w) {
+    size_t off = 0;
+    int64_t start;
+    ssize_t ret = 0;
+
+    uloop_timeout_cancel(&w->timer);
+    if (!w->len) return 0;
+
+    start = gps_latency_now();
+    while (off < w->len) {
+        ret = write(w->fd, w->buf + off, w->len - off);
+        if (ret < 0 && errno == EINTR) continue;
+        w->stats.writes++;
+        if (ret < 0) break;
+        w->stats.bytes += ret;
+        off += ret;
+    }
+    gps_latency_since(&w->write_latency, start);
+
+    if (ret < 0) {
+        // Drop the batch rather than let a full disk stall sampling, and the
+        // part of it that made it out with it, or the file would end in a
+        // torn record that later ones are appended after
+        fprintf(stderr, "Failed to write %u records: %s\n", w->pending, strerror(errno));
+        w->stats.errors++;
+        if (off && ftruncate(w->fd, w->committed) != 0) {
+            fprintf(stderr, "Failed to drop a partly written batch: %s\n", strerror(errno));
+        }
+        if (w->error_cb) w->error_cb(w);
+        w->len = 0;
+        w->pending = 0;
+        return -1;
+    }
+
+    w->committed += off;
+    w->len = 0;
+    w->pending = 0;
+
+    if (w->sync != GPS_WRITER_SYNC_NEVER) return gps_writer_sync(w);
+    return 0;
+}
+
+// A record appended while a failed flush is dropped with the batch before it
+int gps_writer_append(struct gps_writer *w, const void *data, size_t len) {
+    if (len > w->size) return -1;
+    if (w->len + len > w->size && gps_writer_flush(w) != 0) return -1;
+
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    w->stats.records++;
+
+    if (++w->pending >= w->batch || w->sync == GPS_WRITER_SYNC_EVERY) {
+        return gps_writer_flush(w);
+    }
+
+    if (w->pending == 1 && w->max_delay_ms > 0) {
+        uloop_timeout_set(&w->timer, w->max_delay_ms);
+    }
+    return 0;
+}
+
+double gps_writer_syscalls_per_hour(const struct gps_writer *w) {
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - w->start.tv_sec) + (now.tv_nsec - w->start.tv_nsec) / 1e9;
+    if (elapsed <= 0) return 0;
+    return (w->stats.writes + w->stats.syncs) * 3600.0 / elapsed;
+}
+
+void gps_writer_free(struct gps_writer *w) {
+    uloop_timeout_cancel(&w->timer);
+    free(w->buf);
+    w->buf = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef GPS_WRITER_H
+#define GPS_WRITER_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <libubox/uloop.h>
+
+#include "gps-latency.h"
+
+// When to fdatasync() the track file
+enum gps_writer_sync {
+    GPS_WRITER_SYNC_NEVER,      // leave it to the kernel
+    GPS_WRITER_SYNC_BATCH,      // after every batch write
+    GPS_WRITER_SYNC_EVERY,      // write and sync every record as it arrives
+};
+
+// Coalesces records in a preallocated buffer and writes them with a single
+// write() once `batch` records are buffered or the oldest has waited
+// `max_delay_ms`, whichever comes first. A batch that fails to write is
+// dropped whole: the file is truncated back to `committed`, so no torn
+// record is left behind, and error_cb lets the owner forget the records too.
+struct gps_writer {
+    int fd;
+    off_t committed;            // file size after the last batch written
+    void (*error_cb)(struct gps_writer *w);
+    char *buf;
+    size_t size;
+    size_t len;
+    unsigned int batch;
+    unsigned int pending;       // records in buf
+    int max_delay_ms;
+    enum gps_writer_sync sync;
+    struct uloop_timeout timer;
+    struct timespec start;
+    struct {
+        unsigned long records;
+        unsigned long writes;
+        unsigned long long bytes;
+        unsigned long syncs;
+        unsigned long errors;
+    } stats;
+    struct gps_latency write_latency;   // one flush's write() calls
+    struct gps_latency sync_latency;    // fdatasync()
+};
+
+int gps_writer_init(struct gps_writer *w, int fd, size_t size, unsigned int batch,
+                    int max_delay_ms, enum gps_writer_sync sync);
+void gps_writer_set_fd(struct gps_writer *w, int fd);
+int gps_writer_append(struct gps_writer *w, const void *data, size_t len);
+int gps_writer_flush(struct gps_writer *w);
+int gps_writer_sync(struct gps_writer *w);
+void gps_writer_free(struct gps_writer *w);
+
+const char *gps_writer_sync_name(enum gps_writer_sync sync);
+int gps_writer_sync_parse(const char *name, enum gps_writer_sync *sync);
+double gps_writer_syscalls_per_hour(const struct gps_writer *w);
+
+#endif
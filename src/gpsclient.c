@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <string.h>
+#include <libubox/blobmsg.h>
+
+#include "gpsclient.h"
+
+#define GPS_CONN_BACKOFF_MIN_MS 500
+#define GPS_CONN_BACKOFF_MAX_MS 30000
+
+// ubusd announces objects coming and going with these events
+#define GPS_OBJECT_EVENTS "ubus.object.*"
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int reconnect_due(const struct gps_conn *conn) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != conn->retry_at.tv_sec) {
+        return now.tv_sec > conn->retry_at.tv_sec;
+    }
+    return now.tv_nsec >= conn->retry_at.tv_nsec;
+}
+
+static void schedule_reconnect(struct gps_conn *conn) {
+    clock_gettime(CLOCK_MONOTONIC, &conn->retry_at);
+    conn->retry_at.tv_sec += conn->backoff_ms / 1000;
+    conn->retry_at.tv_nsec += (conn->backoff_ms % 1000) * 1000000L;
+    if (conn->retry_at.tv_nsec >= 1000000000L) {
+        conn->retry_at.tv_sec++;
+        conn->retry_at.tv_nsec -= 1000000000L;
+    }
+
+    if (conn->uloop) {
+        uloop_timeout_set(&conn->retry_timer, conn->backoff_ms);
+    }
+}
+
+static void set_id(struct gps_client *cl, int valid, uint32_t id) {
+    if (cl->id_valid == valid && (!valid || cl->id == id)) return;
+
+    cl->id = id;
+    cl->id_valid = valid;
+
+    // Subscriptions follow the object id
+    if (!valid) {
+        cl->subscribed = 0;
+    } else if (cl->sub_registered) {
+        cl->subscribed = ubus_subscribe(&cl->conn->ctx, &cl->sub, id) == 0;
+    }
+
+    if (cl->state_cb) cl->state_cb(cl);
+}
+
+static void object_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                            const char *type, struct blob_attr *msg) {
+    enum { OBJECT_ID, OBJECT_PATH, __OBJECT_MAX };
+    static const struct blobmsg_policy object_policy[__OBJECT_MAX] = {
+        [OBJECT_ID] = { .name = "id", .type = BLOBMSG_TYPE_INT32 },
+        [OBJECT_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+    };
+    struct gps_conn *conn = container_of(ev, struct gps_conn, object_event);
+    struct blob_attr *tb[__OBJECT_MAX];
+    struct gps_client *cl;
+    (void)ctx;
+
+    blobmsg_parse(object_policy, __OBJECT_MAX, tb, blob_data(msg), blob_len(msg));
+    if (!tb[OBJECT_ID] || !tb[OBJECT_PATH]) return;
+
+    const char *path = blobmsg_get_string(tb[OBJECT_PATH]);
+    uint32_t id = blobmsg_get_u32(tb[OBJECT_ID]);
+    int added = strcmp(type, "ubus.object.add") == 0;
+    int removed = strcmp(type, "ubus.object.remove") == 0;
+
+    list_for_each_entry(cl, &conn->clients, list) {
+        if (strcmp(cl->name, path) != 0) continue;
+
+        if (added) {
+            set_id(cl, 1, id);
+        } else if (removed && cl->id == id) {
+            set_id(cl, 0, 0);
+        }
+    }
+}
+
+static void connection_lost(struct gps_conn *conn) {
+    struct gps_client *cl;
+
+    if (!conn->connected) return;
+
+    conn->connected = 0;
+    if (conn->ctx.sock.registered) {
+        uloop_fd_delete(&conn->ctx.sock);
+    }
+
+    list_for_each_entry(cl, &conn->clients, list) {
+        set_id(cl, 0, 0);
+    }
+
+    conn->backoff_ms = GPS_CONN_BACKOFF_MIN_MS;
+    schedule_reconnect(conn);
+}
+
+static void connection_lost_cb(struct ubus_context *ctx) {
+    connection_lost(container_of(ctx, struct gps_conn, ctx));
+}
+
+static int reconnect(struct gps_conn *conn) {
+    if (ubus_reconnect(&conn->ctx, conn->path) != 0) {
+        conn->backoff_ms *= 2;
+        if (conn->backoff_ms > GPS_CONN_BACKOFF_MAX_MS) {
+            conn->backoff_ms = GPS_CONN_BACKOFF_MAX_MS;
+        }
+        schedule_reconnect(conn);
+        return -1;
+    }
+
+    uloop_timeout_cancel(&conn->retry_timer);
+    conn->connected = 1;
+    conn->reconnects++;
+    if (conn->uloop) {
+        ubus_add_uloop(&conn->ctx);
+    }
+
+    // Event registrations don't survive ubusd restarting
+    ubus_register_event_handler(&conn->ctx, &conn->object_event, GPS_OBJECT_EVENTS);
+
+    if (conn->connect_cb) conn->connect_cb(conn);
+    return 0;
+}
+
+static void retry_timer_cb(struct uloop_timeout *t) {
+    struct gps_conn *conn = container_of(t, struct gps_conn, retry_timer);
+
+    if (!conn->connected) {
+        reconnect(conn);
+    }
+}
+
+int gps_conn_init(struct gps_conn *conn, const char *path) {
+    memset(conn, 0, sizeof(*conn));
+    INIT_LIST_HEAD(&conn->clients);
+    conn->path = path;
+    conn->retry_timer.cb = retry_timer_cb;
+    conn->object_event.cb = object_event_cb;
+
+    if (ubus_connect_ctx(&conn->ctx, path) != 0) {
+        return -1;
+    }
+
+    conn->connected = 1;
+    conn->ctx.connection_lost = connection_lost_cb;
+    ubus_register_event_handler(&conn->ctx, &conn->object_event, GPS_OBJECT_EVENTS);
+    return 0;
+}
+
+// Drive the socket (and reconnect retries) from uloop instead of from
+// gps_conn_check() calls
+void gps_conn_add_uloop(struct gps_conn *conn) {
+    conn->uloop = 1;
+    if (conn->connected) {
+        ubus_add_uloop(&conn->ctx);
+    }
+}
+
+// Returns 0 if connected, reconnecting first when the backoff has expired
+int gps_conn_check(struct gps_conn *conn) {
+    if (conn->connected) return 0;
+    if (!reconnect_due(conn)) return -1;
+    return reconnect(conn);
+}
+
+void gps_conn_free(struct gps_conn *conn) {
+    uloop_timeout_cancel(&conn->retry_timer);
+    if (conn->ctx.sock.registered) {
+        uloop_fd_delete(&conn->ctx.sock);
+    }
+    ubus_shutdown(&conn->ctx);
+}
+
+static void data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct gps_client *cl = req->priv;
+    int64_t start = gps_latency_now();
+    (void)type;
+
+    gps_fix_parse(&cl->fix, msg);
+    gps_latency_since(&cl->conn->latency.decode, start);
+}
+
+static void complete_cb(struct ubus_request *req, int ret) {
+    struct gps_client *cl = req->priv;
+
+    cl->req_pending = 0;
+    cl->status = ret;
+    uloop_timeout_cancel(&cl->req_timer);
+    gps_latency_since(&cl->conn->latency.request, cl->req_start);
+
+    if (ret != UBUS_STATUS_OK) {
+        gps_client_error(cl, ret);
+    }
+    if (cl->complete_cb) cl->complete_cb(cl, ret);
+}
+
+static void req_timeout_cb(struct uloop_timeout *t) {
+    struct gps_client *cl = container_of(t, struct gps_client, req_timer);
+
+    ubus_abort_request(&cl->conn->ctx, &cl->req);
+    cl->req_pending = 0;
+    cl->status = UBUS_STATUS_TIMEOUT;
+    cl->stats.timeouts++;
+    if (cl->complete_cb) cl->complete_cb(cl, UBUS_STATUS_TIMEOUT);
+}
+
+static int notify_cb(struct ubus_context *ctx, struct ubus_object *obj,
+                     struct ubus_request_data *req, const char *method,
+                     struct blob_attr *msg) {
+    struct ubus_subscriber *sub = container_of(obj, struct ubus_subscriber, obj);
+    struct gps_client *cl = container_of(sub, struct gps_client, sub);
+    int64_t start = gps_latency_now();
+    (void)ctx;
+    (void)req;
+    (void)method;
+
+    cl->stats.notifications++;
+    cl->status = UBUS_STATUS_OK;
+    gps_fix_parse(&cl->fix, msg);
+    gps_latency_since(&cl->conn->latency.decode, start);
+    clock_gettime(CLOCK_MONOTONIC, &cl->last_notify);
+
+    if (cl->notify_cb) cl->notify_cb(cl);
+    return 0;
+}
+
+static void remove_cb(struct ubus_context *ctx, struct ubus_subscriber *sub, uint32_t id) {
+    struct gps_client *cl = container_of(sub, struct gps_client, sub);
+    (void)ctx;
+    (void)id;
+
+    // The gps object went away; resubscribe once it is registered again
+    cl->subscribed = 0;
+}
+
+void gps_client_init(struct gps_client *cl, struct gps_conn *conn, const char *name) {
+    memset(cl, 0, sizeof(*cl));
+    cl->conn = conn;
+    cl->name = name;
+    cl->req_timer.cb = req_timeout_cb;
+    cl->sub.cb = notify_cb;
+    cl->sub.remove_cb = remove_cb;
+    list_add_tail(&cl->list, &conn->clients);
+}
+
+// Resolve the object id, only talking to ubusd when no valid id is cached
+int gps_client_lookup(struct gps_client *cl, uint32_t *id) {
+    uint32_t new_id;
+    int ret;
+
+    if (gps_conn_check(cl->conn) != 0) {
+        return UBUS_STATUS_CONNECTION_FAILED;
+    }
+
+    if (!cl->id_valid) {
+        int64_t start = gps_latency_now();
+
+        cl->stats.lookups++;
+        ret = ubus_lookup_id(&cl->conn->ctx, cl->name, &new_id);
+        gps_latency_since(&cl->conn->latency.lookup, start);
+        if (ret != 0) {
+            gps_client_error(cl, ret);
+            return ret;
+        }
+        set_id(cl, 1, new_id);
+    }
+
+    *id = cl->id;
+    return 0;
+}
+
+// Request a fix and wait for it; the decoded reply ends up in cl->fix
+int gps_client_fetch(struct gps_client *cl, int timeout_ms) {
+    uint32_t id;
+    int ret;
+
+    ret = gps_client_lookup(cl, &id);
+    if (ret != 0) return ret;
+
+    memset(&cl->fix, 0, sizeof(cl->fix));
+    cl->stats.requests++;
+    cl->req_start = gps_latency_now();
+    ret = ubus_invoke(&cl->conn->ctx, id, "info", NULL, data_cb, cl, timeout_ms);
+    gps_latency_since(&cl->conn->latency.request, cl->req_start);
+    cl->status = ret;
+    if (ret == UBUS_STATUS_TIMEOUT) {
+        cl->stats.timeouts++;
+    } else if (ret != 0) {
+        gps_client_error(cl, ret);
+    }
+
+    return ret;
+}
+
+// Request a fix without blocking; complete_cb runs when the reply arrives or
+// after timeout_ms. Needs the connection on uloop. Returns -1 while an
+// earlier request is still outstanding.
+int gps_client_fetch_async(struct gps_client *cl, int timeout_ms) {
+    uint32_t id;
+    int ret;
+
+    // Never stack requests if the daemon is slower than the caller
+    if (cl->req_pending) return -1;
+
+    ret = gps_client_lookup(cl, &id);
+    if (ret != 0) return ret;
+
+    memset(&cl->fix, 0, sizeof(cl->fix));
+    cl->req_start = gps_latency_now();
+    ret = ubus_invoke_async(&cl->conn->ctx, id, "info", NULL, &cl->req);
+    if (ret != 0) {
+        gps_client_error(cl, ret);
+        return ret;
+    }
+
+    cl->req.data_cb = data_cb;
+    cl->req.complete_cb = complete_cb;
+    cl->req.priv = cl;
+    ubus_complete_request_async(&cl->conn->ctx, &cl->req);
+    cl->req_pending = 1;
+    cl->stats.requests++;
+    uloop_timeout_set(&cl->req_timer, timeout_ms);
+
+    return 0;
+}
+
+// Ask the gps object to push new fixes. The subscription follows the object
+// id, so it is renewed after the object or ubusd restarts.
+int gps_client_subscribe(struct gps_client *cl) {
+    int ret;
+
+    if (!cl->sub_registered) {
+        ret = ubus_register_subscriber(&cl->conn->ctx, &cl->sub);
+        if (ret != 0) return ret;
+        cl->sub_registered = 1;
+    }
+
+    if (cl->id_valid && !cl->subscribed) {
+        cl->subscribed = ubus_subscribe(&cl->conn->ctx, &cl->sub, cl->id) == 0;
+    }
+
+    return 0;
+}
+
+// Whether the gps object pushed a fix within the last stale_ms, so polling
+// can be skipped. Daemons that never notify simply keep this false.
+int gps_client_push_live(const struct gps_client *cl, int stale_ms) {
+    if (!cl->subscribed || !cl->stats.notifications) return 0;
+    return elapsed_ms(&cl->last_notify) <= stale_ms;
+}
+
+void gps_client_invalidate(struct gps_client *cl) {
+    set_id(cl, 0, 0);
+}
+
+// Let the client react to a failed request: a stale id or a dead connection
+void gps_client_error(struct gps_client *cl, int ret) {
+    if (ret == UBUS_STATUS_NOT_FOUND) {
+        gps_client_invalidate(cl);
+    } else if (ret == UBUS_STATUS_CONNECTION_FAILED) {
+        connection_lost(cl->conn);
+    }
+}
+
+void gps_client_free(struct gps_client *cl) {
+    if (cl->req_pending) {
+        ubus_abort_request(&cl->conn->ctx, &cl->req);
+        cl->req_pending = 0;
+    }
+    uloop_timeout_cancel(&cl->req_timer);
+    if (cl->sub_registered && cl->conn->connected) {
+        ubus_unregister_subscriber(&cl->conn->ctx, &cl->sub);
+    }
+    list_del(&cl->list);
+}
@@ -0,0 +1,103 @@
+#ifndef GPSCLIENT_H
+#define GPSCLIENT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <libubus.h>
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include "gps-fix.h"
+#include "gps-latency.h"
+
+// libgpsclient: reentrant client for gps ubus objects, shared by gps-monitor
+// and gps-logger. All state lives in the structs below, so one process can
+// watch any number of gps objects over one or more connections.
+
+// Connection to ubusd shared by all clients on it. When ubusd goes away the
+// connection is retried with exponential backoff, like ubus_auto_connect(),
+// and every client drops its cached object id.
+struct gps_conn {
+    struct ubus_context ctx;
+    const char *path;               // ubus socket, NULL for the default
+    int connected;
+    int uloop;                      // socket registered with uloop
+    int backoff_ms;
+    struct timespec retry_at;
+    struct uloop_timeout retry_timer;   // only armed when uloop is set
+    struct ubus_event_handler object_event;
+    struct list_head clients;
+
+    // Called after every successful reconnect
+    void (*connect_cb)(struct gps_conn *conn);
+
+    unsigned long reconnects;
+
+    // Phase timings of all clients on this connection: id lookups, info
+    // requests from send to reply, and decoding replies and notifications
+    struct {
+        struct gps_latency lookup;
+        struct gps_latency request;
+        struct gps_latency decode;
+    } latency;
+};
+
+// Client for one gps ubus object. The object id is looked up once and kept
+// until ubusd announces the object's removal; a later ubus.object.add event
+// carries the new id, so the steady state needs no lookups at all.
+struct gps_client {
+    struct list_head list;
+    struct gps_conn *conn;
+    const char *name;
+    uint32_t id;
+    int id_valid;
+
+    // Latest fix, from a reply or a notification
+    struct gps_fix fix;
+    int status;                     // ubus status of the last reply
+
+    // Outstanding gps_client_fetch_async() request
+    struct ubus_request req;
+    struct uloop_timeout req_timer;
+    int req_pending;
+    int64_t req_start;              // gps_latency_now() when it was sent
+
+    // Push mode, see gps_client_subscribe()
+    struct ubus_subscriber sub;
+    int sub_registered;
+    int subscribed;
+    struct timespec last_notify;
+
+    // Called whenever id_valid changes or the object is re-registered
+    void (*state_cb)(struct gps_client *cl);
+    // Called when an async fetch completes, fails or times out
+    void (*complete_cb)(struct gps_client *cl, int ret);
+    // Called for every fix pushed by the gps object
+    void (*notify_cb)(struct gps_client *cl);
+
+    void *priv;
+
+    struct {
+        unsigned long lookups;
+        unsigned long requests;
+        unsigned long notifications;
+        unsigned long timeouts;
+    } stats;
+};
+
+int gps_conn_init(struct gps_conn *conn, const char *path);
+void gps_conn_add_uloop(struct gps_conn *conn);
+int gps_conn_check(struct gps_conn *conn);
+void gps_conn_free(struct gps_conn *conn);
+
+void gps_client_init(struct gps_client *cl, struct gps_conn *conn, const char *name);
+int gps_client_lookup(struct gps_client *cl, uint32_t *id);
+int gps_client_fetch(struct gps_client *cl, int timeout_ms);
+int gps_client_fetch_async(struct gps_client *cl, int timeout_ms);
+int gps_client_subscribe(struct gps_client *cl);
+int gps_client_push_live(const struct gps_client *cl, int stale_ms);
+void gps_client_invalidate(struct gps_client *cl);
+void gps_client_error(struct gps_client *cl, int ret);
+void gps_client_free(struct gps_client *cl);
+
+#endif